@@ -27,10 +27,13 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <limits>
 #include <memory>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "CLI/App.hpp"
@@ -40,12 +43,21 @@
 #include "absl/strings/match.h"
 #include "absl/strings/str_split.h"
 
+#include "snova/io/iobuf_allocator.h"
+#include "snova/io/memory_pressure.h"
+#include "snova/io/rudp_socket.h"
+#include "snova/io/transfer.h"
+#include "snova/io/uring_socket.h"
 #include "snova/log/log_macros.h"
+#include "snova/mux/cipher_context.h"
 #include "snova/mux/mux_client.h"
+#include "snova/mux/mux_stream.h"
 #include "snova/server/dns_proxy_server.h"
 #include "snova/server/entry_server.h"
 #include "snova/server/mux_server.h"
+#include "snova/server/relay.h"
 #include "snova/server/tunnel_server.h"
+#include "snova/server/udp_relay.h"
 #include "snova/util/address.h"
 #include "snova/util/dns_options.h"
 #include "snova/util/flags.h"
@@ -76,6 +88,12 @@ static int error_exit(const std::string& error) {
 
 static void init_stats() {
   snova::register_io_stat();
+  snova::register_relay_stat();
+  snova::register_udp_relay_stat();
+  snova::register_rudp_stat();
+  snova::register_uring_stat();
+  snova::register_transfer_stat();
+  snova::register_memory_stat();
   snova::MuxConnManager::GetInstance()->RegisterStat();
 }
 
@@ -110,9 +128,49 @@ int main(int argc, char** argv) {
                  "Remote server connection expire seconds, default 1800s.");
   app.add_option("--conn_max_inactive_secs", snova::g_connection_max_inactive_secs,
                  "Close connection if it's inactive 'conn_max_inactive_secs' ago.");
-  app.add_option("--max_iobuf_pool_size", snova::g_iobuf_max_pool_size, "IOBuf pool max size");
+  app.add_option("--max_iobuf_pool_size", snova::g_iobuf_max_pool_size,
+                 "Max cached IOBufs per size class of each io thread, default 64.");
+  app.add_option("--iobuf_memory_limit_mb", snova::g_iobuf_memory_limit_mb,
+                 "Stop caching IOBufs once more memory is in use, default 0 for no limit.");
+  app.add_option("--iobuf_hugepage", snova::g_iobuf_hugepage,
+                 "Carve IOBufs from a transparent hugepage backed arena on linux, default false.");
+  app.add_option("--memory_soft_limit_mb", snova::g_memory_soft_limit_mb,
+                 "Pause relay reads and accepts over this buffer memory, default 0 for no limit.");
+  app.add_option("--memory_hard_limit_mb", snova::g_memory_hard_limit_mb,
+                 "Close streams buffering most over this buffer memory, default 0 for no limit.");
   app.add_option("--stream_io_timeout_secs", snova::g_stream_io_timeout_secs,
                  "Proxy stream IO timeout secs, default 300s");
+  app.add_option("--udp_session_timeout_secs", snova::g_udp_session_timeout_secs,
+                 "Close udp relay session if it's idle 'udp_session_timeout_secs', default 60s.");
+  app.add_option("--threads", snova::g_thread_num,
+                 "IO thread number, each thread runs an independent event loop, more threads than "
+                 "cpu cores only add contention, default 1.");
+  app.add_option("--mux_write_queue_max_bytes", snova::g_mux_write_queue_max_bytes,
+                 "Writers wait if queued bytes of a mux connection exceed it, default 512KB.");
+  app.add_option("--mux_write_batch_bytes", snova::g_mux_write_batch_bytes,
+                 "Max bytes of queued mux events merged into one connection write, default 128KB.");
+  app.add_option("--mux_write_batch_frames", snova::g_mux_write_batch_frames,
+                 "Max queued mux events merged into one connection write, default 256.");
+  app.add_option("--stream_window_bytes", snova::g_stream_window_bytes,
+                 "Unread bytes a mux stream buffers before its peer must wait, default 512KB.");
+  app.add_option("--mux_max_frame_size", snova::g_mux_max_frame_size,
+                 "Max stream chunk size of a mux frame if peer supports it, default 64KB.");
+  app.add_option("--mux_ping_interval_secs", snova::g_mux_ping_interval_secs,
+                 "Ping interval secs to measure mux connection RTT, set it to 0 to disable ping.");
+  app.add_option("--mux_ping_max_missed", snova::g_mux_ping_max_missed,
+                 "Close mux connection if it misses 'mux_ping_max_missed' pongs in a row.");
+  app.add_option("--mux_udp_fec_group", snova::g_mux_udp_fec_group,
+                 "Send a fec parity packet per 'mux_udp_fec_group' udp mux packets, 0 to disable.");
+  app.add_option("--mux_stream_striping", snova::g_mux_stream_striping,
+                 "Ask server to stripe chunks of large downloads across all mux connections.");
+  app.add_option("--io_uring", snova::g_io_uring,
+                 "Use io_uring for tcp sockets on linux 6.0+, fall back to epoll if unavailable.");
+  app.add_option("--splice_relay", snova::g_splice_relay,
+                 "Relay direct tcp connections by splice on linux without copying, default true.");
+  app.add_option("--tcp_fast_open", snova::g_tcp_fast_open,
+                 "Send first payload with SYN on exit node's remote connects, default false.");
+  app.add_option("--wait_open_result", snova::g_wait_open_result,
+                 "Reply socks5 domain/http CONNECT once the remote is connected, default false.");
   uint32_t stat_log_period_secs = 60;
   app.add_option("--stat_log_period_secs", stat_log_period_secs,
                  "Print stat log every 'stat_log_period_secs', set it to 0 to disable stat log.");
@@ -121,9 +179,11 @@ int main(int argc, char** argv) {
   std::string client_cipher_key = "default cipher key";
   std::string server_cipher_method = "chacha20_poly1305";
   std::string server_cipher_key = "default cipher key";
-  app.add_option("--client_cipher_method", client_cipher_method, "Client cipher method");
+  app.add_option("--client_cipher_method", client_cipher_method,
+                 "Client cipher method, chacha20_poly1305/aes_128_gcm/aes_256_gcm/auto/none.");
   app.add_option("--client_cipher_key", client_cipher_key, "Client cipher key");
-  app.add_option("--server_cipher_method", server_cipher_method, "Server cipher method");
+  app.add_option("--server_cipher_method", server_cipher_method,
+                 "Server cipher method, chacha20_poly1305/aes_128_gcm/aes_256_gcm/auto/none.");
   app.add_option("--server_cipher_key", server_cipher_key, "Server cipher key");
 
   app.add_option("--entry", snova::g_is_entry_node, "Run as entry node.");
@@ -281,24 +341,46 @@ int main(int argc, char** argv) {
   snova::GlobalFlags::GetIntance()->SetUser(auth_user);
   SNOVA_INFO("Snova start to run as {} node.",
              (snova::g_is_entry_node ? "ENTRY" : (snova::g_is_exit_node ? "EXIT" : "MIDDLE")));
-  ::asio::io_context ctx(1);
-
-  if (!remote_server.empty()) {
-    uint64_t client_id = snova::random_uint64(0, std::numeric_limits<uint64_t>::max());
-    snova::MuxClient::GetInstance()->SetClientId(client_id);
-    SNOVA_INFO("Generated client_id:{}", client_id);
-    ::asio::co_spawn(
-        ctx,
-        [&]() -> asio::awaitable<void> {
-          auto ec = co_await snova::MuxClient::GetInstance()->Init(auth_user, client_cipher_method,
-                                                                   client_cipher_key);
-          if (ec) {
-            error_exit(fmt::format("Failed to init mux client with error:{}", ec));
-            co_return;
-          }
-        },
-        ::asio::detached);
+  if (snova::g_thread_num == 0) {
+    snova::g_thread_num = 1;
+  }
+  if (snova::g_mux_write_batch_frames == 0) {
+    snova::g_mux_write_batch_frames = 1;
+  }
+  snova::g_mux_max_frame_size =
+      std::clamp<uint32_t>(snova::g_mux_max_frame_size, snova::kMaxChunkSize,
+                           snova::kMaxEventBodySize - snova::kReservedBufferSize);
+  if (snova::g_stream_window_bytes < 2 * snova::g_mux_max_frame_size) {
+    snova::g_stream_window_bytes = 2 * snova::g_mux_max_frame_size;
+  }
+  if (client_cipher_method == "auto" || server_cipher_method == "auto") {
+    // self-benchmark once before io threads start, it ranks methods for 'auto' negotiation.
+    snova::CipherContext::RankAutoMethods();
   }
+  if (snova::g_is_middle_node && snova::g_thread_num > 1) {
+    // middle node relays events between server side sessions and client connections, which
+    // must live in same io thread.
+    SNOVA_ERROR("Middle node only works with 1 io thread, ignore '--threads {}'.",
+                snova::g_thread_num);
+    snova::g_thread_num = 1;
+  }
+  size_t memory_soft_limit = static_cast<size_t>(snova::g_memory_soft_limit_mb) * 1024 * 1024;
+  size_t memory_hard_limit = static_cast<size_t>(snova::g_memory_hard_limit_mb) * 1024 * 1024;
+  snova::init_memory_limits(memory_soft_limit, memory_hard_limit);
+  snova::IOBufAllocOptions iobuf_opts;
+  iobuf_opts.max_cached_blocks = snova::g_iobuf_max_pool_size;
+  iobuf_opts.memory_limit = static_cast<size_t>(snova::g_iobuf_memory_limit_mb) * 1024 * 1024;
+  if (0 == iobuf_opts.memory_limit) {
+    // cached IOBufs are released first under memory pressure.
+    iobuf_opts.memory_limit = memory_soft_limit > 0 ? memory_soft_limit : memory_hard_limit;
+  }
+  iobuf_opts.hugepage = snova::g_iobuf_hugepage;
+  int iobuf_rc = snova::init_iobuf_allocator(iobuf_opts);
+  if (0 != iobuf_rc) {
+    SNOVA_ERROR("Failed to init hugepage IOBuf arena:{}, fall back to malloc.",
+                strerror(-iobuf_rc));
+  }
+
   std::vector<std::unique_ptr<snova::NetAddress>> listen_addrs;
   uint32_t dns_server_count = 0;
   for (const auto& v : multi_listens) {
@@ -322,59 +404,112 @@ int main(int argc, char** argv) {
       SNOVA_INFO("Listen address:{}", v);
     }
   }
-  for (auto& listen_addr : listen_addrs) {
-    bool is_mux_server = true;  // mux server or entry server
-    if (snova::g_is_exit_node || snova::g_is_middle_node) {
-      is_mux_server = true;  // all listen in middle/exit node is mux server
-    } else {
-      if (listen_addr->schema.empty() || listen_addr->schema == "socks5") {
-        is_mux_server = false;
+
+  // Every io thread owns a shard: an io_context with its own mux client/connections/streams,
+  // listeners(bound with SO_REUSEPORT) and timers, nothing is shared across shards.
+  auto start_shard = [&](::asio::io_context& ctx, uint32_t shard_idx) {
+    snova::g_shard_idx = shard_idx;
+    if (snova::g_io_uring) {
+      int rc = snova::init_io_uring(ctx.get_executor());
+      if (0 != rc) {
+        SNOVA_ERROR("[{}]Failed to init io_uring:{}, fall back to epoll.", shard_idx,
+                    strerror(-rc));
       }
     }
-    bool is_dns_server = listen_addr->schema == "dns";
-    if (is_dns_server) {
-      is_mux_server = false;
+    if (snova::is_memory_limit_enabled()) {
+      snova::set_memory_shed_func(
+          [](size_t bytes) { return snova::MuxStream::ShedBuffered(bytes); });
+      ::asio::co_spawn(ctx, snova::start_memory_monitor(), ::asio::detached);
     }
-    if (is_mux_server) {
+    if (!remote_server.empty()) {
+      uint64_t client_id = snova::random_uint64(0, std::numeric_limits<uint64_t>::max());
+      snova::MuxClient::GetInstance()->SetClientId(client_id);
+      SNOVA_INFO("[{}]Generated client_id:{}", shard_idx, client_id);
       ::asio::co_spawn(
-          ctx, snova::start_mux_server(*listen_addr, server_cipher_method, server_cipher_key),
+          ctx,
+          [&]() -> asio::awaitable<void> {
+            auto ec = co_await snova::MuxClient::GetInstance()->Init(
+                auth_user, client_cipher_method, client_cipher_key);
+            if (ec) {
+              error_exit(fmt::format("Failed to init mux client with error:{}", ec));
+              co_return;
+            }
+          },
           ::asio::detached);
-    } else if (is_dns_server) {
-      if (listen_addr->port == 0) {
-        listen_addr->port = 53;
+    }
+    for (auto& listen_addr : listen_addrs) {
+      bool is_mux_server = true;  // mux server or entry server
+      if (snova::g_is_exit_node || snova::g_is_middle_node) {
+        is_mux_server = true;  // all listen in middle/exit node is mux server
+      } else {
+        if (listen_addr->schema.empty() || listen_addr->schema == "socks5") {
+          is_mux_server = false;
+        }
+      }
+      bool is_dns_server = listen_addr->schema == "dns";
+      if (is_dns_server) {
+        is_mux_server = false;
+      }
+      if (is_mux_server) {
+        ::asio::co_spawn(
+            ctx, snova::start_mux_server(*listen_addr, server_cipher_method, server_cipher_key),
+            ::asio::detached);
+      } else if (is_dns_server) {
+        if (shard_idx > 0) {
+          continue;  // dns proxy only runs in first io thread
+        }
+        if (listen_addr->port == 0) {
+          listen_addr->port = 53;
+        }
+        ::asio::co_spawn(ctx, snova::start_dns_proxy_server(*listen_addr, dns_options),
+                         ::asio::detached);
+      } else {
+        ::asio::co_spawn(ctx, snova::start_entry_server(*listen_addr), ::asio::detached);
       }
-      ::asio::co_spawn(ctx, snova::start_dns_proxy_server(*listen_addr, dns_options),
-                       ::asio::detached);
-    } else {
-      ::asio::co_spawn(ctx, snova::start_entry_server(*listen_addr), ::asio::detached);
     }
-  }
 
-  if (!local_tunnel_opts.empty()) {
-    ::asio::co_spawn(
-        ctx,
-        []() -> asio::awaitable<void> {
-          for (const auto& tunnel_opt : snova::GlobalFlags::GetIntance()->GetLocalTunnelOptions()) {
-            snova::NetAddress src_addr, dst_addr;
-            src_addr.host = "0.0.0.0";
-            src_addr.port = tunnel_opt.local_port;
-            dst_addr.host = tunnel_opt.remote_host;
-            dst_addr.port = tunnel_opt.remote_port;
-            auto [_, ec] = co_await snova::start_tunnel_server(src_addr, dst_addr);
-            if (ec) {
-              error_exit("Failed to start tunnel server.");
+    if (!local_tunnel_opts.empty()) {
+      ::asio::co_spawn(
+          ctx,
+          []() -> asio::awaitable<void> {
+            for (const auto& tunnel_opt :
+                 snova::GlobalFlags::GetIntance()->GetLocalTunnelOptions()) {
+              snova::NetAddress src_addr, dst_addr;
+              src_addr.host = "0.0.0.0";
+              src_addr.port = tunnel_opt.local_port;
+              dst_addr.host = tunnel_opt.remote_host;
+              dst_addr.port = tunnel_opt.remote_port;
+              auto [_, ec] = co_await snova::start_tunnel_server(src_addr, dst_addr);
+              if (ec) {
+                error_exit("Failed to start tunnel server.");
+              }
             }
-          }
-        },
-        ::asio::detached);
-  }
+          },
+          ::asio::detached);
+    }
 
-  init_stats();
-  if (stat_log_period_secs > 0) {
-    ::asio::co_spawn(ctx, snova::start_stat_timer(stat_log_period_secs), ::asio::detached);
-  }
+    init_stats();
+    if (stat_log_period_secs > 0) {
+      ::asio::co_spawn(ctx, snova::start_stat_timer(stat_log_period_secs), ::asio::detached);
+    }
+    ::asio::co_spawn(ctx, snova::TimeWheel::GetInstance()->Run(), ::asio::detached);
+  };
 
-  ::asio::co_spawn(ctx, snova::TimeWheel::GetInstance()->Run(), ::asio::detached);
-  ctx.run();
+  std::vector<std::unique_ptr<::asio::io_context>> shard_ctxs;
+  for (uint32_t i = 0; i < snova::g_thread_num; i++) {
+    shard_ctxs.emplace_back(std::make_unique<::asio::io_context>(1));
+  }
+  std::vector<std::thread> shard_threads;
+  for (uint32_t i = 1; i < snova::g_thread_num; i++) {
+    shard_threads.emplace_back([&, i]() {
+      start_shard(*shard_ctxs[i], i);
+      shard_ctxs[i]->run();
+    });
+  }
+  start_shard(*shard_ctxs[0], 0);
+  shard_ctxs[0]->run();
+  for (auto& t : shard_threads) {
+    t.join();
+  }
   return 0;
 }
@@ -47,6 +47,10 @@ asio::awaitable<IOResult> BufferedIO::AsyncRead(const asio::mutable_buffer& buff
   if (offset_ >= length_) {
     offset_ = 0;
     length_ = 0;
+    if (buffers.size() >= kMaxChunkSize) {
+      // nothing buffered, fill caller's buffer directly if it's no smaller than ours.
+      co_return co_await io_->AsyncRead(buffers);
+    }
     auto [n, ec] = co_await io_->AsyncRead(::asio::buffer(recv_buffer_->data(), kMaxChunkSize));
     if (ec) {
       co_return IOResult{0, ec};
@@ -33,6 +33,8 @@
 #include "asio.hpp"
 #include "snova/io/io.h"
 namespace snova {
+// Buffers small reads(e.g. headers of a framed protocol), reads larger than its buffer bypass it
+// once the buffered bytes are consumed.
 class BufferedIO : public IOConnection {
  public:
   explicit BufferedIO(IOConnectionPtr&& io);
@@ -27,25 +27,71 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/io/io.h"
-#include <stack>
+#include <string>
+#include <vector>
 #include "snova/util/flags.h"
 #include "snova/util/stat.h"
 
 namespace snova {
-static std::stack<IOBuf*> g_io_bufs;
-// static constexpr uint32_t kIOBufPoolSize = 64;
-static uint64_t g_iobuf_pool_bytes = 0;
-static uint64_t g_active_iobuf_bytes = 0;
-static uint32_t g_active_iobuf_num = 0;
+static thread_local uint64_t g_active_iobuf_bytes = 0;
+static thread_local uint32_t g_active_iobuf_num = 0;
+
+// released IOBufs of a whole class block, kept with their storage so that a reuse costs neither
+// the vector object nor the block allocation.
+struct IOBufPool {
+  std::array<std::vector<IOBuf*>, kIOBufClassNum> bufs;
+  uint64_t bytes = 0;
+  // IOBufs held by other thread_local objects may be released after this at thread exit.
+  bool destroyed = false;
+  IOBufPool() {
+    // construct the allocator cache first, it's destroyed after the pool returns its blocks.
+    get_iobuf_alloc_stats();
+  }
+  ~IOBufPool() {
+    for (auto& class_bufs : bufs) {
+      for (IOBuf* p : class_bufs) {
+        delete p;
+      }
+      class_bufs.clear();
+    }
+    bytes = 0;
+    destroyed = true;
+  }
+};
+
+static IOBufPool& get_iobuf_pool() {
+  static thread_local IOBufPool pool;
+  return pool;
+}
 
 void register_io_stat() {
   register_stat_func([]() -> StatValues {
     StatValues vals;
     auto& kv = vals["IOBuf"];
-    kv["pool_size"] = std::to_string(g_io_bufs.size());
-    kv["pool_bytes"] = std::to_string(g_iobuf_pool_bytes);
+    size_t pool_size = 0;
+    for (const auto& class_bufs : get_iobuf_pool().bufs) {
+      pool_size += class_bufs.size();
+    }
+    kv["pool_size"] = std::to_string(pool_size);
+    kv["pool_bytes"] = std::to_string(get_iobuf_pool().bytes);
     kv["active_iobuf_num"] = std::to_string(g_active_iobuf_num);
     kv["active_iobuf_bytes"] = std::to_string(g_active_iobuf_bytes);
+    const IOBufAllocStats& stats = get_iobuf_alloc_stats();
+    for (size_t i = 0; i < kIOBufClassNum; i++) {
+      const IOBufClassStats& class_stats = stats.classes[i];
+      std::string prefix = "class_" + std::to_string(kIOBufClassSizes[i]) + "_";
+      kv[prefix + "used_bytes"] = std::to_string(class_stats.used_bytes);
+      kv[prefix + "high_water_bytes"] = std::to_string(class_stats.high_water_bytes);
+      kv[prefix + "cached_bytes"] = std::to_string(class_stats.cached_bytes);
+      uint64_t requests = class_stats.hits + class_stats.misses;
+      kv[prefix + "hit_rate"] =
+          std::to_string(requests > 0 ? class_stats.hits * 100 / requests : 0) + "%";
+    }
+    kv["large_used_bytes"] = std::to_string(stats.large_used_bytes);
+    kv["over_limit_releases"] = std::to_string(stats.over_limit_releases);
+    kv["memory_bytes"] = std::to_string(get_iobuf_memory_bytes());
+    kv["used_bytes"] = std::to_string(get_iobuf_used_bytes());
+    kv["arena_bytes"] = std::to_string(get_iobuf_arena_bytes());
     return vals;
   });
 }
@@ -53,28 +99,32 @@ void register_io_stat() {
 void IOBufDeleter::operator()(IOBuf* v) const {
   g_active_iobuf_num--;
   g_active_iobuf_bytes -= v->capacity();
-  if (g_io_bufs.size() < g_iobuf_max_pool_size) {
-    g_io_bufs.push(v);
-    g_iobuf_pool_bytes += v->capacity();
+  IOBufPool& pool = get_iobuf_pool();
+  size_t capacity = v->capacity();
+  int idx = iobuf_size_class(capacity);
+  // pooled blocks count as used by the allocator, release them instead while over the limit.
+  if (!pool.destroyed && idx >= 0 && capacity == kIOBufClassSizes[idx] &&
+      pool.bufs[idx].size() < g_iobuf_max_pool_size && !is_iobuf_over_memory_limit()) {
+    pool.bufs[idx].push_back(v);
+    pool.bytes += capacity;
     return;
   }
+  // the storage goes back to the size class free list.
   delete v;
 }
 static IOBuf* get_raw_iobuf(size_t n) {
+  IOBufPool& pool = get_iobuf_pool();
+  int idx = iobuf_size_class(n);
   IOBuf* p = nullptr;
-  if (g_io_bufs.empty()) {
-    p = new IOBuf;
+  if (idx >= 0 && !pool.bufs[idx].empty()) {
+    p = pool.bufs[idx].back();
+    pool.bufs[idx].pop_back();
+    pool.bytes -= p->capacity();
   } else {
-    p = g_io_bufs.top();
-    g_io_bufs.pop();
-    g_iobuf_pool_bytes -= p->capacity();
-  }
-  if (n < (kMaxChunkSize + kReservedBufferSize)) {
-    n = kMaxChunkSize + kReservedBufferSize;
-  }
-  if (p->size() < n) {
-    p->resize(n);
+    p = new IOBuf;
   }
+  // the whole block of the size class is usable, e.g. a reader may fill a spare tail.
+  p->resize(idx >= 0 ? kIOBufClassSizes[idx] : n);
   g_active_iobuf_num++;
   g_active_iobuf_bytes += p->capacity();
   return p;
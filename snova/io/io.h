@@ -35,13 +35,13 @@
 #include "absl/types/span.h"
 #include "asio.hpp"
 #include "asio/experimental/awaitable_operators.hpp"
-#include "snova/io/io.h"
+#include "snova/io/iobuf_allocator.h"
 
 namespace snova {
 using IOResult = std::pair<size_t, std::error_code>;
 using MutableBytes = absl::Span<uint8_t>;
 using Bytes = absl::Span<const uint8_t>;
-using IOBuf = std::vector<uint8_t>;
+using IOBuf = std::vector<uint8_t, IOBufAllocator<uint8_t>>;
 static constexpr uint16_t kMaxChunkSize = 8192;
 static constexpr uint16_t kReservedBufferSize = 256;
 struct IOBufDeleter {
@@ -50,6 +50,8 @@ struct IOBufDeleter {
 using IOBufSharedPtr = std::shared_ptr<IOBuf>;
 using IOBufPtr = std::unique_ptr<IOBuf, IOBufDeleter>;
 
+// size() of the returned buffer is 'n' rounded up to its size class, callers must not use more
+// than size() bytes.
 IOBufPtr get_iobuf(size_t n);
 IOBufSharedPtr get_shared_iobuf(size_t n);
 
@@ -69,6 +71,8 @@ using StreamReadResult = std::tuple<IOBufPtr, size_t, std::error_code>;
 struct Stream {
   virtual uint32_t GetID() const = 0;
   virtual bool IsTLS() const = 0;
+  // max bytes of one Write, readers feeding this stream size their chunks by it.
+  virtual size_t GetMaxWriteSize() const { return kMaxChunkSize; }
   virtual asio::awaitable<StreamReadResult> Read() = 0;
   virtual asio::awaitable<std::error_code> Write(IOBufPtr&& buf, size_t len) = 0;
   virtual asio::awaitable<std::error_code> Close(bool close_by_remote) = 0;
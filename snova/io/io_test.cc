@@ -0,0 +1,80 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/io.h"
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+using namespace snova;  // NOLINT
+
+TEST(IOBuf, Pool) {
+  // run in a new thread for a clean thread local pool.
+  std::thread([]() {
+    IOBuf* raw = nullptr;
+    {
+      IOBufPtr buf = get_iobuf(100);
+      ASSERT_EQ(256u, buf->size());
+      raw = buf.get();
+    }
+    size_t misses = get_iobuf_alloc_stats().classes[0].misses;
+    IOBufPtr small = get_iobuf(200);
+    // reused with its storage, no allocation at all.
+    ASSERT_EQ(raw, small.get());
+    ASSERT_EQ(256u, small->size());
+    ASSERT_EQ(misses, get_iobuf_alloc_stats().classes[0].misses);
+    IOBufPtr chunk = get_iobuf(kMaxChunkSize);
+    ASSERT_NE(raw, chunk.get());
+    ASSERT_EQ(kMaxChunkSize, chunk->size());
+    // grown out of its class, pooled in the larger one.
+    chunk->resize(kMaxChunkSize + 1);
+    IOBuf* grown = chunk.get();
+    chunk.reset();
+    IOBufPtr large = get_iobuf(kMaxChunkSize + 1);
+    ASSERT_EQ(grown, large.get());
+    ASSERT_EQ(16384u, large->size());
+  }).join();
+}
+
+TEST(IOBuf, Benchmark) {
+  static constexpr size_t kCount = 4000000;
+  static constexpr size_t kLive = 64;
+  // same alloc/free pattern as the IOBufAllocator benchmark.
+  std::thread([]() {
+    std::vector<IOBufPtr> live(kLive);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kCount; i++) {
+      live[i % kLive] = get_iobuf(i % 3 == 0 ? 60 : kMaxChunkSize);
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    printf("get_iobuf %.1f ns per buffer\n", static_cast<double>(ns) / kCount);
+  }).join();
+}
@@ -0,0 +1,219 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/iobuf_allocator.h"
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace snova {
+static constexpr size_t kArenaChunkSize = 2 * 1024 * 1024;
+static constexpr size_t kDefaultArenaSize = 1024 * 1024 * 1024;
+
+static IOBufAllocOptions g_alloc_opts;
+static std::atomic<size_t> g_memory_bytes{0};
+// bytes of IOBufs in use of all io threads, cached blocks and untouched arena chunks excluded.
+static std::atomic<size_t> g_used_bytes{0};
+// address space reserved for the hugepage arena, io threads take 2MB chunks from it in turn.
+static uint8_t* g_arena_base = nullptr;
+static size_t g_arena_size = 0;
+static std::atomic<size_t> g_arena_used{0};
+
+struct IOBufThreadCache {
+  std::array<std::vector<void*>, kIOBufClassNum> free_blocks;
+  uint8_t* chunk = nullptr;
+  size_t chunk_left = 0;
+  IOBufAllocStats stats;
+  // IOBufs held by other thread_local objects may be released after this at thread exit.
+  bool destroyed = false;
+  ~IOBufThreadCache() {
+    for (size_t i = 0; i < kIOBufClassNum; i++) {
+      for (void* p : free_blocks[i]) {
+        if (!in_arena(p)) {
+          g_memory_bytes -= kIOBufClassSizes[i];
+          ::operator delete(p);
+        }
+      }
+      free_blocks[i].clear();
+    }
+    destroyed = true;
+  }
+  static bool in_arena(const void* p) {
+    return p >= g_arena_base && p < g_arena_base + g_arena_size;
+  }
+};
+
+static IOBufThreadCache& get_thread_cache() {
+  static thread_local IOBufThreadCache cache;
+  return cache;
+}
+
+static bool is_over_limit() {
+  return g_alloc_opts.memory_limit > 0 && g_used_bytes > g_alloc_opts.memory_limit;
+}
+
+static void* new_block(IOBufThreadCache& cache, size_t size) {
+  if (nullptr != g_arena_base) {
+    if (cache.chunk_left < size) {
+      // the tail of previous chunk is wasted, less than one largest block. The used offset stops
+      // at the arena size, blocks are malloced once it is exhausted.
+      size_t offset = g_arena_used.load();
+      while (offset + kArenaChunkSize <= g_arena_size &&
+             !g_arena_used.compare_exchange_weak(offset, offset + kArenaChunkSize)) {
+      }
+      if (offset + kArenaChunkSize <= g_arena_size) {
+        cache.chunk = g_arena_base + offset;
+        cache.chunk_left = kArenaChunkSize;
+        g_memory_bytes += kArenaChunkSize;
+      }
+    }
+    if (cache.chunk_left >= size) {
+      void* p = cache.chunk;
+      cache.chunk += size;
+      cache.chunk_left -= size;
+      return p;
+    }
+  }
+  g_memory_bytes += size;
+  return ::operator new(size);
+}
+
+int init_iobuf_allocator(const IOBufAllocOptions& opts) {
+  g_alloc_opts = opts;
+  if (!opts.hugepage || nullptr != g_arena_base) {
+    return 0;
+  }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  size_t size = opts.memory_limit > 0 ? opts.memory_limit : kDefaultArenaSize;
+  size = (size + kArenaChunkSize - 1) / kArenaChunkSize * kArenaChunkSize;
+  // only address space, pages are populated on first touch. One more chunk to align the base.
+  void* p = mmap(nullptr, size + kArenaChunkSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == p) {
+    g_alloc_opts.hugepage = false;
+    return -errno;
+  }
+  uintptr_t base = (reinterpret_cast<uintptr_t>(p) + kArenaChunkSize - 1) & ~(kArenaChunkSize - 1);
+  if (0 != madvise(reinterpret_cast<void*>(base), size, MADV_HUGEPAGE)) {
+    int err = errno;
+    munmap(p, size + kArenaChunkSize);
+    g_alloc_opts.hugepage = false;
+    return -err;
+  }
+  g_arena_base = reinterpret_cast<uint8_t*>(base);
+  g_arena_size = size;
+  return 0;
+#else
+  g_alloc_opts.hugepage = false;
+  return -ENOSYS;
+#endif
+}
+
+size_t iobuf_alloc_size(size_t n) {
+  int idx = iobuf_size_class(n);
+  return idx < 0 ? n : kIOBufClassSizes[idx];
+}
+
+void* iobuf_alloc(size_t n) {
+  IOBufThreadCache& cache = get_thread_cache();
+  int idx = iobuf_size_class(n);
+  if (idx < 0) {
+    cache.stats.large_used_bytes += n;
+    g_used_bytes += n;
+    g_memory_bytes += n;
+    return ::operator new(n);
+  }
+  // a request is served by a whole block of its class, so is the release of the same 'n'.
+  size_t size = kIOBufClassSizes[idx];
+  IOBufClassStats& stats = cache.stats.classes[idx];
+  auto& blocks = cache.free_blocks[idx];
+  void* p = nullptr;
+  if (!blocks.empty()) {
+    p = blocks.back();
+    blocks.pop_back();
+    stats.cached_bytes -= size;
+    stats.hits++;
+  } else {
+    p = new_block(cache, size);
+    stats.misses++;
+  }
+  stats.used_bytes += size;
+  g_used_bytes += size;
+  stats.high_water_bytes = std::max(stats.high_water_bytes, stats.used_bytes);
+  return p;
+}
+
+void iobuf_free(void* p, size_t n) {
+  IOBufThreadCache& cache = get_thread_cache();
+  int idx = iobuf_size_class(n);
+  if (idx < 0) {
+    cache.stats.large_used_bytes -= n;
+    g_used_bytes -= n;
+    g_memory_bytes -= n;
+    ::operator delete(p);
+    return;
+  }
+  size_t size = kIOBufClassSizes[idx];
+  IOBufClassStats& stats = cache.stats.classes[idx];
+  stats.used_bytes -= size;
+  bool arena_block = IOBufThreadCache::in_arena(p);
+  if (cache.destroyed) {
+    g_used_bytes -= size;
+    if (!arena_block) {
+      g_memory_bytes -= size;
+      ::operator delete(p);
+    }
+    return;
+  }
+  auto& blocks = cache.free_blocks[idx];
+  // arena blocks could not be released. The limit is checked with the block still in use.
+  bool over_limit = is_over_limit();
+  g_used_bytes -= size;
+  if (arena_block || (blocks.size() < g_alloc_opts.max_cached_blocks && !over_limit)) {
+    blocks.push_back(p);
+    stats.cached_bytes += size;
+    return;
+  }
+  if (over_limit) {
+    cache.stats.over_limit_releases++;
+  }
+  g_memory_bytes -= size;
+  ::operator delete(p);
+}
+
+const IOBufAllocStats& get_iobuf_alloc_stats() { return get_thread_cache().stats; }
+size_t get_iobuf_memory_bytes() { return g_memory_bytes; }
+size_t get_iobuf_used_bytes() { return g_used_bytes; }
+bool is_iobuf_over_memory_limit() { return is_over_limit(); }
+size_t get_iobuf_arena_bytes() { return g_arena_used; }
+
+}  // namespace snova
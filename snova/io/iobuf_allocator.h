@@ -0,0 +1,125 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+#include <new>
+#include <utility>
+
+namespace snova {
+static constexpr size_t kIOBufClassNum = 5;
+static constexpr std::array<size_t, kIOBufClassNum> kIOBufClassSizes = {256, 2048, 8192, 16384,
+                                                                        65536};
+
+struct IOBufAllocOptions {
+  // free blocks cached per size class of each io thread.
+  size_t max_cached_blocks = 64;
+  // bytes of IOBufs in use of all io threads, 0 for no limit. It only caps caching: blocks are
+  // released instead of recycled over the limit, allocations never fail nor wait. Buffering is
+  // bounded by the memory limits of memory_pressure.h instead.
+  size_t memory_limit = 0;
+  // carve blocks from a transparent hugepage backed arena, blocks are then never returned to the
+  // system, the arena is sized by 'memory_limit'(or 1GB) of address space. Blocks are malloced
+  // once the arena is exhausted.
+  bool hugepage = false;
+};
+
+struct IOBufClassStats {
+  int64_t used_bytes = 0;
+  int64_t high_water_bytes = 0;
+  int64_t cached_bytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+// stats of current io thread.
+struct IOBufAllocStats {
+  std::array<IOBufClassStats, kIOBufClassNum> classes;
+  // buffers larger than all classes, allocated as is and never cached.
+  int64_t large_used_bytes = 0;
+  // blocks released since over the memory limit.
+  uint64_t over_limit_releases = 0;
+};
+
+// index of the size class 'n' rounds up to, or -1 if it's larger than all classes.
+inline int iobuf_size_class(size_t n) {
+  for (size_t i = 0; i < kIOBufClassNum; i++) {
+    if (n <= kIOBufClassSizes[i]) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+// call once before io threads start, return 0 or -errno if the hugepage arena is not available,
+// which falls back to malloc.
+int init_iobuf_allocator(const IOBufAllocOptions& opts);
+// size class 'n' rounds up to, or 'n' itself if it's larger than all classes.
+size_t iobuf_alloc_size(size_t n);
+void* iobuf_alloc(size_t n);
+void iobuf_free(void* p, size_t n);
+const IOBufAllocStats& get_iobuf_alloc_stats();
+// bytes of IOBuf memory of all io threads, including cached blocks and taken arena chunks.
+size_t get_iobuf_memory_bytes();
+// bytes of IOBufs in use of all io threads, which are released once the buffered chunks are.
+size_t get_iobuf_used_bytes();
+bool is_iobuf_over_memory_limit();
+// bytes of the hugepage arena taken by io threads, never more than the arena size.
+size_t get_iobuf_arena_bytes();
+
+// std allocator of IOBuf storage on the size classed free lists.
+template <typename T>
+struct IOBufAllocator {
+  using value_type = T;
+  IOBufAllocator() = default;
+  template <typename U>
+  IOBufAllocator(const IOBufAllocator<U>&) {}  // NOLINT
+  T* allocate(size_t n) { return static_cast<T*>(iobuf_alloc(n * sizeof(T))); }
+  void deallocate(T* p, size_t n) { iobuf_free(p, n * sizeof(T)); }
+  // default initialize on resize instead of zero filling, buffers are written before read.
+  template <typename U>
+  void construct(U* p) {
+    ::new (static_cast<void*>(p)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+  }
+  template <typename U>
+  bool operator==(const IOBufAllocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const IOBufAllocator<U>&) const {
+    return false;
+  }
+};
+
+}  // namespace snova
@@ -0,0 +1,216 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/iobuf_allocator.h"
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+using namespace snova;  // NOLINT
+
+using Buffer = std::vector<uint8_t, IOBufAllocator<uint8_t>>;
+
+TEST(IOBufAllocator, SizeClass) {
+  ASSERT_EQ(256u, iobuf_alloc_size(1));
+  ASSERT_EQ(256u, iobuf_alloc_size(256));
+  ASSERT_EQ(2048u, iobuf_alloc_size(257));
+  ASSERT_EQ(8192u, iobuf_alloc_size(8192));
+  ASSERT_EQ(16384u, iobuf_alloc_size(8193));
+  ASSERT_EQ(65536u, iobuf_alloc_size(16385));
+  ASSERT_EQ(65537u, iobuf_alloc_size(65537));
+}
+
+TEST(IOBufAllocator, Recycle) {
+  // run in a new thread for clean thread local stats.
+  std::thread([]() {
+    const IOBufAllocStats& stats = get_iobuf_alloc_stats();
+    void* p = iobuf_alloc(60);
+    ASSERT_EQ(256, stats.classes[0].used_bytes);
+    ASSERT_EQ(1u, stats.classes[0].misses);
+    iobuf_free(p, 60);
+    ASSERT_EQ(0, stats.classes[0].used_bytes);
+    ASSERT_EQ(256, stats.classes[0].cached_bytes);
+    // any size of the class reuses the block.
+    void* q = iobuf_alloc(200);
+    ASSERT_EQ(p, q);
+    ASSERT_EQ(1u, stats.classes[0].hits);
+    iobuf_free(q, 200);
+
+    Buffer buf;
+    buf.resize(8192);
+    ASSERT_EQ(8192, stats.classes[2].used_bytes);
+    buf.resize(9000);  // grows into the 16KB class
+    ASSERT_EQ(0, stats.classes[2].used_bytes);
+    ASSERT_EQ(16384, stats.classes[3].used_bytes);
+    ASSERT_EQ(16384, stats.classes[3].high_water_bytes);
+    buf = Buffer();
+    ASSERT_EQ(0, stats.classes[3].used_bytes);
+
+    void* large = iobuf_alloc(100000);
+    ASSERT_EQ(100000, stats.large_used_bytes);
+    iobuf_free(large, 100000);
+    ASSERT_EQ(0, stats.large_used_bytes);
+  }).join();
+}
+
+TEST(IOBufAllocator, MemoryLimit) {
+  IOBufAllocOptions opts;
+  opts.max_cached_blocks = 2;
+  opts.memory_limit = 4 * 65536;
+  ASSERT_EQ(0, init_iobuf_allocator(opts));
+  std::thread([&]() {
+    const IOBufAllocStats& stats = get_iobuf_alloc_stats();
+    size_t base = get_iobuf_memory_bytes();
+    std::vector<void*> blocks;
+    for (int i = 0; i < 8; i++) {
+      blocks.push_back(iobuf_alloc(65536));
+    }
+    ASSERT_EQ(base + 8 * 65536, get_iobuf_memory_bytes());
+    for (void* p : blocks) {
+      iobuf_free(p, 65536);
+    }
+    // released while over the limit, then cached up to 'max_cached_blocks'.
+    ASSERT_EQ(4u, stats.over_limit_releases);
+    ASSERT_EQ(2 * 65536, stats.classes[4].cached_bytes);
+    ASSERT_EQ(base + 2 * 65536, get_iobuf_memory_bytes());
+  }).join();
+  init_iobuf_allocator(IOBufAllocOptions());
+}
+
+TEST(IOBufAllocator, HugepageArena) {
+  IOBufAllocOptions opts;
+  opts.hugepage = true;
+  opts.memory_limit = 64 * 1024 * 1024;
+  int rc = init_iobuf_allocator(opts);
+  if (0 != rc) {
+    GTEST_SKIP() << "transparent hugepage is not available:" << rc;
+  }
+  std::thread([]() {
+    std::vector<void*> blocks;
+    for (int i = 0; i < 64; i++) {
+      void* p = iobuf_alloc(65536);
+      memset(p, i, 65536);
+      blocks.push_back(p);
+    }
+    ASSERT_EQ(2u * 2 * 1024 * 1024, get_iobuf_arena_bytes());
+    for (void* p : blocks) {
+      iobuf_free(p, 65536);
+    }
+    // arena blocks are always cached.
+    ASSERT_EQ(64 * 65536, get_iobuf_alloc_stats().classes[4].cached_bytes);
+  }).join();
+  init_iobuf_allocator(IOBufAllocOptions());
+}
+
+TEST(IOBufAllocator, HugepageArenaExhausted) {
+  static constexpr size_t kArenaSize = 64 * 1024 * 1024;
+  IOBufAllocOptions opts;
+  opts.hugepage = true;
+  opts.memory_limit = kArenaSize;  // the arena is created once, by this or the test above.
+  int rc = init_iobuf_allocator(opts);
+  if (0 != rc) {
+    GTEST_SKIP() << "transparent hugepage is not available:" << rc;
+  }
+  std::thread([]() {
+    std::vector<void*> blocks;
+    // twice the arena, the second half is malloced.
+    for (size_t i = 0; i < 2 * kArenaSize / 65536; i++) {
+      blocks.push_back(iobuf_alloc(65536));
+    }
+    ASSERT_EQ(kArenaSize, get_iobuf_arena_bytes());
+    for (void* p : blocks) {
+      iobuf_free(p, 65536);
+    }
+  }).join();
+  init_iobuf_allocator(IOBufAllocOptions());
+}
+
+TEST(IOBufAllocator, Benchmark) {
+  static constexpr size_t kCount = 4000000;
+  static constexpr size_t kLive = 64;
+  // alloc/free pattern of relayed chunks: a few buffers alive at a time, one third small ones.
+  auto run = [](const char* name, auto&& alloc, auto&& release) {
+    std::vector<Buffer*> live(kLive, nullptr);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kCount; i++) {
+      size_t slot = i % kLive;
+      if (live[slot] != nullptr) {
+        release(live[slot]);
+      }
+      live[slot] = alloc(i % 3 == 0 ? 60 : 8192);
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    size_t pinned = 0;
+    for (Buffer* b : live) {
+      pinned += b->capacity();
+      release(b);
+    }
+    printf("%-12s %.1f ns per buffer, %zu bytes pinned per live buffer\n", name,
+           static_cast<double>(ns) / kCount, pinned / kLive);
+  };
+  run(
+      "size class",
+      [](size_t n) {
+        Buffer* b = new Buffer;
+        b->resize(iobuf_alloc_size(n));
+        return b;
+      },
+      [](Buffer* b) { delete b; });
+  // the replaced pool: one stack of vectors all sized 8KB + 256B.
+  std::vector<std::vector<uint8_t>*> pool;
+  run(
+      "fixed pool",
+      [&](size_t n) {
+        std::vector<uint8_t>* v = nullptr;
+        if (pool.empty()) {
+          v = new std::vector<uint8_t>;
+        } else {
+          v = pool.back();
+          pool.pop_back();
+        }
+        if (v->size() < 8448) {
+          v->resize(8448);
+        }
+        return reinterpret_cast<Buffer*>(v);
+      },
+      [&](Buffer* b) {
+        auto* v = reinterpret_cast<std::vector<uint8_t>*>(b);
+        if (pool.size() < 64) {
+          pool.push_back(v);
+        } else {
+          delete v;
+        }
+      });
+  for (auto* v : pool) {
+    delete v;
+  }
+}
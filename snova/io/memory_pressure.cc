@@ -0,0 +1,149 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/memory_pressure.h"
+#include <string>
+#include <utility>
+#include "asio/experimental/as_tuple.hpp"
+#include "snova/io/iobuf_allocator.h"
+#include "snova/log/log_macros.h"
+#include "snova/util/stat.h"
+
+namespace snova {
+static constexpr uint32_t kMemoryCheckPeriodMs = 20;
+
+static size_t g_soft_limit = 0;
+static size_t g_hard_limit = 0;
+// never expire, cancelled by the monitor of current thread to wake paused readers/acceptors.
+static thread_local ::asio::steady_timer* g_memory_wait_timer = nullptr;
+static thread_local MemoryShedFunc g_memory_shed_func;
+static thread_local uint32_t g_memory_paused_num = 0;
+static thread_local uint64_t g_memory_pauses = 0;
+static thread_local uint64_t g_memory_shed_rounds = 0;
+static thread_local uint64_t g_memory_shed_bytes = 0;
+
+static const char* pressure_name(MemoryPressure pressure) {
+  switch (pressure) {
+    case MEMORY_PRESSURE_SOFT:
+      return "soft";
+    case MEMORY_PRESSURE_HARD:
+      return "hard";
+    default:
+      return "none";
+  }
+}
+
+void init_memory_limits(size_t soft_limit, size_t hard_limit) {
+  g_soft_limit = soft_limit;
+  g_hard_limit = hard_limit;
+}
+bool is_memory_limit_enabled() { return g_soft_limit > 0 || g_hard_limit > 0; }
+
+MemoryPressure get_memory_pressure() {
+  size_t bytes = get_iobuf_used_bytes();
+  if (g_hard_limit > 0 && bytes > g_hard_limit) {
+    return MEMORY_PRESSURE_HARD;
+  }
+  if (g_soft_limit > 0 && bytes > g_soft_limit) {
+    return MEMORY_PRESSURE_SOFT;
+  }
+  return MEMORY_PRESSURE_NONE;
+}
+
+asio::awaitable<void> wait_memory_available() {
+  if (nullptr == g_memory_wait_timer || get_memory_pressure() == MEMORY_PRESSURE_NONE) {
+    co_return;
+  }
+  g_memory_paused_num++;
+  g_memory_pauses++;
+  while (nullptr != g_memory_wait_timer && get_memory_pressure() != MEMORY_PRESSURE_NONE) {
+    co_await g_memory_wait_timer->async_wait(
+        ::asio::experimental::as_tuple(::asio::use_awaitable));
+  }
+  g_memory_paused_num--;
+}
+
+void set_memory_shed_func(MemoryShedFunc&& func) { g_memory_shed_func = std::move(func); }
+
+asio::awaitable<void> start_memory_monitor() {
+  auto ex = co_await asio::this_coro::executor;
+  ::asio::steady_timer wait_timer(ex);
+  wait_timer.expires_at(::asio::steady_timer::time_point::max());
+  g_memory_wait_timer = &wait_timer;
+  ::asio::steady_timer check_timer(ex);
+  MemoryPressure last_pressure = MEMORY_PRESSURE_NONE;
+  while (true) {
+    check_timer.expires_after(std::chrono::milliseconds(kMemoryCheckPeriodMs));
+    auto [ec] =
+        co_await check_timer.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (ec) {
+      break;
+    }
+    MemoryPressure pressure = get_memory_pressure();
+    if (pressure != last_pressure) {
+      SNOVA_INFO("Memory pressure changed from {} to {} with {} bytes.",
+                 pressure_name(last_pressure), pressure_name(pressure), get_iobuf_used_bytes());
+      last_pressure = pressure;
+    }
+    if (pressure == MEMORY_PRESSURE_NONE) {
+      if (g_memory_paused_num > 0) {
+        wait_timer.cancel();
+      }
+      continue;
+    }
+    if (pressure == MEMORY_PRESSURE_HARD && g_memory_shed_func) {
+      // every io thread sheds its own streams, so the overflow is rechecked before each round.
+      size_t bytes = get_iobuf_used_bytes();
+      if (bytes > g_hard_limit) {
+        g_memory_shed_rounds++;
+        g_memory_shed_bytes += co_await g_memory_shed_func(bytes - g_hard_limit);
+      }
+    }
+  }
+  g_memory_wait_timer = nullptr;
+  if (g_memory_paused_num > 0) {
+    wait_timer.cancel();
+  }
+}
+
+void register_memory_stat() {
+  register_stat_func([]() -> StatValues {
+    StatValues vals;
+    auto& kv = vals["Memory"];
+    kv["pressure"] = pressure_name(get_memory_pressure());
+    kv["iobuf_bytes"] = std::to_string(get_iobuf_used_bytes());
+    kv["soft_limit_bytes"] = std::to_string(g_soft_limit);
+    kv["hard_limit_bytes"] = std::to_string(g_hard_limit);
+    kv["paused_num"] = std::to_string(g_memory_paused_num);
+    kv["pauses"] = std::to_string(g_memory_pauses);
+    kv["shed_rounds"] = std::to_string(g_memory_shed_rounds);
+    kv["shed_bytes"] = std::to_string(g_memory_shed_bytes);
+    return vals;
+  });
+}
+}  // namespace snova
@@ -0,0 +1,59 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <stddef.h>
+#include <functional>
+#include "asio.hpp"
+
+namespace snova {
+enum MemoryPressure {
+  MEMORY_PRESSURE_NONE = 0,
+  // over the soft limit, relays pause reading and servers pause accepting until memory released.
+  MEMORY_PRESSURE_SOFT = 1,
+  // over the hard limit, streams buffering most bytes are closed.
+  MEMORY_PRESSURE_HARD = 2,
+};
+
+// close streams of current io thread buffering most bytes until 'bytes' released, return the bytes
+// released.
+using MemoryShedFunc = std::function<asio::awaitable<size_t>(size_t bytes)>;
+
+// call once before io threads start, 0 disables the limit. Memory is the bytes of IOBufs in use of
+// all io threads, which hold every buffered chunk of sockets and streams. Cached blocks and taken
+// hugepage arena chunks are excluded, so the pressure falls once the chunks are released.
+void init_memory_limits(size_t soft_limit, size_t hard_limit);
+bool is_memory_limit_enabled();
+MemoryPressure get_memory_pressure();
+// suspend while over the soft limit, return at once if not or no monitor runs in current thread.
+asio::awaitable<void> wait_memory_available();
+void set_memory_shed_func(MemoryShedFunc&& func);
+// run in each io thread, wakes paused readers/acceptors and sheds streams of current thread.
+asio::awaitable<void> start_memory_monitor();
+void register_memory_stat();
+}  // namespace snova
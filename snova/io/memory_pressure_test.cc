@@ -0,0 +1,123 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/memory_pressure.h"
+#include <gtest/gtest.h>
+#include <vector>
+#include "snova/io/iobuf_allocator.h"
+using namespace snova;  // NOLINT
+
+static constexpr size_t kBlockSize = 65536;
+
+TEST(MemoryPressure, Limits) {
+  size_t base = get_iobuf_used_bytes();
+  init_memory_limits(base + 4 * kBlockSize, base + 8 * kBlockSize);
+  std::vector<void*> blocks;
+  EXPECT_EQ(MEMORY_PRESSURE_NONE, get_memory_pressure());
+  for (int i = 0; i < 6; i++) {
+    blocks.push_back(iobuf_alloc(kBlockSize + 1));  // larger than all classes, never cached
+  }
+  EXPECT_EQ(MEMORY_PRESSURE_SOFT, get_memory_pressure());
+  for (int i = 0; i < 4; i++) {
+    blocks.push_back(iobuf_alloc(kBlockSize + 1));
+  }
+  EXPECT_EQ(MEMORY_PRESSURE_HARD, get_memory_pressure());
+  for (void* p : blocks) {
+    iobuf_free(p, kBlockSize + 1);
+  }
+  EXPECT_EQ(MEMORY_PRESSURE_NONE, get_memory_pressure());
+  init_memory_limits(0, 0);
+}
+
+TEST(MemoryPressure, WaitAndShed) {
+  ::asio::io_context ctx;
+  size_t base = get_iobuf_used_bytes();
+  init_memory_limits(base + kBlockSize, base + 4 * kBlockSize);
+  std::vector<void*> blocks;
+  for (int i = 0; i < 8; i++) {
+    blocks.push_back(iobuf_alloc(kBlockSize + 1));
+  }
+  size_t shed_request = 0;
+  // releases the blocks like closing the streams buffering them.
+  set_memory_shed_func([&](size_t bytes) -> asio::awaitable<size_t> {
+    shed_request = bytes;
+    size_t released = 0;
+    while (!blocks.empty() && released < bytes) {
+      iobuf_free(blocks.back(), kBlockSize + 1);
+      blocks.pop_back();
+      released += kBlockSize + 1;
+    }
+    co_return released;
+  });
+  bool resumed = false;
+  ::asio::co_spawn(ctx, start_memory_monitor(), ::asio::detached);
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        co_await wait_memory_available();
+        resumed = true;
+      },
+      ::asio::detached);
+  ctx.run_for(std::chrono::milliseconds(200));
+  EXPECT_GT(shed_request, 0);
+  EXPECT_EQ(3, blocks.size());
+  EXPECT_EQ(MEMORY_PRESSURE_SOFT, get_memory_pressure());
+  EXPECT_FALSE(resumed);
+  for (void* p : blocks) {
+    iobuf_free(p, kBlockSize + 1);
+  }
+  ctx.run_for(std::chrono::milliseconds(200));
+  EXPECT_TRUE(resumed);
+  set_memory_shed_func({});
+  init_memory_limits(0, 0);
+}
+
+TEST(MemoryPressure, HugepageArena) {
+  IOBufAllocOptions opts;
+  opts.hugepage = true;
+  opts.memory_limit = 64 * 1024 * 1024;
+  int rc = init_iobuf_allocator(opts);
+  if (0 != rc) {
+    GTEST_SKIP() << "transparent hugepage is not available:" << rc;
+  }
+  size_t base = get_iobuf_used_bytes();
+  init_memory_limits(base + 4 * kBlockSize, base + 8 * kBlockSize);
+  std::vector<void*> blocks;
+  for (int i = 0; i < 10; i++) {
+    blocks.push_back(iobuf_alloc(kBlockSize));  // carved from the arena, cached once freed
+  }
+  EXPECT_EQ(MEMORY_PRESSURE_HARD, get_memory_pressure());
+  for (void* p : blocks) {
+    iobuf_free(p, kBlockSize);
+  }
+  // the taken arena chunk and cached blocks are not counted.
+  EXPECT_GT(get_iobuf_memory_bytes(), base + 8 * kBlockSize);
+  EXPECT_EQ(MEMORY_PRESSURE_NONE, get_memory_pressure());
+  init_memory_limits(0, 0);
+  init_iobuf_allocator(IOBufAllocOptions());
+}
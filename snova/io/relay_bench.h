@@ -0,0 +1,232 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// loopback relay benchmark shared by tests of relay engines, linux only.
+namespace snova {
+namespace relay_bench {
+// connected loopback tcp pair: [0] connect side, [1] accepted side.
+inline bool tcp_pair(int fds[2]) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(listener, 1) != 0 ||
+      getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0) {
+    close(listener);
+    return false;
+  }
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fds[0], reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(listener);
+    return false;
+  }
+  fds[1] = accept(listener, nullptr, nullptr);
+  close(listener);
+  return fds[1] >= 0;
+}
+
+inline void set_nonblocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
+
+// content at stream offset 'pos' is kPattern[pos % kPatternPeriod].
+static constexpr size_t kPatternPeriod = 65521;
+inline const std::vector<uint8_t>& pattern() {
+  static std::vector<uint8_t> data = []() {
+    std::vector<uint8_t> v(2 * kPatternPeriod);
+    for (size_t i = 0; i < v.size(); i++) {
+      v[i] = static_cast<uint8_t>((i % kPatternPeriod) * 131 + (i >> 7));
+    }
+    return v;
+  }();
+  return data;
+}
+
+// source -> [0]in[1] -relay-> [0]out[1] -> sink, the relay runs in the calling thread.
+struct RelayBench {
+  int in[2] = {-1, -1};
+  int out[2] = {-1, -1};
+  uint64_t total = 0;
+  uint64_t received = 0;
+  bool corrupted = false;
+  // pause of the sink before each read, makes the relay's writes block.
+  uint32_t sink_delay_us = 0;
+  std::thread source;
+  std::thread sink;
+
+  bool Start(uint64_t n) {
+    total = n;
+    if (!tcp_pair(in) || !tcp_pair(out)) {
+      return false;
+    }
+    // the relayed sockets are non blocking as asio's sockets.
+    set_nonblocking(in[1]);
+    set_nonblocking(out[0]);
+    source = std::thread([this]() {
+      const uint8_t* data = pattern().data();
+      uint64_t pos = 0;
+      while (pos < total) {
+        size_t n = std::min<uint64_t>(kPatternPeriod, total - pos);
+        ssize_t rc = write(in[0], data + pos % kPatternPeriod, n);
+        if (rc <= 0) {
+          return;
+        }
+        pos += rc;
+      }
+      shutdown(in[0], SHUT_WR);
+    });
+    sink = std::thread([this]() {
+      std::vector<uint8_t> buf(64 * 1024);
+      while (true) {
+        if (sink_delay_us > 0) {
+          usleep(sink_delay_us);
+        }
+        ssize_t rc = read(out[1], buf.data(), buf.size());
+        if (rc <= 0) {
+          break;
+        }
+        // sample the content, checking every byte would make the sink the bottleneck.
+        for (ssize_t i = 0; i < rc; i += 997) {
+          if (buf[i] != pattern()[(received + i) % kPatternPeriod]) {
+            corrupted = true;
+          }
+        }
+        received += rc;
+      }
+    });
+    return true;
+  }
+  void Finish() {
+    shutdown(out[0], SHUT_WR);
+    source.join();
+    sink.join();
+    for (int fd : {in[0], in[1], out[0], out[1]}) {
+      close(fd);
+    }
+  }
+};
+
+inline double cpu_secs(int who) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// readiness based copy loop, what the asio 'transfer' does on epoll.
+inline void epoll_relay(int from, int to, size_t chunk_size) {
+  int ep = epoll_create1(0);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  std::vector<uint8_t> buf(chunk_size);
+  auto wait_fd = [&](int fd, uint32_t events) {
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    struct epoll_event out;
+    epoll_wait(ep, &out, 1, -1);
+    epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+  };
+  while (true) {
+    ssize_t n = read(from, buf.data(), buf.size());
+    if (n < 0 && errno == EAGAIN) {
+      wait_fd(from, EPOLLIN);
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    ssize_t written = 0;
+    while (written < n) {
+      ssize_t rc = write(to, buf.data() + written, n - written);
+      if (rc < 0 && errno == EAGAIN) {
+        wait_fd(to, EPOLLOUT);
+        continue;
+      }
+      if (rc <= 0) {
+        close(ep);
+        return;
+      }
+      written += rc;
+    }
+  }
+  close(ep);
+}
+
+// relay 'bytes' by 'relay(from_fd, to_fd)' for 'rounds' times and print the best throughput &
+// cpu per GB. The relay thread's cpu misses work done by kernel threads, so the cpu of the whole
+// process(source and sink included) is reported too. Return false if data lost or corrupted.
+template <typename Relay>
+inline bool run_benchmark(const char* name, uint64_t bytes, int rounds, Relay&& relay) {
+  double best_gbps = 0;
+  double best_relay_cpu = 1e9;
+  double best_process_cpu = 1e9;
+  for (int i = 0; i < rounds; i++) {
+    RelayBench bench;
+    if (!bench.Start(bytes)) {
+      return false;
+    }
+    double relay_cpu_start = cpu_secs(RUSAGE_THREAD);
+    double process_cpu_start = cpu_secs(RUSAGE_SELF);
+    auto start = std::chrono::steady_clock::now();
+    relay(bench.in[1], bench.out[0]);
+    double relay_cpu = cpu_secs(RUSAGE_THREAD) - relay_cpu_start;
+    bench.Finish();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double process_cpu = cpu_secs(RUSAGE_SELF) - process_cpu_start;
+    if (bench.received != bytes || bench.corrupted) {
+      return false;
+    }
+    double gb = static_cast<double>(bytes) / (1024 * 1024 * 1024);
+    best_gbps = std::max(best_gbps, gb * 8 / secs);
+    best_relay_cpu = std::min(best_relay_cpu, relay_cpu / gb);
+    best_process_cpu = std::min(best_process_cpu, process_cpu / gb);
+  }
+  printf("%-8s %6.2f Gbps, relay cpu %.3f s/GB, process cpu %.3f s/GB\n", name, best_gbps,
+         best_relay_cpu, best_process_cpu);
+  return true;
+}
+}  // namespace relay_bench
+}  // namespace snova
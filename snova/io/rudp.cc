@@ -0,0 +1,601 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/rudp.h"
+#include <string.h>
+#include <algorithm>
+#include <bit>
+#include <utility>
+#include "snova/util/endian.h"
+
+namespace snova {
+static constexpr uint8_t kCmdPush = 1;
+static constexpr uint8_t kCmdAck = 2;
+static constexpr uint8_t kCmdFec = 3;
+static constexpr uint8_t kCmdClose = 4;
+
+static constexpr uint32_t kInitCwnd = 16;
+static constexpr uint32_t kMinSsthresh = 2;
+static constexpr uint32_t kInitRto = 200;
+static constexpr uint32_t kMaxRto = 60000;
+static constexpr uint32_t kDeadLinkXmit = 20;
+static constexpr size_t kAckEntrySize = 8;
+static constexpr size_t kMaxFreeBuffers = 256;
+static constexpr size_t kMaxFecGroups = 128;
+
+// head: conv(4) cmd(1) fec_k(1) wnd(2) ts(4) sn(4) una(4) fec_seq(4) len(2)
+static inline void write_u16(uint8_t* p, uint16_t v) {
+  v = native_to_big(v);
+  memcpy(p, &v, sizeof(v));
+}
+static inline void write_u32(uint8_t* p, uint32_t v) {
+  v = native_to_big(v);
+  memcpy(p, &v, sizeof(v));
+}
+static inline uint16_t read_u16(const uint8_t* p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return big_to_native(v);
+}
+static inline uint32_t read_u32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return big_to_native(v);
+}
+static inline bool seq_before(uint32_t a, uint32_t b) { return static_cast<int32_t>(a - b) < 0; }
+
+uint32_t Rudp::PeekConv(const uint8_t* data, size_t len) {
+  if (len < kRudpHeadSize) {
+    return 0;
+  }
+  return read_u32(data);
+}
+
+bool Rudp::IsOpenPacket(const uint8_t* data, size_t len) {
+  return len >= kRudpHeadSize && data[4] == kCmdPush && read_u32(data + 12) == 0;
+}
+
+Rudp::Rudp(uint32_t conv, const RudpOptions& opts, RudpOutput&& output)
+    : conv_(conv), opts_(opts), output_(std::move(output)) {
+  if (opts_.send_window == 0) {
+    opts_.send_window = 1;
+  }
+  if (opts_.recv_window == 0) {
+    opts_.recv_window = 1;
+  }
+  if (opts_.interval_ms == 0) {
+    opts_.interval_ms = 1;
+  }
+  opts_.fec_group = std::min(opts_.fec_group, kRudpMaxFecGroup);
+  if (opts_.fec_group == 1) {
+    opts_.fec_group = 0;
+  }
+  rmt_wnd_ = opts_.recv_window;
+  cwnd_ = std::min(kInitCwnd, opts_.send_window);
+  ssthresh_ = opts_.send_window;
+  incr_ = cwnd_ * kRudpMss;
+  rto_ = std::max(kInitRto, opts_.min_rto_ms);
+  pacing_tokens_ = kInitCwnd;
+  rcv_buf_.resize(opts_.recv_window);
+  rcv_buf_present_.resize(opts_.recv_window, false);
+  out_buf_.resize(kRudpMaxPacketSize);
+  if (opts_.fec_group > 0) {
+    fec_parity_.resize(kRudpMaxPacketSize, 0);
+  }
+}
+
+std::vector<uint8_t> Rudp::NewBuffer() {
+  if (free_buffers_.empty()) {
+    std::vector<uint8_t> buf;
+    buf.reserve(kRudpMss);
+    return buf;
+  }
+  std::vector<uint8_t> buf = std::move(free_buffers_.back());
+  free_buffers_.pop_back();
+  return buf;
+}
+
+void Rudp::ReleaseBuffer(std::vector<uint8_t>&& buf) {
+  if (free_buffers_.size() >= kMaxFreeBuffers || buf.capacity() < kRudpMss) {
+    return;
+  }
+  buf.clear();
+  free_buffers_.emplace_back(std::move(buf));
+}
+
+uint16_t Rudp::UnusedWindow() const {
+  if (rcv_queue_.size() >= opts_.recv_window) {
+    return 0;
+  }
+  return static_cast<uint16_t>(std::min<size_t>(opts_.recv_window - rcv_queue_.size(), 65535));
+}
+
+size_t Rudp::EncodeHead(uint8_t* buf, uint8_t cmd, uint32_t ts, uint32_t sn, uint16_t len) {
+  write_u32(buf, conv_);
+  buf[4] = cmd;
+  buf[5] = 0;
+  write_u16(buf + 6, UnusedWindow());
+  write_u32(buf + 8, ts);
+  write_u32(buf + 12, sn);
+  write_u32(buf + 16, rcv_nxt_);
+  write_u32(buf + 20, 0);
+  write_u16(buf + 24, len);
+  return kRudpHeadSize;
+}
+
+void Rudp::Output(uint8_t* buf, size_t len, bool data) {
+  stats_.send_packets++;
+  if (!data || opts_.fec_group == 0) {
+    output_(buf, len);
+    return;
+  }
+  uint32_t fec_seq = fec_next_seq_++;
+  buf[5] = static_cast<uint8_t>(opts_.fec_group);
+  write_u32(buf + 20, fec_seq);
+  output_(buf, len);
+
+  uint8_t* parity = fec_parity_.data() + kRudpHeadSize;
+  parity[0] ^= static_cast<uint8_t>(len >> 8);
+  parity[1] ^= static_cast<uint8_t>(len & 0xFF);
+  for (size_t i = 0; i < len; i++) {
+    parity[2 + i] ^= buf[i];
+  }
+  fec_parity_len_ = std::max(fec_parity_len_, len + 2);
+  fec_count_++;
+  if (fec_count_ < opts_.fec_group) {
+    return;
+  }
+  EncodeHead(fec_parity_.data(), kCmdFec, 0, 0, static_cast<uint16_t>(fec_parity_len_));
+  fec_parity_[5] = static_cast<uint8_t>(opts_.fec_group);
+  write_u32(fec_parity_.data() + 20, fec_seq + 1 - opts_.fec_group);
+  output_(fec_parity_.data(), kRudpHeadSize + fec_parity_len_);
+  stats_.send_packets++;
+  stats_.fec_packets++;
+  memset(parity, 0, fec_parity_len_);
+  fec_parity_len_ = 0;
+  fec_count_ = 0;
+}
+
+void Rudp::OutputSegment(Segment& seg, uint32_t now_ms) {
+  seg.ts = now_ms;
+  uint8_t* buf = out_buf_.data();
+  size_t n = EncodeHead(buf, kCmdPush, seg.ts, seg.sn, static_cast<uint16_t>(seg.data.size()));
+  memcpy(buf + n, seg.data.data(), seg.data.size());
+  Output(buf, n + seg.data.size(), true);
+}
+
+void Rudp::FlushAcks() {
+  if (acklist_.empty() && !window_update_) {
+    return;
+  }
+  window_update_ = false;
+  size_t max_entries = kRudpMss / kAckEntrySize;
+  size_t i = 0;
+  do {
+    size_t count = std::min(max_entries, acklist_.size() - i);
+    uint8_t* buf = out_buf_.data();
+    size_t n = EncodeHead(buf, kCmdAck, 0, 0, static_cast<uint16_t>(count * kAckEntrySize));
+    for (size_t j = 0; j < count; j++) {
+      write_u32(buf + n, acklist_[i + j].first);
+      write_u32(buf + n + 4, acklist_[i + j].second);
+      n += kAckEntrySize;
+    }
+    Output(buf, n, false);
+    i += count;
+  } while (i < acklist_.size());
+  acklist_.clear();
+}
+
+void Rudp::SendClose() {
+  uint8_t* buf = out_buf_.data();
+  size_t n = EncodeHead(buf, kCmdClose, 0, 0, 0);
+  Output(buf, n, false);
+}
+
+void Rudp::UpdateRtt(int32_t rtt) {
+  if (srtt_ == 0) {
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+  } else {
+    int32_t delta = rtt - static_cast<int32_t>(srtt_);
+    if (delta < 0) {
+      delta = -delta;
+    }
+    rttvar_ = (3 * rttvar_ + delta) / 4;
+    srtt_ = (7 * srtt_ + rtt) / 8;
+  }
+  if (srtt_ < 1) {
+    srtt_ = 1;
+  }
+  last_rtt_ = rtt;
+  if (min_rtt_ == 0 || static_cast<uint32_t>(rtt) < min_rtt_) {
+    min_rtt_ = std::max(rtt, 1);
+  }
+  // peer delays acks up to one interval, sender may pace the resend up to another one.
+  uint32_t rto = srtt_ + std::max(2 * opts_.interval_ms, 4 * rttvar_);
+  rto_ = std::clamp(rto, opts_.min_rto_ms, kMaxRto);
+}
+
+bool Rudp::IsQueueing() const {
+  // acks are delayed up to one interval, leave room for that.
+  return min_rtt_ > 0 && last_rtt_ > min_rtt_ + std::max(min_rtt_ / 4, 2 * opts_.interval_ms);
+}
+
+void Rudp::IncreaseCwnd(uint32_t acked) {
+  if (!opts_.tcp_like_recovery && IsQueueing()) {
+    return;
+  }
+  for (uint32_t i = 0; i < acked && cwnd_ < std::min(rmt_wnd_, opts_.send_window); i++) {
+    if (cwnd_ < ssthresh_) {
+      cwnd_++;
+      incr_ += kRudpMss;
+    } else {
+      if (incr_ < kRudpMss) {
+        incr_ = kRudpMss;
+      }
+      incr_ += (kRudpMss * kRudpMss) / incr_ + (kRudpMss / 16);
+      if ((cwnd_ + 1) * kRudpMss <= incr_) {
+        cwnd_++;
+      }
+    }
+  }
+}
+
+void Rudp::ShrinkSendBuffer() {
+  while (!snd_buf_.empty() && snd_buf_.front().acked) {
+    ReleaseBuffer(std::move(snd_buf_.front().data));
+    snd_buf_.pop_front();
+  }
+  snd_una_ = snd_buf_.empty() ? snd_nxt_ : snd_buf_.front().sn;
+}
+
+void Rudp::MoveToRecvQueue() {
+  while (rcv_queue_.size() < opts_.recv_window) {
+    size_t idx = rcv_nxt_ % opts_.recv_window;
+    if (!rcv_buf_present_[idx]) {
+      break;
+    }
+    rcv_buf_present_[idx] = false;
+    rcv_queue_bytes_ += rcv_buf_[idx].data.size();
+    rcv_queue_.emplace_back(std::move(rcv_buf_[idx].data));
+    rcv_nxt_++;
+  }
+}
+
+void Rudp::Send(const uint8_t* data, size_t len) {
+  while (len > 0) {
+    if (snd_queue_.empty() || snd_queue_.back().data.size() >= kRudpMss) {
+      Segment seg;
+      seg.data = NewBuffer();
+      snd_queue_.emplace_back(std::move(seg));
+    }
+    std::vector<uint8_t>& buf = snd_queue_.back().data;
+    size_t n = std::min(len, kRudpMss - buf.size());
+    buf.insert(buf.end(), data, data + n);
+    data += n;
+    len -= n;
+  }
+}
+
+size_t Rudp::Recv(uint8_t* buf, size_t len) {
+  bool was_full = rcv_queue_.size() >= opts_.recv_window;
+  size_t n = 0;
+  while (n < len && !rcv_queue_.empty()) {
+    std::vector<uint8_t>& front = rcv_queue_.front();
+    size_t copy_n = std::min(len - n, front.size() - rcv_queue_offset_);
+    memcpy(buf + n, front.data() + rcv_queue_offset_, copy_n);
+    n += copy_n;
+    rcv_queue_offset_ += copy_n;
+    if (rcv_queue_offset_ == front.size()) {
+      ReleaseBuffer(std::move(front));
+      rcv_queue_.pop_front();
+      rcv_queue_offset_ = 0;
+    }
+  }
+  rcv_queue_bytes_ -= n;
+  MoveToRecvQueue();
+  if (was_full && rcv_queue_.size() < opts_.recv_window) {
+    window_update_ = true;
+  }
+  return n;
+}
+
+void Rudp::FecInput(uint32_t fec_seq, uint8_t k, bool parity, const uint8_t* data, size_t len,
+                    uint32_t now_ms) {
+  if (k < 2 || k > kRudpMaxFecGroup) {
+    return;
+  }
+  uint32_t first_seq = parity ? fec_seq : (fec_seq - fec_seq % k);
+  while (!fec_groups_.empty()) {
+    auto it = fec_groups_.begin();
+    if (fec_groups_.size() > kMaxFecGroups ||
+        static_cast<int32_t>(first_seq - it->first) > static_cast<int32_t>(k * kMaxFecGroups)) {
+      fec_groups_.erase(it);
+    } else {
+      break;
+    }
+  }
+  FecGroup& group = fec_groups_[first_seq];
+  if (group.done) {
+    return;
+  }
+  if (parity) {
+    if (!group.parity.empty()) {
+      return;
+    }
+    group.parity.assign(data + kRudpHeadSize, data + len);
+  } else {
+    uint32_t idx = fec_seq - first_seq;
+    uint32_t bit = 1u << idx;
+    if (group.received & bit) {
+      return;
+    }
+    group.received |= bit;
+    group.packets.resize(k);
+    group.packets[idx].assign(data, data + len);
+  }
+  int received = std::popcount(group.received);
+  if (received == k) {
+    group.done = true;
+    group.packets.clear();
+    group.parity.clear();
+    return;
+  }
+  if (received + 1 < k || group.parity.empty()) {
+    return;
+  }
+  std::vector<uint8_t> recovered = std::move(group.parity);
+  for (uint32_t i = 0; i < k; i++) {
+    if (!(group.received & (1u << i))) {
+      continue;
+    }
+    const std::vector<uint8_t>& packet = group.packets[i];
+    if (packet.size() + 2 > recovered.size()) {
+      group.done = true;
+      return;
+    }
+    recovered[0] ^= static_cast<uint8_t>(packet.size() >> 8);
+    recovered[1] ^= static_cast<uint8_t>(packet.size() & 0xFF);
+    for (size_t j = 0; j < packet.size(); j++) {
+      recovered[2 + j] ^= packet[j];
+    }
+  }
+  group.done = true;
+  group.packets.clear();
+  size_t packet_len = (static_cast<size_t>(recovered[0]) << 8) | recovered[1];
+  if (packet_len < kRudpHeadSize || packet_len + 2 > recovered.size()) {
+    return;
+  }
+  stats_.fec_recovered++;
+  Input(recovered.data() + 2, packet_len, now_ms);
+}
+
+int Rudp::Input(const uint8_t* data, size_t len, uint32_t now_ms) {
+  if (len < kRudpHeadSize || read_u32(data) != conv_) {
+    return -1;
+  }
+  uint8_t cmd = data[4];
+  uint8_t fec_k = data[5];
+  uint16_t wnd = read_u16(data + 6);
+  uint32_t ts = read_u32(data + 8);
+  uint32_t sn = read_u32(data + 12);
+  uint32_t una = read_u32(data + 16);
+  uint32_t fec_seq = read_u32(data + 20);
+  size_t payload_len = read_u16(data + 24);
+  if (kRudpHeadSize + payload_len > len) {
+    return -1;
+  }
+  len = kRudpHeadSize + payload_len;
+  const uint8_t* payload = data + kRudpHeadSize;
+  stats_.recv_packets++;
+  if (cmd == kCmdFec) {
+    FecInput(fec_seq, fec_k, true, data, len, now_ms);
+    return 0;
+  }
+  if (cmd == kCmdPush && fec_k > 0) {
+    FecInput(fec_seq, fec_k, false, data, len, now_ms);
+  }
+
+  rmt_wnd_ = wnd;
+  uint32_t acked = 0;
+  while (!snd_buf_.empty() && seq_before(snd_buf_.front().sn, una)) {
+    if (!snd_buf_.front().acked) {
+      acked++;
+    }
+    ReleaseBuffer(std::move(snd_buf_.front().data));
+    snd_buf_.pop_front();
+  }
+  switch (cmd) {
+    case kCmdAck: {
+      uint32_t max_ack = 0;
+      uint32_t sacked = 0;
+      bool has_ack = false;
+      for (size_t i = 0; i + kAckEntrySize <= payload_len; i += kAckEntrySize) {
+        uint32_t ack_sn = read_u32(payload + i);
+        uint32_t ack_ts = read_u32(payload + i + 4);
+        int32_t rtt = static_cast<int32_t>(now_ms - ack_ts);
+        if (rtt >= 0) {
+          UpdateRtt(rtt);
+        }
+        if (!has_ack || seq_before(max_ack, ack_sn)) {
+          max_ack = ack_sn;
+          has_ack = true;
+        }
+        if (snd_buf_.empty() || seq_before(ack_sn, snd_buf_.front().sn)) {
+          continue;
+        }
+        size_t idx = ack_sn - snd_buf_.front().sn;
+        if (idx >= snd_buf_.size()) {
+          continue;
+        }
+        Segment& seg = snd_buf_[idx];
+        if (!seg.acked) {
+          seg.acked = true;
+          acked++;
+          sacked++;
+          ReleaseBuffer(std::move(seg.data));
+        }
+      }
+      if (sacked > 0) {
+        // selective ack: packets sent before the highest acked one are likely lost, count how
+        // many later packets got acked meanwhile like tcp duplicate acks.
+        for (Segment& seg : snd_buf_) {
+          if (!seq_before(seg.sn, max_ack)) {
+            break;
+          }
+          if (!seg.acked && seg.xmit > 0) {
+            seg.fastack += sacked;
+          }
+        }
+      }
+      break;
+    }
+    case kCmdPush: {
+      int32_t diff = static_cast<int32_t>(sn - rcv_nxt_);
+      if (diff >= static_cast<int32_t>(opts_.recv_window)) {
+        break;
+      }
+      acklist_.emplace_back(sn, ts);
+      if (diff >= 0) {
+        size_t idx = sn % opts_.recv_window;
+        if (!rcv_buf_present_[idx]) {
+          rcv_buf_present_[idx] = true;
+          Segment& seg = rcv_buf_[idx];
+          seg.sn = sn;
+          seg.data = NewBuffer();
+          seg.data.assign(payload, payload + payload_len);
+        }
+      }
+      MoveToRecvQueue();
+      break;
+    }
+    case kCmdClose: {
+      peer_closed_ = true;
+      break;
+    }
+    default: {
+      return -1;
+    }
+  }
+  ShrinkSendBuffer();
+  IncreaseCwnd(acked);
+  return 0;
+}
+
+void Rudp::Update(uint32_t now_ms) {
+  if (!updated_) {
+    updated_ = true;
+    next_flush_ts_ = now_ms;
+  }
+  if (seq_before(now_ms, next_flush_ts_)) {
+    return;
+  }
+  next_flush_ts_ += opts_.interval_ms;
+  if (!seq_before(now_ms, next_flush_ts_)) {
+    next_flush_ts_ = now_ms + opts_.interval_ms;
+  }
+  Flush(now_ms);
+}
+
+void Rudp::Flush(uint32_t now_ms) {
+  FlushAcks();
+
+  uint32_t wnd = std::min({opts_.send_window, rmt_wnd_, cwnd_});
+  if (wnd == 0) {
+    // zero window probe
+    wnd = 1;
+  }
+  while (!snd_queue_.empty() && seq_before(snd_nxt_, snd_una_ + wnd)) {
+    snd_queue_.front().sn = snd_nxt_++;
+    snd_buf_.emplace_back(std::move(snd_queue_.front()));
+    snd_queue_.pop_front();
+  }
+
+  bool paced = opts_.pacing && srtt_ > 0;
+  if (paced) {
+    double rate = static_cast<double>(cwnd_) * 1.25 / srtt_;
+    double burst = std::max(static_cast<double>(kInitCwnd), rate * opts_.interval_ms * 2);
+    pacing_tokens_ = std::min(burst, pacing_tokens_ + rate * (now_ms - pacing_ts_));
+  }
+  pacing_ts_ = now_ms;
+
+  bool lost = false;
+  bool fast_resend = false;
+  for (Segment& seg : snd_buf_) {
+    if (seg.acked) {
+      continue;
+    }
+    bool timeout = false;
+    bool fast = false;
+    if (seg.xmit == 0) {
+      seg.rto = rto_;
+    } else if (!seq_before(now_ms, seg.resend_ts)) {
+      timeout = true;
+    } else if (opts_.fast_resend > 0 && seg.fastack >= opts_.fast_resend) {
+      fast = true;
+    } else {
+      continue;
+    }
+    if (paced) {
+      if (pacing_tokens_ < 1) {
+        break;
+      }
+      pacing_tokens_ -= 1;
+    }
+    if (timeout) {
+      lost = true;
+      stats_.resend_packets++;
+      seg.rto = std::min(kMaxRto, opts_.tcp_like_recovery ? seg.rto * 2 : seg.rto + rto_ / 2);
+    } else if (fast) {
+      fast_resend = true;
+      stats_.fast_resend_packets++;
+    }
+    seg.fastack = 0;
+    seg.xmit++;
+    seg.resend_ts = now_ms + seg.rto;
+    OutputSegment(seg, now_ms);
+    if (seg.xmit >= kDeadLinkXmit) {
+      dead_ = true;
+    }
+  }
+
+  // cut cwnd at most once per rtt.
+  bool congested = opts_.tcp_like_recovery ? (lost || fast_resend) : (lost || IsQueueing());
+  if (congested && !seq_before(now_ms, cwnd_cut_ts_ + srtt_)) {
+    cwnd_cut_ts_ = now_ms;
+    if (opts_.tcp_like_recovery) {
+      ssthresh_ = std::max(cwnd_ / 2, kMinSsthresh);
+      cwnd_ = lost ? 1 : ssthresh_;
+    } else {
+      ssthresh_ = std::max(cwnd_ * 7 / 8, kMinSsthresh);
+      cwnd_ = ssthresh_;
+    }
+    incr_ = cwnd_ * kRudpMss;
+  }
+}
+}  // namespace snova
@@ -0,0 +1,180 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace snova {
+static constexpr uint32_t kRudpHeadSize = 26;
+static constexpr uint32_t kRudpMss = 1200;
+// size of a full data packet.
+static constexpr uint32_t kRudpDataPacketSize = kRudpHeadSize + kRudpMss;
+// the fec parity packet is the largest, it carries a xor of 'len + data packet'.
+static constexpr uint32_t kRudpMaxPacketSize = kRudpHeadSize + 2 + kRudpDataPacketSize;
+static constexpr uint32_t kRudpMaxFecGroup = 32;
+
+using RudpOutput = std::function<void(const uint8_t*, size_t)>;
+
+struct RudpOptions {
+  // in packets
+  uint32_t send_window = 1024;
+  uint32_t recv_window = 1024;
+  uint32_t interval_ms = 10;
+  uint32_t min_rto_ms = 30;
+  // retransmit a packet once 'fast_resend' later packets were acked, 0 to disable.
+  uint32_t fast_resend = 2;
+  // send one xor parity packet for every 'fec_group' data packets, 0 to disable.
+  uint32_t fec_group = 0;
+  // spread sends over the rtt at 'cwnd/srtt' instead of bursting the whole window.
+  bool pacing = true;
+  // treat every loss as congestion like tcp does: halve cwnd on fast resend, double rto and
+  // restart slow start on timeout. Only used as a baseline, by default cwnd is cut on timeout
+  // or when the rtt grows above the min rtt, random loss on long links is not congestion.
+  bool tcp_like_recovery = false;
+};
+
+struct RudpStats {
+  uint64_t send_packets = 0;
+  uint64_t resend_packets = 0;
+  uint64_t fast_resend_packets = 0;
+  uint64_t recv_packets = 0;
+  uint64_t fec_packets = 0;
+  uint64_t fec_recovered = 0;
+};
+
+/**
+ * Reliable stream over unreliable datagrams, KCP alike: every data packet is acked selectively, a
+ * packet is retransmitted on rto or once later packets were acked, sends are window & congestion
+ * controlled and paced, optional xor fec recovers one lost packet per group without waiting rto.
+ * It does no io itself, datagrams are emitted by 'output' and fed back by 'Input'.
+ */
+class Rudp {
+ public:
+  Rudp(uint32_t conv, const RudpOptions& opts, RudpOutput&& output);
+  static uint32_t PeekConv(const uint8_t* data, size_t len);
+  // first data packet of a session, server side creates session only for it.
+  static bool IsOpenPacket(const uint8_t* data, size_t len);
+
+  uint32_t GetConv() const { return conv_; }
+  uint32_t GetInterval() const { return opts_.interval_ms; }
+  void Send(const uint8_t* data, size_t len);
+  int Input(const uint8_t* data, size_t len, uint32_t now_ms);
+  size_t Recv(uint8_t* buf, size_t len);
+  size_t Readable() const { return rcv_queue_bytes_; }
+  // packets not acked yet.
+  size_t WaitSend() const { return snd_queue_.size() + snd_buf_.size(); }
+  void Update(uint32_t now_ms);
+  void Flush(uint32_t now_ms);
+  void SendClose();
+  bool IsDead() const { return dead_; }
+  bool IsPeerClosed() const { return peer_closed_; }
+  uint32_t GetSrtt() const { return srtt_; }
+  uint32_t GetCwnd() const { return cwnd_; }
+  const RudpStats& GetStats() const { return stats_; }
+
+ private:
+  struct Segment {
+    uint32_t sn = 0;
+    uint32_t ts = 0;
+    uint32_t resend_ts = 0;
+    uint32_t rto = 0;
+    uint32_t fastack = 0;
+    uint32_t xmit = 0;
+    bool acked = false;
+    std::vector<uint8_t> data;
+  };
+  struct FecGroup {
+    uint32_t received = 0;
+    bool done = false;
+    std::vector<std::vector<uint8_t>> packets;
+    std::vector<uint8_t> parity;
+  };
+  std::vector<uint8_t> NewBuffer();
+  void ReleaseBuffer(std::vector<uint8_t>&& buf);
+  uint16_t UnusedWindow() const;
+  size_t EncodeHead(uint8_t* buf, uint8_t cmd, uint32_t ts, uint32_t sn, uint16_t len);
+  void Output(uint8_t* buf, size_t len, bool data);
+  void OutputSegment(Segment& seg, uint32_t now_ms);
+  void FlushAcks();
+  void UpdateRtt(int32_t rtt);
+  bool IsQueueing() const;
+  void IncreaseCwnd(uint32_t acked);
+  void ShrinkSendBuffer();
+  void MoveToRecvQueue();
+  void FecInput(uint32_t fec_seq, uint8_t k, bool parity, const uint8_t* data, size_t len,
+                uint32_t now_ms);
+
+  uint32_t conv_;
+  RudpOptions opts_;
+  RudpOutput output_;
+  RudpStats stats_;
+
+  uint32_t snd_una_ = 0;
+  uint32_t snd_nxt_ = 0;
+  uint32_t rcv_nxt_ = 0;
+  uint32_t rmt_wnd_;
+  uint32_t cwnd_;
+  uint32_t ssthresh_;
+  uint32_t incr_;
+  uint32_t srtt_ = 0;
+  uint32_t rttvar_ = 0;
+  uint32_t min_rtt_ = 0;
+  uint32_t last_rtt_ = 0;
+  uint32_t rto_;
+  uint32_t next_flush_ts_ = 0;
+  uint32_t cwnd_cut_ts_ = 0;
+  uint32_t pacing_ts_ = 0;
+  double pacing_tokens_;
+  bool updated_ = false;
+  bool dead_ = false;
+  bool peer_closed_ = false;
+  bool window_update_ = false;
+
+  std::deque<Segment> snd_queue_;
+  std::deque<Segment> snd_buf_;
+  std::vector<Segment> rcv_buf_;
+  std::vector<bool> rcv_buf_present_;
+  std::deque<std::vector<uint8_t>> rcv_queue_;
+  size_t rcv_queue_offset_ = 0;
+  size_t rcv_queue_bytes_ = 0;
+  std::vector<std::pair<uint32_t, uint32_t>> acklist_;
+  std::vector<std::vector<uint8_t>> free_buffers_;
+  std::vector<uint8_t> out_buf_;
+
+  uint32_t fec_next_seq_ = 0;
+  uint32_t fec_count_ = 0;
+  size_t fec_parity_len_ = 0;
+  std::vector<uint8_t> fec_parity_;
+  std::map<uint32_t, FecGroup> fec_groups_;
+};
+}  // namespace snova
@@ -0,0 +1,516 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/rudp_socket.h"
+#if defined(__linux__)
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#endif
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include "asio/experimental/as_tuple.hpp"
+#include "snova/log/log_macros.h"
+#include "snova/util/flags.h"
+#include "snova/util/stat.h"
+
+namespace snova {
+static constexpr size_t kRecvBufferSize = 2048;
+// kernel limits one gso send to 64 segments & 64KB.
+static constexpr size_t kMaxGsoSegments = 64;
+static constexpr size_t kMaxGsoBytes = 65000;
+// an open packet costs the sender 26 bytes without any handshake, sessions not authenticated by
+// their owner yet are capped per server and closed if still unauthenticated after the timeout.
+static constexpr size_t kMaxPendingRudpSessions = 128;
+static constexpr uint32_t kRudpAuthTimeoutMs = 10000;
+
+static thread_local uint32_t g_rudp_session_num = 0;
+static thread_local uint64_t g_rudp_resend_packets = 0;
+static thread_local uint64_t g_rudp_fec_recovered = 0;
+static thread_local uint64_t g_rudp_gso_sends = 0;
+static thread_local uint64_t g_rudp_rejected_opens = 0;
+static thread_local bool g_rudp_gso_disabled = false;
+
+static uint32_t now_ms() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+static uint32_t random_conv() {
+  static thread_local std::mt19937 rng(std::random_device{}());
+  uint32_t conv = 0;
+  while (conv == 0) {
+    conv = rng();
+  }
+  return conv;
+}
+
+RudpOptions default_rudp_options() {
+  RudpOptions opts;
+  opts.fec_group = g_mux_udp_fec_group;
+  return opts;
+}
+
+void register_rudp_stat() {
+  register_stat_func([]() -> StatValues {
+    StatValues vals;
+    auto& kv = vals["RUDP"];
+    kv["session_num"] = std::to_string(g_rudp_session_num);
+    kv["resend_packets"] = std::to_string(g_rudp_resend_packets);
+    kv["fec_recovered"] = std::to_string(g_rudp_fec_recovered);
+    kv["gso_sends"] = std::to_string(g_rudp_gso_sends);
+    kv["rejected_opens"] = std::to_string(g_rudp_rejected_opens);
+    return vals;
+  });
+}
+
+struct RudpSession : public std::enable_shared_from_this<RudpSession> {
+  UDPSocketPtr socket;
+  ::asio::ip::udp::endpoint remote;
+  // client side owns a connected socket, server side shares the listening one.
+  bool own_socket = false;
+  bool closed = false;
+  std::unique_ptr<Rudp> rudp;
+  size_t max_wait_send = 0;
+  uint32_t last_recv_ms = 0;
+  ::asio::steady_timer read_timer;
+  ::asio::steady_timer write_timer;
+  ::asio::steady_timer update_timer;
+  std::vector<uint8_t> gso_batch;
+  size_t gso_segments = 0;
+  bool gso_batch_closed = false;
+  std::function<void()> close_callback;
+  // server side session until its owner authenticated the peer or it closed.
+  bool auth_pending = false;
+  uint32_t create_ms = 0;
+  std::function<void()> auth_done_callback;
+
+  RudpSession(UDPSocketPtr s, const ::asio::ip::udp::endpoint& endpoint, uint32_t conv, bool own)
+      : socket(std::move(s)),
+        remote(endpoint),
+        own_socket(own),
+        read_timer(socket->get_executor()),
+        write_timer(socket->get_executor()),
+        update_timer(socket->get_executor()) {
+    RudpOptions opts = default_rudp_options();
+    max_wait_send = 2 * opts.send_window;
+    rudp = std::make_unique<Rudp>(conv, opts,
+                                  [this](const uint8_t* data, size_t len) { Output(data, len); });
+    read_timer.expires_at(::asio::steady_timer::time_point::max());
+    write_timer.expires_at(::asio::steady_timer::time_point::max());
+    last_recv_ms = now_ms();
+    create_ms = last_recv_ms;
+    g_rudp_session_num++;
+  }
+  ~RudpSession() {
+    const RudpStats& stats = rudp->GetStats();
+    g_rudp_resend_packets += (stats.resend_packets + stats.fast_resend_packets);
+    g_rudp_fec_recovered += stats.fec_recovered;
+    g_rudp_session_num--;
+  }
+
+  void Start() {
+    auto self = shared_from_this();
+    ::asio::co_spawn(
+        socket->get_executor(), [self]() -> asio::awaitable<void> { co_await self->UpdateLoop(); },
+        ::asio::detached);
+    if (own_socket) {
+      ::asio::co_spawn(
+          socket->get_executor(),
+          [self]() -> asio::awaitable<void> { co_await self->RecvLoop(); }, ::asio::detached);
+    }
+  }
+
+  asio::awaitable<void> UpdateLoop() {
+    uint32_t max_idle_ms = g_connection_max_inactive_secs * 1000;
+    while (!closed) {
+      update_timer.expires_after(std::chrono::milliseconds(rudp->GetInterval()));
+      co_await update_timer.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+      if (closed) {
+        break;
+      }
+      uint32_t now = now_ms();
+      rudp->Update(now);
+      FlushOutput();
+      if (rudp->IsDead() || (now - last_recv_ms) > max_idle_ms) {
+        SNOVA_ERROR("[{}]Close rudp session since link is dead or idle for {}ms.",
+                    rudp->GetConv(), now - last_recv_ms);
+        Close(false);
+        break;
+      }
+      if (auth_pending && (now - create_ms) > kRudpAuthTimeoutMs) {
+        SNOVA_ERROR("[{}]Close rudp session since it's not authenticated in {}ms.",
+                    rudp->GetConv(), kRudpAuthTimeoutMs);
+        Close(false);
+        break;
+      }
+      WakeWriters();
+    }
+  }
+
+  asio::awaitable<void> RecvLoop() {
+    std::vector<uint8_t> buf(kRecvBufferSize);
+    while (!closed) {
+      auto [ec, n] = co_await socket->async_receive(
+          ::asio::buffer(buf), ::asio::experimental::as_tuple(::asio::use_awaitable));
+      if (closed) {
+        break;
+      }
+      if (ec) {
+        // connected udp socket reports icmp errors, peer may be restarting.
+        if (ec == ::asio::error::connection_refused) {
+          continue;
+        }
+        SNOVA_ERROR("[{}]Failed to recv rudp packet with error:{}", rudp->GetConv(), ec);
+        Close(false);
+        break;
+      }
+      Input(buf.data(), n);
+    }
+  }
+
+  void Input(const uint8_t* data, size_t len) {
+    uint32_t now = now_ms();
+    if (0 != rudp->Input(data, len, now)) {
+      return;
+    }
+    last_recv_ms = now;
+    if (rudp->Readable() > 0) {
+      read_timer.cancel();
+    }
+    WakeWriters();
+    if (rudp->IsPeerClosed()) {
+      Close(false);
+    }
+  }
+
+  void EndAuthPending() {
+    if (!auth_pending) {
+      return;
+    }
+    auth_pending = false;
+    if (auth_done_callback) {
+      auto callback = std::move(auth_done_callback);
+      callback();
+    }
+  }
+
+  void WakeWriters() {
+    if (rudp->WaitSend() < max_wait_send) {
+      write_timer.cancel();
+    }
+  }
+
+  asio::awaitable<IOResult> Write(const uint8_t* data, size_t len) {
+    while (!closed && rudp->WaitSend() >= max_wait_send) {
+      co_await write_timer.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    }
+    if (closed) {
+      co_return IOResult{0, std::make_error_code(std::errc::not_connected)};
+    }
+    bool was_idle = rudp->WaitSend() == 0;
+    rudp->Send(data, len);
+    if (was_idle) {
+      // send new data on idle session right away, busy session is flushed by update loop.
+      rudp->Flush(now_ms());
+      FlushOutput();
+    }
+    co_return IOResult{len, std::error_code{}};
+  }
+
+  asio::awaitable<IOResult> Read(uint8_t* data, size_t len) {
+    while (!closed && rudp->Readable() == 0) {
+      co_await read_timer.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    }
+    if (rudp->Readable() == 0) {
+      co_return IOResult{0, ::asio::error::eof};
+    }
+    size_t n = rudp->Recv(data, len);
+    co_return IOResult{n, std::error_code{}};
+  }
+
+  void Close(bool notify_peer) {
+    if (closed) {
+      return;
+    }
+    closed = true;
+    if (notify_peer) {
+      rudp->SendClose();
+      FlushOutput();
+    }
+    read_timer.cancel();
+    write_timer.cancel();
+    update_timer.cancel();
+    EndAuthPending();
+    if (own_socket) {
+      std::error_code ec;
+      socket->close(ec);
+    }
+    if (close_callback) {
+      auto callback = std::move(close_callback);
+      callback();
+    }
+  }
+
+  void SendDatagram(const uint8_t* data, size_t len) {
+    // socket is non blocking, a dropped datagram is retransmitted by rudp.
+    std::error_code ec;
+    if (own_socket) {
+      socket->send(::asio::buffer(data, len), 0, ec);
+    } else {
+      socket->send_to(::asio::buffer(data, len), remote, 0, ec);
+    }
+  }
+
+  void Output(const uint8_t* data, size_t len) {
+#ifdef UDP_SEGMENT
+    // batch full sized data packets into one gso send, a shorter packet may only end a batch.
+    if (!g_rudp_gso_disabled && len <= kRudpDataPacketSize) {
+      if (gso_segments > 0 && (gso_batch_closed || gso_segments >= kMaxGsoSegments ||
+                               gso_batch.size() + len > kMaxGsoBytes)) {
+        FlushOutput();
+      }
+      gso_batch.insert(gso_batch.end(), data, data + len);
+      gso_segments++;
+      if (len != kRudpDataPacketSize) {
+        gso_batch_closed = true;
+      }
+      return;
+    }
+#endif
+    FlushOutput();
+    SendDatagram(data, len);
+  }
+
+  void FlushOutput() {
+    if (gso_segments == 0) {
+      return;
+    }
+    if (gso_segments == 1) {
+      SendDatagram(gso_batch.data(), gso_batch.size());
+    } else {
+      SendGsoBatch();
+    }
+    gso_batch.clear();
+    gso_segments = 0;
+    gso_batch_closed = false;
+  }
+
+  void SendGsoBatch() {
+#ifdef UDP_SEGMENT
+    struct iovec iov;
+    iov.iov_base = gso_batch.data();
+    iov.iov_len = gso_batch.size();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    if (!own_socket) {
+      msg.msg_name = remote.data();
+      msg.msg_namelen = static_cast<socklen_t>(remote.size());
+    }
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = kRudpDataPacketSize;
+    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    if (::sendmsg(socket->native_handle(), &msg, 0) >= 0) {
+      g_rudp_gso_sends++;
+      return;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      return;
+    }
+    SNOVA_ERROR("Disable udp gso since sendmsg failed with error:{}", strerror(errno));
+    g_rudp_gso_disabled = true;
+#endif
+    for (size_t offset = 0; offset < gso_batch.size(); offset += kRudpDataPacketSize) {
+      size_t len = std::min<size_t>(kRudpDataPacketSize, gso_batch.size() - offset);
+      SendDatagram(gso_batch.data() + offset, len);
+    }
+  }
+};
+
+std::pair<IOConnectionPtr, std::error_code> RudpSocket::Connect(
+    const asio::any_io_executor& ex, const ::asio::ip::udp::endpoint& remote) {
+  auto socket = std::make_shared<::asio::ip::udp::socket>(ex);
+  std::error_code ec;
+  socket->open(remote.protocol(), ec);
+  if (!ec) {
+    socket->connect(remote, ec);
+  }
+  if (!ec) {
+    socket->non_blocking(true, ec);
+  }
+  if (ec) {
+    return {nullptr, ec};
+  }
+  auto session = std::make_shared<RudpSession>(std::move(socket), remote, random_conv(), true);
+  session->Start();
+  return {std::make_unique<RudpSocket>(std::move(session)), std::error_code{}};
+}
+
+RudpSocket::RudpSocket(RudpSessionPtr session) : session_(std::move(session)) {}
+RudpSocket::~RudpSocket() { Close(); }
+
+asio::any_io_executor RudpSocket::GetExecutor() { return session_->socket->get_executor(); }
+
+asio::awaitable<IOResult> RudpSocket::AsyncWrite(const asio::const_buffer& buffers) {
+  co_return co_await session_->Write(reinterpret_cast<const uint8_t*>(buffers.data()),
+                                     buffers.size());
+}
+
+asio::awaitable<IOResult> RudpSocket::AsyncWrite(
+    const std::vector<::asio::const_buffer>& buffers) {
+  size_t total = 0;
+  for (const auto& buffer : buffers) {
+    auto [n, ec] = co_await session_->Write(reinterpret_cast<const uint8_t*>(buffer.data()),
+                                            buffer.size());
+    if (ec) {
+      co_return IOResult{total, ec};
+    }
+    total += n;
+  }
+  co_return IOResult{total, std::error_code{}};
+}
+
+asio::awaitable<IOResult> RudpSocket::AsyncRead(const asio::mutable_buffer& buffers) {
+  co_return co_await session_->Read(reinterpret_cast<uint8_t*>(buffers.data()), buffers.size());
+}
+
+void RudpSocket::Close() { session_->Close(true); }
+
+void RudpSocket::SetAuthenticated() { session_->EndAuthPending(); }
+
+RudpServer::RudpServer(::asio::ip::udp::socket&& socket)
+    : socket_(std::make_shared<::asio::ip::udp::socket>(std::move(socket))),
+      accept_timer_(socket_->get_executor()) {
+  accept_timer_.expires_at(::asio::steady_timer::time_point::max());
+  std::error_code ec;
+  socket_->non_blocking(true, ec);
+}
+
+void RudpServer::Start() {
+  auto self = shared_from_this();
+  ::asio::co_spawn(
+      socket_->get_executor(), [self]() -> asio::awaitable<void> { co_await self->RecvLoop(); },
+      ::asio::detached);
+}
+
+asio::awaitable<void> RudpServer::RecvLoop() {
+  std::vector<uint8_t> buf(kRecvBufferSize);
+  ::asio::ip::udp::endpoint remote;
+  while (!closed_) {
+    auto [ec, n] = co_await socket_->async_receive_from(
+        ::asio::buffer(buf), remote, ::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (closed_ || ec == ::asio::error::operation_aborted) {
+      break;
+    }
+    if (ec) {
+      SNOVA_ERROR("Failed to recv rudp packet with error:{}", ec);
+      continue;
+    }
+    uint32_t conv = Rudp::PeekConv(buf.data(), n);
+    if (0 == conv) {
+      continue;
+    }
+    RudpSessionPtr session;
+    auto found = sessions_.find(conv);
+    if (found != sessions_.end()) {
+      session = found->second.lock();
+      if (!session) {
+        sessions_.erase(found);
+      }
+    }
+    if (session) {
+      if (session->remote == remote) {
+        session->Input(buf.data(), n);
+      }
+      continue;
+    }
+    if (!Rudp::IsOpenPacket(buf.data(), n)) {
+      continue;
+    }
+    if (pending_sessions_ >= kMaxPendingRudpSessions) {
+      g_rudp_rejected_opens++;
+      continue;
+    }
+    session = std::make_shared<RudpSession>(socket_, remote, conv, false);
+    std::weak_ptr<RudpServer> server = weak_from_this();
+    session->close_callback = [server, conv]() {
+      auto s = server.lock();
+      if (s) {
+        s->sessions_.erase(conv);
+      }
+    };
+    pending_sessions_++;
+    session->auth_pending = true;
+    session->auth_done_callback = [server]() {
+      auto s = server.lock();
+      if (s) {
+        s->pending_sessions_--;
+      }
+    };
+    sessions_[conv] = session;
+    session->Start();
+    session->Input(buf.data(), n);
+    accept_queue_.emplace_back(std::move(session));
+    accept_timer_.cancel();
+  }
+}
+
+asio::awaitable<std::pair<IOConnectionPtr, std::error_code>> RudpServer::AsyncAccept() {
+  while (!closed_ && accept_queue_.empty()) {
+    co_await accept_timer_.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+  }
+  if (accept_queue_.empty()) {
+    co_return std::make_pair(IOConnectionPtr{},
+                             ::asio::error::make_error_code(::asio::error::operation_aborted));
+  }
+  RudpSessionPtr session = std::move(accept_queue_.front());
+  accept_queue_.pop_front();
+  IOConnectionPtr conn = std::make_unique<RudpSocket>(std::move(session));
+  co_return std::make_pair(std::move(conn), std::error_code{});
+}
+
+void RudpServer::Close() {
+  closed_ = true;
+  std::error_code ec;
+  socket_->close(ec);
+  accept_timer_.cancel();
+}
+
+}  // namespace snova
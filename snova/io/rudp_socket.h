@@ -0,0 +1,95 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "absl/container/flat_hash_map.h"
+#include "asio.hpp"
+#include "snova/io/io.h"
+#include "snova/io/rudp.h"
+namespace snova {
+using UDPSocketPtr = std::shared_ptr<::asio::ip::udp::socket>;
+struct RudpSession;
+using RudpSessionPtr = std::shared_ptr<RudpSession>;
+
+RudpOptions default_rudp_options();
+void register_rudp_stat();
+
+/**
+ * IOConnection over the 'Rudp' protocol, client side owns a connected udp socket, server side
+ * sessions share the listening socket of 'RudpServer'.
+ */
+class RudpSocket : public IOConnection {
+ public:
+  static std::pair<IOConnectionPtr, std::error_code> Connect(
+      const asio::any_io_executor& ex, const ::asio::ip::udp::endpoint& remote);
+  explicit RudpSocket(RudpSessionPtr session);
+  ~RudpSocket();
+
+  asio::any_io_executor GetExecutor() override;
+  asio::awaitable<IOResult> AsyncWrite(const asio::const_buffer& buffers) override;
+  asio::awaitable<IOResult> AsyncWrite(const std::vector<::asio::const_buffer>& buffers) override;
+  asio::awaitable<IOResult> AsyncRead(const asio::mutable_buffer& buffers) override;
+  void Close() override;
+  // Server side session stops counting as pending once the owner authenticated its peer, see
+  // 'RudpServer'.
+  void SetAuthenticated();
+
+ private:
+  RudpSessionPtr session_;
+};
+
+/**
+ * Sessions accepted by 'RudpServer' are pending until 'RudpSocket::SetAuthenticated', open packets
+ * beyond a small number of pending sessions are dropped, and a session still pending after a few
+ * seconds is closed, since anyone can open one with a single datagram.
+ */
+class RudpServer : public std::enable_shared_from_this<RudpServer> {
+ public:
+  explicit RudpServer(::asio::ip::udp::socket&& socket);
+  void Start();
+  asio::awaitable<std::pair<IOConnectionPtr, std::error_code>> AsyncAccept();
+  void Close();
+  size_t PendingSessions() const { return pending_sessions_; }
+
+ private:
+  asio::awaitable<void> RecvLoop();
+  UDPSocketPtr socket_;
+  absl::flat_hash_map<uint32_t, std::weak_ptr<RudpSession>> sessions_;
+  std::deque<RudpSessionPtr> accept_queue_;
+  ::asio::steady_timer accept_timer_;
+  size_t pending_sessions_ = 0;
+  bool closed_ = false;
+};
+using RudpServerPtr = std::shared_ptr<RudpServer>;
+
+}  // namespace snova
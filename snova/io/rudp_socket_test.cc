@@ -0,0 +1,98 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/rudp_socket.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <utility>
+#include <vector>
+using namespace snova;  // NOLINT
+
+TEST(RudpServer, PendingSessionLimit) {
+  ::asio::io_context ctx;
+  ::asio::ip::udp::socket socket(ctx);
+  ::asio::ip::udp::endpoint listen(::asio::ip::make_address("127.0.0.1"), 0);
+  socket.open(listen.protocol());
+  socket.bind(listen);
+  ::asio::ip::udp::endpoint server_endpoint = socket.local_endpoint();
+  RudpServerPtr server = std::make_shared<RudpServer>(std::move(socket));
+  server->Start();
+
+  std::vector<IOConnectionPtr> clients;
+  auto open_clients = [&](size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      auto [conn, ec] = RudpSocket::Connect(ctx.get_executor(), server_endpoint);
+      ASSERT_FALSE(ec);
+      IOConnection* c = conn.get();
+      clients.emplace_back(std::move(conn));
+      // the first data packet opens the session on server.
+      ::asio::co_spawn(
+          ctx,
+          [c]() -> asio::awaitable<void> {
+            uint8_t hello[5] = {'h', 'e', 'l', 'l', 'o'};
+            co_await c->AsyncWrite(::asio::buffer(hello, sizeof(hello)));
+          },
+          ::asio::detached);
+    }
+    ctx.run_for(std::chrono::milliseconds(200));
+  };
+  open_clients(128);
+  EXPECT_EQ(128u, server->PendingSessions());
+  // rejected opens are retransmitted by clients, stop them before any place freed.
+  open_clients(10);
+  EXPECT_EQ(128u, server->PendingSessions());
+  for (size_t i = 128; i < clients.size(); i++) {
+    clients[i]->Close();
+  }
+  ctx.run_for(std::chrono::milliseconds(50));
+
+  std::vector<IOConnectionPtr> accepted;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto [conn, ec] = co_await server->AsyncAccept();
+        EXPECT_FALSE(ec);
+        static_cast<RudpSocket*>(conn.get())->SetAuthenticated();
+        accepted.emplace_back(std::move(conn));
+        // closing a pending session frees its place too.
+        auto [pending_conn, pending_ec] = co_await server->AsyncAccept();
+        EXPECT_FALSE(pending_ec);
+        pending_conn->Close();
+      },
+      ::asio::detached);
+  ctx.run_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(126u, server->PendingSessions());
+  open_clients(2);
+  EXPECT_EQ(128u, server->PendingSessions());
+
+  for (auto& c : clients) {
+    c->Close();
+  }
+  server->Close();
+  ctx.run_for(std::chrono::milliseconds(50));
+}
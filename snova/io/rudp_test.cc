@@ -0,0 +1,181 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/rudp.h"
+#include <gtest/gtest.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <deque>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+using namespace snova;  // NOLINT
+
+namespace {
+/**
+ * One direction of an emulated long haul link: random loss, fixed propagation delay and a
+ * bottleneck bandwidth with a drop tail queue, driven by a virtual millisecond clock.
+ */
+class EmulatedLink {
+ public:
+  EmulatedLink(double loss, uint32_t delay_ms, uint32_t packets_per_ms, size_t queue_limit,
+               uint32_t seed)
+      : loss_(loss),
+        delay_ms_(delay_ms),
+        packets_per_ms_(packets_per_ms),
+        queue_limit_(queue_limit),
+        rng_(seed) {}
+  void Send(const uint8_t* data, size_t len) {
+    if (queue_.size() >= queue_limit_ || dist_(rng_) < loss_) {
+      return;
+    }
+    queue_.emplace_back(std::vector<uint8_t>(data, data + len));
+  }
+  template <typename F>
+  void Deliver(uint32_t now_ms, F&& f) {
+    for (uint32_t i = 0; i < packets_per_ms_ && !queue_.empty(); i++) {
+      in_flight_.emplace_back(now_ms + delay_ms_, std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    while (!in_flight_.empty() && in_flight_.front().first <= now_ms) {
+      f(in_flight_.front().second);
+      in_flight_.pop_front();
+    }
+  }
+
+ private:
+  double loss_;
+  uint32_t delay_ms_;
+  uint32_t packets_per_ms_;
+  size_t queue_limit_;
+  std::mt19937 rng_;
+  std::uniform_real_distribution<double> dist_{0.0, 1.0};
+  std::deque<std::vector<uint8_t>> queue_;
+  std::deque<std::pair<uint32_t, std::vector<uint8_t>>> in_flight_;
+};
+
+struct TransferResult {
+  bool complete = false;
+  uint32_t elapsed_ms = 0;
+  RudpStats sender_stats;
+  RudpStats receiver_stats;
+};
+
+// 'total' bytes from a to b over a link with 'loss' in both directions and 100ms rtt.
+TransferResult transfer(const RudpOptions& opts, double loss, size_t total) {
+  static constexpr uint32_t kStartMs = 1000;
+  static constexpr uint32_t kTimeoutMs = 600 * 1000;
+  EmulatedLink a_to_b(loss, 50, 2, 512, 1);
+  EmulatedLink b_to_a(loss, 50, 2, 512, 2);
+  Rudp a(1, opts, [&](const uint8_t* data, size_t len) { a_to_b.Send(data, len); });
+  Rudp b(1, opts, [&](const uint8_t* data, size_t len) { b_to_a.Send(data, len); });
+
+  std::vector<uint8_t> chunk(4096);
+  std::vector<uint8_t> recv_buf(65536);
+  size_t sent = 0;
+  size_t received = 0;
+  TransferResult result;
+  for (uint32_t now = kStartMs; now < kStartMs + kTimeoutMs; now++) {
+    while (sent < total && a.WaitSend() < 2 * opts.send_window) {
+      size_t n = std::min(chunk.size(), total - sent);
+      for (size_t i = 0; i < n; i++) {
+        chunk[i] = static_cast<uint8_t>((sent + i) % 251);
+      }
+      a.Send(chunk.data(), n);
+      sent += n;
+    }
+    a_to_b.Deliver(now, [&](const std::vector<uint8_t>& p) { b.Input(p.data(), p.size(), now); });
+    b_to_a.Deliver(now, [&](const std::vector<uint8_t>& p) { a.Input(p.data(), p.size(), now); });
+    while (b.Readable() > 0) {
+      size_t n = b.Recv(recv_buf.data(), recv_buf.size());
+      for (size_t i = 0; i < n; i++) {
+        if (recv_buf[i] != static_cast<uint8_t>((received + i) % 251)) {
+          return result;
+        }
+      }
+      received += n;
+    }
+    if (received == total) {
+      result.complete = true;
+      result.elapsed_ms = now - kStartMs;
+      break;
+    }
+    a.Update(now);
+    b.Update(now);
+  }
+  result.sender_stats = a.GetStats();
+  result.receiver_stats = b.GetStats();
+  return result;
+}
+}  // namespace
+
+TEST(Rudp, Transfer) {
+  RudpOptions opts;
+  TransferResult result = transfer(opts, 0, 4 * 1024 * 1024);
+  ASSERT_TRUE(result.complete);
+  EXPECT_EQ(result.receiver_stats.fec_recovered, 0);
+}
+
+TEST(Rudp, FecRecover) {
+  RudpOptions opts;
+  opts.fec_group = 8;
+  opts.fast_resend = 0;
+  TransferResult result = transfer(opts, 0.01, 1024 * 1024);
+  ASSERT_TRUE(result.complete);
+  EXPECT_GT(result.sender_stats.fec_packets, 0);
+  EXPECT_GT(result.receiver_stats.fec_recovered, 0);
+}
+
+TEST(Rudp, LossyLink) {
+  static constexpr size_t kTotal = 8 * 1024 * 1024;
+  for (double loss : {0.01, 0.03, 0.05}) {
+    RudpOptions tcp_like;
+    tcp_like.min_rto_ms = 200;
+    tcp_like.fast_resend = 3;
+    tcp_like.pacing = false;
+    tcp_like.tcp_like_recovery = true;
+    RudpOptions arq;
+    RudpOptions fec;
+    fec.fec_group = 10;
+
+    TransferResult tcp_like_result = transfer(tcp_like, loss, kTotal);
+    TransferResult arq_result = transfer(arq, loss, kTotal);
+    TransferResult fec_result = transfer(fec, loss, kTotal);
+    ASSERT_TRUE(tcp_like_result.complete);
+    ASSERT_TRUE(arq_result.complete);
+    ASSERT_TRUE(fec_result.complete);
+    auto mbps = [](const TransferResult& r) { return kTotal * 8.0 / 1000 / r.elapsed_ms; };
+    printf("loss:%.0f%% rtt:100ms tcp_like:%.2fMbps rudp:%.2fMbps(resend:%" PRIu64
+           ") rudp+fec:%.2fMbps(recovered:%" PRIu64 ")\n",
+           loss * 100, mbps(tcp_like_result), mbps(arq_result),
+           arq_result.sender_stats.resend_packets, mbps(fec_result),
+           fec_result.receiver_stats.fec_recovered);
+    EXPECT_LT(arq_result.elapsed_ms, tcp_like_result.elapsed_ms);
+  }
+}
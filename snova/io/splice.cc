@@ -0,0 +1,99 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/splice.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace snova {
+static constexpr size_t kMaxPooledPipes = 64;
+
+static thread_local std::vector<SplicePipePtr> g_pipe_pool;
+
+SplicePipePtr SplicePipe::Get() {
+  if (!g_pipe_pool.empty()) {
+    SplicePipePtr pipe = std::move(g_pipe_pool.back());
+    g_pipe_pool.pop_back();
+    return pipe;
+  }
+  SplicePipePtr pipe(new SplicePipe);
+  if (0 != pipe2(pipe->fds_, O_NONBLOCK | O_CLOEXEC)) {
+    return nullptr;
+  }
+  // fewer splice calls per byte with a larger pipe, keep the default on failure(over
+  // /proc/sys/fs/pipe-max-size or the user's pipe quota).
+  int size = fcntl(pipe->fds_[1], F_SETPIPE_SZ, static_cast<int>(kPipeSize));
+  if (size < 0) {
+    size = fcntl(pipe->fds_[1], F_GETPIPE_SZ);
+  }
+  pipe->capacity_ = size > 0 ? size : 65536;
+  return pipe;
+}
+
+void SplicePipe::Put(SplicePipePtr&& pipe) {
+  if (!pipe || pipe->buffered_ > 0 || g_pipe_pool.size() >= kMaxPooledPipes) {
+    pipe.reset();
+    return;
+  }
+  g_pipe_pool.emplace_back(std::move(pipe));
+}
+
+SplicePipe::~SplicePipe() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+ssize_t SplicePipe::Fill(int fd) {
+  if (buffered_ >= capacity_) {
+    return -ENOBUFS;
+  }
+  ssize_t n = splice(fd, nullptr, fds_[1], nullptr, capacity_ - buffered_,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0) {
+    return -errno;
+  }
+  buffered_ += n;
+  return n;
+}
+
+ssize_t SplicePipe::Drain(int fd) {
+  ssize_t n =
+      splice(fds_[0], nullptr, fd, nullptr, buffered_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0) {
+    return -errno;
+  }
+  buffered_ -= n;
+  return n;
+}
+}  // namespace snova
@@ -0,0 +1,68 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <memory>
+
+namespace snova {
+/**
+ * Kernel pipe moving socket data by splice(2), bytes go socket->pipe->socket without being copied
+ * into user space. Both sockets should be non blocking, 'Fill'/'Drain' return -EAGAIN instead of
+ * waiting, callers wait readiness themselves. Linux only.
+ */
+class SplicePipe {
+ public:
+  // bytes a pipe could hold, grown from the default 64KB if the kernel allows.
+  static constexpr size_t kPipeSize = 256 * 1024;
+  // take an empty pipe from current thread's pool, nullptr if splice is not supported.
+  static std::unique_ptr<SplicePipe> Get();
+  // give back a pipe, it's closed if it still holds data or the pool is full.
+  static void Put(std::unique_ptr<SplicePipe>&& pipe);
+
+  SplicePipe(const SplicePipe&) = delete;
+  SplicePipe& operator=(const SplicePipe&) = delete;
+  ~SplicePipe();
+
+  // move available bytes of socket 'fd' into the pipe, return bytes moved, 0 on eof or -errno.
+  ssize_t Fill(int fd);
+  // move buffered bytes into socket 'fd', return bytes moved or -errno.
+  ssize_t Drain(int fd);
+  size_t Buffered() const { return buffered_; }
+
+ private:
+  SplicePipe() = default;
+  int fds_[2] = {-1, -1};
+  size_t capacity_ = 0;
+  size_t buffered_ = 0;
+};
+using SplicePipePtr = std::unique_ptr<SplicePipe>;
+
+}  // namespace snova
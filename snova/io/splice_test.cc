@@ -0,0 +1,127 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/splice.h"
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "snova/io/relay_bench.h"
+using namespace snova;                // NOLINT
+using namespace snova::relay_bench;  // NOLINT
+
+namespace {
+// readiness based splice loop, what 'transfer' does with asio's async_wait.
+bool splice_relay(int from, int to) {
+  SplicePipePtr pipe = SplicePipe::Get();
+  if (!pipe) {
+    return false;
+  }
+  int ep = epoll_create1(0);
+  auto wait_fd = [&](int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    struct epoll_event out;
+    epoll_wait(ep, &out, 1, -1);
+    epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+  };
+  bool ok = true;
+  while (ok) {
+    ssize_t n = pipe->Fill(from);
+    if (n == -EAGAIN) {
+      wait_fd(from, EPOLLIN);
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    while (pipe->Buffered() > 0) {
+      ssize_t rc = pipe->Drain(to);
+      if (rc == -EAGAIN) {
+        wait_fd(to, EPOLLOUT);
+        continue;
+      }
+      if (rc <= 0) {
+        ok = false;
+        break;
+      }
+    }
+  }
+  close(ep);
+  SplicePipe::Put(std::move(pipe));
+  return ok;
+}
+}  // namespace
+
+TEST(SplicePipe, Relay) {
+  RelayBench bench;
+  ASSERT_TRUE(bench.Start(64 * 1024 * 1024 + 1234));
+  ASSERT_TRUE(splice_relay(bench.in[1], bench.out[0]));
+  bench.Finish();
+  ASSERT_EQ(bench.total, bench.received);
+  ASSERT_FALSE(bench.corrupted);
+}
+
+TEST(SplicePipe, Pool) {
+  SplicePipePtr pipe = SplicePipe::Get();
+  ASSERT_TRUE(pipe != nullptr);
+  SplicePipe* p = pipe.get();
+  SplicePipe::Put(std::move(pipe));
+  // an empty pipe is reused.
+  pipe = SplicePipe::Get();
+  ASSERT_EQ(p, pipe.get());
+
+  int fds[2];
+  ASSERT_TRUE(tcp_pair(fds));
+  set_nonblocking(fds[1]);
+  ASSERT_EQ(-EAGAIN, pipe->Fill(fds[1]));
+  ASSERT_EQ(5, write(fds[0], "hello", 5));
+  // wait the loopback delivery.
+  while (pipe->Fill(fds[1]) == -EAGAIN) {
+  }
+  ASSERT_EQ(5u, pipe->Buffered());
+  // a pipe holding data is not pooled.
+  SplicePipe::Put(std::move(pipe));
+  pipe = SplicePipe::Get();
+  ASSERT_EQ(0u, pipe->Buffered());
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(SplicePipe, LoopbackBenchmark) {
+  static constexpr uint64_t kBytes = 1024ULL * 1024 * 1024;
+  // copy loop with kMaxChunkSize buffer as 'transfer' before splice.
+  ASSERT_TRUE(run_benchmark("copy", kBytes, 3,
+                            [](int from, int to) { epoll_relay(from, to, 8192); }));
+  ASSERT_TRUE(run_benchmark("splice", kBytes, 3,
+                            [](int from, int to) { ASSERT_TRUE(splice_relay(from, to)); }));
+}
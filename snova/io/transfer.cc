@@ -27,13 +27,35 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/io/transfer.h"
+#include <errno.h>
+#include <string>
 #include <utility>
 #include <vector>
 #include "asio/experimental/as_tuple.hpp"
+#include "snova/io/memory_pressure.h"
+#include "snova/io/uring_socket.h"
+#include "snova/util/flags.h"
+#include "snova/util/stat.h"
+#if defined(__linux__)
+#include "snova/io/splice.h"
+#endif
 
 namespace snova {
 using namespace asio::experimental::awaitable_operators;  // NOLINT
 
+static thread_local uint32_t g_splice_relay_num = 0;
+static thread_local uint64_t g_splice_relay_bytes = 0;
+
+void register_transfer_stat() {
+  register_stat_func([]() -> StatValues {
+    StatValues vals;
+    auto& kv = vals["Transfer"];
+    kv["splice_relay_num"] = std::to_string(g_splice_relay_num);
+    kv["splice_relay_bytes"] = std::to_string(g_splice_relay_bytes);
+    return vals;
+  });
+}
+
 asio::awaitable<void> transfer(StreamPtr from, StreamPtr to, const TransferRoutineFunc& routine) {
   while (true) {
     auto [data, len, ec] = co_await from->Read();
@@ -70,9 +92,7 @@ asio::awaitable<void> transfer(StreamPtr from, SocketRef to, const TransferRouti
     if (routine) {
       routine();
     }
-    auto [wec, wn] =
-        co_await ::asio::async_write(to, ::asio::buffer(data->data(), len),
-                                     ::asio::experimental::as_tuple(::asio::use_awaitable));
+    auto [wn, wec] = co_await uring_write(to, ::asio::buffer(data->data(), len));
     data.reset();
     if (wec) {
       // co_await from->Close(false);
@@ -84,15 +104,17 @@ asio::awaitable<void> transfer(StreamPtr from, SocketRef to, const TransferRouti
     }
   }
   co_await from->Close(false);
-  to.close();
+  close_socket(to);
   co_return;
 }
 asio::awaitable<void> transfer(SocketRef from, StreamPtr to, const TransferRoutineFunc& routine) {
   while (true) {
-    IOBufPtr buf = get_iobuf(kMaxChunkSize);
-    auto [ec, n] =
-        co_await from.async_read_some(::asio::buffer(buf->data(), kMaxChunkSize),
-                                      ::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (get_memory_pressure() != MEMORY_PRESSURE_NONE) {
+      co_await wait_memory_available();
+    }
+    size_t chunk_size = to->GetMaxWriteSize();
+    IOBufPtr buf = get_iobuf(chunk_size);
+    auto [n, ec] = co_await uring_read_some(from, ::asio::buffer(buf->data(), chunk_size));
     if (ec) {
       break;
     }
@@ -111,9 +133,86 @@ asio::awaitable<void> transfer(SocketRef from, StreamPtr to, const TransferRouti
   co_await to->Close(false);
   co_return;
 }
+#if defined(__linux__)
+// move bytes kernel to kernel through a pipe, return 'operation_not_supported' before moving any
+// byte if splice is unavailable for the sockets.
+static asio::awaitable<std::error_code> splice_transfer(SocketRef from, SocketRef to,
+                                                         const TransferRoutineFunc& routine) {
+  SplicePipePtr pipe = SplicePipe::Get();
+  if (!pipe) {
+    co_return std::make_error_code(std::errc::operation_not_supported);
+  }
+  // splice returns EAGAIN instead of blocking only on non blocking sockets.
+  std::error_code ec;
+  from.non_blocking(true, ec);
+  if (!ec) {
+    to.non_blocking(true, ec);
+  }
+  bool moved = false;
+  g_splice_relay_num++;
+  while (!ec) {
+    ssize_t n = pipe->Fill(from.native_handle());
+    if (-EAGAIN == n) {
+      auto [wait_ec] =
+          co_await from.async_wait(::asio::ip::tcp::socket::wait_read,
+                                   ::asio::experimental::as_tuple(::asio::use_awaitable));
+      ec = wait_ec;
+      continue;
+    }
+    if (n < 0 && !moved && (-EINVAL == n || -ENOSYS == n)) {
+      ec = std::make_error_code(std::errc::operation_not_supported);
+      break;
+    }
+    if (n <= 0) {
+      if (n < 0) {
+        ec = std::error_code(static_cast<int>(-n), std::system_category());
+      }
+      break;
+    }
+    moved = true;
+    g_splice_relay_bytes += n;
+    if (routine) {
+      routine();
+    }
+    while (!ec && pipe->Buffered() > 0) {
+      ssize_t rc = pipe->Drain(to.native_handle());
+      if (-EAGAIN == rc) {
+        auto [wait_ec] = co_await to.async_wait(
+            ::asio::ip::tcp::socket::wait_write,
+            ::asio::experimental::as_tuple(::asio::use_awaitable));
+        ec = wait_ec;
+      } else if (rc < 0) {
+        ec = std::error_code(static_cast<int>(-rc), std::system_category());
+      }
+    }
+    if (!ec && routine) {
+      routine();
+    }
+  }
+  g_splice_relay_num--;
+  SplicePipe::Put(std::move(pipe));
+  co_return ec;
+}
+#endif
+
 asio::awaitable<void> transfer(SocketRef from, SocketRef to, const TransferRoutineFunc& routine) {
+#if defined(__linux__)
+  if (g_splice_relay) {
+    auto splice_ec = co_await splice_transfer(from, to, routine);
+    if (splice_ec != std::errc::operation_not_supported) {
+      co_return;
+    }
+  }
+#endif
+  auto uring_ec = co_await uring_relay(from, to, routine);
+  if (uring_ec != std::errc::operation_not_supported) {
+    co_return;
+  }
   IOBufPtr buf = get_iobuf(kMaxChunkSize);
   while (true) {
+    if (get_memory_pressure() != MEMORY_PRESSURE_NONE) {
+      co_await wait_memory_available();
+    }
     auto [ec, n] =
         co_await from.async_read_some(::asio::buffer(buf->data(), kMaxChunkSize),
                                       ::asio::experimental::as_tuple(::asio::use_awaitable));
@@ -39,7 +39,11 @@ asio::awaitable<void> transfer(StreamPtr from, ::asio::ip::tcp::socket& to,
                                const TransferRoutineFunc& routine = {});
 asio::awaitable<void> transfer(SocketRef from, StreamPtr to,
                                const TransferRoutineFunc& routine = {});
+// moves bytes by splice on linux(unless disabled by 'g_splice_relay'), then io_uring if
+// enabled, otherwise copies through a user space buffer.
 asio::awaitable<void> transfer(SocketRef from, SocketRef to,
                                const TransferRoutineFunc& routine = {});
 
+void register_transfer_stat();
+
 }  // namespace snova
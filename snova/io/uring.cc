@@ -0,0 +1,621 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/uring.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#if SNOVA_HAS_IO_URING
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace snova {
+#if SNOVA_HAS_IO_URING
+static constexpr uint16_t kBufferGroup = 0;
+
+static int io_uring_setup(uint32_t entries, struct io_uring_params* p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+static int io_uring_register(int fd, uint32_t opcode, const void* arg, uint32_t nr_args) {
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+static void* map_ring(int fd, size_t size, off_t offset) {
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+IoUring::~IoUring() { Close(); }
+
+void IoUring::Close() {
+  if (nullptr != buf_ring_) {
+    munmap(buf_ring_, buf_ring_size_);
+    buf_ring_ = nullptr;
+  }
+  if (nullptr != sqes_) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (nullptr != cq_ring_ && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = nullptr;
+  if (nullptr != sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = nullptr;
+  }
+  if (event_fd_ >= 0) {
+    close(event_fd_);
+    event_fd_ = -1;
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+int IoUring::Init(uint32_t entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // multishot receives post many cqes per sqe.
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER;
+  p.cq_entries = entries * 4;
+  int fd = io_uring_setup(entries, &p);
+  if (fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    fd = io_uring_setup(entries, &p);
+  }
+  if (fd < 0) {
+    return -errno;
+  }
+  ring_fd_ = fd;
+  int rc = MapRings(p);
+  if (0 != rc) {
+    Close();
+  }
+  return rc;
+}
+
+int IoUring::MapRings(const struct io_uring_params& p) {
+  int fd = ring_fd_;
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    cq_ring_size_ = sq_ring_size_;
+  }
+  sq_ring_ = map_ring(fd, sq_ring_size_, IORING_OFF_SQ_RING);
+  if (nullptr == sq_ring_) {
+    return -errno;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = map_ring(fd, cq_ring_size_, IORING_OFF_CQ_RING);
+    if (nullptr == cq_ring_) {
+      return -errno;
+    }
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(map_ring(fd, sqes_size_, IORING_OFF_SQES));
+  if (nullptr == sqes_) {
+    return -errno;
+  }
+  uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+  sq_head_ = reinterpret_cast<uint32_t*>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq + p.sq_off.tail);
+  sq_flags_ = reinterpret_cast<uint32_t*>(sq + p.sq_off.flags);
+  sq_array_ = reinterpret_cast<uint32_t*>(sq + p.sq_off.array);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(sq + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<uint32_t*>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<uint32_t*>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+  sqe_tail_ = *sq_tail_;
+
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    return -errno;
+  }
+  if (io_uring_register(fd, IORING_REGISTER_EVENTFD, &event_fd_, 1) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+int IoUring::SetupBuffers(uint8_t* arena, uint32_t buf_size, uint32_t buf_count) {
+  if (buf_count == 0 || (buf_count & (buf_count - 1)) != 0 || buf_count > 32768) {
+    return -EINVAL;
+  }
+  buf_ring_size_ = buf_count * sizeof(struct io_uring_buf);
+  buf_ring_ = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                   -1, 0);
+  if (buf_ring_ == MAP_FAILED) {
+    buf_ring_ = nullptr;
+    return -errno;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+  reg.ring_entries = buf_count;
+  reg.bgid = kBufferGroup;
+  if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = errno;
+    munmap(buf_ring_, buf_ring_size_);
+    buf_ring_ = nullptr;
+    return -err;
+  }
+  arena_ = arena;
+  buf_size_ = buf_size;
+  buf_count_ = buf_count;
+  // pinning the arena may exceed RLIMIT_MEMLOCK, writes fall back to plain sends then.
+  struct iovec iov;
+  iov.iov_base = arena;
+  iov.iov_len = static_cast<size_t>(buf_size) * buf_count;
+  fixed_buffers_ = io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  for (uint32_t i = 0; i < buf_count; i++) {
+    RecycleBuffer(static_cast<uint16_t>(i));
+  }
+  return 0;
+}
+
+void IoUring::RecycleBuffer(uint16_t bid) {
+  // index entries directly, 'io_uring_buf_ring::bufs' is misplaced by the flex array macro in
+  // c++. The ring tail overlays the 'resv' field of the first entry.
+  auto* bufs = static_cast<struct io_uring_buf*>(buf_ring_);
+  struct io_uring_buf* buf = &bufs[buf_ring_tail_ & (buf_count_ - 1)];
+  buf->addr = reinterpret_cast<uint64_t>(GetBuffer(bid));
+  buf->len = buf_size_;
+  buf->bid = bid;
+  buf_ring_tail_++;
+  __atomic_store_n(&bufs[0].resv, buf_ring_tail_, __ATOMIC_RELEASE);
+  if (!buffer_waiters_.empty()) {
+    std::vector<std::function<void()>> waiters = std::move(buffer_waiters_);
+    buffer_waiters_.clear();
+    for (auto& cb : waiters) {
+      cb();
+    }
+  }
+}
+
+io_uring_sqe* IoUring::GetSqe() {
+  if (ring_fd_ < 0) {
+    return nullptr;
+  }
+  uint32_t head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) {
+    Submit();
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sqe_tail_ - head >= sq_entries_) {
+      return nullptr;
+    }
+  }
+  uint32_t idx = sqe_tail_ & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+  sqe_tail_++;
+  pending_submits_++;
+  return sqe;
+}
+
+uint64_t IoUring::AddOp(io_uring_sqe* sqe, Callback&& cb) {
+  uint32_t slot = 0;
+  if (!free_ops_.empty()) {
+    slot = free_ops_.back();
+    free_ops_.pop_back();
+  } else {
+    slot = static_cast<uint32_t>(ops_.size());
+    ops_.emplace_back();
+  }
+  Op& op = ops_[slot];
+  op.cb = std::move(cb);
+  op.generation++;
+  op.active = true;
+  inflight_ops_++;
+  uint64_t id = (static_cast<uint64_t>(op.generation) << 32) | slot;
+  sqe->user_data = id;
+  return id;
+}
+
+uint64_t IoUring::Recv(int fd, void* buf, size_t len, Callback&& cb) {
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return 0;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = static_cast<uint32_t>(len);
+  return AddOp(sqe, std::move(cb));
+}
+
+uint64_t IoUring::RecvMultishot(int fd, Callback&& cb) {
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return 0;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  if (multishot_recv_) {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  }
+  stats_.recv_arms++;
+  return AddOp(sqe, std::move(cb));
+}
+
+uint64_t IoUring::Send(int fd, const void* buf, size_t len, Callback&& cb) {
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return 0;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = static_cast<uint32_t>(len);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  return AddOp(sqe, std::move(cb));
+}
+
+uint64_t IoUring::SendMsg(int fd, const struct msghdr* msg, Callback&& cb) {
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return 0;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  return AddOp(sqe, std::move(cb));
+}
+
+uint64_t IoUring::WriteFixed(int fd, const void* buf, size_t len, Callback&& cb) {
+  if (!fixed_buffers_) {
+    return Send(fd, buf, len, std::move(cb));
+  }
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return 0;
+  }
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = static_cast<uint32_t>(len);
+  sqe->off = 0;
+  sqe->buf_index = 0;
+  stats_.fixed_writes++;
+  return AddOp(sqe, std::move(cb));
+}
+
+void IoUring::Cancel(uint64_t op_id) {
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = op_id;
+  sqe->user_data = 0;
+}
+
+void IoUring::CancelFd(int fd) {
+#if defined(IORING_ASYNC_CANCEL_FD)
+  io_uring_sqe* sqe = GetSqe();
+  if (nullptr == sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = 0;
+#endif
+}
+
+int IoUring::Submit() {
+  if (pending_submits_ == 0) {
+    return 0;
+  }
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+  int rc = 0;
+  do {
+    rc = io_uring_enter(ring_fd_, pending_submits_, 0, 0);
+  } while (rc < 0 && errno == EINTR);
+  stats_.submit_calls++;
+  if (rc < 0) {
+    return -errno;
+  }
+  pending_submits_ -= static_cast<uint32_t>(rc);
+  stats_.submitted_sqes += rc;
+  return rc;
+}
+
+int IoUring::SubmitAndWait() {
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+  int rc = 0;
+  do {
+    rc = io_uring_enter(ring_fd_, pending_submits_, 1, IORING_ENTER_GETEVENTS);
+  } while (rc < 0 && errno == EINTR);
+  stats_.submit_calls++;
+  if (rc < 0) {
+    return -errno;
+  }
+  pending_submits_ -= static_cast<uint32_t>(rc);
+  stats_.submitted_sqes += rc;
+  return rc;
+}
+
+size_t IoUring::Reap() {
+  if (ring_fd_ < 0) {
+    return 0;
+  }
+  if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+    // cqes overflowed the ring are kept by kernel until flushed by entering with GETEVENTS.
+    io_uring_enter(ring_fd_, 0, 0, IORING_ENTER_GETEVENTS);
+  }
+  size_t n = 0;
+  uint32_t head = *cq_head_;
+  while (true) {
+    uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      break;
+    }
+    const io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+    uint64_t id = cqe->user_data;
+    int32_t res = cqe->res;
+    uint32_t flags = cqe->flags;
+    head++;
+    // release the cqe before callbacks, which may queue ops completing at once.
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    n++;
+    stats_.completions++;
+    if (res == -ENOBUFS) {
+      stats_.no_buffers++;
+    }
+    uint32_t slot = static_cast<uint32_t>(id);
+    uint32_t generation = static_cast<uint32_t>(id >> 32);
+    if (id == 0 || slot >= ops_.size() || !ops_[slot].active ||
+        ops_[slot].generation != generation) {
+      continue;
+    }
+    if (flags & IORING_CQE_F_MORE) {
+      ops_[slot].cb(res, flags);
+      continue;
+    }
+    Callback cb = std::move(ops_[slot].cb);
+    ops_[slot].cb = nullptr;
+    ops_[slot].active = false;
+    free_ops_.push_back(slot);
+    inflight_ops_--;
+    cb(res, flags);
+  }
+  return n;
+}
+
+IoUringRelay::IoUringRelay(IoUring& ring, int from_fd, int to_fd,
+                           std::function<void()>&& on_activity, std::function<void(int)>&& on_done)
+    : ring_(ring),
+      from_fd_(from_fd),
+      to_fd_(to_fd),
+      on_activity_(std::move(on_activity)),
+      on_done_(std::move(on_done)) {}
+
+void IoUringRelay::Start() { ArmRecv(); }
+
+void IoUringRelay::Stop() {
+  Fail(ECANCELED);
+  TryFinish();
+}
+
+void IoUringRelay::ArmRecv() {
+  auto self = shared_from_this();
+  recv_op_ = ring_.RecvMultishot(
+      from_fd_, [self](int32_t res, uint32_t flags) { self->OnRecv(res, flags); });
+  if (0 == recv_op_) {
+    Fail(EBUSY);
+    return;
+  }
+  recv_armed_ = true;
+}
+
+void IoUringRelay::MaybeRearmRecv() {
+  if (recv_armed_ || waiting_buffers_ || eof_ || error_ != 0 || done_ ||
+      pending_.size() > kMaxPendingBuffers / 2) {
+    return;
+  }
+  ArmRecv();
+}
+
+void IoUringRelay::OnRecv(int32_t res, uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    recv_armed_ = false;
+  }
+  if (res > 0) {
+    uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+    if (error_ != 0) {
+      ring_.RecycleBuffer(bid);
+    } else {
+      pending_.push_back(Pending{bid, 0, static_cast<uint32_t>(res)});
+      relay_bytes_ += res;
+      if (on_activity_) {
+        on_activity_();
+      }
+      WriteNext();
+    }
+  } else if (res == 0) {
+    eof_ = true;
+  } else if (res == -ENOBUFS) {
+    // retry once a buffer is recycled, by our own write if we hold some, re-arming at once would
+    // only get ENOBUFS again.
+    if (!waiting_buffers_) {
+      waiting_buffers_ = true;
+      auto self = shared_from_this();
+      ring_.WaitBuffers([self]() {
+        self->waiting_buffers_ = false;
+        self->MaybeRearmRecv();
+      });
+    }
+  } else if (res == -EINVAL && ring_.MultishotSupported() && relay_bytes_ == 0) {
+    ring_.DisableMultishot();
+  } else if (res == -ECANCELED && recv_stopping_) {
+    // paused by too many unwritten buffers.
+  } else {
+    Fail(-res);
+  }
+  if (recv_armed_ && !recv_stopping_ && pending_.size() >= kMaxPendingBuffers) {
+    recv_stopping_ = true;
+    ring_.Cancel(recv_op_);
+  }
+  if (!recv_armed_) {
+    recv_stopping_ = false;
+    MaybeRearmRecv();
+  }
+  TryFinish();
+}
+
+void IoUringRelay::WriteNext() {
+  if (writing_ || pending_.empty() || error_ != 0) {
+    return;
+  }
+  auto self = shared_from_this();
+  auto on_write = [self](int32_t res, uint32_t flags) { self->OnWrite(res); };
+  uint64_t id = 0;
+  if (pending_.size() == 1) {
+    const Pending& p = pending_.front();
+    id = ring_.WriteFixed(to_fd_, ring_.GetBuffer(p.bid) + p.offset, p.len - p.offset,
+                          std::move(on_write));
+  } else {
+    // gather the backlog into one send, it saves an op per buffer when the writer lags.
+    size_t n = std::min(pending_.size(), write_iov_.size());
+    for (size_t i = 0; i < n; i++) {
+      const Pending& p = pending_[i];
+      write_iov_[i].iov_base = ring_.GetBuffer(p.bid) + p.offset;
+      write_iov_[i].iov_len = p.len - p.offset;
+    }
+    memset(&write_msg_, 0, sizeof(write_msg_));
+    write_msg_.msg_iov = write_iov_.data();
+    write_msg_.msg_iovlen = n;
+    id = ring_.SendMsg(to_fd_, &write_msg_, std::move(on_write));
+  }
+  if (0 == id) {
+    Fail(EBUSY);
+    return;
+  }
+  writing_ = true;
+}
+
+void IoUringRelay::OnWrite(int32_t res) {
+  writing_ = false;
+  if (res <= 0) {
+    Fail(res == 0 ? EPIPE : -res);
+  } else if (error_ == 0) {
+    size_t written = static_cast<size_t>(res);
+    while (written > 0) {
+      Pending& p = pending_.front();
+      size_t n = std::min<size_t>(written, p.len - p.offset);
+      p.offset += n;
+      written -= n;
+      if (p.offset >= p.len) {
+        ring_.RecycleBuffer(p.bid);
+        pending_.pop_front();
+      }
+    }
+    if (on_activity_) {
+      on_activity_();
+    }
+    WriteNext();
+    MaybeRearmRecv();
+  }
+  TryFinish();
+}
+
+void IoUringRelay::Fail(int err) {
+  if (error_ == 0) {
+    error_ = err;
+  }
+  if (recv_armed_ && !recv_stopping_) {
+    recv_stopping_ = true;
+    ring_.Cancel(recv_op_);
+  }
+}
+
+void IoUringRelay::TryFinish() {
+  // a buffer waiter left behind finds the relay done and does nothing.
+  if (done_ || recv_armed_ || writing_) {
+    return;
+  }
+  if (error_ == 0 && !(eof_ && pending_.empty())) {
+    return;
+  }
+  done_ = true;
+  for (const Pending& p : pending_) {
+    ring_.RecycleBuffer(p.bid);
+  }
+  pending_.clear();
+  auto on_done = std::move(on_done_);
+  on_done(error_);
+}
+#else
+IoUring::~IoUring() {}
+void IoUring::Close() {}
+int IoUring::Init(uint32_t entries) { return -ENOSYS; }
+int IoUring::SetupBuffers(uint8_t* arena, uint32_t buf_size, uint32_t buf_count) {
+  return -ENOSYS;
+}
+void IoUring::RecycleBuffer(uint16_t bid) {}
+uint64_t IoUring::Recv(int fd, void* buf, size_t len, Callback&& cb) { return 0; }
+uint64_t IoUring::RecvMultishot(int fd, Callback&& cb) { return 0; }
+uint64_t IoUring::Send(int fd, const void* buf, size_t len, Callback&& cb) { return 0; }
+uint64_t IoUring::SendMsg(int fd, const struct msghdr* msg, Callback&& cb) { return 0; }
+uint64_t IoUring::WriteFixed(int fd, const void* buf, size_t len, Callback&& cb) { return 0; }
+void IoUring::Cancel(uint64_t op_id) {}
+void IoUring::CancelFd(int fd) {}
+int IoUring::Submit() { return -ENOSYS; }
+int IoUring::SubmitAndWait() { return -ENOSYS; }
+size_t IoUring::Reap() { return 0; }
+IoUringRelay::IoUringRelay(IoUring& ring, int from_fd, int to_fd,
+                           std::function<void()>&& on_activity, std::function<void(int)>&& on_done)
+    : ring_(ring), from_fd_(from_fd), to_fd_(to_fd), on_done_(std::move(on_done)) {}
+void IoUringRelay::Start() { on_done_(ENOSYS); }
+void IoUringRelay::Stop() {}
+#endif
+}  // namespace snova
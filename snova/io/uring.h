@@ -0,0 +1,228 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// built with 6.0+ headers for provided buffer rings and multishot receives, older kernels are
+// detected at runtime.
+#if defined(IORING_RECV_MULTISHOT)
+#define SNOVA_HAS_IO_URING 1
+#endif
+#endif
+#ifndef SNOVA_HAS_IO_URING
+#define SNOVA_HAS_IO_URING 0
+#endif
+
+struct io_uring_params;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace snova {
+struct IoUringStats {
+  uint64_t submit_calls = 0;
+  uint64_t submitted_sqes = 0;
+  uint64_t completions = 0;
+  // multishot receives armed, a relay re-arms after it paused or ran out of provided buffers.
+  uint64_t recv_arms = 0;
+  // receives stopped since all provided buffers were in use.
+  uint64_t no_buffers = 0;
+  uint64_t fixed_writes = 0;
+};
+
+/**
+ * Minimal io_uring driver on raw syscalls, every op completes by invoking its callback with the
+ * cqe's result and flags from 'Reap'. Ops are queued into the submission ring and submitted in
+ * batch by 'Submit'(or when the ring is full). A single memory arena is carved into equal sized
+ * provided buffers for multishot receives, the arena is also registered as fixed buffer 0 so the
+ * received data is written out by 'WriteFixed' without pinning pages again.
+ * It does no waiting itself, 'GetEventFd' becomes readable once completions are available.
+ */
+class IoUring {
+ public:
+  using Callback = std::function<void(int32_t res, uint32_t flags)>;
+  IoUring() = default;
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring();
+
+  // return 0 or -errno, e.g. -ENOSYS/-EPERM if io_uring is unavailable or forbidden.
+  int Init(uint32_t entries);
+  bool Valid() const { return ring_fd_ >= 0; }
+  int GetEventFd() const { return event_fd_; }
+
+  // 'arena' must outlive the ring, it is split into 'buf_count'(power of 2) buffers of 'buf_size'.
+  int SetupBuffers(uint8_t* arena, uint32_t buf_size, uint32_t buf_count);
+  bool HasProvidedBuffers() const { return buf_ring_ != nullptr; }
+  bool HasFixedBuffers() const { return fixed_buffers_; }
+  uint8_t* GetBuffer(uint16_t bid) const { return arena_ + static_cast<size_t>(bid) * buf_size_; }
+  uint32_t GetBufferSize() const { return buf_size_; }
+  // give a provided buffer back to kernel once its data consumed.
+  void RecycleBuffer(uint16_t bid);
+  // 'cb' is called once some buffer recycled, after a receive failed with ENOBUFS.
+  void WaitBuffers(std::function<void()>&& cb) { buffer_waiters_.emplace_back(std::move(cb)); }
+
+  // Each op returns its id(0 if no sqe available) which could be cancelled, callbacks are never
+  // invoked inside these calls.
+  uint64_t Recv(int fd, void* buf, size_t len, Callback&& cb);
+  // receive into provided buffers, buffer id is 'flags >> IORING_CQE_BUFFER_SHIFT' of a positive
+  // result. Keeps receiving until a cqe without IORING_CQE_F_MORE.
+  uint64_t RecvMultishot(int fd, Callback&& cb);
+  uint64_t Send(int fd, const void* buf, size_t len, Callback&& cb);
+  // 'msg' and its iovecs must be valid until completion.
+  uint64_t SendMsg(int fd, const struct msghdr* msg, Callback&& cb);
+  // 'buf' must be inside the arena, falls back to Send if buffers are not registered.
+  uint64_t WriteFixed(int fd, const void* buf, size_t len, Callback&& cb);
+  void Cancel(uint64_t op_id);
+  // cancel all ops on 'fd'(kernel 5.19+), callers still shutdown the socket for older kernels.
+  void CancelFd(int fd);
+
+  // submit queued sqes, return number submitted or -errno.
+  int Submit();
+  // submit and block until at least one completion, only used without an event loop.
+  int SubmitAndWait();
+  // invoke callbacks of all available completions, return the number of cqes.
+  size_t Reap();
+  uint32_t PendingSubmits() const { return pending_submits_; }
+  size_t InflightOps() const { return inflight_ops_; }
+  bool MultishotSupported() const { return multishot_recv_; }
+  // kernel before 6.0 rejects multishot receives, fall back to re-arm a receive per completion.
+  void DisableMultishot() { multishot_recv_ = false; }
+  const IoUringStats& GetStats() const { return stats_; }
+
+ private:
+  struct Op {
+    Callback cb;
+    uint32_t generation = 0;
+    bool active = false;
+  };
+  int MapRings(const struct io_uring_params& p);
+  void Close();
+  io_uring_sqe* GetSqe();
+  uint64_t AddOp(io_uring_sqe* sqe, Callback&& cb);
+
+  int ring_fd_ = -1;
+  int event_fd_ = -1;
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  uint32_t* sq_head_ = nullptr;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t* sq_array_ = nullptr;
+  uint32_t* sq_flags_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t sq_entries_ = 0;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+  uint32_t cq_mask_ = 0;
+  uint32_t sqe_tail_ = 0;
+  uint32_t pending_submits_ = 0;
+
+  // op slots indexed by the low 32 bits of user_data, generation in the high bits. A deque keeps
+  // the slot of a running callback in place while it queues new ops.
+  std::deque<Op> ops_;
+  std::vector<uint32_t> free_ops_;
+  size_t inflight_ops_ = 0;
+
+  uint8_t* arena_ = nullptr;
+  uint32_t buf_size_ = 0;
+  uint32_t buf_count_ = 0;
+  void* buf_ring_ = nullptr;
+  size_t buf_ring_size_ = 0;
+  uint16_t buf_ring_tail_ = 0;
+  bool fixed_buffers_ = false;
+  bool multishot_recv_ = true;
+  std::vector<std::function<void()>> buffer_waiters_;
+  IoUringStats stats_;
+};
+
+/**
+ * One direction socket relay driven by an 'IoUring': a multishot receive fills provided buffers,
+ * which are written to 'to_fd' in order and recycled. A relay holding too many unwritten buffers
+ * stops receiving until drained, so one slow writer could not exhaust the shared buffers.
+ * 'on_activity' is called on every progress, 'on_done' once with 0 or errno after both peer's
+ * eof/error and all received data written(or the write failed).
+ */
+class IoUringRelay : public std::enable_shared_from_this<IoUringRelay> {
+ public:
+  static constexpr size_t kMaxPendingBuffers = 16;
+  IoUringRelay(IoUring& ring, int from_fd, int to_fd, std::function<void()>&& on_activity,
+               std::function<void(int)>&& on_done);
+  void Start();
+  // cancel a running relay, 'on_done' follows with ECANCELED.
+  void Stop();
+  uint64_t GetRelayBytes() const { return relay_bytes_; }
+
+ private:
+  struct Pending {
+    uint16_t bid;
+    uint32_t offset;
+    uint32_t len;
+  };
+  void ArmRecv();
+  void MaybeRearmRecv();
+  void OnRecv(int32_t res, uint32_t flags);
+  void WriteNext();
+  void OnWrite(int32_t res);
+  void Fail(int err);
+  void TryFinish();
+
+  IoUring& ring_;
+  int from_fd_;
+  int to_fd_;
+  std::function<void()> on_activity_;
+  std::function<void(int)> on_done_;
+  std::deque<Pending> pending_;
+  std::array<struct iovec, kMaxPendingBuffers> write_iov_;
+  struct msghdr write_msg_;
+  uint64_t recv_op_ = 0;
+  uint64_t relay_bytes_ = 0;
+  int error_ = 0;
+  bool recv_armed_ = false;
+  bool recv_stopping_ = false;
+  bool waiting_buffers_ = false;
+  bool writing_ = false;
+  bool eof_ = false;
+  bool done_ = false;
+};
+
+}  // namespace snova
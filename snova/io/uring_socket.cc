@@ -0,0 +1,383 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/uring_socket.h"
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include "asio/experimental/as_tuple.hpp"
+#include "snova/io/tcp_socket.h"
+#include "snova/log/log_macros.h"
+#include "snova/util/stat.h"
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "snova/io/uring.h"
+#else
+#define SNOVA_HAS_IO_URING 0
+#endif
+
+namespace snova {
+static asio::awaitable<IOResult> asio_read_some(SocketRef sock,
+                                                const asio::mutable_buffer& buffer) {
+  auto [ec, n] =
+      co_await sock.async_read_some(buffer, ::asio::experimental::as_tuple(::asio::use_awaitable));
+  co_return IOResult{n, ec};
+}
+template <typename T>
+static asio::awaitable<IOResult> asio_write(SocketRef sock, const T& buffers) {
+  auto [ec, n] = co_await ::asio::async_write(
+      sock, buffers, ::asio::experimental::as_tuple(::asio::use_awaitable));
+  co_return IOResult{n, ec};
+}
+
+#if SNOVA_HAS_IO_URING
+// 16 pending buffers of a paused relay hold 256KB, 256 buffers are shared by all relays of the
+// io thread.
+static constexpr uint32_t kUringEntries = 1024;
+static constexpr uint32_t kUringBufferSize = 16384;
+static constexpr uint32_t kUringBufferCount = 256;
+
+static thread_local uint32_t g_uring_relay_num = 0;
+
+class UringContext {
+ public:
+  explicit UringContext(const asio::any_io_executor& ex) : executor_(ex) {}
+  ~UringContext() {
+    if (event_fd_) {
+      event_fd_->release();
+    }
+  }
+  int Init() {
+    int rc = ring_.Init(kUringEntries);
+    if (0 != rc) {
+      return rc;
+    }
+    arena_ = get_iobuf(kUringBufferSize * kUringBufferCount);
+    rc = ring_.SetupBuffers(arena_->data(), kUringBufferSize, kUringBufferCount);
+    if (0 != rc) {
+      // socket ops still work, only relays need provided buffers.
+      SNOVA_ERROR("Failed to setup io_uring provided buffers:{}", strerror(-rc));
+      arena_.reset();
+    }
+    event_fd_ = std::make_unique<asio::posix::stream_descriptor>(executor_, ring_.GetEventFd());
+    ::asio::co_spawn(executor_, ReapLoop(), ::asio::detached);
+    return 0;
+  }
+  IoUring& GetRing() { return ring_; }
+  const asio::any_io_executor& GetExecutor() const { return executor_; }
+  void ScheduleSubmit() {
+    if (submit_scheduled_) {
+      return;
+    }
+    submit_scheduled_ = true;
+    ::asio::post(executor_, [this]() {
+      submit_scheduled_ = false;
+      ring_.Submit();
+    });
+  }
+
+ private:
+  asio::awaitable<void> ReapLoop() {
+    while (true) {
+      auto [ec] = co_await event_fd_->async_wait(
+          asio::posix::stream_descriptor::wait_read,
+          ::asio::experimental::as_tuple(::asio::use_awaitable));
+      if (ec) {
+        SNOVA_ERROR("Failed to wait io_uring eventfd:{}", ec);
+        break;
+      }
+      eventfd_t v;
+      eventfd_read(ring_.GetEventFd(), &v);
+      ring_.Reap();
+      // callbacks queue new ops(re-armed receives, next writes) very often.
+      if (ring_.PendingSubmits() > 0) {
+        ScheduleSubmit();
+      }
+    }
+  }
+
+  asio::any_io_executor executor_;
+  IoUring ring_;
+  IOBufPtr arena_;
+  // only for readiness, the fd is owned by 'ring_'.
+  std::unique_ptr<asio::posix::stream_descriptor> event_fd_;
+  bool submit_scheduled_ = false;
+};
+static thread_local std::unique_ptr<UringContext> g_uring_ctx;
+
+// steady_timer as the condition variable of an op's completion.
+struct UringWaiter {
+  ::asio::steady_timer timer;
+  int32_t result = 0;
+  bool done = false;
+  explicit UringWaiter(const asio::any_io_executor& ex) : timer(ex) {
+    timer.expires_at(::asio::steady_timer::time_point::max());
+  }
+  void Complete(int32_t res) {
+    result = res;
+    done = true;
+    timer.cancel();
+  }
+  // the kernel may still access buffers of a cancelled op, so always wait the real completion,
+  // 'cancel' stops the op if the awaiting coroutine is cancelled.
+  template <typename Cancel>
+  asio::awaitable<void> Wait(Cancel&& cancel) {
+    bool cancelled = false;
+    while (!done) {
+      co_await timer.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+      if (!done && !cancelled) {
+        asio::cancellation_state state = co_await asio::this_coro::cancellation_state;
+        if (state.cancelled() != asio::cancellation_type::none) {
+          cancelled = true;
+          cancel();
+          g_uring_ctx->ScheduleSubmit();
+          co_await asio::this_coro::reset_cancellation_state();
+        }
+      }
+    }
+  }
+};
+using UringWaiterPtr = std::shared_ptr<UringWaiter>;
+
+// issue one op by 'start' and wait its result, -EBUSY if the submission queue is full.
+template <typename Start>
+static asio::awaitable<int32_t> await_uring_op(Start&& start) {
+  auto waiter = std::make_shared<UringWaiter>(g_uring_ctx->GetExecutor());
+  uint64_t op_id = start([waiter](int32_t res, uint32_t flags) { waiter->Complete(res); });
+  if (0 == op_id) {
+    co_return -EBUSY;
+  }
+  g_uring_ctx->ScheduleSubmit();
+  co_await waiter->Wait([op_id]() { g_uring_ctx->GetRing().Cancel(op_id); });
+  co_return waiter->result;
+}
+
+static std::error_code to_error_code(int32_t res) {
+  return std::error_code(-res, std::system_category());
+}
+
+int init_io_uring(const asio::any_io_executor& ex) {
+  if (g_uring_ctx) {
+    return 0;
+  }
+  auto ctx = std::make_unique<UringContext>(ex);
+  int rc = ctx->Init();
+  if (0 != rc) {
+    return rc;
+  }
+  g_uring_ctx = std::move(ctx);
+  return 0;
+}
+bool is_io_uring_enabled() { return g_uring_ctx != nullptr; }
+
+void register_uring_stat() {
+  register_stat_func([]() -> StatValues {
+    StatValues vals;
+    if (!g_uring_ctx) {
+      return vals;
+    }
+    const IoUring& ring = g_uring_ctx->GetRing();
+    const IoUringStats& stats = ring.GetStats();
+    auto& kv = vals["IoUring"];
+    kv["submit_calls"] = std::to_string(stats.submit_calls);
+    kv["submitted_sqes"] = std::to_string(stats.submitted_sqes);
+    kv["completions"] = std::to_string(stats.completions);
+    kv["recv_arms"] = std::to_string(stats.recv_arms);
+    kv["no_buffers"] = std::to_string(stats.no_buffers);
+    kv["fixed_writes"] = std::to_string(stats.fixed_writes);
+    kv["inflight_ops"] = std::to_string(ring.InflightOps());
+    kv["relay_num"] = std::to_string(g_uring_relay_num);
+    return vals;
+  });
+}
+
+asio::awaitable<IOResult> uring_read_some(SocketRef sock, const asio::mutable_buffer& buffer) {
+  if (!g_uring_ctx) {
+    co_return co_await asio_read_some(sock, buffer);
+  }
+  int fd = sock.native_handle();
+  int32_t res = co_await await_uring_op([&](IoUring::Callback&& cb) {
+    return g_uring_ctx->GetRing().Recv(fd, buffer.data(), buffer.size(), std::move(cb));
+  });
+  if (-EBUSY == res) {
+    co_return co_await asio_read_some(sock, buffer);
+  }
+  if (res < 0) {
+    co_return IOResult{0, to_error_code(res)};
+  }
+  if (0 == res && buffer.size() > 0) {
+    co_return IOResult{0, ::asio::error::eof};
+  }
+  co_return IOResult{static_cast<size_t>(res), std::error_code{}};
+}
+
+asio::awaitable<IOResult> uring_write(SocketRef sock, const asio::const_buffer& buffer) {
+  if (!g_uring_ctx) {
+    co_return co_await asio_write(sock, buffer);
+  }
+  int fd = sock.native_handle();
+  size_t written = 0;
+  while (written < buffer.size()) {
+    const uint8_t* data = static_cast<const uint8_t*>(buffer.data()) + written;
+    size_t len = buffer.size() - written;
+    int32_t res = co_await await_uring_op([&](IoUring::Callback&& cb) {
+      return g_uring_ctx->GetRing().Send(fd, data, len, std::move(cb));
+    });
+    if (-EBUSY == res) {
+      auto [n, ec] = co_await asio_write(sock, asio::const_buffer(data, len));
+      co_return IOResult{written + n, ec};
+    }
+    if (res < 0) {
+      co_return IOResult{written, to_error_code(res)};
+    }
+    written += res;
+  }
+  co_return IOResult{written, std::error_code{}};
+}
+
+asio::awaitable<IOResult> uring_write(SocketRef sock,
+                                      const std::vector<::asio::const_buffer>& buffers) {
+  if (!g_uring_ctx) {
+    co_return co_await asio_write(sock, buffers);
+  }
+  int fd = sock.native_handle();
+  std::vector<struct iovec> iov(buffers.size());
+  size_t total = 0;
+  for (size_t i = 0; i < buffers.size(); i++) {
+    iov[i].iov_base = const_cast<void*>(buffers[i].data());
+    iov[i].iov_len = buffers[i].size();
+    total += buffers[i].size();
+  }
+  size_t written = 0;
+  size_t iov_idx = 0;
+  while (written < total) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov[iov_idx];
+    msg.msg_iovlen = iov.size() - iov_idx;
+    int32_t res = co_await await_uring_op([&](IoUring::Callback&& cb) {
+      return g_uring_ctx->GetRing().SendMsg(fd, &msg, std::move(cb));
+    });
+    if (-EBUSY == res) {
+      std::vector<::asio::const_buffer> rest;
+      for (size_t i = iov_idx; i < iov.size(); i++) {
+        rest.emplace_back(iov[i].iov_base, iov[i].iov_len);
+      }
+      auto [n, ec] = co_await asio_write(sock, rest);
+      co_return IOResult{written + n, ec};
+    }
+    if (res < 0) {
+      co_return IOResult{written, to_error_code(res)};
+    }
+    written += res;
+    // skip fully sent iovecs, then trim the partially sent one.
+    size_t n = res;
+    while (iov_idx < iov.size() && n >= iov[iov_idx].iov_len) {
+      n -= iov[iov_idx].iov_len;
+      iov_idx++;
+    }
+    if (n > 0) {
+      iov[iov_idx].iov_base = static_cast<uint8_t*>(iov[iov_idx].iov_base) + n;
+      iov[iov_idx].iov_len -= n;
+    }
+  }
+  co_return IOResult{written, std::error_code{}};
+}
+
+asio::awaitable<std::error_code> uring_relay(SocketRef from, SocketRef to,
+                                             const std::function<void()>& routine) {
+  if (!g_uring_ctx || !g_uring_ctx->GetRing().HasProvidedBuffers()) {
+    co_return std::make_error_code(std::errc::operation_not_supported);
+  }
+  auto waiter = std::make_shared<UringWaiter>(g_uring_ctx->GetExecutor());
+  std::function<void()> on_activity = routine;
+  auto relay = std::make_shared<IoUringRelay>(g_uring_ctx->GetRing(), from.native_handle(),
+                                              to.native_handle(), std::move(on_activity),
+                                              [waiter](int err) { waiter->Complete(err); });
+  g_uring_relay_num++;
+  relay->Start();
+  g_uring_ctx->ScheduleSubmit();
+  co_await waiter->Wait([relay]() { relay->Stop(); });
+  g_uring_relay_num--;
+  if (0 != waiter->result) {
+    co_return std::error_code(waiter->result, std::system_category());
+  }
+  co_return std::error_code{};
+}
+
+void close_socket(SocketRef sock) {
+  if (g_uring_ctx && sock.is_open()) {
+    int fd = sock.native_handle();
+    // submit now, the fd number could be reused once closed.
+    g_uring_ctx->GetRing().CancelFd(fd);
+    g_uring_ctx->GetRing().Submit();
+    ::shutdown(fd, SHUT_RDWR);
+  }
+  std::error_code ec;
+  sock.close(ec);
+}
+
+IOConnectionPtr new_tcp_connection(::asio::ip::tcp::socket&& sock) {
+  if (g_uring_ctx) {
+    return std::make_unique<UringSocket>(std::move(sock));
+  }
+  return std::make_unique<TcpSocket>(std::move(sock));
+}
+#else
+int init_io_uring(const asio::any_io_executor& ex) { return -ENOSYS; }
+bool is_io_uring_enabled() { return false; }
+void register_uring_stat() {}
+asio::awaitable<IOResult> uring_read_some(SocketRef sock, const asio::mutable_buffer& buffer) {
+  co_return co_await asio_read_some(sock, buffer);
+}
+asio::awaitable<IOResult> uring_write(SocketRef sock, const asio::const_buffer& buffer) {
+  co_return co_await asio_write(sock, buffer);
+}
+asio::awaitable<IOResult> uring_write(SocketRef sock,
+                                      const std::vector<::asio::const_buffer>& buffers) {
+  co_return co_await asio_write(sock, buffers);
+}
+asio::awaitable<std::error_code> uring_relay(SocketRef from, SocketRef to,
+                                             const std::function<void()>& routine) {
+  co_return std::make_error_code(std::errc::operation_not_supported);
+}
+void close_socket(SocketRef sock) {
+  std::error_code ec;
+  sock.close(ec);
+}
+IOConnectionPtr new_tcp_connection(::asio::ip::tcp::socket&& sock) {
+  return std::make_unique<TcpSocket>(std::move(sock));
+}
+#endif
+
+UringSocket::UringSocket(::asio::ip::tcp::socket&& sock) : socket_(std::move(sock)) {}
+}  // namespace snova
@@ -0,0 +1,80 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+#include "asio.hpp"
+#include "snova/io/io.h"
+
+namespace snova {
+// create the io_uring engine of current io thread, return 0 or -errno(-ENOSYS if not built with
+// io_uring), callers keep using epoll on failure.
+int init_io_uring(const asio::any_io_executor& ex);
+bool is_io_uring_enabled();
+
+// read/write a tcp socket by io_uring of current io thread, or by asio if it's not enabled.
+asio::awaitable<IOResult> uring_read_some(SocketRef sock, const asio::mutable_buffer& buffer);
+asio::awaitable<IOResult> uring_write(SocketRef sock, const asio::const_buffer& buffer);
+asio::awaitable<IOResult> uring_write(SocketRef sock,
+                                      const std::vector<::asio::const_buffer>& buffers);
+// relay 'from' to 'to' with provided buffers until eof/error, return 'operation_not_supported'
+// without doing anything if io_uring is not enabled.
+asio::awaitable<std::error_code> uring_relay(SocketRef from, SocketRef to,
+                                             const std::function<void()>& routine);
+// asio's close can not abort io_uring ops on the socket, cancel them before close.
+void close_socket(SocketRef sock);
+
+class UringSocket : public IOConnection {
+ public:
+  explicit UringSocket(::asio::ip::tcp::socket&& sock);
+
+  asio::any_io_executor GetExecutor() override { return socket_.get_executor(); }
+  asio::awaitable<IOResult> AsyncWrite(const asio::const_buffer& buffers) override {
+    co_return co_await uring_write(socket_, buffers);
+  }
+  asio::awaitable<IOResult> AsyncWrite(const std::vector<::asio::const_buffer>& buffers) override {
+    co_return co_await uring_write(socket_, buffers);
+  }
+  asio::awaitable<IOResult> AsyncRead(const asio::mutable_buffer& buffers) override {
+    co_return co_await uring_read_some(socket_, buffers);
+  }
+  void Close() override { close_socket(socket_); }
+
+ private:
+  ::asio::ip::tcp::socket socket_;
+};
+
+// UringSocket if io_uring is enabled on current io thread, TcpSocket otherwise.
+IOConnectionPtr new_tcp_connection(::asio::ip::tcp::socket&& sock);
+
+void register_uring_stat();
+
+}  // namespace snova
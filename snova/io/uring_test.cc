@@ -0,0 +1,186 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/uring.h"
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+#include "snova/io/relay_bench.h"
+using namespace snova;                // NOLINT
+using namespace snova::relay_bench;  // NOLINT
+
+namespace {
+static constexpr size_t kChunkSize = 16384;
+static constexpr uint32_t kBufferCount = 128;
+
+struct UringRelayResult {
+  int err = -1;
+  uint64_t bytes = 0;
+};
+
+UringRelayResult uring_relay(IoUring& ring, int from, int to) {
+  UringRelayResult result;
+  bool done = false;
+  auto relay = std::make_shared<IoUringRelay>(ring, from, to, nullptr, [&](int err) {
+    result.err = err;
+    done = true;
+  });
+  relay->Start();
+  while (!done) {
+    ring.SubmitAndWait();
+    ring.Reap();
+  }
+  result.bytes = relay->GetRelayBytes();
+  return result;
+}
+
+std::unique_ptr<IoUring> new_ring(std::vector<uint8_t>& arena,
+                                  uint32_t buffer_count = kBufferCount) {
+  auto ring = std::make_unique<IoUring>();
+  if (ring->Init(256) != 0) {
+    return nullptr;
+  }
+  arena.resize(kChunkSize * buffer_count);
+  if (ring->SetupBuffers(arena.data(), kChunkSize, buffer_count) != 0) {
+    return nullptr;
+  }
+  return ring;
+}
+}  // namespace
+
+TEST(IoUring, Relay) {
+  std::vector<uint8_t> arena;
+  auto ring = new_ring(arena);
+  if (!ring) {
+    GTEST_SKIP() << "io_uring with provided buffers is not available.";
+  }
+  RelayBench bench;
+  ASSERT_TRUE(bench.Start(64 * 1024 * 1024 + 1234));
+  UringRelayResult result = uring_relay(*ring, bench.in[1], bench.out[0]);
+  bench.Finish();
+  ASSERT_EQ(0, result.err);
+  ASSERT_EQ(bench.total, result.bytes);
+  ASSERT_EQ(bench.total, bench.received);
+  ASSERT_FALSE(bench.corrupted);
+  ASSERT_EQ(0u, ring->InflightOps());
+}
+
+TEST(IoUring, RelayOutOfBuffers) {
+  std::vector<uint8_t> arena;
+  // the reader runs out of buffers while its own are still being written.
+  auto ring = new_ring(arena, 2);
+  if (!ring) {
+    GTEST_SKIP() << "io_uring with provided buffers is not available.";
+  }
+  RelayBench bench;
+  bench.sink_delay_us = 1000;
+  ASSERT_TRUE(bench.Start(8 * 1024 * 1024));
+  UringRelayResult result = uring_relay(*ring, bench.in[1], bench.out[0]);
+  bench.Finish();
+  ASSERT_EQ(0, result.err);
+  ASSERT_EQ(bench.total, bench.received);
+  ASSERT_FALSE(bench.corrupted);
+  // recv is re-armed about once per recycled buffer, not spinning on ENOBUFS while the writes
+  // are blocked(~150k arms before).
+  ASSERT_GT(ring->GetStats().no_buffers, 0u);
+  ASSERT_LE(ring->GetStats().recv_arms, bench.total / 1024);
+}
+
+TEST(IoUring, StopRelay) {
+  std::vector<uint8_t> arena;
+  auto ring = new_ring(arena);
+  if (!ring) {
+    GTEST_SKIP() << "io_uring with provided buffers is not available.";
+  }
+  int in[2], out[2];
+  ASSERT_TRUE(tcp_pair(in));
+  ASSERT_TRUE(tcp_pair(out));
+  int err = -1;
+  auto relay = std::make_shared<IoUringRelay>(*ring, in[1], out[0], nullptr,
+                                              [&](int e) { err = e; });
+  relay->Start();
+  ring->Submit();
+  relay->Stop();
+  while (err < 0) {
+    ring->SubmitAndWait();
+    ring->Reap();
+  }
+  ASSERT_EQ(ECANCELED, err);
+  ASSERT_EQ(0u, ring->InflightOps());
+  for (int fd : {in[0], in[1], out[0], out[1]}) {
+    close(fd);
+  }
+}
+
+TEST(IoUring, CancelFd) {
+  std::vector<uint8_t> arena;
+  auto ring = new_ring(arena);
+  if (!ring) {
+    GTEST_SKIP() << "io_uring with provided buffers is not available.";
+  }
+  int fds[2];
+  ASSERT_TRUE(tcp_pair(fds));
+  uint8_t buf[16];
+  int32_t result = 1;
+  ring->Recv(fds[0], buf, sizeof(buf), [&](int32_t res, uint32_t flags) { result = res; });
+  ring->Submit();
+  ring->CancelFd(fds[0]);
+  // kernel without fd cancel still wakes the receive by shutdown.
+  ::shutdown(fds[0], SHUT_RDWR);
+  while (result > 0) {
+    ring->SubmitAndWait();
+    ring->Reap();
+  }
+  ASSERT_TRUE(result == -ECANCELED || result == 0);
+  ASSERT_EQ(0u, ring->InflightOps());
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(IoUring, LoopbackBenchmark) {
+  std::vector<uint8_t> arena;
+  auto ring = new_ring(arena);
+  if (!ring) {
+    GTEST_SKIP() << "io_uring with provided buffers is not available.";
+  }
+  static constexpr uint64_t kBytes = 1024ULL * 1024 * 1024;
+  ASSERT_TRUE(run_benchmark("epoll", kBytes, 3,
+                            [](int from, int to) { epoll_relay(from, to, kChunkSize); }));
+  ASSERT_TRUE(run_benchmark("io_uring", kBytes, 3,
+                            [&](int from, int to) { uring_relay(*ring, from, to); }));
+  const IoUringStats& stats = ring->GetStats();
+  printf("io_uring submit_calls:%llu sqes:%llu cqes:%llu recv_arms:%llu no_buffers:%llu\n",
+         static_cast<unsigned long long>(stats.submit_calls),    // NOLINT
+         static_cast<unsigned long long>(stats.submitted_sqes),  // NOLINT
+         static_cast<unsigned long long>(stats.completions),     // NOLINT
+         static_cast<unsigned long long>(stats.recv_arms),       // NOLINT
+         static_cast<unsigned long long>(stats.no_buffers));     // NOLINT
+}
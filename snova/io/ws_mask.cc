@@ -0,0 +1,170 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/io/ws_mask.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define SNOVA_WS_MASK_SSE2 1
+#if defined(__GNUC__) || defined(__clang__)
+// compiled for AVX2 and chosen at runtime.
+#define SNOVA_WS_MASK_AVX2 1
+#define SNOVA_WS_MASK_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#define SNOVA_WS_MASK_AVX2 1
+#define SNOVA_WS_MASK_AVX2_TARGET
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define SNOVA_WS_MASK_NEON 1
+#endif
+
+namespace snova {
+// 32 bytes of the mask key rotated to start at 'offset'.
+static void fill_mask_pattern(const uint8_t mask_key[4], uint64_t offset, uint8_t pattern[32]) {
+  for (size_t i = 0; i < 32; i++) {
+    pattern[i] = mask_key[(offset + i) & 3];
+  }
+}
+
+static void mask_tail(uint8_t* data, size_t len, const uint8_t pattern[32]) {
+  // every 8 bytes of the pattern are the same since 8 is a multiple of 4.
+  uint64_t key64;
+  memcpy(&key64, pattern, sizeof(key64));
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, sizeof(v));
+    v ^= key64;
+    memcpy(data + i, &v, sizeof(v));
+  }
+  for (; i < len; i++) {
+    data[i] ^= pattern[i & 7];
+  }
+}
+
+void ws_mask_scalar(uint8_t* data, size_t len, const uint8_t mask_key[4], uint64_t offset) {
+  uint8_t pattern[32];
+  fill_mask_pattern(mask_key, offset, pattern);
+  mask_tail(data, len, pattern);
+}
+
+#if defined(SNOVA_WS_MASK_AVX2)
+SNOVA_WS_MASK_AVX2_TARGET static size_t mask_avx2(uint8_t* data, size_t len,
+                                                  const uint8_t pattern[32]) {
+  __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    __m256i* p = reinterpret_cast<__m256i*>(data + i);
+    __m256i v0 = _mm256_loadu_si256(p);
+    __m256i v1 = _mm256_loadu_si256(p + 1);
+    __m256i v2 = _mm256_loadu_si256(p + 2);
+    __m256i v3 = _mm256_loadu_si256(p + 3);
+    _mm256_storeu_si256(p, _mm256_xor_si256(v0, key));
+    _mm256_storeu_si256(p + 1, _mm256_xor_si256(v1, key));
+    _mm256_storeu_si256(p + 2, _mm256_xor_si256(v2, key));
+    _mm256_storeu_si256(p + 3, _mm256_xor_si256(v3, key));
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i* p = reinterpret_cast<__m256i*>(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key));
+  }
+  return i;
+}
+static bool has_avx2() {
+#if defined(__GNUC__) || defined(__clang__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return true;
+#endif
+}
+#endif
+
+#if defined(SNOVA_WS_MASK_SSE2)
+static size_t mask_sse2(uint8_t* data, size_t len, const uint8_t pattern[32]) {
+  __m128i key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m128i* p = reinterpret_cast<__m128i*>(data + i);
+    __m128i v0 = _mm_loadu_si128(p);
+    __m128i v1 = _mm_loadu_si128(p + 1);
+    __m128i v2 = _mm_loadu_si128(p + 2);
+    __m128i v3 = _mm_loadu_si128(p + 3);
+    _mm_storeu_si128(p, _mm_xor_si128(v0, key));
+    _mm_storeu_si128(p + 1, _mm_xor_si128(v1, key));
+    _mm_storeu_si128(p + 2, _mm_xor_si128(v2, key));
+    _mm_storeu_si128(p + 3, _mm_xor_si128(v3, key));
+  }
+  for (; i + 16 <= len; i += 16) {
+    __m128i* p = reinterpret_cast<__m128i*>(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key));
+  }
+  return i;
+}
+#endif
+
+#if defined(SNOVA_WS_MASK_NEON)
+static size_t mask_neon(uint8_t* data, size_t len, const uint8_t pattern[32]) {
+  uint8x16_t key = vld1q_u8(pattern);
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    uint8x16_t v0 = vld1q_u8(data + i);
+    uint8x16_t v1 = vld1q_u8(data + i + 16);
+    uint8x16_t v2 = vld1q_u8(data + i + 32);
+    uint8x16_t v3 = vld1q_u8(data + i + 48);
+    vst1q_u8(data + i, veorq_u8(v0, key));
+    vst1q_u8(data + i + 16, veorq_u8(v1, key));
+    vst1q_u8(data + i + 32, veorq_u8(v2, key));
+    vst1q_u8(data + i + 48, veorq_u8(v3, key));
+  }
+  for (; i + 16 <= len; i += 16) {
+    vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), key));
+  }
+  return i;
+}
+#endif
+
+void ws_mask(uint8_t* data, size_t len, const uint8_t mask_key[4], uint64_t offset) {
+  uint8_t pattern[32];
+  fill_mask_pattern(mask_key, offset, pattern);
+  // vector widths are multiples of 4, so the pattern stays in phase after each kernel.
+  size_t done = 0;
+#if defined(SNOVA_WS_MASK_AVX2)
+  if (has_avx2()) {
+    done = mask_avx2(data, len, pattern);
+  }
+#endif
+#if defined(SNOVA_WS_MASK_SSE2)
+  done += mask_sse2(data + done, len - done, pattern);
+#elif defined(SNOVA_WS_MASK_NEON)
+  done += mask_neon(data + done, len - done, pattern);
+#endif
+  mask_tail(data + done, len - done, pattern);
+}
+}  // namespace snova
@@ -26,36 +26,15 @@
  *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
-
 #pragma once
-#include "asio.hpp"
-#include "asio/experimental/channel.hpp"
-namespace snova {
-using AsyncChannelMutexExecutor =
-    typename asio::experimental::channel<void(std::error_code, bool)>::executor_type;
-class AsyncChannelMutex {
- public:
-  explicit AsyncChannelMutex(const AsyncChannelMutexExecutor& ex);
-  asio::awaitable<std::error_code> Lock();
-  asio::awaitable<std::error_code> Unlock();
-  void Close();
-  size_t GetWaitCount() const { return wait_count_; }
-  bool IsLocked() const { return locked_; }
-
- private:
-  asio::experimental::channel<void(std::error_code, bool)> channel_;
-  size_t wait_count_;
-  bool locked_;
-};
+#include <stddef.h>
+#include <stdint.h>
 
-// class AsyncSpinMutex {
-//  public:
-//   AsyncSpinMutex(const typename ::asio::steady_timer::executor_type& ex);
-//   asio::awaitable<std::error_code> Lock();
-//   asio::awaitable<std::error_code> Unlock();
-//   void Close();
-
-//  private:
-//   bool locked_;
-// };
+namespace snova {
+// XOR 'len' bytes of a websocket payload with the 4 bytes 'mask_key', 'offset' is the position of
+// 'data' in the frame payload so a frame could be (un)masked piece by piece. Masking and unmasking
+// are the same operation, it runs with AVX2/SSE2/NEON if available.
+void ws_mask(uint8_t* data, size_t len, const uint8_t mask_key[4], uint64_t offset = 0);
+// portable fallback of 'ws_mask', 8 bytes a time.
+void ws_mask_scalar(uint8_t* data, size_t len, const uint8_t mask_key[4], uint64_t offset = 0);
 }  // namespace snova
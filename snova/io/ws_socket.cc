@@ -28,6 +28,7 @@
  */
 
 #include "snova/io/ws_socket.h"
+#include <limits>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -38,6 +39,7 @@
 
 #include "snova/io/buffered_io.h"
 #include "snova/io/io_util.h"
+#include "snova/io/ws_mask.h"
 #include "snova/log/log_macros.h"
 #include "snova/util/endian.h"
 #include "snova/util/http_helper.h"
@@ -138,13 +140,8 @@ asio::awaitable<std::error_code> WebSocket::AsyncAccept() {
   is_server_ = true;
   co_return std::error_code{};
 }
-asio::awaitable<IOResult> WebSocket::AsyncWrite(const std::vector<::asio::const_buffer>& buffers) {
-  co_return IOResult{0, std::error_code{}};
-}
-asio::awaitable<IOResult> WebSocket::AsyncWrite(const asio::const_buffer& buffers) {
-  uint8_t head_buffer_data[128];
-  size_t data_len = buffers.size();
-  // SNOVA_INFO("##WS send {} bytes!", data_len);
+size_t WebSocket::EncodeFrameHeader(uint64_t data_len, uint8_t* head_buffer_data,
+                                    uint8_t* mask_key) {
   size_t offset = 2;
   head_buffer_data[0] = 0x82;  // binary msg
   if (data_len <= 125) {
@@ -161,19 +158,52 @@ asio::awaitable<IOResult> WebSocket::AsyncWrite(const asio::const_buffer& buffer
     offset += 2;
   }
   if (!is_server_) {
+    // client frames must be masked by a random key.
     head_buffer_data[1] = (0x80 | head_buffer_data[1]);
-    uint8_t mask_key[4];  // random value
+    uint32_t key = static_cast<uint32_t>(random_uint64(0, std::numeric_limits<uint32_t>::max()));
+    memcpy(mask_key, &key, 4);
     memcpy(head_buffer_data + offset, mask_key, 4);
     offset += 4;
-    uint8_t* send_data = reinterpret_cast<uint8_t*>(const_cast<void*>(buffers.data()));
-    for (size_t i = 0; i < data_len; i++) {
-      send_data[i] = (send_data[i] ^ mask_key[i % 4]);
+  }
+  return offset;
+}
+asio::awaitable<IOResult> WebSocket::AsyncWrite(const std::vector<::asio::const_buffer>& buffers) {
+  // one frame for all the buffers.
+  size_t data_len = 0;
+  for (const auto& buffer : buffers) {
+    data_len += buffer.size();
+  }
+  uint8_t head_buffer_data[kMaxFrameHeaderSize];
+  uint8_t mask_key[4];
+  size_t head_len = EncodeFrameHeader(data_len, head_buffer_data, mask_key);
+  std::vector<::asio::const_buffer> send_bufs;
+  send_bufs.reserve(buffers.size() + 1);
+  send_bufs.push_back(::asio::buffer(head_buffer_data, head_len));
+  uint64_t mask_offset = 0;
+  for (const auto& buffer : buffers) {
+    if (!is_server_) {
+      // masked in place like the single buffer write, callers never reuse the written bytes.
+      uint8_t* send_data = reinterpret_cast<uint8_t*>(const_cast<void*>(buffer.data()));
+      ws_mask(send_data, buffer.size(), mask_key, mask_offset);
+      mask_offset += buffer.size();
     }
-  } else {
-    // memcpy(head_buffer_data + offset, buffers.data(), data_len);
+    send_bufs.push_back(buffer);
+  }
+  auto [n, ec] = co_await io_->AsyncWrite(send_bufs);
+  co_return IOResult{data_len, ec};
+}
+asio::awaitable<IOResult> WebSocket::AsyncWrite(const asio::const_buffer& buffers) {
+  uint8_t head_buffer_data[kMaxFrameHeaderSize];
+  uint8_t mask_key[4];
+  size_t data_len = buffers.size();
+  // SNOVA_INFO("##WS send {} bytes!", data_len);
+  size_t head_len = EncodeFrameHeader(data_len, head_buffer_data, mask_key);
+  if (!is_server_) {
+    uint8_t* send_data = reinterpret_cast<uint8_t*>(const_cast<void*>(buffers.data()));
+    ws_mask(send_data, data_len, mask_key);
   }
   std::vector<::asio::const_buffer> send_bufs;
-  send_bufs.push_back(::asio::buffer(head_buffer_data, offset));
+  send_bufs.push_back(::asio::buffer(head_buffer_data, head_len));
   send_bufs.push_back(buffers);
   auto [n, ec] = co_await io_->AsyncWrite(send_bufs);
   co_return IOResult{data_len, ec};
@@ -190,14 +220,13 @@ asio::awaitable<IOResult> WebSocket::AsyncWrite(const asio::const_buffer& buffer
 //   }
 //   return 0;
 // }
-asio::awaitable<IOResult> WebSocket::AsyncRead(const asio::mutable_buffer& buffers) {
+asio::awaitable<std::error_code> WebSocket::ReadFrameHeader() {
   uint8_t header_bytes[2];
   auto ec = co_await read_exact(*io_, ::asio::buffer(header_bytes, 2));
   if (ec) {
-    co_return IOResult{0, ec};
+    co_return ec;
   }
   uint8_t byte0 = header_bytes[0];
-  uint8_t frame_fin = (byte0 & 0x1);
   uint8_t frame_opcode = (byte0 & 0x0F);
   uint8_t byte1 = header_bytes[1];
   uint8_t frame_mask = (byte1 >> 7);
@@ -205,56 +234,60 @@ asio::awaitable<IOResult> WebSocket::AsyncRead(const asio::mutable_buffer& buffe
   uint64_t data_msg_len = frame_payload_len;
   if (frame_opcode != 0x2) {
     // onlyu accept binary msg
-    // Close();
-    // co_return IOResult{0, std::error_code{}};
     SNOVA_ERROR("Recv unexpected {}", frame_opcode);
   }
-
-  // SNOVA_INFO("Recv data opcode:{}, len:{},frame_opcode:{},frame_mask:{},data_msg_len:{} ",
-  //            frame_opcode, n, frame_opcode, frame_mask, data_msg_len);
   if (frame_payload_len == 126) {
     uint16_t data_len = 0;
     ec = co_await read_exact(*io_, ::asio::buffer(reinterpret_cast<uint8_t*>(&data_len), 2));
     if (ec) {
-      co_return IOResult{0, ec};
+      co_return ec;
     }
-    data_len = big_to_native(data_len);
-    data_msg_len = data_len;
+    data_msg_len = big_to_native(data_len);
   } else if (frame_payload_len == 127) {
     uint64_t data_len = 0;
     ec = co_await read_exact(*io_, ::asio::buffer(reinterpret_cast<uint8_t*>(&data_len), 8));
     if (ec) {
-      co_return IOResult{0, ec};
+      co_return ec;
     }
-    data_len = big_to_native(data_len);
-    data_msg_len = data_len;
+    data_msg_len = big_to_native(data_len);
   }
-  if (buffers.size() < data_msg_len) {
-    co_return IOResult{0, std::make_error_code(std::errc::no_buffer_space)};
-  }
-  // SNOVA_INFO("##WS recv {} bytes with mask:{}!", data_msg_len, frame_mask);
-
-  if (frame_mask == 1) {
-    uint8_t mask_key[4];
-    ec = co_await read_exact(*io_, ::asio::buffer(mask_key, 4));
+  frame_masked_ = frame_mask == 1;
+  if (frame_masked_) {
+    ec = co_await read_exact(*io_, ::asio::buffer(frame_mask_key_, 4));
     if (ec) {
-      co_return IOResult{0, ec};
-    }
-    ec = co_await read_exact(*io_, ::asio::buffer(buffers.data(), data_msg_len));
-    if (ec) {
-      co_return IOResult{0, ec};
-    }
-    uint8_t* buffer_bytes = reinterpret_cast<uint8_t*>(buffers.data());
-    for (size_t i = 0; i < data_msg_len; i++) {
-      buffer_bytes[i] ^= mask_key[i % 4];
+      co_return ec;
     }
-  } else {
-    ec = co_await read_exact(*io_, ::asio::buffer(buffers.data(), data_msg_len));
+  }
+  // SNOVA_INFO("##WS recv {} bytes with mask:{}!", data_msg_len, frame_mask);
+  frame_remain_ = data_msg_len;
+  frame_offset_ = 0;
+  co_return std::error_code{};
+}
+asio::awaitable<IOResult> WebSocket::AsyncRead(const asio::mutable_buffer& buffers) {
+  if (buffers.size() == 0) {
+    co_return IOResult{0, std::error_code{}};
+  }
+  // frames larger than caller's buffer are delivered by several reads, empty frames are skipped.
+  while (0 == frame_remain_) {
+    auto ec = co_await ReadFrameHeader();
     if (ec) {
       co_return IOResult{0, ec};
     }
   }
-  co_return IOResult{data_msg_len, std::error_code{}};
+  size_t read_len = buffers.size();
+  if (frame_remain_ < read_len) {
+    read_len = static_cast<size_t>(frame_remain_);
+  }
+  auto [n, ec] = co_await io_->AsyncRead(::asio::buffer(buffers.data(), read_len));
+  if (ec) {
+    co_return IOResult{0, ec};
+  }
+  if (frame_masked_) {
+    ws_mask(reinterpret_cast<uint8_t*>(buffers.data()), n, frame_mask_key_, frame_offset_);
+  }
+  frame_offset_ += n;
+  frame_remain_ -= n;
+  co_return IOResult{n, std::error_code{}};
 }
 void WebSocket::Close() { io_->Close(); }
 }  // namespace snova
@@ -45,7 +45,18 @@ class WebSocket : public IOConnection {
   void Close() override;
 
  private:
+  // 2 bytes head, 8 bytes extended length and 4 bytes mask key at most.
+  static constexpr size_t kMaxFrameHeaderSize = 14;
+  // return the header length, 'mask_key' is filled for client frames.
+  size_t EncodeFrameHeader(uint64_t data_len, uint8_t* head_buffer_data, uint8_t* mask_key);
+  asio::awaitable<std::error_code> ReadFrameHeader();
   IOConnectionPtr io_;
+  // payload bytes of current frame not yet read, delivered in place into caller's buffer.
+  uint64_t frame_remain_ = 0;
+  // payload bytes of current frame already read, the position in the mask key.
+  uint64_t frame_offset_ = 0;
+  uint8_t frame_mask_key_[4] = {0, 0, 0, 0};
+  bool frame_masked_ = false;
   bool is_server_ = false;
 };
 }  // namespace snova
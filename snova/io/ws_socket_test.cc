@@ -28,10 +28,13 @@
  */
 #include "snova/io/ws_socket.h"
 #include <gtest/gtest.h>
+#include <chrono>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 #include "snova/io/tcp_socket.h"
+#include "snova/io/ws_mask.h"
 #include "snova/log/log_macros.h"
 #include "snova/util/address.h"
 #include "snova/util/net_helper.h"
@@ -76,3 +79,184 @@ TEST(WebSocket, Simple) {
       ::asio::detached);
   ctx.run();
 }
+
+static void mask_bytewise(uint8_t* data, size_t len, const uint8_t mask_key[4], uint64_t offset) {
+  for (size_t i = 0; i < len; i++) {
+    data[i] ^= mask_key[(offset + i) % 4];
+  }
+}
+
+TEST(WebSocket, Mask) {
+  const uint8_t mask_key[4] = {0x12, 0x34, 0x56, 0x78};
+  // every length around the vector widths, payload offsets and misaligned starts.
+  for (size_t len = 0; len < 300; len++) {
+    for (uint64_t offset = 0; offset < 8; offset++) {
+      for (size_t align = 0; align < 4; align++) {
+        std::vector<uint8_t> expected(len + align);
+        for (size_t i = 0; i < expected.size(); i++) {
+          expected[i] = static_cast<uint8_t>(i * 7);
+        }
+        std::vector<uint8_t> simd = expected;
+        std::vector<uint8_t> scalar = expected;
+        mask_bytewise(expected.data() + align, len, mask_key, offset);
+        ws_mask(simd.data() + align, len, mask_key, offset);
+        ws_mask_scalar(scalar.data() + align, len, mask_key, offset);
+        ASSERT_EQ(expected, simd) << len << "/" << offset;
+        ASSERT_EQ(expected, scalar) << len << "/" << offset;
+      }
+    }
+  }
+}
+
+TEST(WebSocket, MaskBenchmark) {
+  const uint8_t mask_key[4] = {1, 2, 3, 4};
+  std::vector<uint8_t> buffer(16 * 1024);
+  constexpr int kRounds = 20000;
+  auto bench = [&](const char* name, auto&& mask) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRounds; i++) {
+      mask(buffer.data(), buffer.size(), mask_key, i);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    SNOVA_INFO("Mask {}: {:.2f}GB/s", name, kRounds * buffer.size() / secs / 1e9);
+  };
+  bench("bytewise", mask_bytewise);
+  bench("scalar", [](uint8_t* data, size_t len, const uint8_t* key, uint64_t offset) {
+    ws_mask_scalar(data, len, key, offset);
+  });
+  bench("simd", [](uint8_t* data, size_t len, const uint8_t* key, uint64_t offset) {
+    ws_mask(data, len, key, offset);
+  });
+}
+
+static constexpr size_t kReadSize = 16 * 1024;  // mux connection read buffer
+static constexpr size_t kTotalBytes = 256 * 1024 * 1024;
+
+struct LoopbackResult {
+  uint64_t sent_sum = 0;
+  uint64_t recv_sum = 0;
+  size_t recv_bytes = 0;
+  double secs = 0;
+};
+
+// client writes 'kTotalBytes' in 'frame_size' writes, server reads by 'kReadSize'.
+static LoopbackResult run_loopback(bool use_ws, size_t frame_size) {
+  ::asio::io_context ctx;
+  ::asio::ip::tcp::acceptor acceptor(ctx, {::asio::ip::make_address("127.0.0.1"), 0});
+  auto endpoint = acceptor.local_endpoint();
+  LoopbackResult result;
+  auto start = std::chrono::steady_clock::now();
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto client = co_await acceptor.async_accept(::asio::use_awaitable);
+        IOConnectionPtr io = std::make_unique<TcpSocket>(std::move(client));
+        if (use_ws) {
+          auto ws = std::make_unique<WebSocket>(std::move(io));
+          auto ec = co_await ws->AsyncAccept();
+          EXPECT_FALSE(ec);
+          io = std::move(ws);
+        }
+        std::vector<uint8_t> buffer(kReadSize);
+        while (result.recv_bytes < kTotalBytes) {
+          auto [n, ec] = co_await io->AsyncRead(::asio::buffer(buffer.data(), buffer.size()));
+          if (ec || 0 == n) {
+            break;
+          }
+          for (size_t i = 0; i < n; i++) {
+            result.recv_sum += buffer[i];
+          }
+          result.recv_bytes += n;
+        }
+      },
+      ::asio::detached);
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto ex = co_await asio::this_coro::executor;
+        ::asio::ip::tcp::socket socket(ex);
+        co_await socket.async_connect(endpoint, ::asio::use_awaitable);
+        IOConnectionPtr io = std::make_unique<TcpSocket>(std::move(socket));
+        if (use_ws) {
+          auto ws = std::make_unique<WebSocket>(std::move(io));
+          auto ec = co_await ws->AsyncConnect("localhost");
+          EXPECT_FALSE(ec);
+          io = std::move(ws);
+        }
+        std::vector<uint8_t> buffer(frame_size);
+        for (size_t sent = 0; sent < kTotalBytes; sent += frame_size) {
+          // client frames are masked in place, so the payload is refilled every time.
+          for (size_t i = 0; i < frame_size; i++) {
+            buffer[i] = static_cast<uint8_t>(sent / frame_size + i);
+            result.sent_sum += buffer[i];
+          }
+          auto [n, ec] = co_await io->AsyncWrite(::asio::buffer(buffer.data(), buffer.size()));
+          if (ec) {
+            break;
+          }
+        }
+      },
+      ::asio::detached);
+  ctx.run();
+  result.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+TEST(WebSocket, LoopbackThroughput) {
+  // a batched mux write larger than the read buffer, and a single chunk frame.
+  for (size_t frame_size : {128 * 1024, 8 * 1024}) {
+    LoopbackResult tcp = run_loopback(false, frame_size);
+    LoopbackResult ws = run_loopback(true, frame_size);
+    EXPECT_EQ(kTotalBytes, tcp.recv_bytes);
+    EXPECT_EQ(kTotalBytes, ws.recv_bytes);
+    EXPECT_EQ(ws.sent_sum, ws.recv_sum);
+    double mb = static_cast<double>(kTotalBytes) / (1024 * 1024);
+    SNOVA_INFO("Loopback {}KB frames, tcp:{:.1f}MB/s, ws:{:.1f}MB/s", frame_size / 1024,
+               mb / tcp.secs, mb / ws.secs);
+  }
+}
+
+TEST(WebSocket, VectoredWrite) {
+  ::asio::io_context ctx;
+  ::asio::ip::tcp::acceptor acceptor(ctx, {::asio::ip::make_address("127.0.0.1"), 0});
+  auto endpoint = acceptor.local_endpoint();
+  std::string recv_data;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto client = co_await acceptor.async_accept(::asio::use_awaitable);
+        WebSocket ws(std::make_unique<TcpSocket>(std::move(client)));
+        EXPECT_FALSE(co_await ws.AsyncAccept());
+        char buffer[1024];
+        while (recv_data.size() < 300) {
+          auto [n, ec] = co_await ws.AsyncRead(::asio::buffer(buffer, sizeof(buffer)));
+          if (ec || 0 == n) {
+            break;
+          }
+          recv_data.append(buffer, n);
+        }
+      },
+      ::asio::detached);
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto ex = co_await asio::this_coro::executor;
+        ::asio::ip::tcp::socket socket(ex);
+        co_await socket.async_connect(endpoint, ::asio::use_awaitable);
+        WebSocket ws(std::make_unique<TcpSocket>(std::move(socket)));
+        EXPECT_FALSE(co_await ws.AsyncConnect("localhost"));
+        // 3 pieces in one frame, the 2nd one starts at an odd offset of the mask key.
+        std::string a(99, 'a');
+        std::string b(101, 'b');
+        std::string c(100, 'c');
+        std::vector<::asio::const_buffer> buffers = {::asio::buffer(a.data(), a.size()),
+                                                     ::asio::buffer(b.data(), b.size()),
+                                                     ::asio::buffer(c.data(), c.size())};
+        auto [n, ec] = co_await ws.AsyncWrite(buffers);
+        EXPECT_FALSE(ec);
+        EXPECT_EQ(300, n);
+      },
+      ::asio::detached);
+  ctx.run();
+  EXPECT_EQ(std::string(99, 'a') + std::string(101, 'b') + std::string(100, 'c'), recv_data);
+}
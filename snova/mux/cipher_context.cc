@@ -27,17 +27,124 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/mux/cipher_context.h"
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include "openssl/sha.h"
+#include "openssl/siphash.h"
 #include "snova/log/log_macros.h"
 #include "snova/util/endian.h"
 
 namespace snova {
+static thread_local uint64_t g_chunk_decrypt_bytes = 0;
+static thread_local uint64_t g_chunk_copy_bytes = 0;
+// set in v2 length prefix if the body is not sealed.
+static constexpr uint32_t kWireV2PlainBodyFlag = 1 << 23;
+static constexpr uint32_t kWireV2LengthMask = (1 << 24) - 1;
 
+uint64_t CipherContext::TotalChunkDecryptBytes() { return g_chunk_decrypt_bytes; }
+uint64_t CipherContext::TotalChunkCopyBytes() { return g_chunk_copy_bytes; }
+
+struct CipherMethodEntry {
+  const char* name;
+  uint32_t id;
+  const EVP_AEAD* (*aead)();
+};
+static const CipherMethodEntry kCipherMethods[] = {
+    {"chacha20_poly1305", CIPHER_CHACHA20_POLY1305, EVP_aead_chacha20_poly1305},
+    {"aes_128_gcm", CIPHER_AES_128_GCM, EVP_aead_aes_128_gcm},
+    {"aes_256_gcm", CIPHER_AES_256_GCM, EVP_aead_aes_256_gcm},
+};
+// "auto" connections auth with it, every peer understands it.
+static constexpr char kAutoBootstrapMethod[] = "chacha20_poly1305";
+
+static const CipherMethodEntry* get_cipher_method(const std::string& method) {
+  for (const auto& entry : kCipherMethods) {
+    if (method == entry.name) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+static const CipherMethodEntry* get_cipher_method(uint32_t id) {
+  for (const auto& entry : kCipherMethods) {
+    if (id == entry.id) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
 static const EVP_AEAD* get_cipher_aead(const std::string& method) {
-  if (method == "chacha20_poly1305") {
-    return EVP_aead_chacha20_poly1305();
-  } else {
+  const CipherMethodEntry* entry = get_cipher_method(method);
+  if (nullptr == entry) {
     return nullptr;
   }
+  return entry->aead();
+}
+
+// ns to seal a 8KB chunk with 'aead'.
+static double bench_cipher_aead(const EVP_AEAD* aead) {
+  std::string key(EVP_AEAD_key_length(aead), 'k');
+  EVP_AEAD_CTX* ctx = EVP_AEAD_CTX_new(aead, reinterpret_cast<const uint8_t*>(key.data()),
+                                       key.size(), EVP_AEAD_DEFAULT_TAG_LENGTH);
+  if (nullptr == ctx) {
+    return -1;
+  }
+  std::vector<uint8_t> in(kMaxChunkSize, 0x5a);
+  std::vector<uint8_t> out(kMaxChunkSize + EVP_AEAD_max_overhead(aead));
+  uint8_t nonce[EVP_AEAD_MAX_NONCE_LENGTH] = {0};
+  size_t nonce_len = EVP_AEAD_nonce_length(aead);
+  constexpr size_t kRounds = 64;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kRounds; i++) {
+    memcpy(nonce, &i, sizeof(i));
+    size_t out_len = 0;
+    EVP_AEAD_CTX_seal(ctx, out.data(), &out_len, out.size(), nonce, nonce_len, in.data(),
+                      in.size(), nullptr, 0);
+  }
+  auto cost_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  EVP_AEAD_CTX_free(ctx);
+  return static_cast<double>(cost_ns) / kRounds;
+}
+
+const std::vector<uint32_t>& CipherContext::RankAutoMethods() {
+  static const std::vector<uint32_t> ranked = []() {
+    std::vector<std::pair<double, uint32_t>> costs;
+    for (const auto& entry : kCipherMethods) {
+      double cost = bench_cipher_aead(entry.aead());
+      if (cost < 0) {
+        continue;
+      }
+      SNOVA_INFO("Cipher method {} seals 8KB in {:.0f}ns.", entry.name, cost);
+      costs.emplace_back(cost, entry.id);
+    }
+    std::sort(costs.begin(), costs.end());
+    std::vector<uint32_t> ids;
+    for (const auto& [cost, id] : costs) {
+      ids.push_back(id);
+    }
+    return ids;
+  }();
+  return ranked;
+}
+
+uint32_t CipherContext::GetAutoMethodMask() {
+  uint32_t mask = 0;
+  for (uint32_t id : RankAutoMethods()) {
+    mask |= (1 << id);
+  }
+  return mask;
+}
+
+uint32_t CipherContext::SelectAutoMethod(uint32_t peer_mask) {
+  for (uint32_t id : RankAutoMethods()) {
+    if (peer_mask & (1 << id)) {
+      return id;
+    }
+  }
+  return 0;
 }
 
 CipherContext::CipherContext() {
@@ -56,7 +163,8 @@ CipherContext::~CipherContext() {
 std::unique_ptr<CipherContext> CipherContext::New(const std::string& cipher_method,
                                                   const std::string& cipher_key) {
   // mbedtls_cipher_type_t cipher_type;
-  const EVP_AEAD* cipher_aead = get_cipher_aead(cipher_method);
+  bool auto_method = (cipher_method == "auto");
+  const EVP_AEAD* cipher_aead = get_cipher_aead(auto_method ? kAutoBootstrapMethod : cipher_method);
   if (nullptr == cipher_aead && cipher_method != "none") {
     SNOVA_ERROR("Unsupported cipher method:{}", cipher_method);
     return nullptr;
@@ -92,113 +200,165 @@ std::unique_ptr<CipherContext> CipherContext::New(const std::string& cipher_meth
   //   key_len,
   //                         MBEDTLS_DECRYPT);
   // }
+  p->cipher_method_ = auto_method ? kAutoBootstrapMethod : cipher_method;
+  p->auto_method_ = auto_method;
   if (nullptr != cipher_aead) {
-    size_t key_len = EVP_AEAD_key_length(cipher_aead);
     p->cipher_key_ = cipher_key;
-    p->cipher_key_.resize(key_len);
     uint64_t default_iv = 102477889876LL;
     p->UpdateNonce(default_iv);
-    p->cipher_nonce_len_ = EVP_AEAD_nonce_length(cipher_aead);
-    p->cipher_tag_len_ = EVP_AEAD_max_tag_len(cipher_aead);
-    p->encrypt_ctx_ = EVP_AEAD_CTX_new(cipher_aead, (const unsigned char*)(p->cipher_key_.data()),
-                                       key_len, p->cipher_tag_len_);
-    p->decrypt_ctx_ = EVP_AEAD_CTX_new(cipher_aead, (const unsigned char*)(p->cipher_key_.data()),
-                                       key_len, p->cipher_tag_len_);
-  }
-  p->encode_buffer_.resize(kMaxChunkSize + kEventHeadSize + kReservedBufferSize);
-  p->decode_buffer_.resize(kMaxChunkSize + kReservedBufferSize);
+    if (!p->InitAEAD(cipher_aead)) {
+      SNOVA_ERROR("Failed to init cipher method:{}", cipher_method);
+      delete p;
+      return nullptr;
+    }
+    std::string length_seed = cipher_key + ":snova-length-mask";
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(length_seed.data()), length_seed.size(), digest);
+    memcpy(p->length_key_, digest, sizeof(p->length_key_));
+  }
   return std::unique_ptr<CipherContext>(p);
 }
+void CipherContext::ReleaseBuffers() {
+  encode_buffer_.reset();
+  decode_buffer_.reset();
+}
+size_t CipherContext::GetBufferBytes() const {
+  return (encode_buffer_ ? encode_buffer_->size() : 0) +
+         (decode_buffer_ ? decode_buffer_->size() : 0);
+}
+bool CipherContext::InitAEAD(const EVP_AEAD* cipher_aead) {
+  if (nullptr != encrypt_ctx_) {
+    EVP_AEAD_CTX_free(encrypt_ctx_);
+    EVP_AEAD_CTX_free(decrypt_ctx_);
+  }
+  // user key is zero padded or truncated to the key length of the method.
+  std::string key = cipher_key_;
+  key.resize(EVP_AEAD_key_length(cipher_aead));
+  cipher_nonce_len_ = EVP_AEAD_nonce_length(cipher_aead);
+  cipher_tag_len_ = EVP_AEAD_max_tag_len(cipher_aead);
+  encrypt_ctx_ = EVP_AEAD_CTX_new(cipher_aead, (const unsigned char*)(key.data()), key.size(),
+                                  cipher_tag_len_);
+  decrypt_ctx_ = EVP_AEAD_CTX_new(cipher_aead, (const unsigned char*)(key.data()), key.size(),
+                                  cipher_tag_len_);
+  return nullptr != encrypt_ctx_ && nullptr != decrypt_ctx_;
+}
+
+int CipherContext::ResetMethod(uint32_t method_id) {
+  const CipherMethodEntry* entry = get_cipher_method(method_id);
+  if (nullptr == entry || nullptr == encrypt_ctx_) {
+    SNOVA_ERROR("Can not reset to cipher method id:{}", method_id);
+    return ERR_INVALID_EVENT;
+  }
+  if (!InitAEAD(entry->aead())) {
+    SNOVA_ERROR("Failed to init cipher method:{}", entry->name);
+    return ERR_INVALID_EVENT;
+  }
+  cipher_method_ = entry->name;
+  return 0;
+}
+
 void CipherContext::UpdateNonce(uint64_t nonce) {
   encrypt_iv_ = nonce;
   decrypt_iv_ = nonce;
 }
 
+void CipherContext::SetWireVersion(uint8_t v) {
+  if (nullptr == encrypt_ctx_) {
+    return;
+  }
+  wire_version_ = v;
+}
+
+uint32_t CipherContext::GetLengthMask(uint64_t iv) const {
+  uint64_t big_iv = native_to_big(iv);
+  return SIPHASH_24(length_key_, reinterpret_cast<const uint8_t*>(&big_iv), sizeof(big_iv)) &
+         kWireV2LengthMask;
+}
+
 int CipherContext::Encrypt(std::unique_ptr<MuxEvent>& in, MutableBytes& out) {
-  uint32_t max_encrypt_buffer_size = kEventHeadSize + kMaxChunkSize + 2 * cipher_tag_len_;
+  uint32_t max_encrypt_buffer_size = kEventHeadSize + max_frame_size_ + 2 * cipher_tag_len_;
   if (out.size() < max_encrypt_buffer_size) {
     SNOVA_ERROR("No enought space to encrypt, requires {} bytes, but given {} bytes",
                 max_encrypt_buffer_size, out.size());
     return ERR_NEED_MORE_OUTPUT_BUFFER;
   }
   if (nullptr == encrypt_ctx_) {
-    MutableBytes head_buffer(out.data(), kEventHeadSize);
-    in->head.Encode(head_buffer);
     MutableBytes body_buffer(out.data() + kEventHeadSize, out.size() - kEventHeadSize);
     int rc = in->Encode(body_buffer);
     if (0 != rc) {
       return rc;
     }
+    in->head.len = body_buffer.size();
+    MutableBytes head_buffer(out.data(), kEventHeadSize);
+    in->head.Encode(head_buffer);
     size_t total_len = (kEventHeadSize + body_buffer.size());
     out.remove_suffix(out.size() - total_len);
     return 0;
   }
-  std::unique_ptr<MutableBytes> body_buffer;
-  if (in->head.flags.body_no_encrypt) {
-    body_buffer = std::make_unique<MutableBytes>(out.data() + kEventHeadSize + cipher_tag_len_,
-                                                 out.size() - kEventHeadSize - cipher_tag_len_);
-    // avoid copy after header encrypt
-  } else {
-    body_buffer = std::make_unique<MutableBytes>(encode_buffer_.data() + kEventHeadSize,
-                                                 encode_buffer_.size() - kEventHeadSize);
+  if (wire_version_ >= 2) {
+    return EncryptV2(in, out);
   }
-  int rc = in->Encode(*body_buffer);
-  if (0 != rc) {
-    return rc;
+  size_t header_len = kEventHeadSize + cipher_tag_len_;
+  uint8_t* body_out = out.data() + header_len;
+  bool seal_body = in->head.flags.body_no_encrypt == 0;
+  // The chunk payload is sealed(or copied if no encrypt) from caller's IOBuf straight into 'out',
+  // other events are encoded first, into 'out' directly if body would not be encrypted.
+  Bytes body;
+  if (in->head.type == EVENT_STREAM_CHUNK) {
+    const StreamChunk* chunk = static_cast<const StreamChunk*>(in.get());
+    if (chunk->chunk_len > max_frame_size_) {
+      SNOVA_ERROR("Too large chunk len:{}", chunk->chunk_len);
+      return ERR_TOO_LARGE_EVENT_ENCODE_CONTENT;
+    }
+    if (chunk->chunk_len > 0) {
+      body = Bytes{chunk->chunk->data(), chunk->chunk_len};
+      if (!seal_body) {
+        memcpy(body_out, body.data(), body.size());
+      }
+    }
+  } else {
+    if (!encode_buffer_) {
+      encode_buffer_ = get_iobuf(kMaxChunkSize + kEventHeadSize + kReservedBufferSize);
+    }
+    MutableBytes body_buffer(encode_buffer_->data(), encode_buffer_->size());
+    if (!seal_body) {
+      body_buffer = MutableBytes(body_out, out.size() - header_len);
+    }
+    int rc = in->Encode(body_buffer);
+    if (0 != rc) {
+      return rc;
+    }
+    body = body_buffer;
   }
 
-  in->head.len = body_buffer->size();
-  MutableBytes head_buffer(encode_buffer_.data(), kEventHeadSize);
-  rc = in->head.Encode(head_buffer);
+  in->head.len = body.size();
+  uint8_t head_buf[kEventHeadSize];
+  MutableBytes head_buffer(head_buf, kEventHeadSize);
+  int rc = in->head.Encode(head_buffer);
   if (0 != rc) {
     return rc;
   }
-  uint64_t iv = native_to_big(encrypt_iv_);
-  std::vector<unsigned char> nonce(cipher_nonce_len_);
-  size_t olen = 0;
-  memset(nonce.data(), 0, cipher_nonce_len_);
-  memcpy(nonce.data(), &iv, sizeof(iv));
-  // rc = mbedtls_cipher_auth_encrypt_ext(&encrypt_ctx_, nonce.data(), iv_len_, nullptr, 0,
-  //                                      (const unsigned char*)head_buffer.data(),
-  //                                      head_buffer.size(), out.data(), out.size(), &olen,
-  //                                      cipher_tag_len_);
-  // if (0 != rc) {
-  //   SNOVA_ERROR("Failed to encrypt header with rc:{}", rc);
-  //   return rc;
-  // }
-  rc = EVP_AEAD_CTX_seal(encrypt_ctx_, out.data(), &olen, out.size(), nonce.data(),
-                         cipher_nonce_len_, (const uint8_t*)head_buffer.data(), head_buffer.size(),
-                         nullptr, 0);
+  uint8_t nonce[EVP_AEAD_MAX_NONCE_LENGTH];
+  FillNonce(encrypt_iv_, nonce);
+  size_t tag_len = 0;
+  rc = EVP_AEAD_CTX_seal_scatter(encrypt_ctx_, out.data(), out.data() + kEventHeadSize, &tag_len,
+                                 cipher_tag_len_, nonce, cipher_nonce_len_, head_buf,
+                                 kEventHeadSize, nullptr, 0, nullptr, 0);
   if (1 != rc) {
-    SNOVA_ERROR("Failed to encrypt header with rc:{}, head_buffer size:{}", rc, head_buffer.size());
+    SNOVA_ERROR("Failed to encrypt header with rc:{}", rc);
     return ERR_CIPHER_HEADER_ENCRYPT;
   }
-  size_t header_len = olen;
-  size_t body_len = body_buffer->size();
-
-  if (body_len > 0) {
-    if (in->head.flags.body_no_encrypt == 0) {
-      // rc = mbedtls_cipher_auth_encrypt_ext(&encrypt_ctx_, nonce.data(), iv_len_, nullptr, 0,
-      //                                      (const unsigned char*)body_buffer->data(),
-      //                                      body_buffer->size(), out.data() + header_len,
-      //                                      out.size() - header_len, &olen, cipher_tag_len_);
-      // if (0 != rc) {
-      //   SNOVA_ERROR("Failed to encrypt event body with rc:{}", rc);
-      //   return rc;
-      // }
-      rc = EVP_AEAD_CTX_seal(encrypt_ctx_, out.data() + header_len, &olen, out.size() - header_len,
-                             nonce.data(), cipher_nonce_len_, (const uint8_t*)body_buffer->data(),
-                             body_buffer->size(), nullptr, 0);
-      if (1 != rc) {
-        SNOVA_ERROR("Failed to encrypt body with rc:{}, body size:{}, output size:{}", rc,
-                    body_buffer->size(), out.size() - header_len);
-        return ERR_CIPHER_BODY_ENCRYPT;
-      }
-      body_len = olen;
-    } else {
-      // memcpy(out.data() + header_len, body_buffer.data(), body_len);
-      // SNOVA_INFO("[{}/{}]Encrypt no encrypt data len:{}", in->head.sid, in->head.type, body_len);
+  size_t body_len = body.size();
+  if (body_len > 0 && seal_body) {
+    rc = EVP_AEAD_CTX_seal_scatter(encrypt_ctx_, body_out, body_out + body_len, &tag_len,
+                                   cipher_tag_len_, nonce, cipher_nonce_len_, body.data(),
+                                   body_len, nullptr, 0, nullptr, 0);
+    if (1 != rc) {
+      SNOVA_ERROR("Failed to encrypt body with rc:{}, body size:{}, output size:{}", rc, body_len,
+                  out.size() - header_len);
+      return ERR_CIPHER_BODY_ENCRYPT;
     }
+    body_len += tag_len;
   }
   size_t total_len = (header_len + body_len);
   if (total_len < out.size()) {
@@ -207,20 +367,90 @@ int CipherContext::Encrypt(std::unique_ptr<MuxEvent>& in, MutableBytes& out) {
   encrypt_iv_++;
   return 0;
 }
+
+int CipherContext::EncryptV2(std::unique_ptr<MuxEvent>& in, MutableBytes& out) {
+  Bytes body;
+  if (in->head.type == EVENT_STREAM_CHUNK) {
+    const StreamChunk* chunk = static_cast<const StreamChunk*>(in.get());
+    if (chunk->chunk_len > max_frame_size_) {
+      SNOVA_ERROR("Too large chunk len:{}", chunk->chunk_len);
+      return ERR_TOO_LARGE_EVENT_ENCODE_CONTENT;
+    }
+    if (chunk->chunk_len > 0) {
+      body = Bytes{chunk->chunk->data(), chunk->chunk_len};
+    }
+  } else {
+    if (!encode_buffer_) {
+      encode_buffer_ = get_iobuf(kMaxChunkSize + kEventHeadSize + kReservedBufferSize);
+    }
+    MutableBytes body_buffer(encode_buffer_->data(), encode_buffer_->size());
+    int rc = in->Encode(body_buffer);
+    if (0 != rc) {
+      return rc;
+    }
+    body = body_buffer;
+  }
+  in->head.len = body.size();
+  uint8_t head_buf[kEventHeadSize];
+  MutableBytes head_buffer(head_buf, kEventHeadSize);
+  int rc = in->head.Encode(head_buffer);
+  if (0 != rc) {
+    return rc;
+  }
+  bool seal_body = in->head.flags.body_no_encrypt == 0;
+  uint32_t prefix = kEventHeadSize + body.size();
+  if (!seal_body) {
+    prefix |= kWireV2PlainBodyFlag;
+  }
+  prefix ^= GetLengthMask(encrypt_iv_);
+  out[0] = static_cast<uint8_t>(prefix >> 16);
+  out[1] = static_cast<uint8_t>(prefix >> 8);
+  out[2] = static_cast<uint8_t>(prefix);
+
+  uint8_t* body_out = out.data() + kWireV2PrefixSize;
+  uint8_t nonce[EVP_AEAD_MAX_NONCE_LENGTH];
+  FillNonce(encrypt_iv_, nonce);
+  Bytes seal_in = body;
+  if (!seal_body) {
+    memcpy(body_out, body.data(), body.size());
+    seal_in = Bytes{};
+  }
+  // head is passed as 'extra_in', sealed right after the body and written before the tag.
+  size_t tag_len = 0;
+  rc = EVP_AEAD_CTX_seal_scatter(encrypt_ctx_, body_out, body_out + body.size(), &tag_len,
+                                 kEventHeadSize + cipher_tag_len_, nonce, cipher_nonce_len_,
+                                 seal_in.data(), seal_in.size(), head_buf, kEventHeadSize,
+                                 out.data(), kWireV2PrefixSize);
+  if (1 != rc) {
+    SNOVA_ERROR("Failed to encrypt v2 frame with rc:{}, body size:{}", rc, body.size());
+    return ERR_CIPHER_BODY_ENCRYPT;
+  }
+  size_t total_len = kWireV2PrefixSize + body.size() + tag_len;
+  out.remove_suffix(out.size() - total_len);
+  encrypt_iv_++;
+  return 0;
+}
+
+void CipherContext::FillNonce(uint64_t iv, uint8_t* nonce) const {
+  uint64_t big_iv = native_to_big(iv);
+  memset(nonce, 0, cipher_nonce_len_);
+  memcpy(nonce, &big_iv, sizeof(big_iv));
+}
+
 int CipherContext::Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size_t& decrypt_len) {
+  if (wire_version_ >= 2) {
+    return DecryptV2(in, out, decrypt_len);
+  }
   if (in.size() < (kEventHeadSize + cipher_tag_len_)) {
     return ERR_NEED_MORE_INPUT_DATA;
   }
   decrypt_len = 0;
   MuxEventHead head;
-  // unsigned char nonce[iv_len_];
-  std::vector<unsigned char> nonce(cipher_nonce_len_);
+  uint8_t nonce[EVP_AEAD_MAX_NONCE_LENGTH];
   if (nullptr == decrypt_ctx_) {
     head.Decode(in);
   } else {
-    uint64_t iv = native_to_big(decrypt_iv_);
-    memset(nonce.data(), 0, cipher_nonce_len_);
-    memcpy(nonce.data(), &iv, sizeof(iv));
+    FillNonce(decrypt_iv_, nonce);
     size_t olen = 0;
     unsigned char head_buf[kEventHeadSize + 20];
     // int rc = mbedtls_cipher_auth_decrypt_ext(
@@ -230,7 +460,7 @@ int CipherContext::Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size
     //   SNOVA_ERROR("Failed to decrypt header with rc:{}", rc);
     //   return rc;
     // }
-    int rc = EVP_AEAD_CTX_open(decrypt_ctx_, head_buf, &olen, sizeof(head_buf), nonce.data(),
+    int rc = EVP_AEAD_CTX_open(decrypt_ctx_, head_buf, &olen, sizeof(head_buf), nonce,
                                cipher_nonce_len_, (const uint8_t*)in.data(),
                                kEventHeadSize + cipher_tag_len_, nullptr, 0);
     if (1 != rc) {
@@ -240,7 +470,7 @@ int CipherContext::Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size
     // SNOVA_INFO("Decrypt header len:{}", olen);
     head.Decode(Bytes{head_buf, kEventHeadSize});
   }
-  if (head.len > (kMaxChunkSize + 128)) {
+  if (head.len > (max_frame_size_ + 128)) {
     SNOVA_ERROR("Too large event len:{}", head.len);
     return ERR_INVALID_EVENT;
   }
@@ -261,6 +491,9 @@ int CipherContext::Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size
     decrypt_iv_++;
     return 0;
   }
+  if (head.type == EVENT_STREAM_CHUNK) {
+    return DecryptChunk(in, nonce, out, decrypt_len);
+  }
   Bytes decode_body;
   if (nullptr == decrypt_ctx_) {
     decode_body = Bytes{in.data() + kEventHeadSize, head.len};
@@ -283,15 +516,18 @@ int CipherContext::Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size
     //   SNOVA_ERROR("Failed to decrypt event body with rc:{}, data len:{}", rc, head.len);
     //   return rc;
     // }
-    int rc = EVP_AEAD_CTX_open(decrypt_ctx_, decode_buffer_.data(), &olen, decode_buffer_.size(),
-                               nonce.data(), cipher_nonce_len_,
+    if (!decode_buffer_) {
+      decode_buffer_ = get_iobuf(kMaxChunkSize + kReservedBufferSize);
+    }
+    int rc = EVP_AEAD_CTX_open(decrypt_ctx_, decode_buffer_->data(), &olen,
+                               decode_buffer_->size(), nonce, cipher_nonce_len_,
                                (const uint8_t*)in.data() + kEventHeadSize + cipher_tag_len_,
                                head.len + cipher_tag_len_, nullptr, 0);
     if (1 != rc) {
       SNOVA_ERROR("Failed to decrypt event body with rc:{}, data len:{}", rc, head.len);
       return ERR_CIPHER_BODY_DECRYPT;
     }
-    decode_body = Bytes{decode_buffer_.data(), head.len};
+    decode_body = Bytes{decode_buffer_->data(), head.len};
     // SNOVA_INFO("Decrypt total len:{}", olen);
     decrypt_len += (head.len + cipher_tag_len_);
   }
@@ -305,4 +541,108 @@ int CipherContext::Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size
   return 0;
 }
 
+int CipherContext::DecryptV2(const Bytes& in, std::unique_ptr<MuxEvent>& out,
+                             size_t& decrypt_len) {
+  if (in.size() < (kWireV2PrefixSize + kEventHeadSize + cipher_tag_len_)) {
+    return ERR_NEED_MORE_INPUT_DATA;
+  }
+  uint32_t prefix = (static_cast<uint32_t>(in[0]) << 16) | (static_cast<uint32_t>(in[1]) << 8) |
+                    in[2];
+  prefix ^= GetLengthMask(decrypt_iv_);
+  bool plain_body = (prefix & kWireV2PlainBodyFlag) != 0;
+  uint32_t frame_len = prefix & ~kWireV2PlainBodyFlag;
+  if (frame_len < kEventHeadSize || frame_len > (max_frame_size_ + 128 + kEventHeadSize)) {
+    SNOVA_ERROR("Invalid v2 frame len:{}", frame_len);
+    return ERR_INVALID_EVENT;
+  }
+  size_t expected_len = kWireV2PrefixSize + frame_len + cipher_tag_len_;
+  if (in.size() < expected_len) {
+    return ERR_NEED_MORE_INPUT_DATA;
+  }
+  // open body and head into one pooled IOBuf, a chunk takes it as payload without copy.
+  IOBufPtr plain = get_iobuf(frame_len);
+  const uint8_t* body_in = in.data() + kWireV2PrefixSize;
+  size_t body_len = frame_len - kEventHeadSize;
+  uint8_t nonce[EVP_AEAD_MAX_NONCE_LENGTH];
+  FillNonce(decrypt_iv_, nonce);
+  int rc = 0;
+  if (plain_body) {
+    memcpy(plain->data(), body_in, body_len);
+    rc = EVP_AEAD_CTX_open_gather(decrypt_ctx_, plain->data() + body_len, nonce,
+                                  cipher_nonce_len_, body_in + body_len, kEventHeadSize,
+                                  body_in + frame_len, cipher_tag_len_, in.data(),
+                                  kWireV2PrefixSize);
+  } else {
+    rc = EVP_AEAD_CTX_open_gather(decrypt_ctx_, plain->data(), nonce, cipher_nonce_len_, body_in,
+                                  frame_len, body_in + frame_len, cipher_tag_len_, in.data(),
+                                  kWireV2PrefixSize);
+  }
+  if (1 != rc) {
+    SNOVA_ERROR("Failed to decrypt v2 frame with rc:{}, frame len:{}", rc, frame_len);
+    return ERR_CIPHER_BODY_DECRYPT;
+  }
+  MuxEventHead head;
+  head.Decode(Bytes{plain->data() + body_len, kEventHeadSize});
+  if (head.len != body_len) {
+    SNOVA_ERROR("Mismatch event len:{} and v2 frame body len:{}", head.len, body_len);
+    return ERR_INVALID_EVENT;
+  }
+  out = MuxEvent::NewEvent(head);
+  if (!out) {
+    return ERR_INVALID_EVENT;
+  }
+  if (head.type == EVENT_STREAM_CHUNK) {
+    StreamChunk* chunk = static_cast<StreamChunk*>(out.get());
+    chunk->chunk = std::move(plain);
+    chunk->chunk_len = body_len;
+    if (plain_body) {
+      g_chunk_copy_bytes += body_len;
+    }
+    g_chunk_decrypt_bytes += body_len;
+  } else if (body_len > 0) {
+    rc = out->Decode(Bytes{plain->data(), body_len});
+    if (0 != rc) {
+      out = nullptr;
+      return rc;
+    }
+  }
+  decrypt_len = expected_len;
+  decrypt_iv_++;
+  return 0;
+}
+
+int CipherContext::DecryptChunk(const Bytes& in, const uint8_t* nonce,
+                                std::unique_ptr<MuxEvent>& out, size_t& decrypt_len) {
+  // Open(or copy if not encrypted) the payload straight into the pooled IOBuf which would be
+  // offered to the stream, no intermediate decode buffer.
+  StreamChunk* chunk = static_cast<StreamChunk*>(out.get());
+  const MuxEventHead& head = out->head;
+  chunk->chunk_len = head.len;
+  chunk->chunk = get_iobuf(head.len);
+  if (nullptr == decrypt_ctx_) {
+    memcpy(chunk->chunk->data(), in.data() + kEventHeadSize, head.len);
+    g_chunk_copy_bytes += head.len;
+    decrypt_len += head.len;
+  } else if (head.flags.body_no_encrypt > 0) {
+    memcpy(chunk->chunk->data(), in.data() + kEventHeadSize + cipher_tag_len_, head.len);
+    g_chunk_copy_bytes += head.len;
+    decrypt_len += head.len;
+  } else {
+    size_t olen = 0;
+    int rc = EVP_AEAD_CTX_open(decrypt_ctx_, chunk->chunk->data(), &olen, chunk->chunk->size(),
+                               nonce, cipher_nonce_len_,
+                               (const uint8_t*)in.data() + kEventHeadSize + cipher_tag_len_,
+                               head.len + cipher_tag_len_, nullptr, 0);
+    if (1 != rc) {
+      SNOVA_ERROR("Failed to decrypt chunk with rc:{}, data len:{}", rc, head.len);
+      out = nullptr;
+      return ERR_CIPHER_BODY_DECRYPT;
+    }
+    decrypt_len += (head.len + cipher_tag_len_);
+  }
+  g_chunk_decrypt_bytes += head.len;
+  decrypt_iv_++;
+  return 0;
+}
+
 }  // namespace snova
@@ -36,18 +36,61 @@
 #include "snova/io/io.h"
 #include "snova/mux/mux_event.h"
 namespace snova {
+// Wire v1 frame: sealed head(kEventHeadSize + tag), then sealed body(body + tag).
+// Wire v2 frame: 3 bytes masked length prefix, body, head, tag. body and head are sealed by one
+// AEAD call with the prefix as additional data, the body is left plain if 'body_no_encrypt'.
+static constexpr size_t kWireV2PrefixSize = 3;
+
+// ids of cipher methods negotiated by "auto" in AuthRequest/AuthResponse.
+enum CipherMethodID {
+  CIPHER_CHACHA20_POLY1305 = 1,
+  CIPHER_AES_128_GCM = 2,
+  CIPHER_AES_256_GCM = 3,
+};
 class CipherContext {
  public:
+  static uint64_t TotalChunkDecryptBytes();
+  // chunk payload bytes copied after read, the encrypted chunk is opened into IOBuf directly.
+  static uint64_t TotalChunkCopyBytes();
   ~CipherContext();
+  // 'cipher_method' is one of chacha20_poly1305/aes_128_gcm/aes_256_gcm/none, or "auto" which
+  // auths with chacha20_poly1305 and then switches to the fastest method both peers support.
   static std::unique_ptr<CipherContext> New(const std::string& cipher_method,
                                             const std::string& cipher_key);
+  // "auto" method ids sorted by a self-benchmark, fastest first, computed once.
+  static const std::vector<uint32_t>& RankAutoMethods();
+  static uint32_t GetAutoMethodMask();
+  // fastest local method in peer's mask, 0 if none.
+  static uint32_t SelectAutoMethod(uint32_t peer_mask);
+  bool IsAutoMethod() const { return auto_method_; }
+  const std::string& GetMethod() const { return cipher_method_; }
+  // switch both directions to the negotiated method, the key is kept.
+  int ResetMethod(uint32_t method_id);
   size_t GetTagLength() const { return cipher_tag_len_; }
+  // max stream chunk size accepted by Encrypt/Decrypt, kMaxChunkSize unless jumbo frames are
+  // negotiated.
+  void SetMaxFrameSize(uint32_t n) { max_frame_size_ = n; }
+  uint32_t GetMaxFrameSize() const { return max_frame_size_; }
   void UpdateNonce(uint64_t nonce);
+  // switch to wire v2 after it's negotiated with peer, no effect for 'none' cipher.
+  void SetWireVersion(uint8_t v);
+  uint8_t GetWireVersion() const { return wire_version_; }
   int Encrypt(std::unique_ptr<MuxEvent>& in, MutableBytes& out);
   int Decrypt(const Bytes& in, std::unique_ptr<MuxEvent>& out, size_t& decrypt_len);
+  // scratch buffers of non chunk events are borrowed from IOBuf pool on first use, return them
+  // once the connection is idle.
+  void ReleaseBuffers();
+  size_t GetBufferBytes() const;
 
  private:
   CipherContext();
+  bool InitAEAD(const EVP_AEAD* cipher_aead);
+  void FillNonce(uint64_t iv, uint8_t* nonce) const;
+  uint32_t GetLengthMask(uint64_t iv) const;
+  int EncryptV2(std::unique_ptr<MuxEvent>& in, MutableBytes& out);
+  int DecryptV2(const Bytes& in, std::unique_ptr<MuxEvent>& out, size_t& decrypt_len);
+  int DecryptChunk(const Bytes& in, const uint8_t* nonce, std::unique_ptr<MuxEvent>& out,
+                   size_t& decrypt_len);
   // const EVP_AEAD* cipher_aead_ = nullptr;
   EVP_AEAD_CTX* encrypt_ctx_ = nullptr;
   EVP_AEAD_CTX* decrypt_ctx_ = nullptr;
@@ -55,13 +98,19 @@ class CipherContext {
   uint64_t decrypt_iv_ = 0;
   size_t cipher_nonce_len_ = 0;
   size_t cipher_tag_len_ = 0;
+  uint32_t max_frame_size_ = kMaxChunkSize;
+  uint8_t wire_version_ = 1;
+  bool auto_method_ = false;
+  std::string cipher_method_;
+  // siphash key derived from cipher key, masks the v2 length prefix.
+  uint64_t length_key_[2] = {0, 0};
   std::string cipher_key_;
 
   // mbedtls_cipher_type_t cipher_type_;
   // mbedtls_cipher_context_t encrypt_ctx_;
   // mbedtls_cipher_context_t decrypt_ctx_;
-  std::vector<uint8_t> encode_buffer_;
-  std::vector<uint8_t> decode_buffer_;
+  IOBufPtr encode_buffer_;
+  IOBufPtr decode_buffer_;
 };
 
 }  // namespace snova
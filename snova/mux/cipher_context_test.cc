@@ -28,16 +28,23 @@
  */
 #include "snova/mux/cipher_context.h"
 #include <gtest/gtest.h>
+#include <chrono>
+#include <string>
 #include <utility>
+#include <vector>
 #include "snova/log/log_macros.h"
 using namespace snova;  // NOLINT
 
-TEST(CipherContext, Chacha20Poly1305) {
-  std::unique_ptr<CipherContext> ctx = CipherContext::New("chacha20_poly1305", "hello,world");
+static const std::vector<std::string> kAllMethods = {"chacha20_poly1305", "aes_128_gcm",
+                                                     "aes_256_gcm"};
+
+static void test_auth_round_trip(const std::string& method) {
+  std::unique_ptr<CipherContext> ctx = CipherContext::New(method, "hello,world");
+  ASSERT_TRUE(ctx != nullptr);
   std::unique_ptr<AuthRequest> auth = std::make_unique<AuthRequest>();
   auth->head.sid = 101;
   std::string user = "test_user";
-  auth->user = user;
+  snprintf(auth->event.user, sizeof(auth->event.user), "%s", user.c_str());
   std::unique_ptr<MuxEvent> event = std::move(auth);
   std::vector<uint8_t> buffer(8192 * 2);
   MutableBytes mbuffer(buffer.data(), buffer.size());
@@ -52,5 +59,253 @@ TEST(CipherContext, Chacha20Poly1305) {
   EXPECT_EQ(0, rc);
   EXPECT_EQ(decrypt_len, mbuffer.size());
   AuthRequest* req = dynamic_cast<AuthRequest*>(decrypt_event.get());
-  EXPECT_EQ(req->user, user);
+  ASSERT_TRUE(req != nullptr);
+  EXPECT_EQ(std::string(req->event.user), user);
+}
+
+TEST(CipherContext, Chacha20Poly1305) { test_auth_round_trip("chacha20_poly1305"); }
+
+TEST(CipherContext, AesGcm) {
+  test_auth_round_trip("aes_128_gcm");
+  test_auth_round_trip("aes_256_gcm");
+  EXPECT_TRUE(CipherContext::New("aes_512_gcm", "hello,world") == nullptr);
+}
+
+TEST(CipherContext, LazyBuffers) {
+  std::unique_ptr<CipherContext> ctx = CipherContext::New("chacha20_poly1305", "hello,world");
+  ASSERT_TRUE(ctx != nullptr);
+  EXPECT_EQ(0u, ctx->GetBufferBytes());
+  for (int i = 0; i < 2; i++) {
+    std::unique_ptr<MuxEvent> event = std::make_unique<AuthRequest>();
+    std::vector<uint8_t> buffer(8192 * 2);
+    MutableBytes mbuffer(buffer.data(), buffer.size());
+    ASSERT_EQ(0, ctx->Encrypt(event, mbuffer));
+    std::unique_ptr<MuxEvent> decrypt_event;
+    size_t decrypt_len;
+    ASSERT_EQ(0, ctx->Decrypt(Bytes(mbuffer.data(), mbuffer.size()), decrypt_event, decrypt_len));
+    EXPECT_GT(ctx->GetBufferBytes(), 0u);
+    // borrowed again by next event.
+    ctx->ReleaseBuffers();
+    EXPECT_EQ(0u, ctx->GetBufferBytes());
+  }
+}
+
+TEST(CipherContext, AutoMethod) {
+  std::unique_ptr<CipherContext> client = CipherContext::New("auto", "auto key");
+  std::unique_ptr<CipherContext> server = CipherContext::New("auto", "auto key");
+  ASSERT_TRUE(client->IsAutoMethod());
+  // auth events are sealed with the bootstrap method, understood by fixed chacha20 peers.
+  EXPECT_EQ("chacha20_poly1305", client->GetMethod());
+  EXPECT_EQ(kAllMethods.size(), CipherContext::RankAutoMethods().size());
+
+  uint32_t method = CipherContext::SelectAutoMethod(CipherContext::GetAutoMethodMask());
+  EXPECT_EQ(CipherContext::RankAutoMethods()[0], method);
+  EXPECT_EQ(CIPHER_AES_128_GCM,
+            CipherContext::SelectAutoMethod(1 << CIPHER_AES_128_GCM | 1 << 30));
+  EXPECT_EQ(0, CipherContext::SelectAutoMethod(1 << 30));
+  ASSERT_EQ(0, client->ResetMethod(method));
+  ASSERT_EQ(0, server->ResetMethod(method));
+  EXPECT_EQ(client->GetMethod(), server->GetMethod());
+
+  std::vector<uint8_t> buffer(8192 * 2);
+  std::unique_ptr<MuxEvent> event = std::make_unique<StreamCloseRequest>();
+  event->head.sid = 7;
+  MutableBytes mbuffer(buffer.data(), buffer.size());
+  ASSERT_EQ(0, client->Encrypt(event, mbuffer));
+  std::unique_ptr<MuxEvent> decrypt_event;
+  size_t decrypt_len = 0;
+  ASSERT_EQ(0, server->Decrypt(mbuffer, decrypt_event, decrypt_len));
+  EXPECT_EQ(7, decrypt_event->head.sid);
+}
+
+static void bench_chunk_decrypt(const std::string& method, bool body_no_encrypt,
+                                size_t chunk_len, size_t count) {
+  std::unique_ptr<CipherContext> encrypt_ctx = CipherContext::New(method, "bench key");
+  std::unique_ptr<CipherContext> decrypt_ctx = CipherContext::New(method, "bench key");
+  std::vector<uint8_t> payload(chunk_len);
+  for (size_t i = 0; i < chunk_len; i++) {
+    payload[i] = static_cast<uint8_t>(i * 31 + 7);
+  }
+  std::vector<uint8_t> wire((chunk_len + kEventHeadSize + kReservedBufferSize) * count + 2 * 8192);
+  size_t wire_len = 0;
+  for (size_t i = 0; i < count; i++) {
+    auto chunk = std::make_unique<StreamChunk>();
+    chunk->head.sid = 1;
+    chunk->head.flags.body_no_encrypt = body_no_encrypt ? 1 : 0;
+    chunk->chunk = get_iobuf(chunk_len);
+    memcpy(chunk->chunk->data(), payload.data(), chunk_len);
+    chunk->chunk_len = chunk_len;
+    std::unique_ptr<MuxEvent> event = std::move(chunk);
+    MutableBytes out(wire.data() + wire_len, wire.size() - wire_len);
+    EXPECT_EQ(0, encrypt_ctx->Encrypt(event, out));
+    wire_len += out.size();
+  }
+
+  uint64_t decrypt_bytes_before = CipherContext::TotalChunkDecryptBytes();
+  auto start = std::chrono::steady_clock::now();
+  Bytes in(wire.data(), wire_len);
+  for (size_t i = 0; i < count; i++) {
+    std::unique_ptr<MuxEvent> event;
+    size_t decrypt_len = 0;
+    EXPECT_EQ(0, decrypt_ctx->Decrypt(in, event, decrypt_len));
+    in.remove_prefix(decrypt_len);
+    StreamChunk* chunk = dynamic_cast<StreamChunk*>(event.get());
+    EXPECT_TRUE(chunk != nullptr);
+    EXPECT_EQ(chunk_len, chunk->chunk_len);
+    EXPECT_EQ(0, memcmp(chunk->chunk->data(), payload.data(), chunk_len));
+  }
+  auto cost_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  EXPECT_TRUE(in.empty());
+  uint64_t decrypt_bytes = CipherContext::TotalChunkDecryptBytes() - decrypt_bytes_before;
+  EXPECT_EQ(decrypt_bytes, chunk_len * count);
+  SNOVA_INFO("[{}]body_no_encrypt:{}, decrypt {} chunks of {} bytes cost {}us", method,
+             body_no_encrypt, count, chunk_len, cost_us);
+}
+
+TEST(CipherContext, ChunkDecrypt) {
+  // bytes copied on the whole read path are counted by MuxConnection.ReadCopyRatio.
+  for (const auto& method : kAllMethods) {
+    bench_chunk_decrypt(method, false, kMaxChunkSize, 1024);
+    bench_chunk_decrypt(method, false, 1024, 1024);
+  }
+  bench_chunk_decrypt("chacha20_poly1305", true, kMaxChunkSize, 1024);
+  bench_chunk_decrypt("none", false, kMaxChunkSize, 1024);
+}
+
+static void bench_chunk_encrypt(const std::string& method) {
+  std::unique_ptr<CipherContext> ctx = CipherContext::New(method, "bench key");
+  std::vector<uint8_t> wire(kMaxChunkSize + kEventHeadSize + kReservedBufferSize);
+  auto chunk = std::make_unique<StreamChunk>();
+  chunk->head.sid = 1;
+  chunk->chunk = get_iobuf(kMaxChunkSize);
+  chunk->chunk_len = kMaxChunkSize;
+  std::unique_ptr<MuxEvent> event = std::move(chunk);
+  size_t count = 16 * 1024;
+  size_t wire_bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    MutableBytes out(wire.data(), wire.size());
+    ASSERT_EQ(0, ctx->Encrypt(event, out));
+    wire_bytes += out.size();
+  }
+  auto cost_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  EXPECT_EQ(wire_bytes, count * (kMaxChunkSize + kEventHeadSize + 2 * ctx->GetTagLength()));
+  SNOVA_INFO("[{}]Encrypt {} chunks of {} bytes cost {}us, {:.2f}MB/s", method, count,
+             kMaxChunkSize, cost_us,
+             static_cast<double>(count * kMaxChunkSize) / (cost_us > 0 ? cost_us : 1));
+}
+
+TEST(CipherContext, ChunkEncryptThroughput) {
+  for (const auto& method : kAllMethods) {
+    bench_chunk_encrypt(method);
+  }
+}
+
+static void test_wire_v2(const std::string& method) {
+  std::unique_ptr<CipherContext> encrypt_ctx = CipherContext::New(method, "v2 key");
+  std::unique_ptr<CipherContext> decrypt_ctx = CipherContext::New(method, "v2 key");
+  encrypt_ctx->SetWireVersion(2);
+  decrypt_ctx->SetWireVersion(2);
+  std::vector<uint8_t> buffer(8192 * 2);
+
+  auto open = std::make_unique<StreamOpenRequest>();
+  open->head.sid = 3;
+  snprintf(open->event.remote_host, sizeof(open->event.remote_host), "%s", "example.com");
+  open->event.remote_port = 443;
+  std::unique_ptr<MuxEvent> event = std::move(open);
+  MutableBytes mbuffer(buffer.data(), buffer.size());
+  ASSERT_EQ(0, encrypt_ctx->Encrypt(event, mbuffer));
+  std::unique_ptr<MuxEvent> decrypt_event;
+  size_t decrypt_len = 0;
+  // a partial frame waits for more data
+  ASSERT_EQ(ERR_NEED_MORE_INPUT_DATA,
+            decrypt_ctx->Decrypt(Bytes{mbuffer.data(), mbuffer.size() - 1}, decrypt_event,
+                                 decrypt_len));
+  ASSERT_EQ(0, decrypt_ctx->Decrypt(mbuffer, decrypt_event, decrypt_len));
+  EXPECT_EQ(decrypt_len, mbuffer.size());
+  StreamOpenRequest* req = dynamic_cast<StreamOpenRequest*>(decrypt_event.get());
+  ASSERT_TRUE(req != nullptr);
+  EXPECT_EQ(3, req->head.sid);
+  EXPECT_EQ(std::string(req->event.remote_host), "example.com");
+  EXPECT_EQ(443, req->event.remote_port);
+
+  for (bool body_no_encrypt : {false, true}) {
+    auto chunk = std::make_unique<StreamChunk>();
+    chunk->head.sid = 5;
+    chunk->head.flags.body_no_encrypt = body_no_encrypt ? 1 : 0;
+    chunk->chunk = get_iobuf(100);
+    memset(chunk->chunk->data(), 'x', 100);
+    chunk->chunk_len = 100;
+    event = std::move(chunk);
+    mbuffer = MutableBytes(buffer.data(), buffer.size());
+    ASSERT_EQ(0, encrypt_ctx->Encrypt(event, mbuffer));
+    EXPECT_EQ(kWireV2PrefixSize + 100 + kEventHeadSize + encrypt_ctx->GetTagLength(),
+              mbuffer.size());
+    ASSERT_EQ(0, decrypt_ctx->Decrypt(mbuffer, decrypt_event, decrypt_len));
+    StreamChunk* decrypt_chunk = dynamic_cast<StreamChunk*>(decrypt_event.get());
+    ASSERT_TRUE(decrypt_chunk != nullptr);
+    EXPECT_EQ(5, decrypt_chunk->head.sid);
+    EXPECT_EQ(100, decrypt_chunk->chunk_len);
+    EXPECT_EQ(0, memcmp(decrypt_chunk->chunk->data(), std::string(100, 'x').data(), 100));
+  }
+
+  // tampered length prefix must fail authentication
+  event = std::make_unique<StreamCloseRequest>();
+  mbuffer = MutableBytes(buffer.data(), buffer.size());
+  ASSERT_EQ(0, encrypt_ctx->Encrypt(event, mbuffer));
+  mbuffer[0] ^= 0x80;
+  EXPECT_NE(0, decrypt_ctx->Decrypt(mbuffer, decrypt_event, decrypt_len));
+}
+
+TEST(CipherContext, WireV2) {
+  for (const auto& method : kAllMethods) {
+    test_wire_v2(method);
+  }
+}
+
+static void bench_wire_version(const std::string& method, uint8_t wire_version, size_t frame_len,
+                               size_t count) {
+  std::unique_ptr<CipherContext> encrypt_ctx = CipherContext::New(method, "bench");
+  std::unique_ptr<CipherContext> decrypt_ctx = CipherContext::New(method, "bench");
+  encrypt_ctx->SetWireVersion(wire_version);
+  decrypt_ctx->SetWireVersion(wire_version);
+  // Encrypt requires room for a max size frame.
+  std::vector<uint8_t> wire(kMaxChunkSize + kEventHeadSize + kReservedBufferSize);
+  auto chunk = std::make_unique<StreamChunk>();
+  chunk->head.sid = 1;
+  chunk->chunk = get_iobuf(frame_len);
+  chunk->chunk_len = frame_len;
+  std::unique_ptr<MuxEvent> event = std::move(chunk);
+  size_t wire_bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    MutableBytes out(wire.data(), wire.size());
+    ASSERT_EQ(0, encrypt_ctx->Encrypt(event, out));
+    wire_bytes += out.size();
+    std::unique_ptr<MuxEvent> decrypt_event;
+    size_t decrypt_len = 0;
+    ASSERT_EQ(0, decrypt_ctx->Decrypt(out, decrypt_event, decrypt_len));
+    ASSERT_EQ(decrypt_len, out.size());
+  }
+  auto cost_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  SNOVA_INFO("[{}][v{}]Encrypt+decrypt {} frames of {} bytes cost {}us, {:.1f}ns/frame, "
+             "overhead:{}B",
+             method, wire_version, count, frame_len, cost_us, cost_us * 1000.0 / count,
+             wire_bytes / count - frame_len);
+}
+
+TEST(CipherContext, WireVersionBenchmark) {
+  for (const auto& method : kAllMethods) {
+    for (size_t frame_len : {64, 1024, 8192}) {
+      size_t count = 8 * 1024 * 1024 / frame_len;
+      bench_wire_version(method, 1, frame_len, count);
+      bench_wire_version(method, 2, frame_len, count);
+    }
+  }
 }
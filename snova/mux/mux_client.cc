@@ -31,8 +31,9 @@
 #include <utility>
 
 #include "asio/experimental/as_tuple.hpp"
-#include "snova/io/tcp_socket.h"
+#include "snova/io/rudp_socket.h"
 #include "snova/io/tls_socket.h"
+#include "snova/io/uring_socket.h"
 #include "snova/io/ws_socket.h"
 #include "snova/log/log_macros.h"
 #include "snova/util/flags.h"
@@ -44,27 +45,24 @@ namespace snova {
 asio::awaitable<void> relay_handler(const std::string& user, uint64_t client_id,
                                     std::unique_ptr<MuxEvent>&& open_request);
 std::shared_ptr<MuxClient>& MuxClient::GetInstance() {
-  static std::shared_ptr<MuxClient> g_instance = std::make_shared<MuxClient>();
+  static thread_local std::shared_ptr<MuxClient> g_instance = std::make_shared<MuxClient>();
   return g_instance;
 }
 
-asio::awaitable<std::error_code> MuxClient::NewConnection(uint32_t idx) {
-  if (idx >= remote_session_->conns.size()) {
-    co_return std::make_error_code(std::errc::invalid_argument);
-  }
+asio::awaitable<std::pair<IOConnectionPtr, std::error_code>> MuxClient::NewStreamConnection() {
   auto ex = co_await asio::this_coro::executor;
   ::asio::ip::tcp::socket socket(ex);
   if (GlobalFlags::GetIntance()->GetHttpProxyHost().empty()) {
     ::asio::ip::tcp::endpoint remote_endpoint;
     auto resolve_ec = co_await remote_mux_address_->GetEndpoint(&remote_endpoint);
     if (resolve_ec) {
-      co_return resolve_ec;
+      co_return std::make_pair(nullptr, resolve_ec);
     }
     auto [ec] = co_await socket.async_connect(
         remote_endpoint, ::asio::experimental::as_tuple(::asio::use_awaitable));
     if (ec) {
       SNOVA_ERROR("Failed to connect:{} with error:{}", remote_mux_address_->String(), ec);
-      co_return ec;
+      co_return std::make_pair(nullptr, ec);
     }
   } else {
     auto ec = co_await connect_remote_via_http_proxy(
@@ -73,7 +71,7 @@ asio::awaitable<std::error_code> MuxClient::NewConnection(uint32_t idx) {
     if (ec) {
       SNOVA_ERROR("Failed to connect:{} via http proxy with error:{}",
                   remote_mux_address_->String(), ec);
-      co_return ec;
+      co_return std::make_pair(nullptr, ec);
     }
   }
   IOConnectionPtr raw_io_conn;
@@ -81,22 +79,47 @@ asio::awaitable<std::error_code> MuxClient::NewConnection(uint32_t idx) {
     auto tls_conn = std::make_unique<TlsSocket>(std::move(socket));
     auto handshake_ec = co_await tls_conn->ClientHandshake();
     if (handshake_ec) {
-      co_return handshake_ec;
+      co_return std::make_pair(nullptr, handshake_ec);
     }
     raw_io_conn = std::move(tls_conn);
   } else {
-    raw_io_conn = std::make_unique<TcpSocket>(std::move(socket));
+    raw_io_conn = new_tcp_connection(std::move(socket));
   }
-  IOConnectionPtr io_conn;
   if (remote_mux_address_->schema == "ws" || remote_mux_address_->schema == "wss") {
     auto ws_conn = std::make_unique<WebSocket>(std::move(raw_io_conn));
     auto conn_ec = co_await ws_conn->AsyncConnect(remote_mux_address_->host);
     if (conn_ec) {
-      co_return conn_ec;
+      co_return std::make_pair(nullptr, conn_ec);
     }
-    io_conn = std::move(ws_conn);
-  } else {
-    io_conn = std::move(raw_io_conn);
+    co_return std::make_pair(std::move(ws_conn), std::error_code{});
+  }
+  co_return std::make_pair(std::move(raw_io_conn), std::error_code{});
+}
+
+asio::awaitable<std::pair<IOConnectionPtr, std::error_code>> MuxClient::NewUdpConnection() {
+  auto ex = co_await asio::this_coro::executor;
+  ::asio::ip::udp::endpoint remote_endpoint;
+  auto resolve_ec = co_await remote_mux_address_->GetEndpoint(&remote_endpoint);
+  if (resolve_ec) {
+    co_return std::make_pair(nullptr, resolve_ec);
+  }
+  // udp mux goes to remote directly, 'proxy' only works with tcp based transports.
+  auto [io_conn, ec] = RudpSocket::Connect(ex, remote_endpoint);
+  if (ec) {
+    SNOVA_ERROR("Failed to connect:{} with error:{}", remote_mux_address_->String(), ec);
+  }
+  co_return std::make_pair(std::move(io_conn), ec);
+}
+
+asio::awaitable<std::error_code> MuxClient::NewConnection(uint32_t idx) {
+  if (idx >= remote_session_->conns.size()) {
+    co_return std::make_error_code(std::errc::invalid_argument);
+  }
+  auto ex = co_await asio::this_coro::executor;
+  auto [io_conn, conn_ec] = remote_mux_address_->schema == "udp" ? co_await NewUdpConnection()
+                                                                  : co_await NewStreamConnection();
+  if (conn_ec) {
+    co_return conn_ec;
   }
 
   std::unique_ptr<CipherContext> cipher_ctx = CipherContext::New(cipher_method_, cipher_key_);
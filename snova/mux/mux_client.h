@@ -30,9 +30,11 @@
 #pragma once
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "asio.hpp"
+#include "snova/io/io.h"
 #include "snova/mux/mux_conn_manager.h"
 #include "snova/util/address.h"
 #include "snova/util/stat.h"
@@ -47,6 +49,8 @@ class MuxClient {
                                         const std::string& cipher_key);
 
  private:
+  asio::awaitable<std::pair<IOConnectionPtr, std::error_code>> NewStreamConnection();
+  asio::awaitable<std::pair<IOConnectionPtr, std::error_code>> NewUdpConnection();
   asio::awaitable<std::error_code> NewConnection(uint32_t idx);
   asio::awaitable<void> CheckConnections();
   MuxConnectionType conn_type_ = MUX_EXIT_CONN;
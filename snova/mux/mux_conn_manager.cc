@@ -52,6 +52,20 @@ void MuxSession::ReportStatInfo(StatKeyValue& kv) {
           std::to_string(conn->GetLatestWindowRecvBytes());
       kv[fmt::format("[{}]latest_30s_send_bytes", i)] =
           std::to_string(conn->GetLatestWindowSendBytes());
+      kv[fmt::format("[{}]queued_bytes", i)] = std::to_string(conn->GetQueuedBytes());
+      kv[fmt::format("[{}]active_write_streams", i)] =
+          std::to_string(conn->GetActiveWriteStreams());
+      if (conn->GetSmoothedRttUs() > 0) {
+        kv[fmt::format("[{}]srtt_ms", i)] =
+            fmt::format("{:.2f}", static_cast<double>(conn->GetSmoothedRttUs()) / 1000);
+        kv[fmt::format("[{}]rttvar_ms", i)] =
+            fmt::format("{:.2f}", static_cast<double>(conn->GetRttVarUs()) / 1000);
+      }
+      kv[fmt::format("[{}]ping_loss", i)] = fmt::format("{:.2f}", conn->GetPingLoss());
+      if (conn->GetWriteCalls() > 0) {
+        kv[fmt::format("[{}]frames_per_write", i)] = fmt::format(
+            "{:.2f}", static_cast<double>(conn->GetWriteFrames()) / conn->GetWriteCalls());
+      }
       if (inactive_secs > g_connection_max_inactive_secs) {
         conn->Close();
       }
@@ -77,11 +91,11 @@ EventWriterFactory MuxSession::GetEventWriterFactory() {
     if (select_idx < 0) {
       return {};
     }
-    return [select_idx, session](std::unique_ptr<MuxEvent>&& event) -> asio::awaitable<bool> {
-      if (select_idx >= session->conns.size()) {
-        co_return false;
-      }
-      auto write_conn = session->conns[select_idx];
+    // bind writer to the selected connection instead of the slot index, a reconnected slot may
+    // be served by another io thread on remote side which knows nothing about the stream.
+    std::weak_ptr<MuxConnection> conn_ref = session->conns[select_idx];
+    return [conn_ref](std::unique_ptr<MuxEvent>&& event) -> asio::awaitable<bool> {
+      auto write_conn = conn_ref.lock();
       if (write_conn) {
         co_return co_await write_conn->Write(std::move(event));
       }
@@ -90,8 +104,28 @@ EventWriterFactory MuxSession::GetEventWriterFactory() {
   };
   return f;
 }
+MuxStreamOptions MuxSession::GetStreamOptions() const {
+  // all connections of a session are authed by same peer, so any live one tells the negotiation.
+  MuxStreamOptions opts;
+  for (const auto& conn : conns) {
+    if (conn) {
+      opts.peer_window = conn->GetPeerStreamWindow();
+      opts.max_chunk_size = conn->GetMaxFrameSize();
+      opts.open_with_data = (conn->GetFeatures() & MUX_FEATURE_OPEN_WITH_DATA) != 0;
+      opts.open_result = (conn->GetFeatures() & MUX_FEATURE_OPEN_RESULT) != 0;
+      opts.udp_relay = (conn->GetFeatures() & MUX_FEATURE_UDP_RELAY) != 0;
+      // only the accepting side stripes: the dialer keeps all connections of a session in the
+      // shard holding the stream, while they may be accepted by different shards here.
+      opts.striping = (conn->GetFeatures() & MUX_FEATURE_STREAM_STRIPING) != 0 &&
+                      opts.peer_window > 0 && !conn->IsLocal();
+      break;
+    }
+  }
+  return opts;
+}
 std::shared_ptr<MuxConnManager>& MuxConnManager::GetInstance() {
-  static std::shared_ptr<MuxConnManager> g_instance = std::make_shared<MuxConnManager>();
+  static thread_local std::shared_ptr<MuxConnManager> g_instance =
+      std::make_shared<MuxConnManager>();
   return g_instance;
 }
 
@@ -103,6 +137,32 @@ void MuxConnManager::RegisterStat() {
     kv["stream_active_num"] = std::to_string(MuxStream::ActiveSize());
     kv["connection_num"] = std::to_string(MuxConnection::Size());
     kv["connection_active_num"] = std::to_string(MuxConnection::ActiveSize());
+    kv["connection_write_calls"] = std::to_string(MuxConnection::TotalWriteCalls());
+    kv["connection_write_frames"] = std::to_string(MuxConnection::TotalWriteFrames());
+    kv["connection_write_queue_waits"] = std::to_string(MuxConnection::TotalWriteQueueWaits());
+    kv["connection_read_move_bytes"] = std::to_string(MuxConnection::TotalReadMoveBytes());
+    kv["connection_ping_timeouts"] = std::to_string(MuxConnection::TotalPingTimeouts());
+    kv["connection_idle_num"] = std::to_string(MuxConnection::IdleSize());
+    kv["connection_buffer_bytes"] = std::to_string(MuxConnection::TotalBufferBytes());
+    kv["idle_connection_memory_bytes"] = std::to_string(MuxConnection::MemoryPerIdleConnection());
+    kv["chunk_decrypt_bytes"] = std::to_string(CipherContext::TotalChunkDecryptBytes());
+    kv["chunk_copy_bytes"] = std::to_string(CipherContext::TotalChunkCopyBytes());
+    kv["chunk_decode_copy_bytes"] = std::to_string(StreamChunk::TotalDecodeCopyBytes());
+    kv["stream_recv_queued_bytes"] = std::to_string(MuxStream::TotalRecvQueuedBytes());
+    kv["stream_send_window_waits"] = std::to_string(MuxStream::TotalSendWindowWaits());
+    kv["stream_open_with_data"] = std::to_string(MuxStream::TotalOpenWithData());
+    kv["stream_striped_chunks"] = std::to_string(MuxStream::TotalStripedChunks());
+    kv["stream_reordered_chunks"] = std::to_string(MuxStream::TotalReorderedChunks());
+    kv["stream_stripe_lost_num"] = std::to_string(MuxStream::TotalStripeLostStreams());
+    kv["stream_shed_num"] = std::to_string(MuxStream::TotalShedStreams());
+    kv["stream_dropped_datagrams"] = std::to_string(MuxStream::TotalDroppedDatagrams());
+    kv["event_allocs"] = std::to_string(MuxEvent::TotalAllocs());
+    kv["event_heap_allocs"] = std::to_string(MuxEvent::TotalHeapAllocs());
+    if (MuxConnection::TotalWriteCalls() > 0) {
+      kv["connection_frames_per_write"] =
+          fmt::format("{:.2f}", static_cast<double>(MuxConnection::TotalWriteFrames()) /
+                                    MuxConnection::TotalWriteCalls());
+    }
     return vals;
   });
   register_stat_func([]() -> StatValues {
@@ -128,7 +188,8 @@ void MuxConnManager::ReportStatInfo(StatValues& stats) {
   }
 }
 EventWriterFactory MuxConnManager::GetRelayEventWriterFactory(std::string_view user,
-                                                              uint64_t* client_id) {
+                                                              uint64_t* client_id,
+                                                              MuxStreamOptions* stream_opts) {
   auto user_found = mux_conns_.find(user);
   if (user_found == mux_conns_.end()) {
     return {};
@@ -142,13 +203,17 @@ EventWriterFactory MuxConnManager::GetRelayEventWriterFactory(std::string_view u
     if (nullptr != client_id) {
       *client_id = cid;
     }
+    if (nullptr != stream_opts) {
+      *stream_opts = session->GetStreamOptions();
+    }
     return session->GetEventWriterFactory();
   }
   return {};
 }
 
 EventWriterFactory MuxConnManager::GetEventWriterFactory(std::string_view user, uint64_t client_id,
-                                                         MuxConnectionType type) {
+                                                         MuxConnectionType type,
+                                                         MuxStreamOptions* stream_opts) {
   auto user_found = mux_conns_.find(user);
   if (user_found == mux_conns_.end()) {
     return {};
@@ -158,6 +223,9 @@ EventWriterFactory MuxConnManager::GetEventWriterFactory(std::string_view user,
   if (found == user_conn->sessions[type].end()) {
     return {};
   }
+  if (nullptr != stream_opts) {
+    *stream_opts = found->second->GetStreamOptions();
+  }
   return found->second->GetEventWriterFactory();
 }
 
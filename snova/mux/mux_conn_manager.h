@@ -44,6 +44,7 @@ struct MuxSession : public std::enable_shared_from_this<MuxSession> {
   MuxConnArray conns;
   std::vector<uint64_t> tunnel_servers;
   EventWriterFactory GetEventWriterFactory();
+  MuxStreamOptions GetStreamOptions() const;
   void ReportStatInfo(StatKeyValue& kv);
   ~MuxSession();
 };
@@ -69,8 +70,10 @@ class MuxConnManager {
   void Remove(std::string_view user, uint64_t client_id, MuxConnection* conn);
 
   EventWriterFactory GetEventWriterFactory(std::string_view user, uint64_t client_id,
-                                           MuxConnectionType type);
-  EventWriterFactory GetRelayEventWriterFactory(std::string_view user, uint64_t* client_id);
+                                           MuxConnectionType type,
+                                           MuxStreamOptions* stream_opts = nullptr);
+  EventWriterFactory GetRelayEventWriterFactory(std::string_view user, uint64_t* client_id,
+                                                MuxStreamOptions* stream_opts = nullptr);
 
  private:
   void ReportStatInfo(StatValues& stats);
@@ -27,6 +27,8 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/mux/mux_connection.h"
+#include <algorithm>
+#include <chrono>
 #include <utility>
 #include "asio/experimental/as_tuple.hpp"
 #include "asio/experimental/promise.hpp"
@@ -53,17 +55,93 @@ enum MuxConnReadState {
   STATE_READ_LOOP_EXIT,
 };
 
-static uint32_t g_mux_conn_num = 0;
-static uint32_t g_mux_conn_num_in_loop = 0;
+static thread_local uint32_t g_mux_conn_num = 0;
+static thread_local uint32_t g_mux_conn_num_in_loop = 0;
+static thread_local uint64_t g_mux_write_calls = 0;
+static thread_local uint64_t g_mux_write_frames = 0;
+static thread_local uint64_t g_mux_write_queue_waits = 0;
+static thread_local uint64_t g_mux_read_move_bytes = 0;
+static thread_local uint64_t g_mux_ping_timeouts = 0;
+static thread_local uint32_t g_mux_idle_conn_num = 0;
+static thread_local uint64_t g_mux_conn_buffer_bytes = 0;
+static thread_local uint64_t g_mux_idle_conn_buffer_bytes = 0;
+
+// reads/writes smaller than this only carry pings or other control events, the read buffer of a
+// connection idle for 'kIdleBufferSecs' is shrunk to it.
+static constexpr size_t kIdleReadBufferSize = 256;
+static constexpr uint32_t kIdleBufferSecs = 10;
+
+static uint64_t steady_now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static size_t max_encrypted_event_size(uint32_t max_frame_size) {
+  return max_frame_size + kEventHeadSize + kReservedBufferSize;
+}
+
+static size_t event_payload_size(const MuxEvent& ev) {
+  if (ev.head.type == EVENT_STREAM_CHUNK) {
+    return static_cast<const StreamChunk&>(ev).chunk_len;
+  }
+  return 0;
+}
+
+// DRR quantum of each stream priority, at least one max size frame per round.
+static size_t stream_quantum(uint8_t priority, uint32_t max_frame_size) {
+  switch (priority) {
+    case STREAM_PRIORITY_INTERACTIVE: {
+      return 4 * max_frame_size;
+    }
+    case STREAM_PRIORITY_BULK: {
+      return max_frame_size;
+    }
+    default: {
+      return 2 * max_frame_size;
+    }
+  }
+}
+
 size_t MuxConnection::Size() { return g_mux_conn_num; }
 size_t MuxConnection::ActiveSize() { return g_mux_conn_num_in_loop; }
+uint64_t MuxConnection::TotalWriteCalls() { return g_mux_write_calls; }
+uint64_t MuxConnection::TotalWriteFrames() { return g_mux_write_frames; }
+uint64_t MuxConnection::TotalWriteQueueWaits() { return g_mux_write_queue_waits; }
+uint64_t MuxConnection::TotalReadMoveBytes() { return g_mux_read_move_bytes; }
+uint64_t MuxConnection::TotalPingTimeouts() { return g_mux_ping_timeouts; }
+size_t MuxConnection::IdleSize() { return g_mux_idle_conn_num; }
+uint64_t MuxConnection::TotalBufferBytes() { return g_mux_conn_buffer_bytes; }
+size_t MuxConnection::MemoryPerIdleConnection() {
+  if (0 == g_mux_idle_conn_num) {
+    return 0;
+  }
+  return sizeof(MuxConnection) + sizeof(CipherContext) +
+         g_mux_idle_conn_buffer_bytes / g_mux_idle_conn_num;
+}
 MuxConnection::MuxConnection(MuxConnectionType type, IOConnectionPtr&& conn,
                              std::unique_ptr<CipherContext>&& cipher_ctx, bool is_local)
     : type_(type),
       io_conn_(std::move(conn)),
-      write_mutex_(io_conn_->GetExecutor()),
       cipher_ctx_(std::move(cipher_ctx)),
+      write_drain_timer_(io_conn_->GetExecutor()),
+      queued_write_bytes_(0),
+      inflight_write_len_(0),
+      ping_timer_(io_conn_->GetExecutor()),
+      srtt_us_(0),
+      rttvar_us_(0),
+      ping_loss_(0),
+      missed_pongs_(0),
+      ping_inflight_(false),
+      write_drain_waiters_(0),
+      write_calls_(0),
+      write_frames_(0),
+      writing_(false),
+      closed_(false),
       client_id_(0),
+      features_(0),
+      peer_stream_window_(0),
+      max_frame_size_(kMaxChunkSize),
       idx_(0),
       expire_at_unix_secs_(0),
       last_unmatch_stream_id_(0),
@@ -72,13 +150,16 @@ MuxConnection::MuxConnection(MuxConnectionType type, IOConnectionPtr&& conn,
       recv_bytes_(0),
       send_bytes_(0),
       read_state_(0),
+      buffer_bytes_(0),
+      last_busy_unix_secs_(0),
+      idle_(false),
       is_local_(is_local),
       is_authed_(false),
       retired_(false) {
-  write_buffer_.resize(kMaxChunkSize + kEventHeadSize + kReservedBufferSize);
-  read_buffer_.resize(2 * kMaxChunkSize);
+  write_drain_timer_.expires_at(::asio::steady_timer::time_point::max());
   g_mux_conn_num++;
-  expire_at_unix_secs_ = (time(nullptr) + g_connection_expire_secs + random_uint64(0, 60));
+  last_busy_unix_secs_ = time(nullptr);
+  expire_at_unix_secs_ = (last_busy_unix_secs_ + g_connection_expire_secs + random_uint64(0, 60));
   latest_window_recv_bytes_.resize(32);
   latest_window_send_bytes_.resize(32);
 }
@@ -117,7 +198,68 @@ uint64_t MuxConnection::GetLatestWindowSendBytes() const {
   return n;
 }
 
-MuxConnection::~MuxConnection() { g_mux_conn_num--; }
+MuxConnection::~MuxConnection() {
+  SetIdle(false);
+  g_mux_conn_buffer_bytes -= buffer_bytes_;
+  g_mux_conn_num--;
+}
+
+void MuxConnection::SetMaxFrameSize(uint32_t n) {
+  max_frame_size_ = n;
+  cipher_ctx_->SetMaxFrameSize(n);
+  // the read buffer is enlarged by next read, unread bytes are moved along.
+}
+
+void MuxConnection::SetIdle(bool v) {
+  if (v == idle_) {
+    return;
+  }
+  idle_ = v;
+  if (idle_) {
+    g_mux_idle_conn_num++;
+    g_mux_idle_conn_buffer_bytes += buffer_bytes_;
+  } else {
+    g_mux_idle_conn_num--;
+    g_mux_idle_conn_buffer_bytes -= buffer_bytes_;
+  }
+}
+
+void MuxConnection::UpdateBufferBytes() {
+  size_t n = cipher_ctx_->GetBufferBytes();
+  if (read_buffer_) {
+    n += read_buffer_->size();
+  }
+  if (write_buffer_) {
+    n += write_buffer_->size();
+  }
+  g_mux_conn_buffer_bytes += n;
+  g_mux_conn_buffer_bytes -= buffer_bytes_;
+  if (idle_) {
+    g_mux_idle_conn_buffer_bytes += n;
+    g_mux_idle_conn_buffer_bytes -= buffer_bytes_;
+  }
+  buffer_bytes_ = n;
+}
+
+void MuxConnection::ReleaseIdleBuffers() {
+  // the write buffer is in use during a socket write, cipher buffers only inside one call.
+  if (!writing_) {
+    write_buffer_.reset();
+  }
+  cipher_ctx_->ReleaseBuffers();
+  if (!read_buffer_ || read_buffer_->size() > kIdleReadBufferSize) {
+    read_buffer_ = get_iobuf(kIdleReadBufferSize);
+  }
+  SetIdle(true);
+  UpdateBufferBytes();
+}
+
+static uint32_t negotiate_max_frame_size(uint32_t features, uint32_t peer_max_frame_size) {
+  if (!(features & MUX_FEATURE_JUMBO_FRAME) || peer_max_frame_size < kMaxChunkSize) {
+    return kMaxChunkSize;
+  }
+  return std::min(g_mux_max_frame_size, peer_max_frame_size);
+}
 
 asio::awaitable<ServerAuthResult> MuxConnection::ServerAuth() {
   if (is_local_) {
@@ -132,7 +274,7 @@ asio::awaitable<ServerAuthResult> MuxConnection::ServerAuth() {
         rc);
     co_return ServerAuthResult{"", 0, false};
   }
-  AuthRequest* auth_req_event = dynamic_cast<AuthRequest*>(auth_req.get());
+  AuthRequest* auth_req_event = event_cast<AuthRequest>(auth_req.get());
   if (nullptr == auth_req_event) {
     SNOVA_ERROR("Recv non auth reqeust with type:{}", auth_req->head.type);
     co_return ServerAuthResult{"", 0, false};
@@ -155,9 +297,32 @@ asio::awaitable<ServerAuthResult> MuxConnection::ServerAuth() {
   std::unique_ptr<AuthResponse> auth_res = std::make_unique<AuthResponse>();
   auth_res->event.success = true;
   auth_res->event.iv = iv;
-  bool write_success = co_await WriteEvent(std::move(auth_res));
+  features_ = auth_req_event->event.features & kMuxSupportedFeatures;
+  if (features_ & MUX_FEATURE_STREAM_FLOW_CONTROL) {
+    peer_stream_window_ = auth_req_event->event.stream_window;
+    auth_res->event.stream_window = g_stream_window_bytes;
+  }
+  if (features_ & MUX_FEATURE_JUMBO_FRAME) {
+    auth_res->event.max_frame_size = g_mux_max_frame_size;
+  }
+  auth_res->event.features = features_;
+  uint32_t cipher_method = 0;
+  if (cipher_ctx_->IsAutoMethod() && auth_req_event->event.cipher_methods > 0) {
+    cipher_method = CipherContext::SelectAutoMethod(auth_req_event->event.cipher_methods);
+    auth_res->event.cipher_method = cipher_method;
+  }
+  SetMaxFrameSize(negotiate_max_frame_size(features_, auth_req_event->event.max_frame_size));
+  bool write_success = co_await WriteAuthEvent(std::move(auth_res));
   if (write_success) {
     cipher_ctx_->UpdateNonce(iv);
+    // auth response is the last frame of the bootstrap cipher and v1 framing, both sides switch
+    // after it.
+    if (cipher_method > 0 && 0 != cipher_ctx_->ResetMethod(cipher_method)) {
+      write_success = false;
+    }
+    if (features_ & MUX_FEATURE_WIRE_V2) {
+      cipher_ctx_->SetWireVersion(2);
+    }
   }
   client_id_ = auth_req_event->event.client_id;
   auth_user_ = auth_req_event->event.user;
@@ -183,7 +348,17 @@ asio::awaitable<bool> MuxConnection::ClientAuth(const std::string& user, uint64_
   if (g_is_middle_node) {
     auth->event.is_middle = 1;
   }
-  bool write_success = co_await WriteEvent(std::move(auth));
+  auth->event.features = kMuxSupportedFeatures;
+  if (!g_mux_stream_striping) {
+    // striping is asked by the downloading side, server stripes as soon as the feature negotiated.
+    auth->event.features &= ~MUX_FEATURE_STREAM_STRIPING;
+  }
+  auth->event.stream_window = g_stream_window_bytes;
+  auth->event.max_frame_size = g_mux_max_frame_size;
+  if (cipher_ctx_->IsAutoMethod()) {
+    auth->event.cipher_methods = CipherContext::GetAutoMethodMask();
+  }
+  bool write_success = co_await WriteAuthEvent(std::move(auth));
   if (!write_success) {
     SNOVA_ERROR("Write auth request failed.");
     co_return false;
@@ -196,7 +371,7 @@ asio::awaitable<bool> MuxConnection::ClientAuth(const std::string& user, uint64_
                 rc);
     co_return false;
   }
-  AuthResponse* auth_res_event = dynamic_cast<AuthResponse*>(auth_res.get());
+  AuthResponse* auth_res_event = event_cast<AuthResponse>(auth_res.get());
   if (nullptr == auth_res_event) {
     SNOVA_ERROR("Recv non auth response with type:{}", auth_res->head.type);
     co_return false;
@@ -206,6 +381,20 @@ asio::awaitable<bool> MuxConnection::ClientAuth(const std::string& user, uint64_
     SNOVA_ERROR("Recv error auth response.");
   } else {
     cipher_ctx_->UpdateNonce(auth_res_event->event.iv);
+    if (auth_res_event->event.cipher_method > 0) {
+      if (0 != cipher_ctx_->ResetMethod(auth_res_event->event.cipher_method)) {
+        co_return false;
+      }
+      SNOVA_INFO("[{}]Switch to cipher method:{}", idx_, cipher_ctx_->GetMethod());
+    }
+    features_ = auth_res_event->event.features & kMuxSupportedFeatures;
+    if (features_ & MUX_FEATURE_WIRE_V2) {
+      cipher_ctx_->SetWireVersion(2);
+    }
+    if (features_ & MUX_FEATURE_STREAM_FLOW_CONTROL) {
+      peer_stream_window_ = auth_res_event->event.stream_window;
+    }
+    SetMaxFrameSize(negotiate_max_frame_size(features_, auth_res_event->event.max_frame_size));
     is_authed_ = true;
     // SNOVA_INFO("Success to recv auth response.");
   }
@@ -233,9 +422,9 @@ asio::awaitable<bool> MuxConnection::OpenTunnel(uint16_t remote_port, const std:
                 rc);
     co_return false;
   }
-  TunnelOpenResponse* tunnel_res_event = dynamic_cast<TunnelOpenResponse*>(tunnel_res.get());
+  TunnelOpenResponse* tunnel_res_event = event_cast<TunnelOpenResponse>(tunnel_res.get());
   if (nullptr == tunnel_res_event) {
-    SNOVA_ERROR("Recv non tunnel response with type:{}", tunnel_res_event->head.type);
+    SNOVA_ERROR("Recv non tunnel response with type:{}", tunnel_res->head.type);
     co_return false;
   }
   bool success = tunnel_res_event->event.success;
@@ -263,9 +452,6 @@ int MuxConnection::ReadEventFromBuffer(std::unique_ptr<MuxEvent>& event, Bytes&
     SNOVA_ERROR("[{}]Failed to read event with rc:{}", idx_, rc);
     return rc;
   }
-  if (read_buffer_.data() != buffer.data()) {
-    memmove(read_buffer_.data(), buffer.data(), buffer.size());
-  }
   return ERR_NEED_MORE_INPUT_DATA;
 }
 asio::awaitable<int> MuxConnection::ReadEvent(std::unique_ptr<MuxEvent>& event) {
@@ -279,10 +465,36 @@ asio::awaitable<int> MuxConnection::ReadEvent(std::unique_ptr<MuxEvent>& event)
     if (rc != ERR_NEED_MORE_INPUT_DATA) {
       break;
     }
-    size_t read_pos = current_read_buffer.size();
-    // SNOVA_INFO("start read {} {}.", read_pos, read_buffer_.size() - read_pos);
+    size_t data_offset = 0;
+    size_t data_len = current_read_buffer.size();
+    // a buffer of 2 max size events moves the partial second event to the head after almost
+    // every event, copying most received bytes once more.
+    size_t read_buffer_size = 4 * max_frame_size_;
+    if (0 == data_len && time(nullptr) - last_busy_unix_secs_ >= kIdleBufferSecs) {
+      // wait next bytes of a connection carrying only pings in a small buffer.
+      ReleaseIdleBuffers();
+    } else if (!read_buffer_ || read_buffer_->size() < read_buffer_size) {
+      IOBufPtr buffer = get_iobuf(read_buffer_size);
+      if (data_len > 0) {
+        memcpy(buffer->data(), current_read_buffer.data(), data_len);
+      }
+      read_buffer_ = std::move(buffer);
+      SetIdle(false);
+      UpdateBufferBytes();
+    } else if (data_len > 0) {
+      // Keep reading after the partial event, only move it to the buffer head when a max size
+      // event starting from current offset could not fit in the buffer.
+      data_offset = current_read_buffer.data() - read_buffer_->data();
+      if (data_offset + max_encrypted_event_size(max_frame_size_) > read_buffer_->size()) {
+        memmove(read_buffer_->data(), current_read_buffer.data(), data_len);
+        g_mux_read_move_bytes += data_len;
+        data_offset = 0;
+      }
+    }
+    size_t read_pos = data_offset + data_len;
+    // SNOVA_INFO("start read {} {}.", read_pos, read_buffer_->size() - read_pos);
     auto [n, ec] = co_await io_conn_->AsyncRead(
-        ::asio::buffer(read_buffer_.data() + read_pos, read_buffer_.size() - read_pos));
+        ::asio::buffer(read_buffer_->data() + read_pos, read_buffer_->size() - read_pos));
     if (ec) {
       SNOVA_ERROR("Failed to read event with error:{}", ec);
       rc = ec.value();
@@ -295,11 +507,14 @@ asio::awaitable<int> MuxConnection::ReadEvent(std::unique_ptr<MuxEvent>& event)
     }
     auto now = time(nullptr);
     last_active_read_unix_secs_ = now;
+    if (n >= kIdleReadBufferSize) {
+      last_busy_unix_secs_ = now;
+    }
     latest_window_recv_bytes_[now % latest_window_recv_bytes_.size()] += n;
     recv_bytes_ += n;
     // SNOVA_INFO("Read {} bytes.", n);
-    // readable_data_ = Bytes{read_buffer_.data(), read_pos + n};
-    current_read_buffer = absl::MakeSpan(read_buffer_.data(), read_pos + n);
+    // readable_data_ = Bytes{read_buffer_->data(), read_pos + n};
+    current_read_buffer = absl::MakeSpan(read_buffer_->data() + data_offset, data_len + n);
   }
   readable_data_ = current_read_buffer;
   co_return rc;
@@ -330,7 +545,7 @@ asio::awaitable<int> MuxConnection::ProcessReadEvent() {
       break;
     }
     case EVENT_STREAM_OPEN: {
-      StreamOpenRequest* open_request = dynamic_cast<StreamOpenRequest*>(event.get());
+      StreamOpenRequest* open_request = event_cast<StreamOpenRequest>(event.get());
       if (nullptr == open_request) {
         SNOVA_ERROR("null request for EVENT_STREAM_OPEN");
         co_return -1;
@@ -352,6 +567,12 @@ asio::awaitable<int> MuxConnection::ProcessReadEvent() {
       if (!stream) {
         // SNOVA_ERROR("[{}][{}]No stream found to close.", idx_, event->head.sid);
       } else {
+        StreamCloseRequest* close_req = event_cast<StreamCloseRequest>(event.get());
+        if (nullptr != close_req && close_req->head.flags.stream_seq &&
+            stream->DeferRemoteClose(close_req->chunk_count)) {
+          // striped chunks still in flight on other connections, closed once all arrived.
+          break;
+        }
         co_await stream->Close(true);
       }
       break;
@@ -370,13 +591,63 @@ asio::awaitable<int> MuxConnection::ProcessReadEvent() {
           co_await WriteEvent(std::move(close_ev));
         }
       } else {
-        StreamChunk* chunk = dynamic_cast<StreamChunk*>(event.get());
+        StreamChunk* chunk = event_cast<StreamChunk>(event.get());
         if (nullptr == chunk) {
           SNOVA_ERROR("null chunk for EVENT_STREAM_CHUNK");
           co_return -1;
         }
+        if (chunk->head.flags.body_no_encrypt && !stream->IsTLS()) {
+          // peer found the stream is tls after open(by the first data), reply without encryption.
+          stream->SetTLS(true);
+        }
         read_state_ = STATE_OFFER_CHUNK;
-        co_await stream->Offer(std::move(chunk->chunk), chunk->chunk_len);
+        std::error_code ec;
+        if (chunk->head.flags.stream_seq) {
+          ec = co_await stream->OfferStriped(std::move(chunk->chunk), chunk->chunk_len);
+        } else {
+          ec = co_await stream->Offer(std::move(chunk->chunk), chunk->chunk_len);
+        }
+        if (ec == std::errc::no_buffer_space) {
+          SNOVA_ERROR("[{}][{}]Peer overran stream window, close stream.", idx_, event->head.sid);
+          read_state_ = STATE_CLOSING_STREAM;
+          co_await stream->Close(false);
+        } else if (ec == std::errc::bad_message) {
+          SNOVA_ERROR("[{}][{}]Invalid striped chunk, close stream.", idx_, event->head.sid);
+          read_state_ = STATE_CLOSING_STREAM;
+          co_await stream->Close(false);
+        }
+      }
+      break;
+    }
+    case EVENT_PING: {
+      PingRequest* ping = event_cast<PingRequest>(event.get());
+      if (nullptr != ping) {
+        auto pong = std::make_unique<PingResponse>();
+        pong->event.timestamp_us = ping->event.timestamp_us;
+        co_await WriteEvent(std::move(pong));
+      }
+      break;
+    }
+    case EVENT_PONG: {
+      PingResponse* pong = event_cast<PingResponse>(event.get());
+      if (nullptr != pong) {
+        OnPong(pong->event.timestamp_us);
+      }
+      break;
+    }
+    case EVENT_STREAM_OPEN_RES: {
+      MuxStreamPtr stream = MuxStream::Get(client_id_, event->head.sid);
+      StreamOpenResult* result = event_cast<StreamOpenResult>(event.get());
+      if (stream && nullptr != result) {
+        stream->OnOpenResult(result->event.error_code, result->event.connect_latency_ms);
+      }
+      break;
+    }
+    case EVENT_STREAM_WINDOW_UPDATE: {
+      MuxStreamPtr stream = MuxStream::Get(client_id_, event->head.sid);
+      StreamWindowUpdate* update = event_cast<StreamWindowUpdate>(event.get());
+      if (stream && nullptr != update) {
+        stream->UpdateSendWindow(update->event.increment);
       }
       break;
     }
@@ -391,6 +662,12 @@ asio::awaitable<int> MuxConnection::ProcessReadEvent() {
 
 asio::awaitable<void> MuxConnection::ReadEventLoop() {
   g_mux_conn_num_in_loop++;
+  if ((features_ & MUX_FEATURE_PING) && g_mux_ping_interval_secs > 0) {
+    ::asio::co_spawn(
+        io_conn_->GetExecutor(),
+        [self = GetSelf()]() -> asio::awaitable<void> { co_await self->PingLoop(); },
+        ::asio::detached);
+  }
   while (true) {
     int rc = co_await ProcessReadEvent();
     if (0 != rc && ERR_NEED_MORE_INPUT_DATA != rc) {
@@ -399,63 +676,263 @@ asio::awaitable<void> MuxConnection::ReadEventLoop() {
   }
   read_state_ = STATE_READ_LOOP_EXIT;
   Close();
+  MuxStream::OnConnectionClosed(client_id_);
   g_mux_conn_num_in_loop--;
   SNOVA_INFO("Close mux connection:{}, retired:{}", idx_, retired_);
 }
 
 void MuxConnection::Close() {
+  closed_ = true;
   io_conn_->Close();
-  write_mutex_.Close();
+  write_drain_timer_.cancel();
+  ping_timer_.cancel();
 }
 
-asio::awaitable<bool> MuxConnection::Write(std::unique_ptr<MuxEvent>&& write_ev) {
-  // SNOVA_INFO("[{}]Write event:{}", write_ev->head.sid, write_ev->head.type);
-  // bool locked = write_mutex_.IsLocked();
-  // if (locked) {
-  //   SNOVA_INFO("######[{}]Write locked.", write_ev->head.sid);
-  // }
-  co_await write_mutex_.Lock();
-  // co_await write_mutex_.lock_async();
-  auto now = time(nullptr);
-  last_active_write_unix_secs_ = now;
-  MutableBytes wbuffer(write_buffer_.data(), write_buffer_.size());
+asio::awaitable<void> MuxConnection::PingLoop() {
+  while (!closed_) {
+    ping_timer_.expires_after(std::chrono::seconds(g_mux_ping_interval_secs));
+    co_await ping_timer_.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (closed_) {
+      break;
+    }
+    if (ping_inflight_) {
+      missed_pongs_++;
+      ping_loss_ = ping_loss_ * 7 / 8 + 1.0 / 8;
+      if (g_mux_ping_max_missed > 0 && missed_pongs_ >= g_mux_ping_max_missed) {
+        // a connection stuck in retransmission would not be idle long enough to hit
+        // 'g_connection_max_inactive_secs', close it so that a new one is created.
+        SNOVA_ERROR("[{}]Close mux connection since it missed {} pongs.", idx_, missed_pongs_);
+        g_mux_ping_timeouts++;
+        Close();
+        break;
+      }
+    }
+    auto ping = std::make_unique<PingRequest>();
+    ping->event.timestamp_us = steady_now_us();
+    ping_inflight_ = true;
+    co_await WriteEvent(std::move(ping));
+  }
+}
+
+void MuxConnection::OnPong(uint64_t timestamp_us) {
+  uint64_t now_us = steady_now_us();
+  if (timestamp_us > now_us) {
+    return;
+  }
+  uint64_t rtt_us = now_us - timestamp_us;
+  // same smoothing as TCP(RFC 6298).
+  if (0 == srtt_us_) {
+    srtt_us_ = rtt_us;
+    rttvar_us_ = rtt_us / 2;
+  } else {
+    uint64_t delta = srtt_us_ > rtt_us ? srtt_us_ - rtt_us : rtt_us - srtt_us_;
+    rttvar_us_ = (3 * rttvar_us_ + delta) / 4;
+    srtt_us_ = (7 * srtt_us_ + rtt_us) / 8;
+  }
+  if (missed_pongs_ == 0) {
+    ping_loss_ = ping_loss_ * 7 / 8;
+  }
+  missed_pongs_ = 0;
+  ping_inflight_ = false;
+}
+
+void MuxConnection::EnqueueEvent(std::unique_ptr<MuxEvent>&& write_ev) {
+  queued_write_bytes_ += kEventHeadSize + event_payload_size(*write_ev);
+  uint32_t sid = write_ev->head.sid;
+  if (write_ev->head.type == EVENT_STREAM_CHUNK) {
+    uint8_t priority = static_cast<const StreamChunk&>(*write_ev).priority;
+    auto [it, inserted] = stream_write_queues_.try_emplace(sid);
+    if (inserted) {
+      active_write_streams_.push_back(sid);
+    }
+    it->second.priority = priority;
+    it->second.events.emplace_back(std::move(write_ev));
+    return;
+  }
+  // a close must not overtake the queued chunks of its stream, other control events(e.g. window
+  // updates for the peer's data) go first so that they never wait behind bulk data.
+  if (write_ev->head.type == EVENT_STREAM_CLOSE) {
+    auto found = stream_write_queues_.find(sid);
+    if (found != stream_write_queues_.end()) {
+      found->second.events.emplace_back(std::move(write_ev));
+      return;
+    }
+  }
+  control_write_queue_.emplace_back(std::move(write_ev));
+}
+
+int MuxConnection::EncryptEvent(std::unique_ptr<MuxEvent>& write_ev, size_t& write_len) {
+  size_t max_event_size = max_encrypted_event_size(max_frame_size_);
+  if (!write_buffer_) {
+    write_buffer_ = get_iobuf(max_event_size);
+  }
+  if (write_buffer_->size() - write_len < max_event_size) {
+    write_buffer_->resize(write_len + max_event_size);
+  }
+  queued_write_bytes_ -= kEventHeadSize + event_payload_size(*write_ev);
+  MutableBytes wbuffer(write_buffer_->data() + write_len, write_buffer_->size() - write_len);
   int rc = cipher_ctx_->Encrypt(write_ev, wbuffer);
   if (0 != rc) {
-    SNOVA_ERROR("Encrypt event request:{} with rc:{}", write_ev->head.type, rc);
-    co_await write_mutex_.Unlock();
-    // co_await write_mutex_.unlock();
+    SNOVA_ERROR("[{}]Encrypt event:{} failed with rc:{}", idx_, write_ev->head.type, rc);
+    return rc;
+  }
+  write_len += wbuffer.size();
+  return 0;
+}
+
+int MuxConnection::EncryptScheduledEvents(size_t& write_len, uint32_t& write_frames) {
+  while (!control_write_queue_.empty()) {
+    int rc = EncryptEvent(control_write_queue_.front(), write_len);
+    control_write_queue_.pop_front();
+    if (0 != rc) {
+      return rc;
+    }
+    write_frames++;
+  }
+  // stop scheduling chunks into one socket write at the batch limits, so control events queued
+  // meanwhile wait at most one such write.
+  while (!active_write_streams_.empty() && write_len < g_mux_write_batch_bytes &&
+         write_frames < g_mux_write_batch_frames) {
+    uint32_t sid = active_write_streams_.front();
+    active_write_streams_.pop_front();
+    auto found = stream_write_queues_.find(sid);
+    if (found == stream_write_queues_.end()) {
+      continue;
+    }
+    StreamWriteQueue& queue = found->second;
+    queue.deficit += stream_quantum(queue.priority, max_frame_size_);
+    while (!queue.events.empty() && write_frames < g_mux_write_batch_frames) {
+      size_t cost = event_payload_size(*queue.events.front());
+      if (cost > queue.deficit) {
+        break;
+      }
+      queue.deficit -= cost;
+      int rc = EncryptEvent(queue.events.front(), write_len);
+      queue.events.pop_front();
+      if (0 != rc) {
+        return rc;
+      }
+      write_frames++;
+    }
+    if (queue.events.empty()) {
+      stream_write_queues_.erase(found);
+    } else {
+      active_write_streams_.push_back(sid);
+    }
+  }
+  return 0;
+}
+
+asio::awaitable<void> MuxConnection::WriteLoop() {
+  while (!closed_ && (!control_write_queue_.empty() || !active_write_streams_.empty())) {
+    size_t write_len = 0;
+    uint32_t write_frames = 0;
+    int rc = EncryptScheduledEvents(write_len, write_frames);
+    if (0 != rc) {
+      Close();
+      break;
+    }
+    if (0 == write_len) {
+      continue;
+    }
+    inflight_write_len_ = write_len;
+    auto now = time(nullptr);
+    last_active_write_unix_secs_ = now;
+    if (write_len >= kIdleReadBufferSize) {
+      last_busy_unix_secs_ = now;
+    }
+    UpdateBufferBytes();
+    auto [n, ec] = co_await io_conn_->AsyncWrite(::asio::buffer(write_buffer_->data(), write_len));
+    inflight_write_len_ = 0;
+    if (ec) {
+      SNOVA_ERROR("[{}]Write {} events/{} bytes failed with error:{}", idx_, write_frames,
+                  write_len, ec);
+      Close();
+      break;
+    }
+    send_bytes_ += write_len;
+    latest_window_send_bytes_[now % latest_window_send_bytes_.size()] += write_len;
+    write_calls_++;
+    write_frames_ += write_frames;
+    g_mux_write_calls++;
+    g_mux_write_frames += write_frames;
+    if (write_drain_waiters_ > 0) {
+      write_drain_timer_.cancel();
+    }
+  }
+  writing_ = false;
+}
+
+asio::awaitable<bool> MuxConnection::WriteAuthEvent(std::unique_ptr<MuxEvent>&& event) {
+  if (!write_buffer_) {
+    write_buffer_ = get_iobuf(max_encrypted_event_size(max_frame_size_));
+  }
+  MutableBytes wbuffer(write_buffer_->data(), write_buffer_->size());
+  int rc = cipher_ctx_->Encrypt(event, wbuffer);
+  if (0 != rc) {
+    SNOVA_ERROR("[{}]Encrypt auth event:{} failed with rc:{}", idx_, event->head.type, rc);
     co_return false;
   }
-  // auto cancel_write_timeout = TimeWheel::GetInstance()->Add(
-  //     [this]() -> asio::awaitable<void> {
-  //       socket_.close();
-  //       co_return;
-  //     },
-  //     g_tcp_write_timeout_secs);
   auto [n, ec] = co_await io_conn_->AsyncWrite(::asio::buffer(wbuffer.data(), wbuffer.size()));
-  // cancel_write_timeout();
-  co_await write_mutex_.Unlock();
-  // co_await write_mutex_.unlock();
   if (ec) {
-    SNOVA_ERROR("Write event:{}/{} failed with error:{}", write_ev->head.type, wbuffer.size(), ec);
+    SNOVA_ERROR("[{}]Write auth event failed with error:{}", idx_, ec);
     co_return false;
   }
   send_bytes_ += wbuffer.size();
-  latest_window_send_bytes_[now % latest_window_send_bytes_.size()] += wbuffer.size();
   co_return true;
 }
 
-int MuxConnection::ComparePriority(const MuxConnection& other) const {
-  if (write_mutex_.GetWaitCount() < other.write_mutex_.GetWaitCount()) {
-    return 1;
+asio::awaitable<bool> MuxConnection::Write(std::unique_ptr<MuxEvent>&& write_ev) {
+  // SNOVA_INFO("[{}]Write event:{}", write_ev->head.sid, write_ev->head.type);
+  bool is_chunk = write_ev->head.type == EVENT_STREAM_CHUNK;
+  if (is_chunk && event_payload_size(*write_ev) > max_frame_size_) {
+    SNOVA_ERROR("[{}]Too large chunk len:{}", idx_, event_payload_size(*write_ev));
+    co_return false;
   }
-  if (write_mutex_.GetWaitCount() > other.write_mutex_.GetWaitCount()) {
-    return -1;
+  // only chunks are throttled by the queue high-water mark, small control events go straight to
+  // the head of the queue.
+  while (is_chunk && !closed_ && writing_ && GetQueuedBytes() >= g_mux_write_queue_max_bytes) {
+    write_drain_waiters_++;
+    g_mux_write_queue_waits++;
+    co_await write_drain_timer_.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    write_drain_waiters_--;
+  }
+  if (closed_) {
+    co_return false;
+  }
+  EnqueueEvent(std::move(write_ev));
+  if (!writing_) {
+    writing_ = true;
+    ::asio::co_spawn(
+        io_conn_->GetExecutor(),
+        [self = GetSelf()]() -> asio::awaitable<void> { co_await self->WriteLoop(); },
+        ::asio::detached);
+  }
+  co_return true;
+}
+
+int MuxConnection::ComparePriority(const MuxConnection& other) const {
+  // a connection missing pongs is probably stuck in retransmission.
+  if (missed_pongs_ != other.missed_pongs_) {
+    return missed_pongs_ < other.missed_pongs_ ? 1 : -1;
+  }
+  // prefer the clearly faster path, small RTT differences are noise and left to load balancing.
+  if (srtt_us_ > 0 && other.srtt_us_ > 0) {
+    uint64_t rtt_us = srtt_us_ + rttvar_us_;
+    uint64_t other_rtt_us = other.srtt_us_ + other.rttvar_us_;
+    if (2 * rtt_us < other_rtt_us) {
+      return 1;
+    }
+    if (rtt_us > 2 * other_rtt_us) {
+      return -1;
+    }
   }
-  if (!write_mutex_.IsLocked() && other.write_mutex_.IsLocked()) {
+  size_t queued_bytes = GetQueuedBytes();
+  size_t other_queued_bytes = other.GetQueuedBytes();
+  if (queued_bytes < other_queued_bytes) {
     return 1;
   }
-  if (write_mutex_.IsLocked() && !other.write_mutex_.IsLocked()) {
+  if (queued_bytes > other_queued_bytes) {
     return -1;
   }
 
@@ -28,6 +28,7 @@
  */
 
 #pragma once
+#include <deque>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -44,7 +45,6 @@
 #include "snova/log/log_macros.h"
 #include "snova/mux/cipher_context.h"
 #include "snova/mux/mux_stream.h"
-#include "snova/util/async_channel_mutex.h"
 
 namespace snova {
 enum MuxConnectionType {
@@ -62,6 +62,17 @@ class MuxConnection : public std::enable_shared_from_this<MuxConnection> {
  public:
   static size_t Size();
   static size_t ActiveSize();
+  static uint64_t TotalWriteCalls();
+  static uint64_t TotalWriteFrames();
+  static uint64_t TotalWriteQueueWaits();
+  static uint64_t TotalReadMoveBytes();
+  static uint64_t TotalPingTimeouts();
+  // connections holding only the small idle read buffer.
+  static size_t IdleSize();
+  // read/write/cipher buffer bytes of all connections.
+  static uint64_t TotalBufferBytes();
+  // memory of an idle connection, the objects plus the buffers it still holds.
+  static size_t MemoryPerIdleConnection();
   MuxConnection(MuxConnectionType type, IOConnectionPtr&& conn,
                 std::unique_ptr<CipherContext>&& cipher_ctx, bool is_local);
   asio::awaitable<bool> ClientAuth(const std::string& user, uint64_t client_id);
@@ -80,12 +91,29 @@ class MuxConnection : public std::enable_shared_from_this<MuxConnection> {
   uint32_t GetIdx() const { return idx_; }
   uint32_t GetExpireAtUnixSecs() const { return expire_at_unix_secs_; }
   uint64_t GetClientId() const { return client_id_; }
+  uint32_t GetFeatures() const { return features_; }
+  // connection dialed by this node.
+  bool IsLocal() const { return is_local_; }
+  // receive window advertised by peer for each stream, 0 if stream flow control is not negotiated.
+  uint32_t GetPeerStreamWindow() const { return peer_stream_window_; }
+  // max stream chunk size of a frame, larger than kMaxChunkSize if jumbo frames are negotiated.
+  uint32_t GetMaxFrameSize() const { return max_frame_size_; }
   uint32_t GetLastActiveUnixSecs() const {
     return last_active_write_unix_secs_ > last_active_read_unix_secs_ ? last_active_write_unix_secs_
                                                                       : last_active_read_unix_secs_;
   }
   uint64_t GetRecvBytes() const { return recv_bytes_; }
   uint64_t GetSendBytes() const { return send_bytes_; }
+  uint64_t GetWriteCalls() const { return write_calls_; }
+  uint64_t GetWriteFrames() const { return write_frames_; }
+  // bytes queued or being written, the load signal for connection selection.
+  size_t GetQueuedBytes() const { return queued_write_bytes_ + inflight_write_len_; }
+  size_t GetActiveWriteStreams() const { return active_write_streams_.size(); }
+  // smoothed ping RTT and its variation in microseconds, 0 before the first pong.
+  uint64_t GetSmoothedRttUs() const { return srtt_us_; }
+  uint64_t GetRttVarUs() const { return rttvar_us_; }
+  double GetPingLoss() const { return ping_loss_; }
+  uint32_t GetMissedPongs() const { return missed_pongs_; }
   bool IsRetired() const { return retired_; }
   void SetRetired() { retired_ = true; }
   uint64_t GetLatestWindowRecvBytes() const;
@@ -116,18 +144,66 @@ class MuxConnection : public std::enable_shared_from_this<MuxConnection> {
 
   int ReadEventFromBuffer(std::unique_ptr<MuxEvent>& event, Bytes& buffer);
   asio::awaitable<int> ReadEvent(std::unique_ptr<MuxEvent>& event);
+  void EnqueueEvent(std::unique_ptr<MuxEvent>&& write_ev);
+  int EncryptEvent(std::unique_ptr<MuxEvent>& write_ev, size_t& write_len);
+  int EncryptScheduledEvents(size_t& write_len, uint32_t& write_frames);
+  asio::awaitable<void> WriteLoop();
+  // seal and write at once, bypassing the write queue, so that the nonce/cipher switch right
+  // after auth could never apply to the auth events.
+  asio::awaitable<bool> WriteAuthEvent(std::unique_ptr<MuxEvent>&& event);
+  void SetMaxFrameSize(uint32_t n);
+  // return buffers to IOBuf pool except a small one for the next read.
+  void ReleaseIdleBuffers();
+  void SetIdle(bool v);
+  void UpdateBufferBytes();
+  asio::awaitable<void> PingLoop();
+  void OnPong(uint64_t timestamp_us);
 
   MuxConnectionType type_;
   IOConnectionPtr io_conn_;
   std::unique_ptr<CipherContext> cipher_ctx_;
-  AsyncChannelMutex write_mutex_;
-  // cppcoro::async_mutex write_mutex_;
-
-  std::vector<uint8_t> write_buffer_;
-  std::vector<uint8_t> read_buffer_;
+  // never expires, cancelled to wake producers suspended by the write queue high-water mark.
+  ::asio::steady_timer write_drain_timer_;
+
+  // Producers only queue events, the writer coroutine encrypts them into 'write_buffer_' right
+  // before each socket write in scheduling order: control events first, then stream events by
+  // deficit round robin weighted by stream priority. Events of one stream keep their order.
+  struct StreamWriteQueue {
+    std::deque<std::unique_ptr<MuxEvent>> events;
+    size_t deficit = 0;
+    uint8_t priority = STREAM_PRIORITY_NORMAL;
+  };
+  std::deque<std::unique_ptr<MuxEvent>> control_write_queue_;
+  absl::flat_hash_map<uint32_t, StreamWriteQueue> stream_write_queues_;
+  std::deque<uint32_t> active_write_streams_;
+  size_t queued_write_bytes_;
+  size_t inflight_write_len_;
+
+  ::asio::steady_timer ping_timer_;
+  uint64_t srtt_us_;
+  uint64_t rttvar_us_;
+  double ping_loss_;
+  uint32_t missed_pongs_;
+  bool ping_inflight_;
+  uint32_t write_drain_waiters_;
+  uint64_t write_calls_;
+  uint64_t write_frames_;
+  bool writing_;
+  bool closed_;
+
+  // borrowed from IOBuf pool while data flows, released once the connection has carried no
+  // more than pings for 'kIdleBufferSecs'.
+  IOBufPtr write_buffer_;
+  IOBufPtr read_buffer_;
+  size_t buffer_bytes_;
+  uint32_t last_busy_unix_secs_;
+  bool idle_;
   Bytes readable_data_;
   std::string auth_user_;
   uint64_t client_id_;
+  uint32_t features_;
+  uint32_t peer_stream_window_;
+  uint32_t max_frame_size_;
   uint32_t idx_;
   uint32_t expire_at_unix_secs_;
   uint32_t last_unmatch_stream_id_;
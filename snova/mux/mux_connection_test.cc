@@ -0,0 +1,215 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/mux/mux_connection.h"
+#include <gtest/gtest.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "snova/log/log_macros.h"
+#include "snova/server/tunnel_server.h"
+using namespace snova;  // NOLINT
+
+namespace snova {
+// the tunnel server is not linked into this test.
+asio::awaitable<std::unique_ptr<MuxEvent>> tunnel_server_handler(
+    const std::string& user, uint64_t client_id, std::unique_ptr<MuxEvent>&& tunnel_request) {
+  co_return nullptr;
+}
+}  // namespace snova
+
+// returns 'wire' in segments of at most 'segment_size' bytes like a tcp socket, writes are kept.
+class SegmentedConnection : public IOConnection {
+ public:
+  SegmentedConnection(const asio::any_io_executor& ex, std::vector<uint8_t>&& wire,
+                      size_t segment_size)
+      : ex_(ex), wire_(std::move(wire)), segment_size_(segment_size) {}
+  asio::any_io_executor GetExecutor() override { return ex_; }
+  asio::awaitable<IOResult> AsyncWrite(const asio::const_buffer& buffers) override {
+    const uint8_t* data = static_cast<const uint8_t*>(buffers.data());
+    written_.insert(written_.end(), data, data + buffers.size());
+    co_return IOResult{buffers.size(), std::error_code{}};
+  }
+  asio::awaitable<IOResult> AsyncWrite(
+      const std::vector<::asio::const_buffer>& buffers) override {
+    size_t n = 0;
+    for (const auto& buffer : buffers) {
+      auto [wn, ec] = co_await AsyncWrite(buffer);
+      n += wn;
+    }
+    co_return IOResult{n, std::error_code{}};
+  }
+  asio::awaitable<IOResult> AsyncRead(const asio::mutable_buffer& buffers) override {
+    size_t n = std::min(std::min(segment_size_, wire_.size() - read_pos_), buffers.size());
+    memcpy(buffers.data(), wire_.data() + read_pos_, n);
+    read_pos_ += n;
+    co_return IOResult{n, std::error_code{}};
+  }
+  void Close() override {}
+  const std::vector<uint8_t>& Written() const { return written_; }
+
+ private:
+  asio::any_io_executor ex_;
+  std::vector<uint8_t> wire_;
+  size_t segment_size_;
+  size_t read_pos_ = 0;
+  std::vector<uint8_t> written_;
+};
+
+struct ReadCopyResult {
+  uint64_t chunk_bytes = 0;
+  uint64_t copy_bytes = 0;
+  uint64_t move_bytes = 0;
+};
+
+// runs 'count' chunks through the read loop of a mux connection and counts every byte copied
+// between the socket read and the chunk offered to its stream.
+static ReadCopyResult bench_connection_read(const std::string& method, uint32_t wire_version,
+                                            bool body_no_encrypt, size_t chunk_len,
+                                            size_t segment_size) {
+  size_t count = 1024;
+  std::unique_ptr<CipherContext> encrypt_ctx = CipherContext::New(method, "read key");
+  std::unique_ptr<CipherContext> decrypt_ctx = CipherContext::New(method, "read key");
+  encrypt_ctx->SetWireVersion(wire_version);
+  decrypt_ctx->SetWireVersion(wire_version);
+  std::vector<uint8_t> wire(count * (chunk_len + kEventHeadSize + kReservedBufferSize));
+  size_t wire_len = 0;
+  for (size_t i = 0; i < count; i++) {
+    auto chunk = std::make_unique<StreamChunk>();
+    chunk->head.sid = 101;
+    chunk->head.flags.body_no_encrypt = body_no_encrypt ? 1 : 0;
+    chunk->chunk = get_iobuf(chunk_len);
+    memset(chunk->chunk->data(), static_cast<int>(i & 0xFF), chunk_len);
+    chunk->chunk_len = chunk_len;
+    std::unique_ptr<MuxEvent> event = std::move(chunk);
+    MutableBytes out(wire.data() + wire_len, wire.size() - wire_len);
+    EXPECT_EQ(0, encrypt_ctx->Encrypt(event, out));
+    wire_len += out.size();
+  }
+  wire.resize(wire_len);
+
+  ::asio::io_context ctx;
+  IOConnectionPtr io_conn =
+      std::make_unique<SegmentedConnection>(ctx.get_executor(), std::move(wire), segment_size);
+  auto conn = std::make_shared<MuxConnection>(MUX_EXIT_CONN, std::move(io_conn),
+                                              std::move(decrypt_ctx), false);
+  uint64_t decrypt_bytes = CipherContext::TotalChunkDecryptBytes();
+  uint64_t copy_bytes =
+      CipherContext::TotalChunkCopyBytes() + StreamChunk::TotalDecodeCopyBytes();
+  uint64_t move_bytes = MuxConnection::TotalReadMoveBytes();
+  auto start = std::chrono::steady_clock::now();
+  ::asio::co_spawn(ctx, conn->ReadEventLoop(), ::asio::detached);
+  ctx.run();
+  auto cost_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  ReadCopyResult result;
+  result.chunk_bytes = CipherContext::TotalChunkDecryptBytes() - decrypt_bytes;
+  result.copy_bytes =
+      CipherContext::TotalChunkCopyBytes() + StreamChunk::TotalDecodeCopyBytes() - copy_bytes;
+  result.move_bytes = MuxConnection::TotalReadMoveBytes() - move_bytes;
+  EXPECT_EQ(count * chunk_len, result.chunk_bytes);
+  SNOVA_INFO(
+      "[{}][v{}]body_no_encrypt:{}, {} chunks of {} bytes in {} bytes reads cost {}us, "
+      "copied/received:{:.3f}, moved/received:{:.3f}",
+      method, wire_version, body_no_encrypt, count, chunk_len, segment_size, cost_us,
+      static_cast<double>(result.copy_bytes) / result.chunk_bytes,
+      static_cast<double>(result.move_bytes) / result.chunk_bytes);
+  return result;
+}
+
+TEST(MuxConnection, ReadCopyRatio) {
+  std::string method = "chacha20_poly1305";
+  std::vector<size_t> chunk_lens = {kMaxChunkSize, 1024};
+  for (size_t segment_size : {1448, 16384, 65536}) {
+    for (uint32_t wire_version : {1, 2}) {
+      // encrypted chunks are opened straight into the IOBuf offered to the stream.
+      for (size_t chunk_len : chunk_lens) {
+        ReadCopyResult result =
+            bench_connection_read(method, wire_version, false, chunk_len, segment_size);
+        EXPECT_EQ(0u, result.copy_bytes);
+        // partial events are moved to the buffer head only once per several events.
+        EXPECT_LT(result.move_bytes, result.chunk_bytes / 4);
+      }
+      // tls streams skip encryption, the payload is copied once out of the read buffer.
+      ReadCopyResult result =
+          bench_connection_read(method, wire_version, true, kMaxChunkSize, segment_size);
+      EXPECT_EQ(result.chunk_bytes, result.copy_bytes);
+      EXPECT_LT(result.move_bytes, result.chunk_bytes / 4);
+    }
+  }
+}
+
+TEST(MuxConnection, ControlEventsFirst) {
+  ::asio::io_context ctx;
+  auto io_conn = std::make_unique<SegmentedConnection>(ctx.get_executor(),
+                                                       std::vector<uint8_t>{}, kMaxChunkSize);
+  SegmentedConnection* io = io_conn.get();
+  auto conn = std::make_shared<MuxConnection>(
+      MUX_ENTRY_CONN, std::move(io_conn), CipherContext::New("chacha20_poly1305", "k"), true);
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        // queued together, before the writer coroutine runs.
+        for (size_t i = 0; i < 4; i++) {
+          auto chunk = std::make_unique<StreamChunk>();
+          chunk->head.sid = 7;
+          chunk->chunk = get_iobuf(kMaxChunkSize);
+          chunk->chunk_len = kMaxChunkSize;
+          EXPECT_TRUE(co_await conn->WriteEvent(std::move(chunk)));
+        }
+        auto update = std::make_unique<StreamWindowUpdate>();
+        update->head.sid = 7;
+        EXPECT_TRUE(co_await conn->WriteEvent(std::move(update)));
+        auto close = std::make_unique<StreamCloseRequest>();
+        close->head.sid = 7;
+        EXPECT_TRUE(co_await conn->WriteEvent(std::move(close)));
+      },
+      ::asio::detached);
+  ctx.run();
+
+  std::unique_ptr<CipherContext> decrypt_ctx = CipherContext::New("chacha20_poly1305", "k");
+  std::vector<EventType> types;
+  Bytes in(io->Written().data(), io->Written().size());
+  while (!in.empty()) {
+    std::unique_ptr<MuxEvent> event;
+    size_t decrypt_len = 0;
+    ASSERT_EQ(0, decrypt_ctx->Decrypt(in, event, decrypt_len));
+    in.remove_prefix(decrypt_len);
+    types.push_back(static_cast<EventType>(event->head.type));
+  }
+  // the window update overtakes the queued chunks of its stream, the close never does.
+  std::vector<EventType> expected = {EVENT_STREAM_WINDOW_UPDATE, EVENT_STREAM_CHUNK,
+                                     EVENT_STREAM_CHUNK,         EVENT_STREAM_CHUNK,
+                                     EVENT_STREAM_CHUNK,         EVENT_STREAM_CLOSE};
+  EXPECT_EQ(expected, types);
+}
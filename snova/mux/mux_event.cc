@@ -27,6 +27,7 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/mux/mux_event.h"
+#include <vector>
 
 #include "pb_decode.h"
 #include "pb_encode.h"
@@ -41,10 +42,15 @@ int MuxEventHead::Encode(MutableBytes& buffer) {
     SNOVA_ERROR("No enoght space to encode head.");
     return -1;
   }
+  if (this->len > kMaxEventBodySize) {
+    SNOVA_ERROR("Too large event len:{} to encode head.", this->len);
+    return -1;
+  }
+  this->flags.len_hi = this->len >> 16;
   uint32_t id = native_to_big(this->sid);
   memcpy(buffer.data(), &id, sizeof(id));
   size_t pos = sizeof(id);
-  uint16_t length = native_to_big(this->len);
+  uint16_t length = native_to_big(static_cast<uint16_t>(this->len & 0xFFFF));
   memcpy(buffer.data() + pos, &length, sizeof(length));
   pos += sizeof(length);
   buffer.data()[pos] = this->type;
@@ -63,14 +69,70 @@ int MuxEventHead::Decode(const Bytes& buffer) {
   size_t pos = sizeof(sid);
   uint16_t len;
   memcpy(&len, buffer.data() + pos, sizeof(len));
-  this->len = big_to_native(len);
   pos += sizeof(len);
   this->type = buffer.data()[pos];
   pos++;
   memcpy(&(this->flags), buffer.data() + pos, 1);
+  this->len = (static_cast<uint32_t>(this->flags.len_hi) << 16) | big_to_native(len);
   return 0;
 }
 
+// size classes of 16 bytes cover all events, the largest are the auth events.
+static constexpr size_t kEventSizeAlign = 16;
+static constexpr size_t kMaxPooledEventSize = 1024;
+static constexpr size_t kMaxFreeEventsPerClass = 1024;
+struct EventFreeLists {
+  std::vector<void*> lists[kMaxPooledEventSize / kEventSizeAlign];
+  ~EventFreeLists();
+};
+static thread_local EventFreeLists g_event_free_lists;
+// events held by other thread_local objects may be released after the free lists at thread exit.
+static thread_local bool g_event_free_lists_destroyed = false;
+static thread_local uint64_t g_event_allocs = 0;
+static thread_local uint64_t g_event_heap_allocs = 0;
+static thread_local uint64_t g_chunk_decode_copy_bytes = 0;
+
+EventFreeLists::~EventFreeLists() {
+  for (auto& list : lists) {
+    for (void* p : list) {
+      ::operator delete(p);
+    }
+    list.clear();
+  }
+  g_event_free_lists_destroyed = true;
+}
+
+uint64_t MuxEvent::TotalAllocs() { return g_event_allocs; }
+uint64_t MuxEvent::TotalHeapAllocs() { return g_event_heap_allocs; }
+uint64_t StreamChunk::TotalDecodeCopyBytes() { return g_chunk_decode_copy_bytes; }
+
+void* MuxEvent::operator new(size_t size) {
+  g_event_allocs++;
+  if (size > kMaxPooledEventSize || g_event_free_lists_destroyed) {
+    g_event_heap_allocs++;
+    return ::operator new(size);
+  }
+  size_t size_class = (size - 1) / kEventSizeAlign;
+  auto& list = g_event_free_lists.lists[size_class];
+  if (!list.empty()) {
+    void* p = list.back();
+    list.pop_back();
+    return p;
+  }
+  g_event_heap_allocs++;
+  return ::operator new((size_class + 1) * kEventSizeAlign);
+}
+void MuxEvent::operator delete(void* p, size_t size) {
+  if (size <= kMaxPooledEventSize && !g_event_free_lists_destroyed) {
+    auto& list = g_event_free_lists.lists[(size - 1) / kEventSizeAlign];
+    if (list.size() < kMaxFreeEventsPerClass) {
+      list.push_back(p);
+      return;
+    }
+  }
+  ::operator delete(p);
+}
+
 std::unique_ptr<MuxEvent> MuxEvent::NewEvent(MuxEventHead h) {
   std::unique_ptr<MuxEvent> event;
   switch (h.type) {
@@ -110,6 +172,22 @@ std::unique_ptr<MuxEvent> MuxEvent::NewEvent(MuxEventHead h) {
       event = std::make_unique<TunnelCloseRequest>();
       break;
     }
+    case EVENT_STREAM_WINDOW_UPDATE: {
+      event = std::make_unique<StreamWindowUpdate>();
+      break;
+    }
+    case EVENT_STREAM_OPEN_RES: {
+      event = std::make_unique<StreamOpenResult>();
+      break;
+    }
+    case EVENT_PING: {
+      event = std::make_unique<PingRequest>();
+      break;
+    }
+    case EVENT_PONG: {
+      event = std::make_unique<PingResponse>();
+      break;
+    }
     case EVENT_COMMON_RES: {
       event = std::make_unique<CommonResponse>();
       break;
@@ -168,6 +246,15 @@ int StreamOpenRequest::Encode(MutableBytes& buffer) const {
     return ERR_PB_ENCODE;
   }
   size_t total = output.bytes_written;
+  if (event.data_len > 0) {
+    if (buffer.size() - total < event.data_len) {
+      SNOVA_ERROR("Require {}bytes for open data, but got {} bytes.", event.data_len,
+                  buffer.size() - total);
+      return ERR_TOO_LARGE_EVENT_ENCODE_CONTENT;
+    }
+    memcpy(buffer.data() + total, data->data(), event.data_len);
+    total += event.data_len;
+  }
   buffer.remove_suffix(buffer.size() - total);
   return 0;
 }
@@ -177,14 +264,82 @@ int StreamOpenRequest::Decode(const Bytes& buffer) {
     SNOVA_ERROR("Decode StreamOpenRequest failed:{}", PB_GET_ERROR(&input));
     return ERR_PB_DECODE;
   }
+  if (event.data_len > 0) {
+    if (input.bytes_left != event.data_len) {
+      SNOVA_ERROR("Invalid open data len:{}, while {} bytes left.", event.data_len,
+                  input.bytes_left);
+      return ERR_INVALID_EVENT;
+    }
+    // 'buffer' may be the cipher's reused decode buffer, copy it out.
+    data = get_iobuf(event.data_len);
+    memcpy(data->data(), buffer.data() + buffer.size() - input.bytes_left, event.data_len);
+  }
   return 0;
 }
 
 int StreamCloseRequest::Encode(MutableBytes& buffer) const {
-  buffer.remove_suffix(buffer.size());
+  if (head.flags.stream_seq == 0) {
+    buffer.remove_suffix(buffer.size());
+    return 0;
+  }
+  if (buffer.size() < sizeof(chunk_count)) {
+    return ERR_TOO_LARGE_EVENT_ENCODE_CONTENT;
+  }
+  uint32_t count = native_to_big(chunk_count);
+  memcpy(buffer.data(), &count, sizeof(count));
+  buffer.remove_suffix(buffer.size() - sizeof(count));
+  return 0;
+}
+int StreamCloseRequest::Decode(const Bytes& buffer) {
+  if (head.flags.stream_seq == 0) {
+    return 0;
+  }
+  if (buffer.size() < sizeof(chunk_count)) {
+    return ERR_TOO_SMALL_EVENT_DECODE_CONTENT;
+  }
+  uint32_t count;
+  memcpy(&count, buffer.data(), sizeof(count));
+  chunk_count = big_to_native(count);
+  return 0;
+}
+
+int StreamOpenResult::Encode(MutableBytes& buffer) const {
+  pb_ostream_t output = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_encode_delimited(&output, snova_StreamOpenResult_fields, &event)) {
+    SNOVA_ERROR("Encoding StreamOpenResult failed:{}", PB_GET_ERROR(&output));
+    return ERR_PB_ENCODE;
+  }
+  size_t total = output.bytes_written;
+  buffer.remove_suffix(buffer.size() - total);
+  return 0;
+}
+int StreamOpenResult::Decode(const Bytes& buffer) {
+  pb_istream_t input = pb_istream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_decode_delimited(&input, snova_StreamOpenResult_fields, &event)) {
+    SNOVA_ERROR("Decode StreamOpenResult failed:{}", PB_GET_ERROR(&input));
+    return ERR_PB_DECODE;
+  }
+  return 0;
+}
+
+int StreamWindowUpdate::Encode(MutableBytes& buffer) const {
+  pb_ostream_t output = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_encode_delimited(&output, snova_StreamWindowUpdate_fields, &event)) {
+    SNOVA_ERROR("Encoding StreamWindowUpdate failed:{}", PB_GET_ERROR(&output));
+    return ERR_PB_ENCODE;
+  }
+  size_t total = output.bytes_written;
+  buffer.remove_suffix(buffer.size() - total);
+  return 0;
+}
+int StreamWindowUpdate::Decode(const Bytes& buffer) {
+  pb_istream_t input = pb_istream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_decode_delimited(&input, snova_StreamWindowUpdate_fields, &event)) {
+    SNOVA_ERROR("Decode StreamWindowUpdate failed:{}", PB_GET_ERROR(&input));
+    return ERR_PB_DECODE;
+  }
   return 0;
 }
-int StreamCloseRequest::Decode(const Bytes& buffer) { return 0; }
 
 int RetireConnRequest::Encode(MutableBytes& buffer) const {
   buffer.remove_suffix(buffer.size());
@@ -210,7 +365,7 @@ int StreamChunk::Encode(MutableBytes& buffer) const {
 int StreamChunk::Decode(const Bytes& buffer) {
   // RETURN_NOT_OK(decode_int(buffer, 0, chunk_len));
   chunk_len = head.len;
-  if (chunk_len > 2 * kMaxChunkSize) {
+  if (chunk_len > kMaxEventBodySize) {
     return ERR_INVALID_EVENT;
   }
   if (buffer.size() < chunk_len) {
@@ -218,6 +373,7 @@ int StreamChunk::Decode(const Bytes& buffer) {
   }
   chunk = get_iobuf(chunk_len);
   memcpy(chunk->data(), buffer.data(), chunk_len);
+  g_chunk_decode_copy_bytes += chunk_len;
   return 0;
 }
 
@@ -301,4 +457,44 @@ int TunnelCloseRequest::Encode(MutableBytes& buffer) const {
   return 0;
 }
 
+int PingRequest::Decode(const Bytes& buffer) {
+  pb_istream_t input = pb_istream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_decode_delimited(&input, snova_Ping_fields, &event)) {
+    SNOVA_ERROR("Decode PingRequest failed:{}", PB_GET_ERROR(&input));
+    return ERR_PB_DECODE;
+  }
+  return 0;
+}
+
+int PingRequest::Encode(MutableBytes& buffer) const {
+  pb_ostream_t output = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_encode_delimited(&output, snova_Ping_fields, &event)) {
+    SNOVA_ERROR("Encoding PingRequest failed:{}", PB_GET_ERROR(&output));
+    return ERR_PB_ENCODE;
+  }
+  size_t total = output.bytes_written;
+  buffer.remove_suffix(buffer.size() - total);
+  return 0;
+}
+
+int PingResponse::Decode(const Bytes& buffer) {
+  pb_istream_t input = pb_istream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_decode_delimited(&input, snova_Ping_fields, &event)) {
+    SNOVA_ERROR("Decode PingResponse failed:{}", PB_GET_ERROR(&input));
+    return ERR_PB_DECODE;
+  }
+  return 0;
+}
+
+int PingResponse::Encode(MutableBytes& buffer) const {
+  pb_ostream_t output = pb_ostream_from_buffer(buffer.data(), buffer.size());
+  if (!pb_encode_delimited(&output, snova_Ping_fields, &event)) {
+    SNOVA_ERROR("Encoding PingResponse failed:{}", PB_GET_ERROR(&output));
+    return ERR_PB_ENCODE;
+  }
+  size_t total = output.bytes_written;
+  buffer.remove_suffix(buffer.size() - total);
+  return 0;
+}
+
 }  // namespace snova
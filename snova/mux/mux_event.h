@@ -53,19 +53,27 @@
 
 namespace snova {
 static constexpr uint16_t kEventHeadSize = 8;
+// 16bits 'len' field plus 2 'len_hi' bits in flags, the high bits are only set for jumbo frames
+// negotiated with peer, so old peers always see a plain 16bits length.
+static constexpr uint32_t kMaxEventBodySize = (1 << 18) - 1;
 
 struct MuxFlags {
   unsigned body_no_encrypt : 1;
-  unsigned reserved : 7;
+  unsigned len_hi : 2;
+  // chunk body ends with a 4 bytes stream sequence, close body carries the total chunk count.
+  unsigned stream_seq : 1;
+  unsigned reserved : 4;
   MuxFlags() {
     body_no_encrypt = 0;
+    len_hi = 0;
+    stream_seq = 0;
     reserved = 0;
   }
 };
 
 struct MuxEventHead {
   uint32_t sid = 0;
-  uint16_t len = 0;
+  uint32_t len = 0;
   uint8_t type = 0;
   MuxFlags flags;
   int Encode(MutableBytes& buffer);
@@ -82,9 +90,48 @@ enum EventType {
   EVENT_TUNNEL_OPEN_REQ,
   EVENT_TUNNEL_OPEN_RSP,
   EVENT_TUNNEL_CLOSE_REQ,
+  EVENT_STREAM_WINDOW_UPDATE,
+  EVENT_PING,
+  EVENT_PONG,
+  EVENT_STREAM_OPEN_RES,
   EVENT_COMMON_RES = 100,
 };
 
+// optional protocol features negotiated by AuthRequest/AuthResponse, old peers send none.
+enum MuxFeature {
+  MUX_FEATURE_STREAM_FLOW_CONTROL = 1 << 0,
+  MUX_FEATURE_JUMBO_FRAME = 1 << 1,
+  MUX_FEATURE_PING = 1 << 2,
+  MUX_FEATURE_OPEN_WITH_DATA = 1 << 3,
+  MUX_FEATURE_OPEN_RESULT = 1 << 4,
+  MUX_FEATURE_WIRE_V2 = 1 << 5,
+  MUX_FEATURE_UDP_RELAY = 1 << 6,
+  MUX_FEATURE_STREAM_STRIPING = 1 << 7,
+};
+static constexpr uint32_t kMuxSupportedFeatures =
+    MUX_FEATURE_STREAM_FLOW_CONTROL | MUX_FEATURE_JUMBO_FRAME | MUX_FEATURE_PING |
+    MUX_FEATURE_OPEN_WITH_DATA | MUX_FEATURE_OPEN_RESULT | MUX_FEATURE_WIRE_V2 |
+    MUX_FEATURE_UDP_RELAY | MUX_FEATURE_STREAM_STRIPING;
+// size of the sequence trailer of a striped stream chunk.
+static constexpr size_t kStreamSeqSize = 4;
+
+// error code of StreamOpenResult, values are the same as socks5 reply codes.
+enum StreamOpenError {
+  STREAM_OPEN_OK = 0,
+  STREAM_OPEN_ERR_GENERAL = 1,
+  STREAM_OPEN_ERR_NETWORK_UNREACHABLE = 3,
+  STREAM_OPEN_ERR_HOST_UNREACHABLE = 4,
+  STREAM_OPEN_ERR_CONNECTION_REFUSED = 5,
+  STREAM_OPEN_ERR_TIMEOUT = 6,
+};
+
+// local scheduling class of a stream's chunks on mux connection, never sent to peer.
+enum StreamPriority {
+  STREAM_PRIORITY_INTERACTIVE = 0,
+  STREAM_PRIORITY_NORMAL,
+  STREAM_PRIORITY_BULK,
+};
+
 struct MuxEvent {
   MuxEventHead head;
 
@@ -92,8 +139,24 @@ struct MuxEvent {
   virtual int Encode(MutableBytes& buffer) const = 0;
   virtual int Decode(const Bytes& buffer) = 0;
   virtual ~MuxEvent() {}
+
+  // events are created and released per frame, their memory is recycled by per shard free lists
+  // of size classes instead of the heap.
+  static void* operator new(size_t size);
+  static void operator delete(void* p, size_t size);
+  static uint64_t TotalAllocs();
+  static uint64_t TotalHeapAllocs();
 };
 
+// Dispatch by 'head.type' instead of RTTI, return nullptr if 'event' is not a 'T'.
+template <typename T>
+T* event_cast(MuxEvent* event) {
+  if (nullptr == event || event->head.type != T::kType) {
+    return nullptr;
+  }
+  return static_cast<T*>(event);
+}
+
 using EventWriter = std::function<asio::awaitable<bool>(std::unique_ptr<MuxEvent>&&)>;
 using EventWriterFactory = std::function<EventWriter()>;
 
@@ -102,33 +165,58 @@ struct AuthRequest : public MuxEvent {
   // std::string user;
   // uint64_t client_id = 0;
   // AuthFlags flags;
-  AuthRequest() { head.type = EVENT_AUTH_REQ; }
+  static constexpr EventType kType = EVENT_AUTH_REQ;
+  AuthRequest() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 struct AuthResponse : public MuxEvent {
   snova_AuthResponse event = snova_AuthResponse_init_default;
 
-  AuthResponse() { head.type = EVENT_AUTH_RES; }
+  static constexpr EventType kType = EVENT_AUTH_RES;
+  AuthResponse() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 
 struct RetireConnRequest : public MuxEvent {
-  RetireConnRequest() { head.type = EVENT_RETIRE_CONN_REQ; }
+  static constexpr EventType kType = EVENT_RETIRE_CONN_REQ;
+  RetireConnRequest() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 
 struct StreamOpenRequest : public MuxEvent {
   snova_StreamOpenRequest event = snova_StreamOpenRequest_init_default;
+  // first payload of the stream appended after the pb message, 'event.data_len' bytes.
+  IOBufPtr data;
 
-  StreamOpenRequest() { head.type = EVENT_STREAM_OPEN; }
+  static constexpr EventType kType = EVENT_STREAM_OPEN;
+  StreamOpenRequest() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 struct StreamCloseRequest : public MuxEvent {
-  StreamCloseRequest() { head.type = EVENT_STREAM_CLOSE; }
+  // number of chunks sent by a striped stream, only encoded with 'head.flags.stream_seq'.
+  uint32_t chunk_count = 0;
+  static constexpr EventType kType = EVENT_STREAM_CLOSE;
+  StreamCloseRequest() { head.type = kType; }
+  int Encode(MutableBytes& buffer) const override;
+  int Decode(const Bytes& buffer) override;
+};
+
+struct StreamOpenResult : public MuxEvent {
+  snova_StreamOpenResult event = snova_StreamOpenResult_init_default;
+  static constexpr EventType kType = EVENT_STREAM_OPEN_RES;
+  StreamOpenResult() { head.type = kType; }
+  int Encode(MutableBytes& buffer) const override;
+  int Decode(const Bytes& buffer) override;
+};
+
+struct StreamWindowUpdate : public MuxEvent {
+  snova_StreamWindowUpdate event = snova_StreamWindowUpdate_init_default;
+  static constexpr EventType kType = EVENT_STREAM_WINDOW_UPDATE;
+  StreamWindowUpdate() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
@@ -136,33 +224,55 @@ struct StreamCloseRequest : public MuxEvent {
 struct StreamChunk : public MuxEvent {
   IOBufPtr chunk;
   uint32_t chunk_len = 0;
-  StreamChunk() { head.type = EVENT_STREAM_CHUNK; }
+  uint8_t priority = STREAM_PRIORITY_NORMAL;
+  static constexpr EventType kType = EVENT_STREAM_CHUNK;
+  StreamChunk() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
+  // bytes copied by Decode, cipher contexts open chunks without it.
+  static uint64_t TotalDecodeCopyBytes();
 };
 
 struct CommonResponse : public MuxEvent {
   snova_CommonResponse event = snova_CommonResponse_init_default;
-  CommonResponse() { head.type = EVENT_COMMON_RES; }
+  static constexpr EventType kType = EVENT_COMMON_RES;
+  CommonResponse() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 
 struct TunnelOpenRequest : public MuxEvent {
   snova_TunnelOpenRequest event = snova_TunnelOpenRequest_init_default;
-  TunnelOpenRequest() { head.type = EVENT_TUNNEL_OPEN_REQ; }
+  static constexpr EventType kType = EVENT_TUNNEL_OPEN_REQ;
+  TunnelOpenRequest() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 struct TunnelOpenResponse : public MuxEvent {
   snova_TunnelOpenResponse event = snova_TunnelOpenResponse_init_default;
-  TunnelOpenResponse() { head.type = EVENT_TUNNEL_OPEN_RSP; }
+  static constexpr EventType kType = EVENT_TUNNEL_OPEN_RSP;
+  TunnelOpenResponse() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
 struct TunnelCloseRequest : public MuxEvent {
   snova_TunnelCloseRequest event = snova_TunnelCloseRequest_init_default;
-  TunnelCloseRequest() { head.type = EVENT_TUNNEL_CLOSE_REQ; }
+  static constexpr EventType kType = EVENT_TUNNEL_CLOSE_REQ;
+  TunnelCloseRequest() { head.type = kType; }
+  int Encode(MutableBytes& buffer) const override;
+  int Decode(const Bytes& buffer) override;
+};
+struct PingRequest : public MuxEvent {
+  snova_Ping event = snova_Ping_init_default;
+  static constexpr EventType kType = EVENT_PING;
+  PingRequest() { head.type = kType; }
+  int Encode(MutableBytes& buffer) const override;
+  int Decode(const Bytes& buffer) override;
+};
+struct PingResponse : public MuxEvent {
+  snova_Ping event = snova_Ping_init_default;
+  static constexpr EventType kType = EVENT_PONG;
+  PingResponse() { head.type = kType; }
   int Encode(MutableBytes& buffer) const override;
   int Decode(const Bytes& buffer) override;
 };
@@ -18,6 +18,12 @@ PB_BIND(snova_AuthResponse, snova_AuthResponse, AUTO)
 PB_BIND(snova_StreamOpenRequest, snova_StreamOpenRequest, 2)
 
 
+PB_BIND(snova_StreamOpenResult, snova_StreamOpenResult, AUTO)
+
+
+PB_BIND(snova_StreamWindowUpdate, snova_StreamWindowUpdate, AUTO)
+
+
 PB_BIND(snova_TunnelOpenRequest, snova_TunnelOpenRequest, 2)
 
 
@@ -27,4 +33,7 @@ PB_BIND(snova_TunnelOpenResponse, snova_TunnelOpenResponse, AUTO)
 PB_BIND(snova_TunnelCloseRequest, snova_TunnelCloseRequest, AUTO)
 
 
+PB_BIND(snova_Ping, snova_Ping, AUTO)
+
+
 
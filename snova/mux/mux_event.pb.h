@@ -16,11 +16,19 @@ typedef struct _snova_AuthRequest {
   bool is_entry;
   bool is_exit;
   bool is_middle;
+  uint32_t features;
+  uint32_t stream_window;
+  uint32_t max_frame_size;
+  uint32_t cipher_methods;
 } snova_AuthRequest;
 
 typedef struct _snova_AuthResponse {
   bool success;
   uint64_t iv;
+  uint32_t features;
+  uint32_t stream_window;
+  uint32_t max_frame_size;
+  uint32_t cipher_method;
 } snova_AuthResponse;
 
 typedef struct _snova_CommonResponse {
@@ -29,13 +37,28 @@ typedef struct _snova_CommonResponse {
   char reason[512];
 } snova_CommonResponse;
 
+typedef struct _snova_Ping {
+  uint64_t timestamp_us;
+} snova_Ping;
+
 typedef struct _snova_StreamOpenRequest {
   char remote_host[512];
   uint32_t remote_port;
   bool is_tcp;
   bool is_tls;
+  uint32_t data_len;
+  bool wait_result;
 } snova_StreamOpenRequest;
 
+typedef struct _snova_StreamOpenResult {
+  uint32_t error_code;
+  uint32_t connect_latency_ms;
+} snova_StreamOpenResult;
+
+typedef struct _snova_StreamWindowUpdate {
+  uint32_t increment;
+} snova_StreamWindowUpdate;
+
 typedef struct _snova_TunnelCloseRequest {
   uint64_t tunnel_id;
 } snova_TunnelCloseRequest;
@@ -61,31 +84,43 @@ extern "C" {
 #define snova_CommonResponse_init_default \
   { 0, 0, "" }
 #define snova_AuthRequest_init_default \
-  { "", 0, 0, 0, 0 }
+  { "", 0, 0, 0, 0, 0, 0, 0, 0 }
 #define snova_AuthResponse_init_default \
-  { 0, 0 }
+  { 0, 0, 0, 0, 0, 0 }
 #define snova_StreamOpenRequest_init_default \
-  { "", 0, 0, 0 }
+  { "", 0, 0, 0, 0, 0 }
+#define snova_StreamOpenResult_init_default \
+  { 0, 0 }
+#define snova_StreamWindowUpdate_init_default \
+  { 0 }
 #define snova_TunnelOpenRequest_init_default \
   { "", 0, 0, 0 }
 #define snova_TunnelOpenResponse_init_default \
   { 0, 0, 0 }
 #define snova_TunnelCloseRequest_init_default \
   { 0 }
+#define snova_Ping_init_default \
+  { 0 }
 #define snova_CommonResponse_init_zero \
   { 0, 0, "" }
 #define snova_AuthRequest_init_zero \
-  { "", 0, 0, 0, 0 }
+  { "", 0, 0, 0, 0, 0, 0, 0, 0 }
 #define snova_AuthResponse_init_zero \
-  { 0, 0 }
+  { 0, 0, 0, 0, 0, 0 }
 #define snova_StreamOpenRequest_init_zero \
-  { "", 0, 0, 0 }
+  { "", 0, 0, 0, 0, 0 }
+#define snova_StreamOpenResult_init_zero \
+  { 0, 0 }
+#define snova_StreamWindowUpdate_init_zero \
+  { 0 }
 #define snova_TunnelOpenRequest_init_zero \
   { "", 0, 0, 0 }
 #define snova_TunnelOpenResponse_init_zero \
   { 0, 0, 0 }
 #define snova_TunnelCloseRequest_init_zero \
   { 0 }
+#define snova_Ping_init_zero \
+  { 0 }
 
 /* Field tags (for use in manual encoding/decoding) */
 #define snova_AuthRequest_user_tag 1
@@ -93,15 +128,29 @@ extern "C" {
 #define snova_AuthRequest_is_entry_tag 3
 #define snova_AuthRequest_is_exit_tag 4
 #define snova_AuthRequest_is_middle_tag 5
+#define snova_AuthRequest_features_tag 6
+#define snova_AuthRequest_stream_window_tag 7
+#define snova_AuthRequest_max_frame_size_tag 8
+#define snova_AuthRequest_cipher_methods_tag 9
 #define snova_AuthResponse_success_tag 1
 #define snova_AuthResponse_iv_tag 2
+#define snova_AuthResponse_features_tag 3
+#define snova_AuthResponse_stream_window_tag 4
+#define snova_AuthResponse_max_frame_size_tag 5
+#define snova_AuthResponse_cipher_method_tag 6
 #define snova_CommonResponse_success_tag 1
 #define snova_CommonResponse_errc_tag 2
 #define snova_CommonResponse_reason_tag 3
+#define snova_Ping_timestamp_us_tag 1
 #define snova_StreamOpenRequest_remote_host_tag 1
 #define snova_StreamOpenRequest_remote_port_tag 2
 #define snova_StreamOpenRequest_is_tcp_tag 3
 #define snova_StreamOpenRequest_is_tls_tag 4
+#define snova_StreamOpenRequest_data_len_tag 5
+#define snova_StreamOpenRequest_wait_result_tag 6
+#define snova_StreamOpenResult_error_code_tag 1
+#define snova_StreamOpenResult_connect_latency_ms_tag 2
+#define snova_StreamWindowUpdate_increment_tag 1
 #define snova_TunnelCloseRequest_tunnel_id_tag 1
 #define snova_TunnelOpenRequest_local_host_tag 1
 #define snova_TunnelOpenRequest_local_port_tag 2
@@ -124,13 +173,21 @@ extern "C" {
   X(a, STATIC, SINGULAR, UINT64, client_id, 2) \
   X(a, STATIC, SINGULAR, BOOL, is_entry, 3)    \
   X(a, STATIC, SINGULAR, BOOL, is_exit, 4)     \
-  X(a, STATIC, SINGULAR, BOOL, is_middle, 5)
+  X(a, STATIC, SINGULAR, BOOL, is_middle, 5)   \
+  X(a, STATIC, SINGULAR, UINT32, features, 6)  \
+  X(a, STATIC, SINGULAR, UINT32, stream_window, 7) \
+  X(a, STATIC, SINGULAR, UINT32, max_frame_size, 8) \
+  X(a, STATIC, SINGULAR, UINT32, cipher_methods, 9)
 #define snova_AuthRequest_CALLBACK NULL
 #define snova_AuthRequest_DEFAULT NULL
 
-#define snova_AuthResponse_FIELDLIST(X, a) \
-  X(a, STATIC, SINGULAR, BOOL, success, 1) \
-  X(a, STATIC, SINGULAR, UINT64, iv, 2)
+#define snova_AuthResponse_FIELDLIST(X, a)    \
+  X(a, STATIC, SINGULAR, BOOL, success, 1)    \
+  X(a, STATIC, SINGULAR, UINT64, iv, 2)       \
+  X(a, STATIC, SINGULAR, UINT32, features, 3) \
+  X(a, STATIC, SINGULAR, UINT32, stream_window, 4) \
+  X(a, STATIC, SINGULAR, UINT32, max_frame_size, 5) \
+  X(a, STATIC, SINGULAR, UINT32, cipher_method, 6)
 #define snova_AuthResponse_CALLBACK NULL
 #define snova_AuthResponse_DEFAULT NULL
 
@@ -138,10 +195,22 @@ extern "C" {
   X(a, STATIC, SINGULAR, STRING, remote_host, 1) \
   X(a, STATIC, SINGULAR, UINT32, remote_port, 2) \
   X(a, STATIC, SINGULAR, BOOL, is_tcp, 3)        \
-  X(a, STATIC, SINGULAR, BOOL, is_tls, 4)
+  X(a, STATIC, SINGULAR, BOOL, is_tls, 4)        \
+  X(a, STATIC, SINGULAR, UINT32, data_len, 5)    \
+  X(a, STATIC, SINGULAR, BOOL, wait_result, 6)
 #define snova_StreamOpenRequest_CALLBACK NULL
 #define snova_StreamOpenRequest_DEFAULT NULL
 
+#define snova_StreamOpenResult_FIELDLIST(X, a)  \
+  X(a, STATIC, SINGULAR, UINT32, error_code, 1) \
+  X(a, STATIC, SINGULAR, UINT32, connect_latency_ms, 2)
+#define snova_StreamOpenResult_CALLBACK NULL
+#define snova_StreamOpenResult_DEFAULT NULL
+
+#define snova_StreamWindowUpdate_FIELDLIST(X, a) X(a, STATIC, SINGULAR, UINT32, increment, 1)
+#define snova_StreamWindowUpdate_CALLBACK NULL
+#define snova_StreamWindowUpdate_DEFAULT NULL
+
 #define snova_TunnelOpenRequest_FIELDLIST(X, a)  \
   X(a, STATIC, SINGULAR, STRING, local_host, 1)  \
   X(a, STATIC, SINGULAR, UINT32, local_port, 2)  \
@@ -161,28 +230,41 @@ extern "C" {
 #define snova_TunnelCloseRequest_CALLBACK NULL
 #define snova_TunnelCloseRequest_DEFAULT NULL
 
+#define snova_Ping_FIELDLIST(X, a) X(a, STATIC, SINGULAR, UINT64, timestamp_us, 1)
+#define snova_Ping_CALLBACK NULL
+#define snova_Ping_DEFAULT NULL
+
 extern const pb_msgdesc_t snova_CommonResponse_msg;
 extern const pb_msgdesc_t snova_AuthRequest_msg;
 extern const pb_msgdesc_t snova_AuthResponse_msg;
 extern const pb_msgdesc_t snova_StreamOpenRequest_msg;
+extern const pb_msgdesc_t snova_StreamOpenResult_msg;
+extern const pb_msgdesc_t snova_StreamWindowUpdate_msg;
 extern const pb_msgdesc_t snova_TunnelOpenRequest_msg;
 extern const pb_msgdesc_t snova_TunnelOpenResponse_msg;
 extern const pb_msgdesc_t snova_TunnelCloseRequest_msg;
+extern const pb_msgdesc_t snova_Ping_msg;
 
 /* Defines for backwards compatibility with code written before nanopb-0.4.0 */
 #define snova_CommonResponse_fields &snova_CommonResponse_msg
 #define snova_AuthRequest_fields &snova_AuthRequest_msg
 #define snova_AuthResponse_fields &snova_AuthResponse_msg
 #define snova_StreamOpenRequest_fields &snova_StreamOpenRequest_msg
+#define snova_StreamOpenResult_fields &snova_StreamOpenResult_msg
+#define snova_StreamWindowUpdate_fields &snova_StreamWindowUpdate_msg
 #define snova_TunnelOpenRequest_fields &snova_TunnelOpenRequest_msg
 #define snova_TunnelOpenResponse_fields &snova_TunnelOpenResponse_msg
 #define snova_TunnelCloseRequest_fields &snova_TunnelCloseRequest_msg
+#define snova_Ping_fields &snova_Ping_msg
 
 /* Maximum encoded size of messages (where known) */
-#define snova_AuthRequest_size 275
-#define snova_AuthResponse_size 13
+#define snova_AuthRequest_size 299
+#define snova_AuthResponse_size 37
 #define snova_CommonResponse_size 527
-#define snova_StreamOpenRequest_size 524
+#define snova_Ping_size 11
+#define snova_StreamOpenRequest_size 532
+#define snova_StreamOpenResult_size 12
+#define snova_StreamWindowUpdate_size 6
 #define snova_TunnelCloseRequest_size 11
 #define snova_TunnelOpenRequest_size 528
 #define snova_TunnelOpenResponse_size 24
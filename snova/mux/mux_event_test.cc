@@ -28,7 +28,9 @@
  */
 #include "snova/mux/mux_event.h"
 #include <gtest/gtest.h>
+#include <string>
 #include <utility>
+#include <vector>
 #include "pb_decode.h"
 #include "pb_encode.h"
 #include "snova/log/log_macros.h"
@@ -55,3 +57,66 @@ TEST(MuxEvent, nanopb) {
   }
   printf("%s %llu %d\n", decode_msg.user, decode_msg.client_id, input.bytes_left);
 }
+
+TEST(MuxEvent, StreamOpenWithData) {
+  StreamOpenRequest req;
+  snprintf(req.event.remote_host, sizeof(req.event.remote_host), "%s", "example.com");
+  req.event.remote_port = 443;
+  req.event.is_tcp = true;
+  std::string payload = "GET / HTTP/1.1\r\n\r\n";
+  req.data = get_iobuf(payload.size());
+  memcpy(req.data->data(), payload.data(), payload.size());
+  req.event.data_len = payload.size();
+
+  std::vector<uint8_t> buf(1024);
+  MutableBytes out(buf.data(), buf.size());
+  ASSERT_EQ(0, req.Encode(out));
+
+  StreamOpenRequest decoded;
+  ASSERT_EQ(0, decoded.Decode(Bytes{out.data(), out.size()}));
+  ASSERT_EQ(443, decoded.event.remote_port);
+  ASSERT_EQ(payload.size(), decoded.event.data_len);
+  ASSERT_EQ(payload, std::string(reinterpret_cast<const char*>(decoded.data->data()),
+                                 decoded.event.data_len));
+
+  // truncated payload must be rejected.
+  ASSERT_NE(0, decoded.Decode(Bytes{out.data(), out.size() - 1}));
+}
+
+TEST(MuxEvent, PooledEvents) {
+  MuxEventHead head;
+  head.type = EVENT_STREAM_CHUNK;
+  // warm up the free list of chunk's size class.
+  MuxEvent::NewEvent(head);
+  uint64_t heap_allocs = MuxEvent::TotalHeapAllocs();
+  for (int i = 0; i < 100; i++) {
+    std::unique_ptr<MuxEvent> event = MuxEvent::NewEvent(head);
+    ASSERT_NE(nullptr, event_cast<StreamChunk>(event.get()));
+    ASSERT_EQ(nullptr, event_cast<StreamOpenRequest>(event.get()));
+    auto close_ev = std::make_unique<StreamCloseRequest>();
+    ASSERT_NE(nullptr, event_cast<StreamCloseRequest>(close_ev.get()));
+  }
+  // only the first close request allocates.
+  ASSERT_LE(MuxEvent::TotalHeapAllocs(), heap_allocs + 1);
+}
+
+TEST(MuxEvent, StripedStreamClose) {
+  StreamCloseRequest req;
+  req.head.flags.stream_seq = 1;
+  req.chunk_count = 123456;
+  std::vector<uint8_t> buf(64);
+  MutableBytes out(buf.data(), buf.size());
+  ASSERT_EQ(0, req.Encode(out));
+  ASSERT_EQ(kStreamSeqSize, out.size());
+
+  StreamCloseRequest decoded;
+  decoded.head.flags.stream_seq = 1;
+  ASSERT_EQ(0, decoded.Decode(Bytes{out.data(), out.size()}));
+  ASSERT_EQ(123456u, decoded.chunk_count);
+
+  // legacy close has no body.
+  StreamCloseRequest legacy;
+  MutableBytes legacy_out(buf.data(), buf.size());
+  ASSERT_EQ(0, legacy.Encode(legacy_out));
+  ASSERT_EQ(0, legacy_out.size());
+}
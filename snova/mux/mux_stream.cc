@@ -27,76 +27,363 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/mux/mux_stream.h"
-#include <atomic>
+#include <algorithm>
+#include <deque>
 #include <memory>
+#include <string.h>
+#include <vector>
 #include "absl/container/flat_hash_map.h"
 #include "asio/experimental/as_tuple.hpp"
 #include "snova/log/log_macros.h"
+#include "snova/util/endian.h"
 #include "snova/util/flags.h"
 namespace snova {
 
-struct ClientStreamID {
-  uint64_t client_id = 0;
-  uint32_t sid = 0;
-  bool operator==(const ClientStreamID& other) const {
-    return client_id == other.client_id && sid == other.sid;
+// Ids of streams opened by this node encode a slot of the shard's id allocator:
+//   | generation(11 bits) | slot(20 bits) | opener(1 bit, 1 for client side) |
+// Released slots are reused FIFO once 'kMinFreeStreamSlots' of them queued, so a slot comes back
+// only after all others in the queue, and the 11 bits generation wraps(the sid repeats) after
+// about 2047 * kMinFreeStreamSlots opens instead of 2047 open/close cycles of one stream. The
+// stream tables indexed by 'sid & kStreamSlotMask' stay as dense as the peak number of live
+// streams plus the queue, the generation tells a reused slot from its previous stream.
+static constexpr uint32_t kStreamSlotBits = 21;
+static constexpr uint32_t kStreamSlotMask = (1u << kStreamSlotBits) - 1;
+static constexpr uint32_t kStreamGenerationMask = (1u << (32 - kStreamSlotBits)) - 1;
+// slots must fit in the 20 bits of the id, more live streams of a shard fail to open.
+static constexpr size_t kMaxStreamSlots = (kStreamSlotMask >> 1) + 1;
+// released slots kept queued before any is reused.
+static constexpr size_t kMinFreeStreamSlots = 1024;
+// ids beyond this(sequential ids from legacy peers) or colliding with a live stream of the same
+// slot(reused before peer processed the close) are kept in the overflow map.
+static constexpr uint32_t kMaxDenseStreamSlots = 128 * 1024;
+// cached memory blocks of released streams per shard.
+static constexpr size_t kMaxFreeStreamBlocks = 4096;
+
+struct StreamIDAllocator {
+  std::vector<uint16_t> generations;
+  std::deque<uint32_t> free_slots;
+  // return 0 if all slots are taken by live streams.
+  uint32_t Next(uint32_t opener) {
+    uint32_t slot = 0;
+    if (!free_slots.empty() &&
+        (free_slots.size() >= kMinFreeStreamSlots || generations.size() >= kMaxStreamSlots)) {
+      slot = free_slots.front();
+      free_slots.pop_front();
+    } else {
+      if (generations.size() >= kMaxStreamSlots) {
+        return 0;
+      }
+      slot = static_cast<uint32_t>(generations.size());
+      generations.push_back(0);
+    }
+    uint16_t generation = (generations[slot] + 1) & kStreamGenerationMask;
+    if (generation == 0) {
+      generation = 1;  // never generate sid 0
+    }
+    generations[slot] = generation;
+    return (static_cast<uint32_t>(generation) << kStreamSlotBits) | (slot << 1) | opener;
   }
+  void Release(uint32_t sid) {
+    uint32_t slot = (sid & kStreamSlotMask) >> 1;
+    if (slot < generations.size() && generations[slot] == (sid >> kStreamSlotBits)) {
+      free_slots.push_back(slot);
+    }
+  }
+};
+
+// streams of one client(session), indexed by the slot bits of stream id.
+struct MuxStreamTable {
+  std::vector<MuxStreamPtr> slots;
+  absl::flat_hash_map<uint32_t, MuxStreamPtr> overflow;
+  size_t size = 0;
 };
-struct ClientStreamIDHasher {
-  std::size_t operator()(const ClientStreamID& k) const { return k.client_id + k.sid; }
+
+// Allocator of MuxStream objects(together with the shared_ptr control block), recycles memory
+// blocks in a per shard free list since streams are created and destroyed at a high rate.
+template <typename T>
+struct MuxStreamAllocator {
+  using value_type = T;
+  MuxStreamAllocator() = default;
+  template <typename U>
+  MuxStreamAllocator(const MuxStreamAllocator<U>&) {}  // NOLINT
+  T* allocate(size_t n) {
+    auto& blocks = GetFreeBlocks();
+    if (n == 1 && !blocks.list.empty()) {
+      void* p = blocks.list.back();
+      blocks.list.pop_back();
+      return static_cast<T*>(p);
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    auto& blocks = GetFreeBlocks();
+    if (n == 1 && !blocks.destroyed && blocks.list.size() < kMaxFreeStreamBlocks) {
+      blocks.list.push_back(p);
+      return;
+    }
+    ::operator delete(p);
+  }
+  struct FreeBlocks {
+    std::vector<void*> list;
+    // thread_locals are destroyed in the reverse order of their construction, so streams held by
+    // one constructed earlier(e.g. g_stream_tables touched before the first stream allocation)
+    // are released after this at thread exit. They must not be pushed to the destroyed list, the
+    // flag stays readable since thread local storage outlives the destructor until thread exit.
+    bool destroyed = false;
+    ~FreeBlocks() {
+      for (void* p : list) {
+        ::operator delete(p);
+      }
+      list.clear();
+      destroyed = true;
+    }
+  };
+  static FreeBlocks& GetFreeBlocks() {
+    static thread_local FreeBlocks blocks;
+    return blocks;
+  }
+  template <typename U>
+  bool operator==(const MuxStreamAllocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const MuxStreamAllocator<U>&) const {
+    return false;
+  }
 };
 
-using MuxStreamTable = absl::flat_hash_map<ClientStreamID, MuxStreamPtr, ClientStreamIDHasher>;
-static MuxStreamTable g_streams;
-static uint32_t g_active_stream_size = 0;
-static std::atomic<uint32_t> g_client_sid{1};
-static std::atomic<uint32_t> g_server_sid{2};
+static thread_local StreamIDAllocator g_sid_allocators[2];
+static thread_local absl::flat_hash_map<uint64_t, MuxStreamTable> g_stream_tables;
+static thread_local size_t g_stream_size = 0;
+static thread_local uint32_t g_active_stream_size = 0;
+static thread_local uint64_t g_stream_recv_queued_bytes = 0;
+static thread_local uint64_t g_stream_send_window_waits = 0;
+static thread_local uint64_t g_stream_open_with_data = 0;
+static thread_local uint64_t g_stream_striped_chunks = 0;
+static thread_local uint64_t g_stream_reordered_chunks = 0;
+static thread_local uint64_t g_stream_shed_num = 0;
+static thread_local uint64_t g_stream_dropped_datagrams = 0;
+static thread_local uint64_t g_stream_stripe_lost_num = 0;
+// open request fields plus the data must fit in the cipher's non chunk event buffers.
+static constexpr size_t kMaxOpenDataSize = kMaxChunkSize - 1024;
+// exit node's connect to remote should have finished or failed far before this.
+static constexpr uint32_t kOpenResultTimeoutSecs = 30;
+// streams which have written this many bytes are bulk transfers, and yield to other streams on
+// the same mux connection.
+static constexpr size_t kBulkStreamWriteBytes = 4 * 1024 * 1024;
+// reorder buffer is bounded by the stream window, this bounds it for tiny chunks.
+static constexpr size_t kMaxReorderChunks = 4096;
+// a chunk sent on a live connection before one already received arrives far sooner than this.
+static constexpr uint32_t kStripeLossWaitMs = 5000;
 
-size_t MuxStream::Size() { return g_streams.size(); }
+size_t MuxStream::Size() { return g_stream_size; }
 size_t MuxStream::ActiveSize() { return g_active_stream_size; }
+uint64_t MuxStream::TotalRecvQueuedBytes() { return g_stream_recv_queued_bytes; }
+uint64_t MuxStream::TotalSendWindowWaits() { return g_stream_send_window_waits; }
+uint64_t MuxStream::TotalOpenWithData() { return g_stream_open_with_data; }
+uint64_t MuxStream::TotalStripedChunks() { return g_stream_striped_chunks; }
+uint64_t MuxStream::TotalReorderedChunks() { return g_stream_reordered_chunks; }
+uint64_t MuxStream::TotalShedStreams() { return g_stream_shed_num; }
+uint64_t MuxStream::TotalDroppedDatagrams() { return g_stream_dropped_datagrams; }
+uint64_t MuxStream::TotalStripeLostStreams() { return g_stream_stripe_lost_num; }
 
-uint32_t MuxStream::NextID(bool is_client) {
-  if (is_client) {
-    return g_client_sid.fetch_add(2);
+MuxStreamPtr MuxStream::NewLocal(EventWriterFactory&& factory, const StreamExecutor& ex,
+                                 uint64_t client_id, bool is_client) {
+  uint32_t opener = is_client ? 1 : 0;
+  uint32_t sid = g_sid_allocators[opener].Next(opener);
+  if (0 == sid) {
+    SNOVA_ERROR("No stream id available for {} live streams.", g_stream_size);
+    return nullptr;
+  }
+  MuxStreamPtr p = New(std::move(factory), ex, client_id, sid);
+  if (!p) {
+    g_sid_allocators[opener].Release(sid);
+    return nullptr;
   }
-  return g_server_sid.fetch_add(2);
+  p->local_id_ = true;
+  return p;
 }
-MuxStreamPtr MuxStream::New(EventWriterFactory&& factory, const StreamDataChannelExecutor& ex,
+MuxStreamPtr MuxStream::New(EventWriterFactory&& factory, const StreamExecutor& ex,
                             uint64_t client_id, uint32_t sid) {
-  MuxStreamPtr p(new MuxStream(std::move(factory), ex, client_id, sid));
-  ClientStreamID id{client_id, sid};
-  g_streams.emplace(id, p);
+  MuxStreamTable& table = g_stream_tables[client_id];
+  uint32_t idx = sid & kStreamSlotMask;
+  MuxStreamPtr* slot = nullptr;
+  if (idx < kMaxDenseStreamSlots) {
+    if (idx >= table.slots.size()) {
+      size_t n = std::max<size_t>(idx + 1, table.slots.size() * 2);
+      table.slots.resize(std::min<size_t>(n, kMaxDenseStreamSlots));
+    }
+    slot = &table.slots[idx];
+    if (*slot && (*slot)->sid_ == sid) {
+      return nullptr;  // duplicate id of a live stream
+    }
+    if (*slot) {
+      slot = nullptr;  // taken by another generation of the slot
+    }
+  }
+  if (nullptr == slot && table.overflow.contains(sid)) {
+    return nullptr;
+  }
+  MuxStreamPtr p = std::allocate_shared<MuxStream>(MuxStreamAllocator<MuxStream>(), PrivateTag{},
+                                                   std::move(factory), ex, client_id, sid);
+  if (nullptr != slot) {
+    *slot = p;
+  } else {
+    table.overflow.emplace(sid, p);
+  }
+  table.size++;
+  g_stream_size++;
   return p;
 }
 MuxStreamPtr MuxStream::Get(uint64_t client_id, uint32_t sid) {
-  ClientStreamID id{client_id, sid};
-  auto found = g_streams.find(id);
-  if (found == g_streams.end()) {
+  auto found = g_stream_tables.find(client_id);
+  if (found == g_stream_tables.end()) {
+    return nullptr;
+  }
+  const MuxStreamTable& table = found->second;
+  uint32_t idx = sid & kStreamSlotMask;
+  if (idx < table.slots.size() && table.slots[idx] && table.slots[idx]->sid_ == sid) {
+    return table.slots[idx];
+  }
+  if (table.overflow.empty()) {
     return nullptr;
   }
-  return found->second;
+  auto overflow_found = table.overflow.find(sid);
+  if (overflow_found == table.overflow.end()) {
+    return nullptr;
+  }
+  return overflow_found->second;
 }
 void MuxStream::Remove(uint64_t client_id, uint32_t sid) {
-  ClientStreamID id{client_id, sid};
-  g_streams.erase(id);
+  auto found = g_stream_tables.find(client_id);
+  if (found == g_stream_tables.end()) {
+    return;
+  }
+  MuxStreamTable& table = found->second;
+  MuxStreamPtr removed;  // destroyed after the table updated
+  uint32_t idx = sid & kStreamSlotMask;
+  if (idx < table.slots.size() && table.slots[idx] && table.slots[idx]->sid_ == sid) {
+    removed = std::move(table.slots[idx]);
+  } else {
+    auto overflow_found = table.overflow.find(sid);
+    if (overflow_found == table.overflow.end()) {
+      return;
+    }
+    removed = std::move(overflow_found->second);
+    table.overflow.erase(overflow_found);
+  }
+  table.size--;
+  g_stream_size--;
+  if (table.size == 0) {
+    g_stream_tables.erase(found);
+  }
+}
+
+asio::awaitable<size_t> MuxStream::ShedBuffered(size_t bytes) {
+  std::vector<MuxStreamPtr> streams;
+  for (const auto& [client_id, table] : g_stream_tables) {
+    for (const MuxStreamPtr& stream : table.slots) {
+      if (stream && stream->BufferedBytes() > 0) {
+        streams.emplace_back(stream);
+      }
+    }
+    for (const auto& [sid, stream] : table.overflow) {
+      if (stream->BufferedBytes() > 0) {
+        streams.emplace_back(stream);
+      }
+    }
+  }
+  std::sort(streams.begin(), streams.end(), [](const MuxStreamPtr& x, const MuxStreamPtr& y) {
+    return x->BufferedBytes() > y->BufferedBytes();
+  });
+  size_t released = 0;
+  for (const MuxStreamPtr& stream : streams) {
+    if (released >= bytes) {
+      break;
+    }
+    size_t n = stream->BufferedBytes();
+    SNOVA_ERROR("[{}]Close stream buffering {} bytes under memory pressure.", stream->sid_, n);
+    // drop received data at once, reader would drain it before seeing the close.
+    g_stream_recv_queued_bytes -= stream->recv_queue_bytes_;
+    stream->recv_queue_bytes_ = 0;
+    stream->recv_queue_.clear();
+    released += n;
+    g_stream_shed_num++;
+    co_await stream->Close(false);
+  }
+  co_return released;
 }
 
-MuxStream::MuxStream(EventWriterFactory&& factory, const StreamDataChannelExecutor& ex,
+MuxStream::MuxStream(PrivateTag, EventWriterFactory&& factory, const StreamExecutor& ex,
                      uint64_t client_id, uint32_t sid)
     : event_writer_factory_(std::move(factory)),
-      data_channel_(ex, 1),
+      recv_timer_(ex),
+      send_window_timer_(ex),
+      open_result_timer_(ex),
+      recv_queue_bytes_(0),
+      reorder_bytes_(0),
+      recv_seq_(0),
+      send_seq_(0),
+      remote_chunk_count_(0),
+      recv_unacked_bytes_(0),
+      send_window_(0),
       write_bytes_(0),
+      max_chunk_size_(kMaxChunkSize),
+      priority_(STREAM_PRIORITY_NORMAL),
+      open_error_(-1),
+      open_latency_ms_(0),
       client_id_(client_id),
       sid_(sid),
       is_tls_(false),
+      datagram_(false),
+      flow_control_(false),
+      open_with_data_(false),
+      open_result_(false),
+      result_awaited_(false),
+      striping_(false),
+      peer_acked_(false),
+      remote_close_pending_(false),
+      recv_striped_(false),
+      stripe_loss_check_(false),
+      local_id_(false),
       closed_(false) {
+  recv_timer_.expires_at(::asio::steady_timer::time_point::max());
+  send_window_timer_.expires_at(::asio::steady_timer::time_point::max());
   event_writer_ = event_writer_factory_();
   g_active_stream_size++;
 }
-MuxStream::~MuxStream() { g_active_stream_size--; }
+MuxStream::~MuxStream() {
+  g_stream_recv_queued_bytes -= recv_queue_bytes_ + reorder_bytes_;
+  g_active_stream_size--;
+  if (local_id_) {
+    g_sid_allocators[sid_ & 1].Release(sid_);
+  }
+}
+
+void MuxStream::SetOptions(const MuxStreamOptions& opts) {
+  flow_control_ = opts.peer_window > 0;
+  send_window_ = opts.peer_window;
+  max_chunk_size_ = opts.max_chunk_size;
+  open_with_data_ = opts.open_with_data;
+  open_result_ = opts.open_result;
+  striping_ = opts.striping;
+  if (striping_) {
+    max_chunk_size_ -= kStreamSeqSize;  // room for the sequence trailer in a frame
+  }
+}
+
+void MuxStream::UpdateSendWindow(uint32_t increment) {
+  peer_acked_ = true;
+  bool blocked = send_window_ <= 0;
+  send_window_ += increment;
+  if (blocked && send_window_ > 0) {
+    send_window_timer_.cancel();
+  }
+}
 
 asio::awaitable<std::error_code> MuxStream::Open(const std::string& host, uint16_t port,
-                                                 bool is_tcp, bool is_tls) {
+                                                 bool is_tcp, bool is_tls, const Bytes& data,
+                                                 bool wait_result) {
   std::unique_ptr<StreamOpenRequest> open_request = std::make_unique<StreamOpenRequest>();
   open_request->head.sid = sid_;
   // open_request->remote_host = host;
@@ -105,41 +392,257 @@ asio::awaitable<std::error_code> MuxStream::Open(const std::string& host, uint16
   open_request->event.remote_port = port;
   open_request->event.is_tcp = is_tcp;
   open_request->event.is_tls = is_tls;
+  open_request->event.wait_result = open_result_ && wait_result;
+  bool data_in_open = open_with_data_ && data.size() > 0 && data.size() <= kMaxOpenDataSize;
+  if (data_in_open) {
+    open_request->data = get_iobuf(data.size());
+    memcpy(open_request->data->data(), data.data(), data.size());
+    open_request->event.data_len = data.size();
+    write_bytes_ += data.size();
+    g_stream_open_with_data++;
+  }
 
   is_tls_ = is_tls;
+  datagram_ = !is_tcp;
   bool success = co_await WriteEvent(std::move(open_request));
   if (!success) {
     co_return std::make_error_code(std::errc::no_link);
   }
+  if (!data_in_open && data.size() > 0) {
+    IOBufPtr buf = get_iobuf(data.size());
+    memcpy(buf->data(), data.data(), data.size());
+    co_return co_await Write(std::move(buf), data.size());
+  }
   co_return std::error_code{};
 }
 
+asio::awaitable<int> MuxStream::WaitOpenResult(uint32_t* connect_latency_ms) {
+  if (!open_result_) {
+    co_return STREAM_OPEN_OK;
+  }
+  if (open_error_ < 0 && !closed_) {
+    open_result_timer_.expires_after(std::chrono::seconds(kOpenResultTimeoutSecs));
+    auto [ec] = co_await open_result_timer_.async_wait(
+        ::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (!ec) {
+      SNOVA_ERROR("[{}]No open result received in {}s.", sid_, kOpenResultTimeoutSecs);
+      co_return STREAM_OPEN_ERR_TIMEOUT;
+    }
+  }
+  if (open_error_ < 0) {
+    // closed by peer or local before any result.
+    co_return STREAM_OPEN_ERR_GENERAL;
+  }
+  if (nullptr != connect_latency_ms) {
+    *connect_latency_ms = open_latency_ms_;
+  }
+  co_return open_error_;
+}
+
+void MuxStream::OnOpenResult(uint32_t error_code, uint32_t connect_latency_ms) {
+  if (open_error_ >= 0) {
+    return;
+  }
+  open_error_ = static_cast<int>(error_code);
+  open_latency_ms_ = connect_latency_ms;
+  open_result_timer_.cancel();
+}
+
+asio::awaitable<void> MuxStream::ReplyOpenResult(int error_code, uint32_t connect_latency_ms) {
+  if (!open_result_ || closed_) {
+    co_return;
+  }
+  auto result = std::make_unique<StreamOpenResult>();
+  result->head.sid = sid_;
+  result->event.error_code = error_code;
+  result->event.connect_latency_ms = connect_latency_ms;
+  co_await WriteEvent(std::move(result));
+}
+
 asio::awaitable<std::error_code> MuxStream::Offer(IOBufPtr&& buf, size_t len) {
+  if (flow_control_) {
+    // peer never sends more than the window we advertised(plus the chunk in flight when it was
+    // exhausted), a stream buffering far beyond it is broken and must not eat memory.
+    if (recv_queue_bytes_ + len > 2 * static_cast<size_t>(g_stream_window_bytes)) {
+      co_return std::make_error_code(std::errc::no_buffer_space);
+    }
+  } else {
+    // legacy peer without window updates, hold the connection read loop as before.
+    while (!closed_ && recv_queue_bytes_ >= g_stream_window_bytes) {
+      co_await recv_timer_.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    }
+  }
   if (closed_) {
     co_return std::make_error_code(std::errc::no_link);
   }
-  auto [ec] =
-      co_await data_channel_.async_send(std::error_code{}, std::move(buf), len,
-                                        ::asio::experimental::as_tuple(::asio::use_awaitable));
-  if (ec) {
-    SNOVA_ERROR("[{}]Failed to write event channel with error:{}", sid_, ec);
-    co_return ec;
+  bool was_empty = recv_queue_.empty();
+  recv_queue_.emplace_back(std::move(buf), len);
+  recv_queue_bytes_ += len;
+  g_stream_recv_queued_bytes += len;
+  if (was_empty) {
+    recv_timer_.cancel();
   }
   co_return std::error_code{};
 }
-asio::awaitable<StreamReadResult> MuxStream::Read() {
+
+asio::awaitable<std::error_code> MuxStream::OfferStriped(IOBufPtr&& buf, size_t len) {
+  if (len < kStreamSeqSize) {
+    co_return std::make_error_code(std::errc::bad_message);
+  }
   if (closed_) {
+    co_return std::make_error_code(std::errc::no_link);
+  }
+  len -= kStreamSeqSize;
+  recv_striped_ = true;
+  uint32_t seq;
+  memcpy(&seq, buf->data() + len, sizeof(seq));
+  seq = big_to_native(seq);
+  int32_t distance = static_cast<int32_t>(seq - static_cast<uint32_t>(recv_seq_));
+  if (distance < 0) {
+    co_return std::error_code{};  // duplicate
+  }
+  if (distance > 0) {
+    if (recv_queue_bytes_ + reorder_bytes_ + len > 2 * static_cast<size_t>(g_stream_window_bytes) ||
+        reorder_queue_.size() >= kMaxReorderChunks) {
+      co_return std::make_error_code(std::errc::no_buffer_space);
+    }
+    auto [it, inserted] =
+        reorder_queue_.try_emplace(recv_seq_ + distance, std::make_pair(std::move(buf), len));
+    if (!inserted) {
+      co_return std::error_code{};  // duplicate
+    }
+    reorder_bytes_ += len;
+    g_stream_recv_queued_bytes += len;
+    g_stream_reordered_chunks++;
+    co_return std::error_code{};
+  }
+  auto ec = co_await Offer(std::move(buf), len);
+  recv_seq_++;
+  while (!ec && !reorder_queue_.empty() && reorder_queue_.begin()->first == recv_seq_) {
+    auto node = reorder_queue_.extract(reorder_queue_.begin());
+    size_t n = node.mapped().second;
+    reorder_bytes_ -= n;
+    g_stream_recv_queued_bytes -= n;
+    ec = co_await Offer(std::move(node.mapped().first), n);
+    recv_seq_++;
+  }
+  if (!ec && remote_close_pending_ && static_cast<uint32_t>(recv_seq_) == remote_chunk_count_) {
+    co_await Close(true);
+  }
+  co_return ec;
+}
+
+void MuxStream::OnConnectionClosed(uint64_t client_id) {
+  auto found = g_stream_tables.find(client_id);
+  if (found == g_stream_tables.end()) {
+    return;
+  }
+  std::vector<MuxStreamPtr> streams;
+  auto collect = [&streams](const MuxStreamPtr& stream) {
+    if (stream && stream->recv_striped_ && !stream->stripe_loss_check_ && !stream->closed_) {
+      stream->stripe_loss_check_ = true;
+      streams.emplace_back(stream);
+    }
+  };
+  for (const MuxStreamPtr& stream : found->second.slots) {
+    collect(stream);
+  }
+  for (const auto& [sid, stream] : found->second.overflow) {
+    collect(stream);
+  }
+  for (MuxStreamPtr& stream : streams) {
+    auto ex = stream->recv_timer_.get_executor();
+    ::asio::co_spawn(
+        ex,
+        [stream = std::move(stream)]() -> asio::awaitable<void> {
+          co_await stream->CheckStripeLoss(kStripeLossWaitMs);
+        },
+        ::asio::detached);
+  }
+}
+
+asio::awaitable<void> MuxStream::CheckStripeLoss(uint32_t wait_ms) {
+  stripe_loss_check_ = true;
+  ::asio::steady_timer timer(recv_timer_.get_executor());
+  while (!closed_) {
+    uint64_t wait_seq = recv_seq_;
+    timer.expires_after(std::chrono::milliseconds(wait_ms));
+    co_await timer.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (closed_ || (reorder_queue_.empty() && !remote_close_pending_)) {
+      break;
+    }
+    if (recv_seq_ == wait_seq) {
+      SNOVA_ERROR("[{}]Close striped stream since chunk:{} is lost with a closed connection.", sid_,
+                  wait_seq);
+      g_stream_stripe_lost_num++;
+      co_await Close(false);
+      break;
+    }
+  }
+  stripe_loss_check_ = false;
+}
+
+bool MuxStream::DeferRemoteClose(uint32_t chunk_count) {
+  if (closed_ || static_cast<uint32_t>(recv_seq_) == chunk_count) {
+    return false;
+  }
+  remote_close_pending_ = true;
+  remote_chunk_count_ = chunk_count;
+  return true;
+}
+
+asio::awaitable<void> MuxStream::AckConsumed(size_t len) {
+  recv_unacked_bytes_ += len;
+  // batch window updates, one per quarter window keeps control traffic small.
+  if (recv_unacked_bytes_ < g_stream_window_bytes / 4 || closed_) {
+    co_return;
+  }
+  auto update = std::make_unique<StreamWindowUpdate>();
+  update->head.sid = sid_;
+  update->event.increment = static_cast<uint32_t>(recv_unacked_bytes_);
+  recv_unacked_bytes_ = 0;
+  co_await WriteEvent(std::move(update));
+}
+
+asio::awaitable<StreamReadResult> MuxStream::Read() {
+  while (recv_queue_.empty() && !closed_) {
+    co_await recv_timer_.async_wait(::asio::experimental::as_tuple(::asio::use_awaitable));
+  }
+  if (recv_queue_.empty()) {
     co_return StreamReadResult{nullptr, 0, std::make_error_code(std::errc::no_link)};
   }
-  auto [ec, data, len] =
-      co_await data_channel_.async_receive(::asio::experimental::as_tuple(::asio::use_awaitable));
-  if (ec) {
-    co_return StreamReadResult{nullptr, 0, ec};
+  auto [data, len] = std::move(recv_queue_.front());
+  recv_queue_.pop_front();
+  bool was_full = recv_queue_bytes_ >= g_stream_window_bytes;
+  recv_queue_bytes_ -= len;
+  g_stream_recv_queued_bytes -= len;
+  if (flow_control_) {
+    co_await AckConsumed(len);
+  } else if (was_full && recv_queue_bytes_ < g_stream_window_bytes) {
+    recv_timer_.cancel();
   }
   co_return StreamReadResult{std::move(data), len, std::error_code{}};
 }
 
 asio::awaitable<std::error_code> MuxStream::Write(IOBufPtr&& buf, size_t len) {
+  if (len > max_chunk_size_ && datagram_) {
+    // a datagram must stay in one chunk, drop it like a link with a smaller mtu does.
+    g_stream_dropped_datagrams++;
+    co_return std::error_code{};
+  }
+  if (len > max_chunk_size_) {
+    // chunk read from a session with larger frames(relayed by middle node), split it to fit.
+    for (size_t pos = 0; pos < len; pos += max_chunk_size_) {
+      size_t n = std::min<size_t>(max_chunk_size_, len - pos);
+      IOBufPtr part = get_iobuf(n);
+      memcpy(part->data(), buf->data() + pos, n);
+      auto ec = co_await Write(std::move(part), n);
+      if (ec) {
+        co_return ec;
+      }
+    }
+    co_return std::error_code{};
+  }
   auto chunk = std::make_unique<StreamChunk>();
   chunk->head.sid = sid_;
   if (is_tls_) {
@@ -150,10 +653,47 @@ asio::awaitable<std::error_code> MuxStream::Write(IOBufPtr&& buf, size_t len) {
       chunk->head.flags.body_no_encrypt = 1;
     }
   }
+  if (flow_control_) {
+    while (!closed_ && send_window_ <= 0) {
+      g_stream_send_window_waits++;
+      co_await send_window_timer_.async_wait(
+          ::asio::experimental::as_tuple(::asio::use_awaitable));
+    }
+    if (closed_) {
+      co_return std::make_error_code(std::errc::no_link);
+    }
+    send_window_ -= static_cast<int64_t>(len);
+  }
+  write_bytes_ += len;
+  if (write_bytes_ > kBulkStreamWriteBytes) {
+    priority_ = STREAM_PRIORITY_BULK;
+  }
+  chunk->priority = priority_;
+  if (striping_) {
+    if (buf->size() < len + kStreamSeqSize) {
+      buf->resize(len + kStreamSeqSize);
+    }
+    uint32_t seq = native_to_big(send_seq_++);
+    memcpy(buf->data() + len, &seq, sizeof(seq));
+    len += kStreamSeqSize;
+    chunk->head.flags.stream_seq = 1;
+  }
   chunk->chunk = std::move(buf);
   chunk->chunk_len = len;
-  write_bytes_ += len;
-  bool success = co_await WriteEvent(std::move(chunk));
+  std::unique_ptr<MuxEvent> write_ev = std::move(chunk);
+  bool success = false;
+  if (striping_ && peer_acked_) {
+    // the session picks the least loaded connection for every chunk, the first chunks stay on
+    // 'event_writer_' behind the open event until peer acked.
+    EventWriter writer = event_writer_factory_();
+    if (writer) {
+      success = co_await writer(std::move(write_ev));
+      g_stream_striped_chunks++;
+    }
+  }
+  if (!success) {
+    success = co_await WriteEvent(std::move(write_ev));
+  }
   if (!success) {
     co_return std::make_error_code(std::errc::no_link);
   }
@@ -166,13 +706,21 @@ asio::awaitable<std::error_code> MuxStream::Close(bool close_by_remote) {
   MuxStream::Remove(client_id_, sid_);
   SNOVA_INFO("[{}]Close from remote peer:{}", sid_, close_by_remote);
   closed_ = true;
-  data_channel_.cancel();
-  data_channel_.close();
+  recv_timer_.cancel();
+  send_window_timer_.cancel();
+  open_result_timer_.cancel();
+  g_stream_recv_queued_bytes -= reorder_bytes_;
+  reorder_bytes_ = 0;
+  reorder_queue_.clear();
   if (close_by_remote) {
     // do nothing
   } else {
     auto close_ev = std::make_unique<StreamCloseRequest>();
     close_ev->head.sid = sid_;
+    if (striping_) {
+      close_ev->head.flags.stream_seq = 1;
+      close_ev->chunk_count = send_seq_;
+    }
     bool success = co_await WriteEvent(std::move(close_ev));
     if (!success) {
       co_return std::make_error_code(std::errc::no_link);
@@ -28,6 +28,8 @@
  */
 
 #pragma once
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
@@ -36,36 +38,109 @@
 #include "snova/io/io.h"
 #include "snova/mux/mux_event.h"
 namespace snova {
-using StreamDataChannel = asio::experimental::channel<void(std::error_code, IOBufPtr&&, size_t)>;
-using StreamDataChannelExecutor = typename StreamDataChannel::executor_type;
+using StreamExecutor = asio::any_io_executor;
+// stream settings negotiated by the mux connections of a session.
+struct MuxStreamOptions {
+  // receive window peer advertised for each stream, 0 for legacy peer without flow control.
+  uint32_t peer_window = 0;
+  uint32_t max_chunk_size = kMaxChunkSize;
+  // peer accepts the first payload inside StreamOpenRequest.
+  bool open_with_data = false;
+  // peer replies StreamOpenResult once the remote connect finished.
+  bool open_result = false;
+  // peer relays streams opened with 'is_tcp=false' as udp sessions.
+  bool udp_relay = false;
+  // spread chunks over all connections of the session, peer reorders them by stream sequence.
+  bool striping = false;
+};
 class MuxStream;
 using MuxStreamPtr = std::shared_ptr<MuxStream>;
 class MuxStream : public Stream {
  public:
+  // 'data' is the first payload of the stream, sent inside the open frame if peer supports it.
+  // 'wait_result' tells peer the opener holds its client until the StreamOpenResult.
   asio::awaitable<std::error_code> Open(const std::string& host, uint16_t port, bool is_tcp,
-                                        bool is_tls);
+                                        bool is_tls, const Bytes& data = {},
+                                        bool wait_result = false);
+  // Wait the StreamOpenResult of a opened stream, return STREAM_OPEN_OK at once if peer never
+  // sends it.
+  asio::awaitable<int> WaitOpenResult(uint32_t* connect_latency_ms = nullptr);
+  void OnOpenResult(uint32_t error_code, uint32_t connect_latency_ms);
+  bool HasOpenResult() const { return open_error_ >= 0; }
+  // Return true if the opener holds its client until the StreamOpenResult of this stream.
+  bool IsOpenResultAwaited() const { return open_result_ && result_awaited_; }
+  void SetOpenResultAwaited(bool v) { result_awaited_ = v; }
+  // Send the remote connect result back to the stream opener.
+  asio::awaitable<void> ReplyOpenResult(int error_code, uint32_t connect_latency_ms);
+  // Queue received chunk for Read, never suspends once flow control is negotiated with peer.
   asio::awaitable<std::error_code> Offer(IOBufPtr&& buf, size_t len);
+  // Offer a chunk ending with its stream sequence, chunks arrived out of order are held in a
+  // bounded reorder buffer until the gap filled.
+  asio::awaitable<std::error_code> OfferStriped(IOBufPtr&& buf, size_t len);
+  // Return true if close must wait striped chunks still in flight, 'chunk_count' is the number of
+  // chunks peer sent.
+  bool DeferRemoteClose(uint32_t chunk_count);
   asio::awaitable<StreamReadResult> Read() override;
   asio::awaitable<std::error_code> Write(IOBufPtr&& buf, size_t len) override;
   asio::awaitable<std::error_code> Close(bool close_by_remote) override;
   uint32_t GetID() const override { return sid_; }
   bool IsTLS() const override { return is_tls_; }
+  size_t GetMaxWriteSize() const override { return max_chunk_size_; }
 
   void SetTLS(bool v) { is_tls_ = v; }
+  // stream carrying one datagram per chunk(opened with 'is_tcp=false'), set by Open for the opener.
+  void SetDatagram(bool v) { datagram_ = v; }
+  // scheduling class of chunks written by this stream, see StreamPriority.
+  void SetPriority(uint8_t v) { priority_ = v; }
+  void SetOptions(const MuxStreamOptions& opts);
+  void UpdateSendWindow(uint32_t increment);
 
   ~MuxStream();
 
-  static uint32_t NextID(bool is_client);
-  static MuxStreamPtr New(EventWriterFactory&& factory, const StreamDataChannelExecutor& ex,
+  // New stream opened by this node, its id is allocated from the shard's stream slots. Return
+  // nullptr if all slots are taken.
+  static MuxStreamPtr NewLocal(EventWriterFactory&& factory, const StreamExecutor& ex,
+                               uint64_t client_id, bool is_client);
+  // New stream with the id chosen by the peer which opened it, return nullptr if the id is used
+  // by a live stream, 'factory' is left untouched then.
+  static MuxStreamPtr New(EventWriterFactory&& factory, const StreamExecutor& ex,
                           uint64_t client_id, uint32_t sid);
   static MuxStreamPtr Get(uint64_t client_id, uint32_t sid);
   static void Remove(uint64_t client_id, uint32_t sid);
   static size_t Size();
   static size_t ActiveSize();
+  static uint64_t TotalRecvQueuedBytes();
+  static uint64_t TotalSendWindowWaits();
+  static uint64_t TotalOpenWithData();
+  static uint64_t TotalStripedChunks();
+  static uint64_t TotalReorderedChunks();
+  static uint64_t TotalShedStreams();
+  static uint64_t TotalDroppedDatagrams();
+  static uint64_t TotalStripeLostStreams();
+  // Close streams of current shard buffering most received bytes until 'bytes' released, return
+  // the bytes released.
+  static asio::awaitable<size_t> ShedBuffered(size_t bytes);
+  // A mux connection of the client closed, striped chunks it carried may be lost, streams of the
+  // client stuck on such a gap are closed a few seconds later.
+  static void OnConnectionClosed(uint64_t client_id);
+
+ private:
+  friend struct MuxStreamTestPeer;
+  // only constructible by New/NewLocal.
+  struct PrivateTag {
+    explicit PrivateTag() = default;
+  };
+
+ public:
+  MuxStream(PrivateTag, EventWriterFactory&& factory, const StreamExecutor& ex,
+            uint64_t client_id, uint32_t sid);
 
  private:
-  MuxStream(EventWriterFactory&& factory, const StreamDataChannelExecutor& ex, uint64_t client_id,
-            uint32_t sid);
+  asio::awaitable<void> AckConsumed(size_t len);
+  // Close the stream if it still waits the same missing chunk after 'wait_ms' while later chunks
+  // or the close arrived, repeat while it waits any.
+  asio::awaitable<void> CheckStripeLoss(uint32_t wait_ms);
+  size_t BufferedBytes() const { return recv_queue_bytes_ + reorder_bytes_; }
   template <typename T>
   asio::awaitable<bool> WriteEvent(std::unique_ptr<T>&& event) {
     std::unique_ptr<MuxEvent> write_ev = std::move(event);
@@ -85,11 +160,44 @@ class MuxStream : public Stream {
   }
   EventWriterFactory event_writer_factory_;
   EventWriter event_writer_;
-  StreamDataChannel data_channel_;
+  // never expire, cancelled to wake the reader/offer waiters or writers waiting for send window.
+  ::asio::steady_timer recv_timer_;
+  ::asio::steady_timer send_window_timer_;
+  ::asio::steady_timer open_result_timer_;
+  std::deque<std::pair<IOBufPtr, size_t>> recv_queue_;
+  size_t recv_queue_bytes_;
+  // striped chunks received ahead of 'recv_seq_', keyed by the unwrapped sequence.
+  std::map<uint64_t, std::pair<IOBufPtr, size_t>> reorder_queue_;
+  size_t reorder_bytes_;
+  uint64_t recv_seq_;
+  uint32_t send_seq_;
+  uint32_t remote_chunk_count_;
+  // bytes consumed by Read but not yet returned to peer by a window update.
+  size_t recv_unacked_bytes_;
+  int64_t send_window_;
   size_t write_bytes_;
+  uint32_t max_chunk_size_;
+  uint8_t priority_;
+  // -1 until StreamOpenResult received.
+  int open_error_;
+  uint32_t open_latency_ms_;
   uint64_t client_id_;
   uint32_t sid_;
   bool is_tls_;
+  bool datagram_;
+  bool flow_control_;
+  bool open_with_data_;
+  bool open_result_;
+  bool result_awaited_;
+  bool striping_;
+  // peer sent a window update, so it holds the stream and chunks could take any connection.
+  bool peer_acked_;
+  bool remote_close_pending_;
+  // peer stripes its chunks of this stream.
+  bool recv_striped_;
+  bool stripe_loss_check_;
+  // id allocated by NewLocal, released when the stream destroyed.
+  bool local_id_;
   bool closed_;
 };
 
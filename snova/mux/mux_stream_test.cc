@@ -0,0 +1,442 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/mux/mux_stream.h"
+#include <gtest/gtest.h>
+#include <string.h>
+#include <memory>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "snova/util/endian.h"
+#include "snova/util/flags.h"
+
+namespace snova {
+struct MuxStreamTestPeer {
+  static void SetRecvSeq(MuxStream* stream, uint64_t seq) { stream->recv_seq_ = seq; }
+  static size_t ReorderedChunks(const MuxStream* stream) { return stream->reorder_queue_.size(); }
+  static asio::awaitable<void> CheckStripeLoss(MuxStream* stream, uint32_t wait_ms) {
+    co_await stream->CheckStripeLoss(wait_ms);
+  }
+};
+}  // namespace snova
+using namespace snova;  // NOLINT
+
+// events written by streams, in write order.
+struct EventCollector {
+  std::vector<std::unique_ptr<MuxEvent>> events;
+  EventWriterFactory Factory() {
+    return [this]() -> EventWriter {
+      return [this](std::unique_ptr<MuxEvent>&& ev) -> asio::awaitable<bool> {
+        events.emplace_back(std::move(ev));
+        co_return true;
+      };
+    };
+  }
+  size_t Count(EventType type) const {
+    size_t n = 0;
+    for (const auto& ev : events) {
+      if (ev->head.type == type) {
+        n++;
+      }
+    }
+    return n;
+  }
+};
+
+static IOBufPtr new_chunk(size_t len) {
+  IOBufPtr buf = get_iobuf(len);
+  memset(buf->data(), static_cast<int>(len & 0xFF), len);
+  return buf;
+}
+
+// one byte chunk tagged by the low byte of its stream sequence, followed by the sequence trailer.
+static std::error_code offer_striped(::asio::io_context& ctx, const MuxStreamPtr& stream,
+                                     uint32_t seq) {
+  IOBufPtr buf = get_iobuf(1 + kStreamSeqSize);
+  buf->data()[0] = static_cast<uint8_t>(seq & 0xFF);
+  uint32_t trailer = native_to_big(seq);
+  memcpy(buf->data() + 1, &trailer, sizeof(trailer));
+  std::error_code result;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        result = co_await stream->OfferStriped(std::move(buf), 1 + kStreamSeqSize);
+      },
+      ::asio::detached);
+  // poll stops the context once it runs out of work.
+  ctx.restart();
+  ctx.poll();
+  return result;
+}
+
+// tags of all chunks readable now, stops at the first read error. A read left waiting for more
+// only touches the shared state.
+static std::vector<uint8_t> read_available(::asio::io_context& ctx, const MuxStreamPtr& stream,
+                                           std::error_code* last_ec) {
+  struct ReadState {
+    std::vector<uint8_t> tags;
+    std::error_code ec;
+  };
+  auto state = std::make_shared<ReadState>();
+  ::asio::co_spawn(
+      ctx,
+      [stream, state]() -> asio::awaitable<void> {
+        while (true) {
+          auto [buf, len, ec] = co_await stream->Read();
+          if (ec) {
+            state->ec = ec;
+            break;
+          }
+          EXPECT_EQ(1u, len);
+          state->tags.push_back(buf->data()[0]);
+        }
+      },
+      ::asio::detached);
+  ctx.restart();
+  ctx.poll();
+  *last_ec = state->ec;
+  return std::move(state->tags);
+}
+
+static MuxStreamPtr new_striped_stream(::asio::io_context& ctx, EventCollector& collector,
+                                       uint64_t client_id) {
+  MuxStreamPtr stream =
+      MuxStream::NewLocal(collector.Factory(), ctx.get_executor(), client_id, true);
+  MuxStreamOptions opts;
+  opts.peer_window = g_stream_window_bytes;
+  stream->SetOptions(opts);
+  return stream;
+}
+
+static void close_stream(::asio::io_context& ctx, const MuxStreamPtr& stream) {
+  ::asio::co_spawn(
+      ctx, [&]() -> asio::awaitable<void> { co_await stream->Close(false); }, ::asio::detached);
+  ctx.restart();
+  ctx.poll();
+}
+
+TEST(MuxStream, DatagramNearLimit) {
+  ::asio::io_context ctx;
+  std::vector<std::unique_ptr<MuxEvent>> events;
+  EventWriterFactory factory = [&events]() -> EventWriter {
+    return [&events](std::unique_ptr<MuxEvent>&& ev) -> asio::awaitable<bool> {
+      events.emplace_back(std::move(ev));
+      co_return true;
+    };
+  };
+  size_t limit = 0;
+  uint64_t dropped = MuxStream::TotalDroppedDatagrams();
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto ex = co_await asio::this_coro::executor;
+        // a small peer frame with striping trailer, a datagram must never be split to fit it.
+        MuxStreamOptions opts;
+        opts.max_chunk_size = 1024;
+        opts.striping = true;
+        MuxStreamPtr stream = MuxStream::NewLocal(std::move(factory), ex, 1, true);
+        stream->SetOptions(opts);
+        auto ec = co_await stream->Open("127.0.0.1", 53, false, false);
+        EXPECT_FALSE(ec);
+        limit = stream->GetMaxWriteSize();
+        for (size_t len : {limit, limit + 1}) {
+          IOBufPtr buf = get_iobuf(len);
+          memset(buf->data(), static_cast<int>(len & 0xFF), len);
+          ec = co_await stream->Write(std::move(buf), len);
+          EXPECT_FALSE(ec);
+        }
+        co_await stream->Close(false);
+      },
+      ::asio::detached);
+  ctx.run();
+  // open, the datagram at the limit in one chunk, close.
+  ASSERT_EQ(3u, events.size());
+  ASSERT_NE(nullptr, event_cast<StreamOpenRequest>(events[0].get()));
+  StreamChunk* chunk = event_cast<StreamChunk>(events[1].get());
+  ASSERT_NE(nullptr, chunk);
+  // the datagram and the stream sequence trailer.
+  ASSERT_EQ(limit + kStreamSeqSize, chunk->chunk_len);
+  ASSERT_EQ(static_cast<uint8_t>(limit & 0xFF), chunk->chunk->data()[limit - 1]);
+  ASSERT_NE(nullptr, event_cast<StreamCloseRequest>(events[2].get()));
+  // the one over the limit is dropped as a whole.
+  ASSERT_EQ(dropped + 1, MuxStream::TotalDroppedDatagrams());
+}
+
+TEST(MuxStream, SendWindow) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = MuxStream::NewLocal(collector.Factory(), ctx.get_executor(), 2, true);
+  MuxStreamOptions opts;
+  opts.peer_window = 2 * kMaxChunkSize;
+  stream->SetOptions(opts);
+  uint64_t waits = MuxStream::TotalSendWindowWaits();
+  size_t written = 0;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        for (size_t i = 0; i < 3; i++) {
+          auto ec = co_await stream->Write(new_chunk(kMaxChunkSize), kMaxChunkSize);
+          EXPECT_FALSE(ec);
+          written++;
+        }
+      },
+      ::asio::detached);
+  ctx.poll();
+  // the window is used up by 2 chunks, the third waits for peer.
+  EXPECT_EQ(2u, written);
+  EXPECT_EQ(2u, collector.Count(EVENT_STREAM_CHUNK));
+  EXPECT_EQ(waits + 1, MuxStream::TotalSendWindowWaits());
+  stream->UpdateSendWindow(kMaxChunkSize);
+  ctx.poll();
+  EXPECT_EQ(3u, written);
+  EXPECT_EQ(3u, collector.Count(EVENT_STREAM_CHUNK));
+  ::asio::co_spawn(
+      ctx, [&]() -> asio::awaitable<void> { co_await stream->Close(false); }, ::asio::detached);
+  ctx.poll();
+}
+
+TEST(MuxStream, WindowUpdate) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = MuxStream::NewLocal(collector.Factory(), ctx.get_executor(), 3, true);
+  MuxStreamOptions opts;
+  opts.peer_window = g_stream_window_bytes;
+  stream->SetOptions(opts);
+  size_t chunks = g_stream_window_bytes / kMaxChunkSize;
+  size_t read_bytes = 0;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        for (size_t i = 0; i < chunks; i++) {
+          auto ec = co_await stream->Offer(new_chunk(kMaxChunkSize), kMaxChunkSize);
+          EXPECT_FALSE(ec);
+        }
+        for (size_t i = 0; i < chunks; i++) {
+          auto [buf, len, ec] = co_await stream->Read();
+          EXPECT_FALSE(ec);
+          read_bytes += len;
+        }
+        co_await stream->Close(false);
+      },
+      ::asio::detached);
+  ctx.run();
+  EXPECT_EQ(g_stream_window_bytes, read_bytes);
+  // consumed bytes are returned to peer a quarter window at a time.
+  size_t increments = 0;
+  for (const auto& ev : collector.events) {
+    StreamWindowUpdate* update = event_cast<StreamWindowUpdate>(ev.get());
+    if (nullptr != update) {
+      EXPECT_GE(update->event.increment, g_stream_window_bytes / 4);
+      increments += update->event.increment;
+    }
+  }
+  EXPECT_EQ(4u, collector.Count(EVENT_STREAM_WINDOW_UPDATE));
+  EXPECT_EQ(g_stream_window_bytes, increments);
+}
+
+TEST(MuxStream, WindowOverrun) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = MuxStream::NewLocal(collector.Factory(), ctx.get_executor(), 4, true);
+  MuxStreamOptions opts;
+  opts.peer_window = g_stream_window_bytes;
+  stream->SetOptions(opts);
+  // a peer may overshoot the window by chunks in flight, buffering twice of it is a broken peer.
+  size_t chunks = 2 * g_stream_window_bytes / kMaxChunkSize;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        for (size_t i = 0; i < chunks; i++) {
+          auto ec = co_await stream->Offer(new_chunk(kMaxChunkSize), kMaxChunkSize);
+          EXPECT_FALSE(ec);
+        }
+        auto ec = co_await stream->Offer(new_chunk(kMaxChunkSize), kMaxChunkSize);
+        EXPECT_EQ(std::make_error_code(std::errc::no_buffer_space), ec);
+        co_await stream->Close(false);
+      },
+      ::asio::detached);
+  ctx.run();
+}
+
+TEST(MuxStream, LegacyPeerWithoutWindow) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = MuxStream::NewLocal(collector.Factory(), ctx.get_executor(), 5, true);
+  // peer_window 0: peer never sends window updates.
+  stream->SetOptions(MuxStreamOptions{});
+  size_t chunks = g_stream_window_bytes / kMaxChunkSize;
+  size_t offered = 0;
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        for (size_t i = 0; i <= chunks; i++) {
+          auto ec = co_await stream->Offer(new_chunk(kMaxChunkSize), kMaxChunkSize);
+          EXPECT_FALSE(ec);
+          offered++;
+        }
+      },
+      ::asio::detached);
+  ctx.poll();
+  // the connection read loop is held once a window of data is buffered.
+  EXPECT_EQ(chunks, offered);
+  ::asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        auto [buf, len, ec] = co_await stream->Read();
+        EXPECT_FALSE(ec);
+        // writes are never held by a send window.
+        for (size_t i = 0; i <= chunks; i++) {
+          ec = co_await stream->Write(new_chunk(kMaxChunkSize), kMaxChunkSize);
+          EXPECT_FALSE(ec);
+        }
+      },
+      ::asio::detached);
+  ctx.poll();
+  EXPECT_EQ(chunks + 1, offered);
+  EXPECT_EQ(chunks + 1, collector.Count(EVENT_STREAM_CHUNK));
+  EXPECT_EQ(0u, collector.Count(EVENT_STREAM_WINDOW_UPDATE));
+  ::asio::co_spawn(
+      ctx, [&]() -> asio::awaitable<void> { co_await stream->Close(false); }, ::asio::detached);
+  ctx.poll();
+}
+
+TEST(MuxStream, StreamIDNotReusedSoon) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  std::unordered_set<uint32_t> sids;
+  // one stream opened and released at a time, its slot must not come back with a wrapped
+  // generation(2047 cycles).
+  for (size_t i = 0; i < 8192; i++) {
+    MuxStreamPtr stream = MuxStream::NewLocal(collector.Factory(), ctx.get_executor(), 6, true);
+    ASSERT_TRUE(stream);
+    EXPECT_TRUE(sids.insert(stream->GetID()).second) << "sid reused at " << i;
+    MuxStream::Remove(6, stream->GetID());
+  }
+}
+
+TEST(MuxStream, StripedGapAndDuplicates) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = new_striped_stream(ctx, collector, 7);
+  uint64_t queued = MuxStream::TotalRecvQueuedBytes();
+  EXPECT_FALSE(offer_striped(ctx, stream, 0));
+  EXPECT_FALSE(offer_striped(ctx, stream, 2));
+  EXPECT_FALSE(offer_striped(ctx, stream, 3));
+  // duplicates of a delivered and of a reordered chunk are dropped.
+  EXPECT_FALSE(offer_striped(ctx, stream, 0));
+  EXPECT_FALSE(offer_striped(ctx, stream, 2));
+  EXPECT_EQ(2u, MuxStreamTestPeer::ReorderedChunks(stream.get()));
+  EXPECT_EQ(queued + 3, MuxStream::TotalRecvQueuedBytes());
+  EXPECT_FALSE(offer_striped(ctx, stream, 1));
+  EXPECT_EQ(0u, MuxStreamTestPeer::ReorderedChunks(stream.get()));
+  std::error_code ec;
+  EXPECT_EQ(std::vector<uint8_t>({0, 1, 2, 3}), read_available(ctx, stream, &ec));
+  EXPECT_EQ(queued, MuxStream::TotalRecvQueuedBytes());
+  close_stream(ctx, stream);
+}
+
+TEST(MuxStream, StripedSequenceWraparound) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = new_striped_stream(ctx, collector, 8);
+  MuxStreamTestPeer::SetRecvSeq(stream.get(), 0xFFFFFFFEu);
+  EXPECT_FALSE(offer_striped(ctx, stream, 1));
+  EXPECT_FALSE(offer_striped(ctx, stream, 0xFFFFFFFFu));
+  EXPECT_FALSE(offer_striped(ctx, stream, 0));
+  EXPECT_EQ(3u, MuxStreamTestPeer::ReorderedChunks(stream.get()));
+  // the last chunk before the wrap is a duplicate once the wrap is passed.
+  EXPECT_FALSE(offer_striped(ctx, stream, 0xFFFFFFFEu));
+  EXPECT_EQ(0u, MuxStreamTestPeer::ReorderedChunks(stream.get()));
+  EXPECT_FALSE(offer_striped(ctx, stream, 0xFFFFFFFEu));
+  std::error_code ec;
+  EXPECT_EQ(std::vector<uint8_t>({0xFE, 0xFF, 0, 1}), read_available(ctx, stream, &ec));
+  close_stream(ctx, stream);
+}
+
+TEST(MuxStream, StripedReorderLimit) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = new_striped_stream(ctx, collector, 9);
+  for (uint32_t seq = 1; seq <= 4096; seq++) {
+    ASSERT_FALSE(offer_striped(ctx, stream, seq));
+  }
+  EXPECT_EQ(std::make_error_code(std::errc::no_buffer_space), offer_striped(ctx, stream, 4097));
+  EXPECT_EQ(4096u, MuxStreamTestPeer::ReorderedChunks(stream.get()));
+  EXPECT_FALSE(offer_striped(ctx, stream, 0));
+  EXPECT_EQ(0u, MuxStreamTestPeer::ReorderedChunks(stream.get()));
+  std::error_code ec;
+  EXPECT_EQ(4097u, read_available(ctx, stream, &ec).size());
+  close_stream(ctx, stream);
+}
+
+TEST(MuxStream, StripedCloseAfterReorder) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr stream = new_striped_stream(ctx, collector, 10);
+  uint32_t sid = stream->GetID();
+  EXPECT_FALSE(offer_striped(ctx, stream, 0));
+  EXPECT_FALSE(offer_striped(ctx, stream, 2));
+  // peer closed after 3 chunks, the one in flight must still be read.
+  EXPECT_TRUE(stream->DeferRemoteClose(3));
+  EXPECT_EQ(stream, MuxStream::Get(10, sid));
+  EXPECT_FALSE(offer_striped(ctx, stream, 1));
+  EXPECT_EQ(nullptr, MuxStream::Get(10, sid));
+  std::error_code ec;
+  EXPECT_EQ(std::vector<uint8_t>({0, 1, 2}), read_available(ctx, stream, &ec));
+  EXPECT_TRUE(ec);
+  // closed by remote, no close sent back.
+  EXPECT_EQ(0u, collector.Count(EVENT_STREAM_CLOSE));
+}
+
+TEST(MuxStream, StripeLossAfterConnectionClose) {
+  ::asio::io_context ctx;
+  EventCollector collector;
+  MuxStreamPtr lossy = new_striped_stream(ctx, collector, 11);
+  MuxStreamPtr intact = new_striped_stream(ctx, collector, 11);
+  EXPECT_FALSE(offer_striped(ctx, lossy, 0));
+  EXPECT_FALSE(offer_striped(ctx, lossy, 2));
+  EXPECT_FALSE(offer_striped(ctx, intact, 0));
+  uint64_t lost = MuxStream::TotalStripeLostStreams();
+  for (const MuxStreamPtr& stream : {lossy, intact}) {
+    ::asio::co_spawn(
+        ctx,
+        [stream]() -> asio::awaitable<void> {
+          co_await MuxStreamTestPeer::CheckStripeLoss(stream.get(), 10);
+        },
+        ::asio::detached);
+  }
+  ctx.restart();
+  ctx.run_for(std::chrono::milliseconds(100));
+  // chunk 1 never arrives, the stream is closed instead of waiting forever.
+  EXPECT_EQ(lost + 1, MuxStream::TotalStripeLostStreams());
+  EXPECT_EQ(nullptr, MuxStream::Get(11, lossy->GetID()));
+  EXPECT_EQ(intact, MuxStream::Get(11, intact->GetID()));
+  EXPECT_EQ(1u, collector.Count(EVENT_STREAM_CLOSE));
+  close_stream(ctx, intact);
+}
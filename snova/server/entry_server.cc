@@ -35,6 +35,7 @@
 #include "absl/strings/match.h"
 #include "absl/strings/str_split.h"
 #include "asio/experimental/as_tuple.hpp"
+#include "snova/io/memory_pressure.h"
 #include "snova/log/log_macros.h"
 #include "snova/server/relay.h"
 #include "snova/util/address.h"
@@ -43,7 +44,7 @@
 #include "snova/util/stat.h"
 
 namespace snova {
-static uint32_t g_local_proxy_conn_num = 0;
+static thread_local uint32_t g_local_proxy_conn_num = 0;
 
 static ::asio::awaitable<void> handle_conn(::asio::ip::tcp::socket sock) {
   g_local_proxy_conn_num++;
@@ -120,6 +121,9 @@ static ::asio::awaitable<void> handle_conn(::asio::ip::tcp::socket sock) {
 
 static ::asio::awaitable<void> server_loop(::asio::ip::tcp::acceptor server) {
   while (true) {
+    if (get_memory_pressure() != MEMORY_PRESSURE_NONE) {
+      co_await wait_memory_available();
+    }
     auto [ec, client] =
         co_await server.async_accept(::asio::experimental::as_tuple(::asio::use_awaitable));
     if (ec) {
@@ -170,6 +174,13 @@ asio::awaitable<std::error_code> start_entry_server(const NetAddress& server_add
   acceptor.open(endpoint.protocol());
   acceptor.set_option(::asio::socket_base::reuse_address(true));
   std::error_code ec;
+  if (g_thread_num > 1) {
+    // every io thread binds same address, let kernel balance accepted connections.
+    ec = set_reuse_port(acceptor);
+    if (ec) {
+      SNOVA_ERROR("Failed to set reuse port with error:{}", ec.message());
+    }
+  }
   acceptor.bind(endpoint, ec);
   if (ec) {
     SNOVA_ERROR("Failed to bind {} with error:{}", server_address.String(), ec.message());
@@ -42,6 +42,8 @@ asio::awaitable<std::error_code> start_entry_server(const NetAddress& addr);
 
 asio::awaitable<void> handle_socks5_connection(::asio::ip::tcp::socket&& sock,
                                                IOBufPtr&& read_buffer, const Bytes& readable_data);
+// get SNI of a tls client hello as the remote host, return false if it should not be relayed as tls.
+bool get_tls_remote_host(const Bytes& client_hello, std::string* remote_host);
 asio::awaitable<bool> handle_tls_connection(
     ::asio::ip::tcp::socket&& sock, IOBufPtr&& read_buffer, const Bytes& readable_data,
     std::unique_ptr<::asio::ip::tcp::endpoint>&& orig_remote_endpoint);
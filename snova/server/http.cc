@@ -36,6 +36,7 @@
 #include "snova/log/log_macros.h"
 #include "snova/server/entry_server.h"
 #include "snova/server/relay.h"
+#include "snova/util/flags.h"
 #include "snova/util/http_helper.h"
 
 namespace snova {
@@ -89,9 +90,25 @@ asio::awaitable<void> handle_http_connection(::asio::ip::tcp::socket&& s, IOBufP
       remote_port = 443;
       relay_ctx.is_tls = true;
     }
-    absl::string_view conn_ok = "HTTP/1.0 200 Connection established\r\n\r\n";
-    co_await ::asio::async_write(sock, ::asio::buffer(conn_ok.data(), conn_ok.size()),
-                                 ::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (g_wait_open_result) {
+      relay_ctx.reply_open = [](::asio::ip::tcp::socket& sock, int open_error,
+                                RelayContext& ctx) -> asio::awaitable<Bytes> {
+        absl::string_view reply = "HTTP/1.0 200 Connection established\r\n\r\n";
+        if (open_error == STREAM_OPEN_ERR_TIMEOUT) {
+          reply = "HTTP/1.0 504 Gateway Timeout\r\n\r\n";
+        } else if (open_error != STREAM_OPEN_OK) {
+          reply = "HTTP/1.0 502 Bad Gateway\r\n\r\n";
+        }
+        co_await ::asio::async_write(sock, ::asio::buffer(reply.data(), reply.size()),
+                                     ::asio::experimental::as_tuple(::asio::use_awaitable));
+        co_return Bytes{};
+      };
+    } else {
+      // optimistic reply, a failed open closes the tunnel at once.
+      absl::string_view conn_ok = "HTTP/1.0 200 Connection established\r\n\r\n";
+      co_await ::asio::async_write(sock, ::asio::buffer(conn_ok.data(), conn_ok.size()),
+                                   ::asio::experimental::as_tuple(::asio::use_awaitable));
+    }
     // tunnel
     relay_ctx.remote_port = remote_port;
     co_await relay(std::move(sock), Bytes{}, relay_ctx);
@@ -27,6 +27,7 @@
  *THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "snova/server/mux_server.h"
+#include <functional>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -37,13 +38,16 @@
 #include "absl/strings/escaping.h"
 #include "absl/strings/str_split.h"
 #include "asio/experimental/as_tuple.hpp"
-#include "snova/io/tcp_socket.h"
+#include "snova/io/memory_pressure.h"
+#include "snova/io/rudp_socket.h"
+#include "snova/io/uring_socket.h"
 #include "snova/io/ws_socket.h"
 #include "snova/log/log_macros.h"
 #include "snova/mux/mux_conn_manager.h"
 #include "snova/mux/mux_connection.h"
 #include "snova/server/relay.h"
 #include "snova/util/address.h"
+#include "snova/util/flags.h"
 #include "snova/util/misc_helper.h"
 #include "snova/util/net_helper.h"
 #include "snova/util/stat.h"
@@ -56,39 +60,17 @@ enum class MuxTransportType : uint8_t {
   MUX_OVER_TLS,
   MUX_OVER_TLS_WEBSOCKET,
 };
-static uint32_t g_mux_server_conn_num = 0;
+static thread_local uint32_t g_mux_server_conn_num = 0;
 
-static ::asio::awaitable<void> handle_conn(::asio::ip::tcp::socket sock,
-                                           MuxTransportType transport_type,
-                                           const std::string& cipher_method,
-                                           const std::string& cipher_key) {
+// 'auth_callback' is called once the peer passed auth, the connection is still owned by the mux
+// connection then.
+static ::asio::awaitable<void> handle_mux_conn(IOConnectionPtr io_conn,
+                                               const std::string& cipher_method,
+                                               const std::string& cipher_key,
+                                               std::function<void()> auth_callback = {}) {
   g_mux_server_conn_num++;
   absl::Cleanup auto_counter = [] { g_mux_server_conn_num--; };
   std::unique_ptr<CipherContext> cipher_ctx = CipherContext::New(cipher_method, cipher_key);
-  IOConnectionPtr io_conn;
-
-  switch (transport_type) {
-    case MuxTransportType::MUX_OVER_TCP: {
-      io_conn = std::make_unique<TcpSocket>(std::move(sock));
-      break;
-    }
-    case MuxTransportType::MUX_OVER_WEBSOCKET: {
-      IOConnectionPtr tcp_conn = std::make_unique<TcpSocket>(std::move(sock));
-      auto ws_conn = std::make_unique<WebSocket>(std::move(tcp_conn));
-      auto ec = co_await ws_conn->AsyncAccept();
-      if (ec) {
-        SNOVA_ERROR("Failed to handshake from ws client:{}", ec);
-        co_return;
-      }
-      io_conn = std::move(ws_conn);
-      break;
-    }
-    default: {
-      SNOVA_ERROR("Unsupported connection type:{}", static_cast<uint8_t>(transport_type));
-      co_return;
-    }
-  }
-
   // rewrite conn type by later 'ServerAuth'
   MuxConnectionPtr mux_conn = std::make_shared<MuxConnection>(MUX_ENTRY_CONN, std::move(io_conn),
                                                               std::move(cipher_ctx), false);
@@ -97,6 +79,9 @@ static ::asio::awaitable<void> handle_conn(::asio::ip::tcp::socket sock,
     SNOVA_ERROR("Server auth failed!");
     co_return;
   }
+  if (auth_callback) {
+    auth_callback();
+  }
   mux_conn->SetRelayHandler(relay_handler);
   std::string mux_user = std::move(auth_user);
   SNOVA_INFO("MuxServer recv connection from user:{} with type:{}, client_id:{}", mux_user,
@@ -122,17 +107,49 @@ static ::asio::awaitable<void> handle_conn(::asio::ip::tcp::socket sock,
   uint32_t idx = 0;
   MuxConnManager::GetInstance()->Add(mux_user, client_id, mux_conn, &idx);
   mux_conn->SetIdx(idx);
-  auto ex = co_await asio::this_coro::executor;
   co_await mux_conn->ReadEventLoop();
   mux_conn->Close();
   MuxConnManager::GetInstance()->Remove(mux_user, client_id, mux_conn);
 }
 
+static ::asio::awaitable<void> handle_conn(::asio::ip::tcp::socket sock,
+                                           MuxTransportType transport_type,
+                                           const std::string& cipher_method,
+                                           const std::string& cipher_key) {
+  IOConnectionPtr io_conn;
+
+  switch (transport_type) {
+    case MuxTransportType::MUX_OVER_TCP: {
+      io_conn = new_tcp_connection(std::move(sock));
+      break;
+    }
+    case MuxTransportType::MUX_OVER_WEBSOCKET: {
+      IOConnectionPtr tcp_conn = new_tcp_connection(std::move(sock));
+      auto ws_conn = std::make_unique<WebSocket>(std::move(tcp_conn));
+      auto ec = co_await ws_conn->AsyncAccept();
+      if (ec) {
+        SNOVA_ERROR("Failed to handshake from ws client:{}", ec);
+        co_return;
+      }
+      io_conn = std::move(ws_conn);
+      break;
+    }
+    default: {
+      SNOVA_ERROR("Unsupported connection type:{}", static_cast<uint8_t>(transport_type));
+      co_return;
+    }
+  }
+  co_await handle_mux_conn(std::move(io_conn), cipher_method, cipher_key);
+}
+
 static ::asio::awaitable<void> server_loop(::asio::ip::tcp::acceptor server,
                                            MuxTransportType transport_type,
                                            const std::string& cipher_method,
                                            const std::string& cipher_key) {
   while (true) {
+    if (get_memory_pressure() != MEMORY_PRESSURE_NONE) {
+      co_await wait_memory_available();
+    }
     auto [ec, client] =
         co_await server.async_accept(::asio::experimental::as_tuple(::asio::use_awaitable));
     if (ec) {
@@ -147,6 +164,60 @@ static ::asio::awaitable<void> server_loop(::asio::ip::tcp::acceptor server,
   co_return;
 }
 
+static ::asio::awaitable<void> udp_server_loop(RudpServerPtr server,
+                                               const std::string& cipher_method,
+                                               const std::string& cipher_key) {
+  while (true) {
+    if (get_memory_pressure() != MEMORY_PRESSURE_NONE) {
+      co_await wait_memory_available();
+    }
+    auto [io_conn, ec] = co_await server->AsyncAccept();
+    if (ec) {
+      SNOVA_ERROR("Failed to accept udp session with error:{}", ec.message());
+      co_return;
+    }
+    auto ex = co_await asio::this_coro::executor;
+    RudpSocket* rudp_conn = static_cast<RudpSocket*>(io_conn.get());
+    ::asio::co_spawn(ex,
+                     handle_mux_conn(std::move(io_conn), cipher_method, cipher_key,
+                                     [rudp_conn]() { rudp_conn->SetAuthenticated(); }),
+                     ::asio::detached);
+  }
+}
+
+static asio::awaitable<std::error_code> start_udp_mux_server(const NetAddress& server_address,
+                                                             const std::string& cipher_method,
+                                                             const std::string& cipher_key) {
+  auto ex = co_await asio::this_coro::executor;
+  ::asio::ip::udp::endpoint endpoint;
+  auto resolve_ec = co_await server_address.GetEndpoint(&endpoint);
+  if (resolve_ec) {
+    co_return resolve_ec;
+  }
+  ::asio::ip::udp::socket socket(ex);
+  std::error_code ec;
+  socket.open(endpoint.protocol(), ec);
+  if (ec) {
+    co_return ec;
+  }
+  socket.set_option(::asio::socket_base::reuse_address(true), ec);
+  if (g_thread_num > 1) {
+    ec = set_reuse_port(socket);
+    if (ec) {
+      SNOVA_ERROR("Failed to set reuse port with error:{}", ec.message());
+    }
+  }
+  socket.bind(endpoint, ec);
+  if (ec) {
+    SNOVA_ERROR("Failed to bind {} with error:{}", server_address.String(), ec.message());
+    co_return ec;
+  }
+  RudpServerPtr server = std::make_shared<RudpServer>(std::move(socket));
+  server->Start();
+  ::asio::co_spawn(ex, udp_server_loop(server, cipher_method, cipher_key), ::asio::detached);
+  co_return std::error_code{};
+}
+
 asio::awaitable<std::error_code> start_mux_server(const NetAddress& server_address,
                                                   const std::string& cipher_method,
                                                   const std::string& cipher_key) {
@@ -165,6 +236,8 @@ asio::awaitable<std::error_code> start_mux_server(const NetAddress& server_addre
   MuxTransportType transport_type = MuxTransportType::MUX_OVER_TCP;
   if (server_address.schema == "ws") {
     transport_type = MuxTransportType::MUX_OVER_WEBSOCKET;
+  } else if (server_address.schema == "udp") {
+    co_return co_await start_udp_mux_server(server_address, cipher_method, cipher_key);
   }
 
   auto ex = co_await asio::this_coro::executor;
@@ -177,6 +250,13 @@ asio::awaitable<std::error_code> start_mux_server(const NetAddress& server_addre
   acceptor.open(endpoint.protocol());
   acceptor.set_option(::asio::socket_base::reuse_address(true));
   std::error_code ec;
+  if (g_thread_num > 1) {
+    // every io thread binds same address, let kernel balance accepted connections.
+    ec = set_reuse_port(acceptor);
+    if (ec) {
+      SNOVA_ERROR("Failed to set reuse port with error:{}", ec.message());
+    }
+  }
   acceptor.bind(endpoint, ec);
   if (ec) {
     SNOVA_ERROR("Failed to bind {} with error:{}", server_address.String(), ec.message());
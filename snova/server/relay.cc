@@ -28,22 +28,112 @@
  */
 #include "snova/server/relay.h"
 
+#include <algorithm>
+#include <chrono>
+#include <string>
 #include <type_traits>
 #include <utility>
 
 #include "absl/cleanup/cleanup.h"
+#include "absl/container/flat_hash_map.h"
 #include "asio/experimental/as_tuple.hpp"
 #include "asio/experimental/awaitable_operators.hpp"
 #include "snova/io/transfer.h"
+#include "snova/io/uring_socket.h"
 #include "snova/mux/mux_client.h"
+#include "snova/server/udp_relay.h"
 #include "snova/util/flags.h"
 #include "snova/util/net_helper.h"
+#include "snova/util/stat.h"
 #include "snova/util/time_wheel.h"
+#include "spdlog/fmt/fmt.h"
 
 using namespace asio::experimental::awaitable_operators;  // NOLINT
 namespace snova {
 
 using CloseFunc = std::function<asio::awaitable<std::error_code>()>;
+
+struct DestinationStat {
+  uint64_t opens = 0;
+  uint64_t failures = 0;
+  uint64_t total_connect_ms = 0;
+  uint32_t max_connect_ms = 0;
+};
+// keyed by 'host:port', stop adding new destinations once full.
+static constexpr size_t kMaxDestinationStats = 1024;
+static thread_local absl::flat_hash_map<std::string, DestinationStat> g_destination_stats;
+
+static void record_destination_stat(const RelayContext& relay_ctx, int open_error,
+                                     uint32_t connect_latency_ms) {
+  if (!relay_ctx.is_tcp) {
+    return;  // udp streams have no remote connect
+  }
+  std::string key = fmt::format("{}:{}", relay_ctx.remote_host, relay_ctx.remote_port);
+  auto found = g_destination_stats.find(key);
+  if (found == g_destination_stats.end()) {
+    if (g_destination_stats.size() >= kMaxDestinationStats) {
+      return;
+    }
+    found = g_destination_stats.emplace(std::move(key), DestinationStat{}).first;
+  }
+  DestinationStat& stat = found->second;
+  stat.opens++;
+  if (open_error != STREAM_OPEN_OK) {
+    stat.failures++;
+    return;
+  }
+  stat.total_connect_ms += connect_latency_ms;
+  stat.max_connect_ms = std::max(stat.max_connect_ms, connect_latency_ms);
+}
+
+void register_relay_stat() {
+  register_stat_func([]() -> StatValues {
+    StatValues vals;
+    if (g_destination_stats.empty()) {
+      return vals;
+    }
+    auto& kv = vals["Destination"];
+    for (const auto& [dest, stat] : g_destination_stats) {
+      uint64_t succeed = stat.opens - stat.failures;
+      kv[dest] = fmt::format("opens:{},failures:{},avg_connect_ms:{},max_connect_ms:{}",
+                             stat.opens, stat.failures,
+                             succeed > 0 ? stat.total_connect_ms / succeed : 0,
+                             stat.max_connect_ms);
+    }
+    return vals;
+  });
+}
+
+static int get_open_error(const std::error_code& ec) {
+  if (ec == ::asio::error::connection_refused) {
+    return STREAM_OPEN_ERR_CONNECTION_REFUSED;
+  }
+  if (ec == ::asio::error::network_unreachable) {
+    return STREAM_OPEN_ERR_NETWORK_UNREACHABLE;
+  }
+  if (ec == ::asio::error::host_unreachable || ec == ::asio::error::host_not_found ||
+      ec == ::asio::error::host_not_found_try_again || ec == std::errc::bad_address) {
+    return STREAM_OPEN_ERR_HOST_UNREACHABLE;
+  }
+  if (ec == ::asio::error::timed_out) {
+    return STREAM_OPEN_ERR_TIMEOUT;
+  }
+  return STREAM_OPEN_ERR_GENERAL;
+}
+
+static uint8_t get_stream_priority(const RelayContext& relay_ctx) {
+  switch (relay_ctx.remote_port) {
+    case 22:    // ssh
+    case 53:    // dns over tcp
+    case 3389:  // rdp
+    case 5900:  // vnc
+      return STREAM_PRIORITY_INTERACTIVE;
+    default:
+      // bulk streams are detected by MuxStream with written bytes.
+      return STREAM_PRIORITY_NORMAL;
+  }
+}
+
 template <typename T>
 static asio::awaitable<void> do_relay(T& local_stream, const Bytes& readed_data,
                                       RelayContext& relay_ctx) {
@@ -54,7 +144,7 @@ static asio::awaitable<void> do_relay(T& local_stream, const Bytes& readed_data,
   uint32_t stream_id = 0;
   if constexpr (std::is_same_v<T, ::asio::ip::tcp::socket>) {
     close_local = [&]() -> asio::awaitable<std::error_code> {
-      local_stream.close();
+      close_socket(local_stream);
       co_return std::error_code{};
     };
   } else {
@@ -64,7 +154,10 @@ static asio::awaitable<void> do_relay(T& local_stream, const Bytes& readed_data,
     };
   }
 
-  if (g_stream_io_timeout_secs > 0) {
+  // udp sessions expire like NAT mappings, usually far sooner than tcp streams.
+  uint32_t io_timeout_secs =
+      relay_ctx.is_tcp ? g_stream_io_timeout_secs : g_udp_session_timeout_secs;
+  if (io_timeout_secs > 0) {
     transfer_routine = [&]() { latest_io_time = time(nullptr); };
     cancel_transfer_timeout = TimeWheel::GetInstance()->Add(
         [stream_id, &latest_io_time, close_local]() -> asio::awaitable<void> {
@@ -73,7 +166,7 @@ static asio::awaitable<void> do_relay(T& local_stream, const Bytes& readed_data,
           co_await close_local();
           co_return;
         },
-        [&]() -> uint64_t { return latest_io_time * 1000; }, g_stream_io_timeout_secs * 1000);
+        [&]() -> uint64_t { return latest_io_time * 1000; }, io_timeout_secs * 1000);
   }
 
   absl::Cleanup auto_cancel_timeout = [&cancel_transfer_timeout] {
@@ -83,9 +176,47 @@ static asio::awaitable<void> do_relay(T& local_stream, const Bytes& readed_data,
   };
 
   bool direct_relay = (g_is_exit_node || relay_ctx.direct);
+  if (direct_relay && !relay_ctx.is_tcp) {
+    if constexpr (std::is_same_v<T, ::asio::ip::tcp::socket>) {
+      SNOVA_ERROR("Can NOT relay udp for tcp socket.");
+    } else {
+      if constexpr (std::is_same_v<T, MuxStreamPtr>) {
+        co_await local_stream->ReplyOpenResult(STREAM_OPEN_OK, 0);
+      }
+      co_await relay_udp(local_stream, readed_data, transfer_routine);
+    }
+    co_return;
+  }
   if (direct_relay) {
-    auto remote_socket = co_await get_connected_socket(relay_ctx.remote_host, relay_ctx.remote_port,
-                                                       relay_ctx.is_tcp);
+    // a fast open connect returns before the handshake, useless for a waited open result.
+    bool wait_open_result = false;
+    if constexpr (std::is_same_v<T, MuxStreamPtr>) {
+      wait_open_result = local_stream->IsOpenResultAwaited();
+    } else if constexpr (std::is_same_v<T, ::asio::ip::tcp::socket>) {
+      wait_open_result = static_cast<bool>(relay_ctx.reply_open);
+    }
+    bool fast_open = g_tcp_fast_open && readed_data.size() > 0 && !wait_open_result;
+    auto connect_start = std::chrono::steady_clock::now();
+    std::error_code connect_ec;
+    auto remote_socket = co_await get_connected_socket(
+        relay_ctx.remote_host, relay_ctx.remote_port, relay_ctx.is_tcp, fast_open, &connect_ec);
+    uint32_t connect_latency_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                      std::chrono::steady_clock::now() - connect_start)
+                                      .count();
+    int open_error = remote_socket ? STREAM_OPEN_OK : get_open_error(connect_ec);
+    record_destination_stat(relay_ctx, open_error, connect_latency_ms);
+    if constexpr (std::is_same_v<T, MuxStreamPtr>) {
+      co_await local_stream->ReplyOpenResult(open_error, connect_latency_ms);
+    } else if constexpr (std::is_same_v<T, ::asio::ip::tcp::socket>) {
+      if (relay_ctx.reply_open) {
+        Bytes first_data = co_await relay_ctx.reply_open(local_stream, open_error, relay_ctx);
+        if (remote_socket && first_data.size() > 0) {
+          co_await ::asio::async_write(*remote_socket,
+                                       ::asio::buffer(first_data.data(), first_data.size()),
+                                       ::asio::experimental::as_tuple(::asio::use_awaitable));
+        }
+      }
+    }
     if (remote_socket) {
       if (readed_data.size() > 0) {
         co_await ::asio::async_write(*remote_socket,
@@ -108,25 +239,85 @@ static asio::awaitable<void> do_relay(T& local_stream, const Bytes& readed_data,
     // EventWriterFactory factory = MuxClient::GetInstance()->GetEventWriterFactory();
     // uint64_t client_id = MuxClient::GetInstance()->GetClientId();
     uint64_t client_id = 0;
-    EventWriterFactory factory =
-        MuxConnManager::GetInstance()->GetRelayEventWriterFactory(relay_ctx.user, &client_id);
+    MuxStreamOptions stream_opts;
+    EventWriterFactory factory = MuxConnManager::GetInstance()->GetRelayEventWriterFactory(
+        relay_ctx.user, &client_id, &stream_opts);
     if (!factory) {
       SNOVA_ERROR("No remote event factory found to relay for user:{}", relay_ctx.user);
       co_return;
     }
+    if (!relay_ctx.is_tcp && !stream_opts.udp_relay) {
+      SNOVA_ERROR("Remote peer does NOT support udp relay.");
+      co_return;
+    }
 
-    stream_id = MuxStream::NextID(true);
-    MuxStreamPtr remote_stream = MuxStream::New(std::move(factory), ex, client_id, stream_id);
+    MuxStreamPtr remote_stream = MuxStream::NewLocal(std::move(factory), ex, client_id, true);
+    if (!remote_stream) {
+      SNOVA_ERROR("Failed to create remote stream for {}:{}", relay_ctx.remote_host,
+                  relay_ctx.remote_port);
+      co_return;
+    }
+    stream_id = remote_stream->GetID();
     remote_stream->SetTLS(relay_ctx.is_tls);
+    remote_stream->SetOptions(stream_opts);
+    remote_stream->SetPriority(get_stream_priority(relay_ctx));
     absl::Cleanup auto_remove_remove_stream = [client_id, stream_id] {
       MuxStream::Remove(client_id, stream_id);
     };
+    bool wait_open_result = false;
+    if constexpr (std::is_same_v<T, MuxStreamPtr>) {
+      wait_open_result = local_stream->IsOpenResultAwaited();
+    } else if constexpr (std::is_same_v<T, ::asio::ip::tcp::socket>) {
+      wait_open_result = static_cast<bool>(relay_ctx.reply_open);
+    }
     auto ec = co_await remote_stream->Open(relay_ctx.remote_host, relay_ctx.remote_port,
-                                           relay_ctx.is_tcp, relay_ctx.is_tls);
-    if (readed_data.size() > 0) {
-      IOBufPtr tmp_buf = get_iobuf(readed_data.size());
-      memcpy(tmp_buf->data(), readed_data.data(), readed_data.size());
-      co_await remote_stream->Write(std::move(tmp_buf), readed_data.size());
+                                           relay_ctx.is_tcp, relay_ctx.is_tls, readed_data,
+                                           wait_open_result);
+    if constexpr (std::is_same_v<T, ::asio::ip::tcp::socket>) {
+      if (relay_ctx.reply_open) {
+        uint32_t connect_latency_ms = 0;
+        int open_error = STREAM_OPEN_ERR_GENERAL;
+        if (!ec) {
+          open_error = co_await remote_stream->WaitOpenResult(&connect_latency_ms);
+        }
+        if (stream_opts.open_result) {
+          record_destination_stat(relay_ctx, open_error, connect_latency_ms);
+        }
+        Bytes first_data = co_await relay_ctx.reply_open(local_stream, open_error, relay_ctx);
+        if (open_error != STREAM_OPEN_OK) {
+          co_await remote_stream->Close(false);
+          co_return;
+        }
+        // the sniffed first data is tls, following chunks need no encryption.
+        remote_stream->SetTLS(relay_ctx.is_tls);
+        if (first_data.size() > 0) {
+          IOBufPtr buf = get_iobuf(first_data.size());
+          memcpy(buf->data(), first_data.data(), first_data.size());
+          ec = co_await remote_stream->Write(std::move(buf), first_data.size());
+          if (ec) {
+            co_await remote_stream->Close(false);
+            co_return;
+          }
+        }
+      }
+    }
+    if (!relay_ctx.reply_open && stream_opts.open_result) {
+      // the client got an optimistic reply, close the stream once the open failed instead of
+      // waiting the peer's close behind the result. The stream->local transfer then closes the
+      // local side.
+      ::asio::co_spawn(
+          ex,
+          [remote_stream, relay_ctx]() -> asio::awaitable<void> {
+            uint32_t connect_latency_ms = 0;
+            int open_error = co_await remote_stream->WaitOpenResult(&connect_latency_ms);
+            if (remote_stream->HasOpenResult()) {
+              record_destination_stat(relay_ctx, open_error, connect_latency_ms);
+              if (open_error != STREAM_OPEN_OK) {
+                co_await remote_stream->Close(false);
+              }
+            }
+          },
+          ::asio::detached);
     }
 
     try {
@@ -168,16 +359,31 @@ asio::awaitable<void> relay_handler(const std::string& auth_user, uint64_t clien
   std::unique_ptr<MuxEvent> mux_event =
       std::move(event);  // this make rvalue event not release after co_await
   auto ex = co_await asio::this_coro::executor;
-  StreamOpenRequest* open_request = dynamic_cast<StreamOpenRequest*>(mux_event.get());
+  StreamOpenRequest* open_request = event_cast<StreamOpenRequest>(mux_event.get());
   if (nullptr == open_request) {
     SNOVA_ERROR("null request for EVENT_STREAM_OPEN");
     co_return;
   }
-  EventWriterFactory factory =
-      MuxConnManager::GetInstance()->GetEventWriterFactory(auth_user, client_id, MUX_ENTRY_CONN);
+  MuxStreamOptions stream_opts;
+  EventWriterFactory factory = MuxConnManager::GetInstance()->GetEventWriterFactory(
+      auth_user, client_id, MUX_ENTRY_CONN, &stream_opts);
   uint32_t local_stream_id = open_request->head.sid;
   MuxStreamPtr local_stream = MuxStream::New(std::move(factory), ex, client_id, local_stream_id);
+  if (!local_stream) {
+    // never touch the live stream of the id, reset the peer's new one.
+    SNOVA_ERROR("[{}]Reject open of a stream id in use.", local_stream_id);
+    EventWriter writer = factory ? factory() : nullptr;
+    if (writer) {
+      auto close_ev = std::make_unique<StreamCloseRequest>();
+      close_ev->head.sid = local_stream_id;
+      co_await writer(std::move(close_ev));
+    }
+    co_return;
+  }
   local_stream->SetTLS(open_request->event.is_tls);
+  local_stream->SetDatagram(!open_request->event.is_tcp);
+  local_stream->SetOptions(stream_opts);
+  local_stream->SetOpenResultAwaited(open_request->event.wait_result);
   absl::Cleanup auto_remove_local_stream = [client_id, local_stream_id] {
     MuxStream::Remove(client_id, local_stream_id);
   };
@@ -188,7 +394,12 @@ asio::awaitable<void> relay_handler(const std::string& auth_user, uint64_t clien
   relay_ctx.is_tcp = open_request->event.is_tcp;
   relay_ctx.is_tls = open_request->event.is_tls;
   relay_ctx.direct = false;
-  co_await do_relay(local_stream, {}, relay_ctx);
+  local_stream->SetPriority(get_stream_priority(relay_ctx));
+  Bytes first_data;
+  if (open_request->data && open_request->event.data_len > 0) {
+    first_data = Bytes{open_request->data->data(), open_request->event.data_len};
+  }
+  co_await do_relay(local_stream, first_data, relay_ctx);
   co_await local_stream->Close(false);
 }
 
@@ -29,6 +29,7 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -39,6 +40,13 @@
 
 namespace snova {
 
+struct RelayContext;
+// reply the proxy client with a StreamOpenError once the remote connect result is known, then
+// read the first data of the client if the open succeeded. The data is relayed before others and
+// may mark the context 'is_tls'.
+using OpenReplyFunc = std::function<asio::awaitable<Bytes>(::asio::ip::tcp::socket& sock,
+                                                            int open_error, RelayContext& ctx)>;
+
 struct RelayContext {
   std::string user;
   std::string remote_host;
@@ -46,8 +54,12 @@ struct RelayContext {
   bool is_tls = false;
   bool is_tcp = false;
   bool direct = false;
+  // if set, relay waits the remote connect result and stops at once on failure.
+  OpenReplyFunc reply_open;
 };
 
+void register_relay_stat();
+
 asio::awaitable<void> relay_direct(::asio::ip::tcp::socket&& sock, const Bytes& readed_data,
                                    RelayContext& relay_ctx);
 asio::awaitable<void> relay(::asio::ip::tcp::socket&& sock, const Bytes& readed_data,
@@ -33,15 +33,91 @@
 #include "snova/log/log_macros.h"
 #include "snova/server/entry_server.h"
 #include "snova/server/relay.h"
+#include "snova/server/udp_relay.h"
 #include "snova/util/flags.h"
 
 namespace snova {
 static constexpr uint8_t kMethodNoAuth = 0;
 static constexpr uint8_t kMethodGSSAPI = 1;
 static constexpr uint8_t kCmdConnect = 1;
+static constexpr uint8_t kCmdUDPAssociate = 3;
 static constexpr uint8_t kAddrIPV4 = 1;
 static constexpr uint8_t kAddrIPV6 = 4;
 static constexpr uint8_t kAddrDomain = 3;
+
+// 'rep' is a socks5 reply code, same values as StreamOpenError.
+static asio::awaitable<void> send_socks5_reply(::asio::ip::tcp::socket& sock, int rep) {
+  uint8_t socks5_resp[10];
+  memset(socks5_resp, 0, 10);
+  socks5_resp[0] = 5;
+  socks5_resp[1] = static_cast<uint8_t>(rep);
+  socks5_resp[2] = 0;
+  socks5_resp[3] = 1;  // socksAtypeV4         = 0x01
+  co_await ::asio::async_write(sock, ::asio::buffer(socks5_resp, 10),
+                               ::asio::experimental::as_tuple(::asio::use_awaitable));
+}
+
+static asio::awaitable<void> handle_socks5_udp_associate(::asio::ip::tcp::socket&& s) {
+  auto control_sock = std::make_shared<::asio::ip::tcp::socket>(std::move(s));
+  std::error_code ec;
+  auto local_endpoint = control_sock->local_endpoint(ec);
+  auto client_endpoint = control_sock->remote_endpoint(ec);
+  UDPSocket udp_socket(control_sock->get_executor());
+  if (!ec) {
+    // bind on the address the client connected, so that it's reachable by the client.
+    ::asio::ip::udp::endpoint bind_endpoint(local_endpoint.address(), 0);
+    udp_socket.open(bind_endpoint.protocol(), ec);
+    if (!ec) {
+      udp_socket.bind(bind_endpoint, ec);
+    }
+  }
+  ::asio::ip::udp::endpoint bound_endpoint;
+  if (!ec) {
+    bound_endpoint = udp_socket.local_endpoint(ec);
+  }
+  if (ec) {
+    SNOVA_ERROR("Failed to bind udp socket for socks5 udp associate with error:{}", ec);
+    co_await send_socks5_reply(*control_sock, STREAM_OPEN_ERR_GENERAL);
+    co_return;
+  }
+  uint8_t socks5_resp[3 + kMaxUDPIPAddressSize];
+  socks5_resp[0] = 5;
+  socks5_resp[1] = STREAM_OPEN_OK;
+  socks5_resp[2] = 0;
+  size_t resp_len = 3 + encode_udp_address(bound_endpoint, socks5_resp + 3);
+  co_await ::asio::async_write(*control_sock, ::asio::buffer(socks5_resp, resp_len),
+                               ::asio::experimental::as_tuple(::asio::use_awaitable));
+  SNOVA_INFO("Socks5 udp associate on {} for client {}", bound_endpoint, client_endpoint);
+
+  auto udp_stream =
+      std::make_shared<Socks5UDPStream>(std::move(udp_socket), client_endpoint.address());
+  auto ex = co_await asio::this_coro::executor;
+  // the association ends once the control connection closed.
+  ::asio::co_spawn(
+      ex,
+      [control_sock, udp_stream]() -> asio::awaitable<void> {
+        uint8_t discard[256];
+        while (true) {
+          auto [rec, rn] = co_await control_sock->async_read_some(
+              ::asio::buffer(discard, sizeof(discard)),
+              ::asio::experimental::as_tuple(::asio::use_awaitable));
+          if (rec) {
+            break;
+          }
+        }
+        co_await udp_stream->Close(false);
+      },
+      ::asio::detached);
+
+  RelayContext relay_ctx;
+  relay_ctx.user = GlobalFlags::GetIntance()->GetUser();
+  relay_ctx.remote_host = bound_endpoint.address().to_string();
+  relay_ctx.remote_port = bound_endpoint.port();
+  relay_ctx.is_tcp = false;
+  co_await relay(udp_stream, Bytes{}, relay_ctx);
+  control_sock->close(ec);
+}
+
 asio::awaitable<void> handle_socks5_connection(::asio::ip::tcp::socket&& s, IOBufPtr&& rbuf,
                                                const Bytes& readable_data) {
   // SNOVA_INFO("Handle proxy connection by socks5.");
@@ -72,8 +148,13 @@ asio::awaitable<void> handle_socks5_connection(::asio::ip::tcp::socket&& s, IOBu
     SNOVA_ERROR("Socks5 not confirm with socks5");
     co_return;
   }
+  if (read_buffer[1] == kCmdUDPAssociate) {
+    // the address in request is the client's expected source, not used.
+    co_await handle_socks5_udp_associate(std::move(sock));
+    co_return;
+  }
   if (read_buffer[1] != kCmdConnect) {
-    SNOVA_ERROR("Only connect command supported.");
+    SNOVA_ERROR("Only connect/udp associate command supported.");
     co_return;
   }
   uint8_t target_addr_type = read_buffer[3];
@@ -125,14 +206,40 @@ asio::awaitable<void> handle_socks5_connection(::asio::ip::tcp::socket&& s, IOBu
     }
   }
   SNOVA_INFO("Socks5 target {}:{}", remote_host, remote_port);
-  uint8_t socks5_resp[10];
-  memset(socks5_resp, 0, 10);
-  socks5_resp[0] = 5;
-  socks5_resp[1] = 0;  // SOCKS_RESP_SUUCESS
-  socks5_resp[2] = 0;
-  socks5_resp[3] = 1;  // socksAtypeV4         = 0x01
-  co_await ::asio::async_write(sock, ::asio::buffer(socks5_resp, 10),
-                               ::asio::experimental::as_tuple(::asio::use_awaitable));
+  if (target_addr_type == kAddrDomain && g_wait_open_result) {
+    // reply client with the remote connect result, so that it fails at once if the remote is
+    // unreachable. It costs a round trip to the exit node before the client sends anything, and
+    // the first data can't be carried by the open frame, it's sniffed after the reply.
+    RelayContext relay_ctx;
+    relay_ctx.user = GlobalFlags::GetIntance()->GetUser();
+    relay_ctx.remote_host = std::move(remote_host);
+    relay_ctx.remote_port = remote_port;
+    relay_ctx.is_tcp = true;
+    relay_ctx.reply_open = [&read_buffer](::asio::ip::tcp::socket& client, int open_error,
+                                          RelayContext& ctx) -> asio::awaitable<Bytes> {
+      co_await send_socks5_reply(client, open_error);
+      if (open_error != STREAM_OPEN_OK) {
+        co_return Bytes{};
+      }
+      auto [rec, rn] =
+          co_await client.async_read_some(::asio::buffer(read_buffer.data(), read_buffer.size()),
+                                          ::asio::experimental::as_tuple(::asio::use_awaitable));
+      if (rec) {
+        co_return Bytes{};
+      }
+      Bytes first_data(read_buffer.data(), rn);
+      std::string sni;
+      if (rn > 3 && read_buffer[0] == 0x16 && read_buffer[1] >= 3 &&
+          get_tls_remote_host(first_data, &sni)) {
+        // the target is already connected, SNI only tells the data is tls.
+        ctx.is_tls = true;
+      }
+      co_return first_data;
+    };
+    co_await relay(std::move(sock), Bytes{}, relay_ctx);
+    co_return;
+  }
+  co_await send_socks5_reply(sock, STREAM_OPEN_OK);
 
   auto [rec, rn] =
       co_await sock.async_read_some(::asio::buffer(read_buffer.data(), read_buffer.size()),
@@ -33,6 +33,18 @@
 #include "snova/util/sni.h"
 
 namespace snova {
+bool get_tls_remote_host(const Bytes& client_hello, std::string* remote_host) {
+  int rc = parse_sni(client_hello.data(), client_hello.size(), remote_host);
+  if (0 != rc) {
+    SNOVA_ERROR("Failed to read sni with rc:{}", rc);
+    return false;
+  }
+  if (*remote_host == "courier.push.apple.com") {  // special case
+    return false;
+  }
+  return true;
+}
+
 asio::awaitable<bool> handle_tls_connection(
     ::asio::ip::tcp::socket&& s, IOBufPtr&& rbuf, const Bytes& readable_data,
     std::unique_ptr<::asio::ip::tcp::endpoint>&& orig_remote_endpoint) {
@@ -41,20 +53,14 @@ asio::awaitable<bool> handle_tls_connection(
   if (orig_remote_endpoint) {
     remote_port = orig_remote_endpoint->port();
   }
-  ::asio::ip::tcp::socket sock(std::move(s));  //  make rvalue sock not release after co_await
-  IOBufPtr conn_read_buffer = std::move(rbuf);
-  IOBuf& read_buffer = *conn_read_buffer;
   std::string remote_host;
-  int rc = parse_sni(readable_data.data(), readable_data.size(), &remote_host);
-  if (0 != rc) {
-    SNOVA_ERROR("Failed to read sni with rc:{}", rc);
+  if (!get_tls_remote_host(readable_data, &remote_host)) {
+    // the caller relays the connection itself, keep its socket and buffer.
     co_return false;
   }
-
+  ::asio::ip::tcp::socket sock(std::move(s));  //  make rvalue sock not release after co_await
+  IOBufPtr conn_read_buffer = std::move(rbuf);
   SNOVA_INFO("Retrive SNI:{} from tls connection with port:{}", remote_host, remote_port);
-  if (remote_host == "courier.push.apple.com") {  // special case
-    co_return false;
-  }
   RelayContext relay_ctx;
   relay_ctx.user = GlobalFlags::GetIntance()->GetUser();
   relay_ctx.remote_host = std::move(remote_host);
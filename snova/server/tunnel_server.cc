@@ -37,6 +37,7 @@
 #include "snova/mux/mux_conn_manager.h"
 #include "snova/server/relay.h"
 #include "snova/util/flags.h"
+#include "snova/util/net_helper.h"
 namespace snova {
 
 struct TunnelServer {
@@ -47,9 +48,9 @@ struct TunnelServer {
 };
 using TunnelServerTable = absl::flat_hash_map<uint64_t, TunnelServer>;
 using TunnelServerAddrIdTable = absl::flat_hash_map<std::string, uint64_t>;
-static TunnelServerTable g_tunnel_servers;
-static TunnelServerAddrIdTable g_tunnel_server_addr2ids;
-static uint64_t g_tunnel_server_id_seed = 1;
+static thread_local TunnelServerTable g_tunnel_servers;
+static thread_local TunnelServerAddrIdTable g_tunnel_server_addr2ids;
+static thread_local uint64_t g_tunnel_server_id_seed = 1;
 
 void close_tunnel_server(uint32_t server_id) {
   auto found = g_tunnel_servers.find(server_id);
@@ -118,6 +119,13 @@ asio::awaitable<TunnelServerListenResult> start_tunnel_server(const NetAddress&
   acceptor.open(endpoint.protocol());
   acceptor.set_option(::asio::socket_base::reuse_address(true));
   std::error_code ec;
+  if (g_thread_num > 1) {
+    // every io thread binds same address, let kernel balance accepted connections.
+    ec = set_reuse_port(acceptor);
+    if (ec) {
+      SNOVA_ERROR("Failed to set reuse port with error:{}", ec.message());
+    }
+  }
   acceptor.bind(endpoint, ec);
   if (ec) {
     SNOVA_ERROR("Failed to bind {} with error:{}", server_addr, ec.message());
@@ -150,7 +158,7 @@ asio::awaitable<std::unique_ptr<MuxEvent>> tunnel_server_handler(
       std::move(event);  // this make rvalue event not release after co_await
   auto ex = co_await asio::this_coro::executor;
   std::unique_ptr<TunnelOpenResponse> tunnel_rsp = std::make_unique<TunnelOpenResponse>();
-  TunnelOpenRequest* tunnel_request = dynamic_cast<TunnelOpenRequest*>(mux_event.get());
+  TunnelOpenRequest* tunnel_request = event_cast<TunnelOpenRequest>(mux_event.get());
   if (nullptr == tunnel_request) {
     tunnel_rsp->event.success = false;
     tunnel_rsp->event.errc = ERR_INVALID_EVENT;
@@ -0,0 +1,336 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "snova/server/udp_relay.h"
+
+#include <array>
+#include <string>
+#include <utility>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/container/flat_hash_map.h"
+#include "asio/experimental/as_tuple.hpp"
+#include "asio/experimental/awaitable_operators.hpp"
+#include "snova/log/log_macros.h"
+#include "snova/util/net_helper.h"
+#include "snova/util/stat.h"
+
+using namespace asio::experimental::awaitable_operators;  // NOLINT
+namespace snova {
+static constexpr uint8_t kAddrIPV4 = 1;
+static constexpr uint8_t kAddrDomain = 3;
+static constexpr uint8_t kAddrIPV6 = 4;
+// socks5 udp request header before the address: RSV(2 bytes)|FRAG(1 byte).
+static constexpr size_t kSocks5UDPReservedSize = 3;
+// resolved destination domains cached by one udp session.
+static constexpr size_t kMaxResolvedDomains = 256;
+
+static thread_local uint32_t g_udp_session_num = 0;
+static thread_local uint64_t g_udp_send_datagrams = 0;
+static thread_local uint64_t g_udp_recv_datagrams = 0;
+static thread_local uint64_t g_udp_drop_datagrams = 0;
+
+void register_udp_relay_stat() {
+  register_stat_func([]() -> StatValues {
+    StatValues vals;
+    auto& kv = vals["UDP"];
+    kv["session_num"] = std::to_string(g_udp_session_num);
+    kv["send_datagrams"] = std::to_string(g_udp_send_datagrams);
+    kv["recv_datagrams"] = std::to_string(g_udp_recv_datagrams);
+    kv["drop_datagrams"] = std::to_string(g_udp_drop_datagrams);
+    return vals;
+  });
+}
+
+int decode_udp_address(const Bytes& data, UDPAddress* addr) {
+  if (data.size() < 1) {
+    return -1;
+  }
+  size_t pos = 1;
+  size_t addr_len = 0;
+  switch (data[0]) {
+    case kAddrIPV4: {
+      addr_len = 4;
+      break;
+    }
+    case kAddrIPV6: {
+      addr_len = 16;
+      break;
+    }
+    case kAddrDomain: {
+      if (data.size() < 2) {
+        return -1;
+      }
+      addr_len = data[1];
+      pos++;
+      break;
+    }
+    default: {
+      return -1;
+    }
+  }
+  if (data.size() < pos + addr_len + 2) {
+    return -1;
+  }
+  addr->domain.clear();
+  if (data[0] == kAddrIPV4) {
+    std::array<uint8_t, 4> v4_ip;
+    memcpy(v4_ip.data(), data.data() + pos, v4_ip.size());
+    addr->ip = ::asio::ip::make_address_v4(v4_ip);
+  } else if (data[0] == kAddrIPV6) {
+    std::array<uint8_t, 16> v6_ip;
+    memcpy(v6_ip.data(), data.data() + pos, v6_ip.size());
+    addr->ip = ::asio::ip::make_address_v6(v6_ip);
+  } else {
+    addr->domain.assign(reinterpret_cast<const char*>(data.data() + pos), addr_len);
+  }
+  pos += addr_len;
+  addr->port = (static_cast<uint16_t>(data[pos]) << 8) + data[pos + 1];
+  return static_cast<int>(pos + 2);
+}
+
+size_t encode_udp_address(const ::asio::ip::udp::endpoint& endpoint, uint8_t* buf) {
+  ::asio::ip::address ip = endpoint.address();
+  if (ip.is_v6() && ip.to_v6().is_v4_mapped()) {
+    ip = ::asio::ip::make_address_v4(::asio::ip::v4_mapped, ip.to_v6());
+  }
+  size_t pos = 1;
+  if (ip.is_v4()) {
+    buf[0] = kAddrIPV4;
+    auto bytes = ip.to_v4().to_bytes();
+    memcpy(buf + pos, bytes.data(), bytes.size());
+    pos += bytes.size();
+  } else {
+    buf[0] = kAddrIPV6;
+    auto bytes = ip.to_v6().to_bytes();
+    memcpy(buf + pos, bytes.data(), bytes.size());
+    pos += bytes.size();
+  }
+  buf[pos] = static_cast<uint8_t>(endpoint.port() >> 8);
+  buf[pos + 1] = static_cast<uint8_t>(endpoint.port() & 0xFF);
+  return pos + 2;
+}
+
+Socks5UDPStream::Socks5UDPStream(UDPSocket&& socket, const ::asio::ip::address& client_address)
+    : socket_(std::move(socket)),
+      client_address_(client_address),
+      client_known_(false),
+      closed_(false) {}
+
+asio::awaitable<StreamReadResult> Socks5UDPStream::Read() {
+  while (true) {
+    // one more byte than a chunk to tell truncated datagrams.
+    IOBufPtr buf = get_iobuf(kMaxChunkSize + kSocks5UDPReservedSize + 1);
+    ::asio::ip::udp::endpoint from;
+    auto [ec, n] = co_await socket_.async_receive_from(
+        ::asio::buffer(buf->data(), buf->size()), from,
+        ::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (ec) {
+      co_return StreamReadResult{nullptr, 0, ec};
+    }
+    // only the client of the association may send, and fragments are not supported.
+    if (from.address() != client_address_ || n <= kSocks5UDPReservedSize ||
+        n > kMaxChunkSize + kSocks5UDPReservedSize || buf->data()[2] != 0) {
+      g_udp_drop_datagrams++;
+      continue;
+    }
+    client_endpoint_ = from;
+    client_known_ = true;
+    size_t len = n - kSocks5UDPReservedSize;
+    memmove(buf->data(), buf->data() + kSocks5UDPReservedSize, len);
+    co_return StreamReadResult{std::move(buf), len, std::error_code{}};
+  }
+}
+
+asio::awaitable<std::error_code> Socks5UDPStream::Write(IOBufPtr&& buf, size_t len) {
+  if (closed_) {
+    co_return std::make_error_code(std::errc::no_link);
+  }
+  if (!client_known_) {
+    g_udp_drop_datagrams++;
+    co_return std::error_code{};
+  }
+  static const uint8_t kReserved[kSocks5UDPReservedSize] = {0, 0, 0};
+  std::array<::asio::const_buffer, 2> buffers = {::asio::buffer(kReserved, sizeof(kReserved)),
+                                                 ::asio::buffer(buf->data(), len)};
+  auto [ec, n] = co_await socket_.async_send_to(
+      buffers, client_endpoint_, ::asio::experimental::as_tuple(::asio::use_awaitable));
+  if (ec) {
+    // datagrams may be dropped, only a closed socket ends the stream.
+    g_udp_drop_datagrams++;
+    if (closed_) {
+      co_return ec;
+    }
+  }
+  co_return std::error_code{};
+}
+
+asio::awaitable<std::error_code> Socks5UDPStream::Close(bool close_by_remote) {
+  if (closed_) {
+    co_return std::error_code{};
+  }
+  closed_ = true;
+  std::error_code ec;
+  socket_.close(ec);
+  co_return std::error_code{};
+}
+
+struct UDPSession {
+  UDPSocket socket;
+  absl::flat_hash_map<std::string, ::asio::ip::address> resolved;
+  UDPAddress addr;
+  // ipv6 socket accepting ipv4 destinations as mapped addresses.
+  bool dual_stack = false;
+  explicit UDPSession(const ::asio::any_io_executor& ex) : socket(ex) {}
+};
+
+static asio::awaitable<void> send_datagram(UDPSession& session, const Bytes& datagram) {
+  int n = decode_udp_address(datagram, &session.addr);
+  if (n < 0) {
+    g_udp_drop_datagrams++;
+    co_return;
+  }
+  ::asio::ip::address ip = session.addr.ip;
+  if (!session.addr.domain.empty()) {
+    auto found = session.resolved.find(session.addr.domain);
+    if (found != session.resolved.end()) {
+      ip = found->second;
+    } else {
+      ::asio::ip::udp::endpoint endpoint;
+      auto ec = co_await resolve_endpoint(session.addr.domain, session.addr.port, &endpoint);
+      if (ec) {
+        g_udp_drop_datagrams++;
+        co_return;
+      }
+      ip = endpoint.address();
+      if (session.resolved.size() < kMaxResolvedDomains) {
+        session.resolved.emplace(session.addr.domain, ip);
+      }
+    }
+  }
+  if (ip.is_v4() && session.dual_stack) {
+    ip = ::asio::ip::make_address_v6(::asio::ip::v4_mapped, ip.to_v4());
+  } else if (ip.is_v6() && !session.dual_stack) {
+    g_udp_drop_datagrams++;
+    co_return;
+  }
+  auto [ec, wn] = co_await session.socket.async_send_to(
+      ::asio::buffer(datagram.data() + n, datagram.size() - n),
+      ::asio::ip::udp::endpoint(ip, session.addr.port),
+      ::asio::experimental::as_tuple(::asio::use_awaitable));
+  if (ec) {
+    g_udp_drop_datagrams++;
+  } else {
+    g_udp_send_datagrams++;
+  }
+}
+
+static asio::awaitable<void> udp_send_loop(UDPSession& session, StreamPtr stream,
+                                           const TransferRoutineFunc& routine) {
+  while (true) {
+    auto [data, len, ec] = co_await stream->Read();
+    if (ec) {
+      break;
+    }
+    if (routine) {
+      routine();
+    }
+    co_await send_datagram(session, Bytes{data->data(), len});
+  }
+  std::error_code ignore_ec;
+  session.socket.close(ignore_ec);
+}
+
+static asio::awaitable<void> udp_recv_loop(UDPSession& session, StreamPtr stream,
+                                           const TransferRoutineFunc& routine) {
+  while (true) {
+    size_t max_size = stream->GetMaxWriteSize();
+    IOBufPtr buf = get_iobuf(max_size);
+    // leave room for the address header, which is known after received.
+    size_t capacity = max_size - kMaxUDPIPAddressSize;
+    ::asio::ip::udp::endpoint from;
+    auto [ec, n] = co_await session.socket.async_receive_from(
+        ::asio::buffer(buf->data() + kMaxUDPIPAddressSize, capacity), from,
+        ::asio::experimental::as_tuple(::asio::use_awaitable));
+    if (ec) {
+      if (ec == ::asio::error::connection_refused) {
+        continue;  // icmp error of a previous send
+      }
+      break;
+    }
+    if (n >= capacity) {
+      g_udp_drop_datagrams++;  // maybe truncated
+      continue;
+    }
+    if (routine) {
+      routine();
+    }
+    uint8_t head[kMaxUDPIPAddressSize];
+    size_t head_len = encode_udp_address(from, head);
+    memmove(buf->data() + head_len, buf->data() + kMaxUDPIPAddressSize, n);
+    memcpy(buf->data(), head, head_len);
+    auto wec = co_await stream->Write(std::move(buf), head_len + n);
+    if (wec) {
+      break;
+    }
+    g_udp_recv_datagrams++;
+  }
+  co_await stream->Close(false);
+}
+
+asio::awaitable<void> relay_udp(StreamPtr stream, const Bytes& first_datagram,
+                                const TransferRoutineFunc& routine) {
+  auto ex = co_await asio::this_coro::executor;
+  UDPSession session(ex);
+  std::error_code ec;
+  session.socket.open(::asio::ip::udp::v6(), ec);
+  if (!ec) {
+    session.socket.set_option(::asio::ip::v6_only(false), ec);
+    if (ec) {
+      std::error_code ignore_ec;
+      session.socket.close(ignore_ec);
+    } else {
+      session.dual_stack = true;
+    }
+  }
+  if (!session.dual_stack) {
+    session.socket.open(::asio::ip::udp::v4(), ec);
+    if (ec) {
+      SNOVA_ERROR("[{}]Failed to open udp socket with error:{}", stream->GetID(), ec);
+      co_return;
+    }
+  }
+  g_udp_session_num++;
+  absl::Cleanup session_num_cleanup = [] { g_udp_session_num--; };
+  if (first_datagram.size() > 0) {
+    co_await send_datagram(session, first_datagram);
+  }
+  co_await(udp_send_loop(session, stream, routine) && udp_recv_loop(session, stream, routine));
+}
+
+}  // namespace snova
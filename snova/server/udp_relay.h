@@ -0,0 +1,83 @@
+/*
+ *Copyright (c) 2022, yinqiwen <yinqiwen@gmail.com>
+ *All rights reserved.
+ *
+ *Redistribution and use in source and binary forms, with or without
+ *modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of rimos nor the names of its contributors may be used
+ *    to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ *THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ *BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <string>
+#include "asio.hpp"
+#include "snova/io/io.h"
+#include "snova/io/transfer.h"
+
+namespace snova {
+// Streams opened with 'is_tcp=false' carry one datagram per StreamChunk, prefixed with the socks5
+// udp address header(ATYP|ADDR|PORT) of its destination(to exit) or source(back to entry). So a
+// single stream serves all flows of a socks5 udp association, with message boundaries kept.
+static constexpr size_t kMaxUDPAddressSize = 1 + 1 + 255 + 2;
+// header of ipv4/ipv6 addresses encoded by 'encode_udp_address'.
+static constexpr size_t kMaxUDPIPAddressSize = 1 + 16 + 2;
+
+struct UDPAddress {
+  // valid if 'domain' is empty.
+  ::asio::ip::address ip;
+  std::string domain;
+  uint16_t port = 0;
+};
+// Return the header length, or -1 if 'data' starts with no valid address header.
+int decode_udp_address(const Bytes& data, UDPAddress* addr);
+// 'buf' must have 'kMaxUDPIPAddressSize' bytes at least, return the header length.
+size_t encode_udp_address(const ::asio::ip::udp::endpoint& endpoint, uint8_t* buf);
+
+// Stream of a socks5 udp association on entry node, reads datagrams from the socks5 client with
+// the RSV/FRAG fields stripped, and writes datagrams back with them prefixed.
+class Socks5UDPStream : public Stream {
+ public:
+  Socks5UDPStream(UDPSocket&& socket, const ::asio::ip::address& client_address);
+  asio::awaitable<StreamReadResult> Read() override;
+  asio::awaitable<std::error_code> Write(IOBufPtr&& buf, size_t len) override;
+  asio::awaitable<std::error_code> Close(bool close_by_remote) override;
+  uint32_t GetID() const override { return 0; }
+  bool IsTLS() const override { return false; }
+
+ private:
+  UDPSocket socket_;
+  ::asio::ip::address client_address_;
+  ::asio::ip::udp::endpoint client_endpoint_;
+  bool client_known_;
+  bool closed_;
+};
+
+// Forward datagrams read from 'stream' to their destinations by one NAT socket, and the replies
+// back to 'stream', until the stream closed. 'first_datagram' is the payload carried by the open
+// request if not empty.
+asio::awaitable<void> relay_udp(StreamPtr stream, const Bytes& first_datagram,
+                                const TransferRoutineFunc& routine);
+
+void register_udp_relay_stat();
+
+}  // namespace snova
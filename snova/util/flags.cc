@@ -34,18 +34,38 @@ bool g_is_middle_node = false;
 bool g_is_entry_node = false;
 bool g_is_exit_node = false;
 bool g_is_redirect_node = false;
+bool g_tcp_fast_open = false;
+bool g_wait_open_result = false;
+bool g_mux_stream_striping = false;
+bool g_io_uring = false;
+bool g_splice_relay = true;
+bool g_iobuf_hugepage = false;
 // std::string g_remote_server;
 // std::string g_http_proxy_host;
 uint16_t g_http_proxy_port = 0;
 uint32_t g_conn_num_per_server = 5;
 uint32_t g_iobuf_max_pool_size = 64;
+uint32_t g_iobuf_memory_limit_mb = 0;
+uint32_t g_memory_soft_limit_mb = 0;
+uint32_t g_memory_hard_limit_mb = 0;
 uint32_t g_stream_io_timeout_secs = 120;
+uint32_t g_udp_session_timeout_secs = 60;
 uint32_t g_connection_expire_secs = 1800;
 uint32_t g_connection_max_inactive_secs = 300;
 uint32_t g_tcp_write_timeout_secs = 10;
 uint32_t g_entry_socket_send_buffer_size = 0;
 uint32_t g_entry_socket_recv_buffer_size = 0;
 uint32_t g_dns_query_timeout_msecs = 800;
+uint32_t g_thread_num = 1;
+uint32_t g_mux_write_queue_max_bytes = 512 * 1024;
+uint32_t g_mux_write_batch_bytes = 128 * 1024;
+uint32_t g_mux_write_batch_frames = 256;
+uint32_t g_stream_window_bytes = 512 * 1024;
+uint32_t g_mux_max_frame_size = 64 * 1024;
+uint32_t g_mux_ping_interval_secs = 3;
+uint32_t g_mux_ping_max_missed = 3;
+uint32_t g_mux_udp_fec_group = 0;
+thread_local uint32_t g_shard_idx = 0;
 
 std::shared_ptr<GlobalFlags>& GlobalFlags::GetIntance() {
   static std::shared_ptr<GlobalFlags> s = std::make_shared<GlobalFlags>();
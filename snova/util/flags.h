@@ -39,17 +39,38 @@ extern bool g_is_middle_node;
 extern bool g_is_entry_node;
 extern bool g_is_exit_node;
 extern bool g_is_redirect_node;
+extern bool g_tcp_fast_open;
+extern bool g_wait_open_result;
+extern bool g_mux_stream_striping;
+extern bool g_io_uring;
+extern bool g_splice_relay;
+extern bool g_iobuf_hugepage;
 
 extern uint16_t g_http_proxy_port;
 extern uint32_t g_conn_num_per_server;
 extern uint32_t g_connection_expire_secs;
 extern uint32_t g_connection_max_inactive_secs;
 extern uint32_t g_iobuf_max_pool_size;
+extern uint32_t g_iobuf_memory_limit_mb;
+extern uint32_t g_memory_soft_limit_mb;
+extern uint32_t g_memory_hard_limit_mb;
 extern uint32_t g_stream_io_timeout_secs;
+extern uint32_t g_udp_session_timeout_secs;
 extern uint32_t g_tcp_write_timeout_secs;
 extern uint32_t g_entry_socket_send_buffer_size;
 extern uint32_t g_entry_socket_recv_buffer_size;
 extern uint32_t g_dns_query_timeout_msecs;
+extern uint32_t g_thread_num;
+extern uint32_t g_mux_write_queue_max_bytes;
+extern uint32_t g_mux_write_batch_bytes;
+extern uint32_t g_mux_write_batch_frames;
+extern uint32_t g_stream_window_bytes;
+extern uint32_t g_mux_max_frame_size;
+extern uint32_t g_mux_ping_interval_secs;
+extern uint32_t g_mux_ping_max_missed;
+extern uint32_t g_mux_udp_fec_group;
+// index of the io thread(shard) running current code, 0 for main thread.
+extern thread_local uint32_t g_shard_idx;
 
 class GlobalFlags {
  public:
@@ -29,6 +29,7 @@
 #include "snova/util/net_helper.h"
 #ifdef __linux__
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #endif
 #include <array>
@@ -89,20 +90,61 @@ int get_orig_dst(int fd, ::asio::ip::tcp::endpoint* endpoint) {
   return -1;
 }
 
+std::error_code set_reuse_port(::asio::ip::tcp::acceptor& acceptor) {
+  std::error_code ec;
+#ifdef SO_REUSEPORT
+  using reuse_port = ::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+  acceptor.set_option(reuse_port(true), ec);
+#else
+  ec = ::asio::error::operation_not_supported;
+#endif
+  return ec;
+}
+
+std::error_code set_reuse_port(::asio::ip::udp::socket& socket) {
+  std::error_code ec;
+#ifdef SO_REUSEPORT
+  using reuse_port = ::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+  socket.set_option(reuse_port(true), ec);
+#else
+  ec = ::asio::error::operation_not_supported;
+#endif
+  return ec;
+}
+
 asio::awaitable<SocketPtr> get_connected_socket(const std::string& host, uint16_t port,
-                                                bool is_tcp) {
+                                                bool is_tcp, bool fast_open,
+                                                std::error_code* ec) {
   auto ex = co_await asio::this_coro::executor;
   ::asio::ip::tcp::endpoint select_endpoint;
   auto resolve_ec = co_await resolve_endpoint(host, port, &select_endpoint);
   if (resolve_ec) {
     SNOVA_ERROR("No endpoint found for {}:{} with error:{}", host, port, resolve_ec);
+    if (nullptr != ec) {
+      *ec = resolve_ec;
+    }
     co_return nullptr;
   }
   SocketPtr socket = std::make_unique<::asio::ip::tcp::socket>(ex);
+#ifdef TCP_FASTOPEN_CONNECT
+  if (fast_open) {
+    std::error_code open_ec;
+    socket->open(select_endpoint.protocol(), open_ec);
+    if (!open_ec) {
+      using fastopen_connect =
+          ::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>;
+      // kernel without TFO support would reject this, just fallback to normal connect.
+      socket->set_option(fastopen_connect(true), open_ec);
+    }
+  }
+#endif
   auto [connect_ec] = co_await socket->async_connect(
       select_endpoint, ::asio::experimental::as_tuple(::asio::use_awaitable));
   if (connect_ec) {
     SNOVA_ERROR("Connect {} with error:{}", select_endpoint, connect_ec);
+    if (nullptr != ec) {
+      *ec = connect_ec;
+    }
     co_return nullptr;
   }
   co_return socket;
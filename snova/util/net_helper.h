@@ -42,9 +42,19 @@ bool is_private_address(const ::asio::ip::address& addr);
 
 int get_orig_dst(int fd, ::asio::ip::tcp::endpoint* endpoint);
 
+// enable SO_REUSEPORT on acceptor, so that every io thread could bind & accept on same address.
+std::error_code set_reuse_port(::asio::ip::tcp::acceptor& acceptor);
+// kernel hashes a peer's datagrams to the same socket, so per thread udp sessions stay intact.
+std::error_code set_reuse_port(::asio::ip::udp::socket& socket);
+
 using SocketPtr = std::unique_ptr<::asio::ip::tcp::socket>;
+// 'fast_open' enables TCP_FASTOPEN_CONNECT where available, so the first write after connect
+// rides on the SYN. The connect then completes at once with a cached cookie, even if the remote
+// is unreachable, so never use it if the connect result matters. 'ec' is set to the
+// resolve/connect error if it returns nullptr.
 asio::awaitable<SocketPtr> get_connected_socket(const std::string& host, uint16_t port,
-                                                bool is_tcp);
+                                                bool is_tcp, bool fast_open = false,
+                                                std::error_code* ec = nullptr);
 
 using SocketRef = ::asio::ip::tcp::socket&;
 asio::awaitable<std::error_code> connect_remote_via_http_proxy(SocketRef socket,
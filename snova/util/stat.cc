@@ -33,13 +33,14 @@
 #include "absl/container/btree_map.h"
 #include "absl/container/btree_set.h"
 #include "snova/log/log_macros.h"
+#include "snova/util/flags.h"
 
 namespace snova {
 using StatMap = absl::btree_map<std::string, std::string>;
 using StatTable = absl::btree_map<std::string, StatMap>;
 
-static StatTable g_stat_table;
-static std::vector<CollectStatFunc> g_stat_funcs;
+static thread_local StatTable g_stat_table;
+static thread_local std::vector<CollectStatFunc> g_stat_funcs;
 
 void register_stat_func(CollectStatFunc&& func) { g_stat_funcs.emplace_back(std::move(func)); }
 
@@ -57,7 +58,11 @@ static void print_stats() {
     return;
   }
   std::string buffer;
-  buffer.append("======================Stats=====================\n");
+  if (g_thread_num > 1) {
+    buffer.append(fmt::format("==================Stats(Shard:{})=================\n", g_shard_idx));
+  } else {
+    buffer.append("======================Stats=====================\n");
+  }
   for (const auto& [section, map] : g_stat_table) {
     buffer.append("[").append(section).append("]:\n");
     for (const auto& [key, value] : map) {
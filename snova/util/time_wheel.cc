@@ -46,7 +46,7 @@ struct TimerTask {
 };
 
 std::shared_ptr<TimeWheel>& TimeWheel::GetInstance() {
-  static std::shared_ptr<TimeWheel> g_instance = std::make_shared<TimeWheel>(128);
+  static thread_local std::shared_ptr<TimeWheel> g_instance = std::make_shared<TimeWheel>(128);
   return g_instance;
 }
 